@@ -0,0 +1,1141 @@
+#define _GNU_SOURCE
+#include "fs.h"
+#include "mkfs.h"
+#include "snapshot.h"
+#include "dedup.h"
+#include "compress.h"
+#include "mount.h"
+#include "helpers.h"
+#include "stats.h"
+#include "tail.h"
+#include "filemap.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define MIB (1024.0 * 1024.0)
+
+// Benchmark cases
+int bench_snapshot_writes();
+int bench_dedup();
+int bench_compression();
+int bench_mount_options();
+int bench_tail_packing();
+
+// Monotonic time in seconds
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Standard workloads, run at each thread count with warmup samples discarded.
+// The filesystem layer is single-threaded, so threads share one image behind
+// fs_lock; bitmapalloc runs on per-thread bitmaps and scales freely.
+
+#define MAX_BENCH_THREADS 16
+#define SUITE_DISK "bench_disk_suite"
+#define SUITE_DISK_SIZE (256 * 1024 * 1024)
+#define SUITE_FILES 256                     // files per thread for metadata workloads
+#define SUITE_FILE_SIZE (1024 * BLOCK_SIZE) // file per thread for data workloads
+#define SUITE_CHUNK (16 * BLOCK_SIZE)       // sequential I/O size
+#define BITMAP_BITS 32768
+
+// One workload: `setup`/`teardown` run once per thread count, `before`/`after`
+// around every sample (untimed) and `run` is the timed part, `ops` operations
+typedef struct {
+    const char *name;
+    const char *params;
+    size_t ops;
+    size_t bytes_per_op;        // 0 if throughput in bytes is meaningless
+    bool single_threaded;       // touches global image state outside fs_lock
+    size_t arg;
+    int (*setup)(size_t arg, int threads);
+    int (*before)(size_t arg, int thread);
+    int (*run)(size_t arg, int thread, size_t ops);
+    int (*after)(size_t arg, int thread);
+    void (*teardown)();
+} workload_t;
+
+// Suite settings, from the command line
+typedef struct {
+    int threads[MAX_BENCH_THREADS];
+    int nthreads;
+    int samples;
+    int warmup;
+    unsigned seed;
+    bool json;
+    bool stats;
+    const char *filter;
+} bench_config_t;
+
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static bench_config_t config;
+static int thread_dirs[MAX_BENCH_THREADS];
+static int thread_files[MAX_BENCH_THREADS][SUITE_FILES];
+static char *thread_bufs[MAX_BENCH_THREADS];
+static char *thread_bitmaps[MAX_BENCH_THREADS];
+static uint64_t thread_rng[MAX_BENCH_THREADS];
+
+// Per-thread xorshift generator, reseeded identically for every run
+static uint64_t next_random(int thread) {
+    uint64_t x = thread_rng[thread];
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    thread_rng[thread] = x;
+    return x;
+}
+
+static int format_run(size_t size_mib, int thread, size_t ops) {
+    (void)thread;
+    for (size_t i = 0; i < ops; i++) {
+        if (format_disk(SUITE_DISK, size_mib * 1024 * 1024, MAX_INODES) < 0) {
+            return -1;
+        }
+        if (i + 1 < ops) {
+            cleanup_disk(disk_map, sb->disk_size, disk_fd);
+        }
+    }
+    return 0;
+}
+
+static int format_after(size_t arg, int thread) {
+    (void)arg;
+    (void)thread;
+    cleanup_disk(disk_map, sb->disk_size, disk_fd);
+    return 0;
+}
+
+static void suite_unlink() {
+    unlink(SUITE_DISK);
+}
+
+// Bitmaps are filled from the front to `fill_percent`, like a linear allocator
+static int bitmap_setup(size_t fill_percent, int threads) {
+    for (int t = 0; t < threads; t++) {
+        thread_bitmaps[t] = calloc(BITMAP_BITS / 8, 1);
+        if (thread_bitmaps[t] == NULL) {
+            return -1;
+        }
+        size_t used = fill_percent >= 100 ? BITMAP_BITS : BITMAP_BITS * fill_percent / 100;
+        for (size_t i = 0; i < used; i++) {
+            bitmapset(thread_bitmaps[t], BITMAP_BITS, i, true);
+        }
+    }
+    return 0;
+}
+
+// Allocate and release so the bitmap stays at its fill level
+static int bitmap_run(size_t fill_percent, int thread, size_t ops) {
+    char *bitmap = thread_bitmaps[thread];
+    for (size_t i = 0; i < ops; i++) {
+        int bit = bitmapalloc(bitmap, BITMAP_BITS);
+        if (bit >= 0) {
+            bitmapset(bitmap, BITMAP_BITS, bit, false);
+        } else if (fill_percent < 100) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void bitmap_teardown() {
+    for (int t = 0; t < MAX_BENCH_THREADS; t++) {
+        free(thread_bitmaps[t]);
+        thread_bitmaps[t] = NULL;
+    }
+}
+
+// Fresh image with one directory per thread; `nfiles` files pre-created in each.
+// create and unlink start from empty directories and refill/empty them untimed.
+static int image_setup(size_t nfiles, int threads) {
+    unlink(SUITE_DISK);
+    if (format_disk(SUITE_DISK, SUITE_DISK_SIZE, 8192) < 0) {
+        return -1;
+    }
+    for (int t = 0; t < threads; t++) {
+        char name[32];
+        snprintf(name, sizeof(name), "t%d", t);
+        thread_dirs[t] = vsfs_create(ROOT_INODE, name, S_IFDIR | 0755);
+        if (thread_dirs[t] < 0) {
+            return -1;
+        }
+        for (size_t i = 0; i < nfiles; i++) {
+            snprintf(name, sizeof(name), "f%zu", i);
+            thread_files[t][i] = vsfs_create(thread_dirs[t], name, S_IFREG | 0644);
+            if (thread_files[t][i] < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void image_teardown() {
+    cleanup_disk(disk_map, sb->disk_size, disk_fd);
+    unlink(SUITE_DISK);
+    for (int t = 0; t < MAX_BENCH_THREADS; t++) {
+        free(thread_bufs[t]);
+        thread_bufs[t] = NULL;
+    }
+}
+
+static int create_files(size_t nfiles, int thread, size_t ops) {
+    (void)nfiles;
+    for (size_t i = 0; i < ops; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "f%zu", i);
+        pthread_mutex_lock(&fs_lock);
+        thread_files[thread][i] = vsfs_create(thread_dirs[thread], name, S_IFREG | 0644);
+        pthread_mutex_unlock(&fs_lock);
+        if (thread_files[thread][i] < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int unlink_files(size_t nfiles, int thread, size_t ops) {
+    (void)nfiles;
+    for (size_t i = 0; i < ops; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "f%zu", i);
+        pthread_mutex_lock(&fs_lock);
+        int ret = vsfs_unlink(thread_dirs[thread], name);
+        pthread_mutex_unlock(&fs_lock);
+        if (ret < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int create_before(size_t nfiles, int thread) {
+    return create_files(nfiles, thread, SUITE_FILES);
+}
+
+static int unlink_after(size_t nfiles, int thread) {
+    return unlink_files(nfiles, thread, SUITE_FILES);
+}
+
+// "f0".."f255", shared by the batch workloads
+static const char **batch_names() {
+    static char storage[SUITE_FILES][16];
+    static const char *names[SUITE_FILES];
+    if (names[0] == NULL) {
+        for (int i = 0; i < SUITE_FILES; i++) {
+            snprintf(storage[i], sizeof(storage[i]), "f%d", i);
+            names[i] = storage[i];
+        }
+    }
+    return names;
+}
+
+static int create_batch_run(size_t nfiles, int thread, size_t ops) {
+    (void)nfiles;
+    pthread_mutex_lock(&fs_lock);
+    int ret = vsfs_create_batch(thread_dirs[thread], batch_names(), ops, S_IFREG | 0644,
+                                (uint32_t *)thread_files[thread]);
+    pthread_mutex_unlock(&fs_lock);
+    return ret == (int)ops ? 0 : -1;
+}
+
+static int unlink_batch_run(size_t nfiles, int thread, size_t ops) {
+    (void)nfiles;
+    pthread_mutex_lock(&fs_lock);
+    int ret = vsfs_unlink_batch(thread_dirs[thread], batch_names(), ops);
+    pthread_mutex_unlock(&fs_lock);
+    return ret == (int)ops ? 0 : -1;
+}
+
+static int create_batch_before(size_t nfiles, int thread) {
+    return create_batch_run(nfiles, thread, SUITE_FILES);
+}
+
+static int unlink_batch_after(size_t nfiles, int thread) {
+    return unlink_batch_run(nfiles, thread, SUITE_FILES);
+}
+
+static int stat_run(size_t nfiles, int thread, size_t ops) {
+    inode_t inode;
+    for (size_t i = 0; i < ops; i++) {
+        int file = thread_files[thread][next_random(thread) % nfiles];
+        pthread_mutex_lock(&fs_lock);
+        int ret = vsfs_stat(file, &inode);
+        pthread_mutex_unlock(&fs_lock);
+        if (ret < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// List the thread's directory with attributes; one op per entry
+static int readdir_run(size_t nfiles, int thread, size_t ops) {
+    dirent_plus_t buf[64];
+    size_t cursor = 0, listed = 0;
+    int got;
+    (void)nfiles;
+    do {
+        pthread_mutex_lock(&fs_lock);
+        got = vsfs_readdir_plus(thread_dirs[thread], &cursor, buf, 64);
+        pthread_mutex_unlock(&fs_lock);
+        listed += got > 0 ? got : 0;
+    } while (got > 0);
+    return got < 0 || listed != ops ? -1 : 0;
+}
+
+// Image with every other data block in use and one free run of `run` blocks
+// at the very end: the worst case for an allocator that scans the bitmap
+static int fragmented_setup(size_t run, int threads) {
+    (void)threads;
+    unlink(SUITE_DISK);
+    if (format_disk(SUITE_DISK, SUITE_DISK_SIZE, MAX_INODES) < 0) {
+        return -1;
+    }
+    uint32_t first = data_region_start(), nblocks = sb->num_total_blocks;
+    uint32_t *blocks = malloc((nblocks - first) * sizeof(uint32_t));
+    size_t n = 0;
+    if (blocks == NULL || alloc_data_extent(nblocks - first) != (int)first) {
+        free(blocks);
+        return -1;
+    }
+    for (uint32_t block = first; block < nblocks; block++) {
+        if (block >= nblocks - run || (block - first) % 2 == 1) {
+            blocks[n++] = block;
+        }
+    }
+    int ret = free_data_blocks(blocks, n);
+    free(blocks);
+    return ret;
+}
+
+static int alloc_extent_run(size_t run, int thread, size_t ops) {
+    (void)thread;
+    for (size_t i = 0; i < ops; i++) {
+        int start = alloc_data_extent(run);
+        if (start < 0) {
+            return -1;
+        }
+        uint32_t blocks[256];
+        for (size_t k = 0; k < run; k++) {
+            blocks[k] = start + k;
+        }
+        if (free_data_blocks(blocks, run) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int mount_setup(size_t arg, int threads) {
+    if (fragmented_setup(arg, threads) < 0) {
+        return -1;
+    }
+    return unmount_disk();
+}
+
+static int mount_run(size_t arg, int thread, size_t ops) {
+    (void)arg;
+    (void)thread;
+    (void)ops;
+    return mount_disk(SUITE_DISK, NULL);
+}
+
+static int mount_after(size_t arg, int thread) {
+    (void)arg;
+    (void)thread;
+    return unmount_disk();
+}
+
+// One fully written SUITE_FILE_SIZE file per thread
+static int io_setup(size_t arg, int threads) {
+    (void)arg;
+    if (image_setup(1, threads) < 0) {
+        return -1;
+    }
+    for (int t = 0; t < threads; t++) {
+        thread_bufs[t] = malloc(SUITE_CHUNK);
+        if (thread_bufs[t] == NULL) {
+            return -1;
+        }
+        memset(thread_bufs[t], 'a' + t, SUITE_CHUNK);
+        for (size_t off = 0; off < SUITE_FILE_SIZE; off += SUITE_CHUNK) {
+            if (vsfs_write(thread_files[t][0], off, thread_bufs[t], SUITE_CHUNK) != SUITE_CHUNK) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// `io_size` bytes per operation, sequential when it is SUITE_CHUNK and at
+// random block-aligned offsets otherwise; `arg` low bit selects writes
+static int io_run(size_t arg, int thread, size_t ops) {
+    bool write = arg & 1;
+    size_t io_size = arg >> 1;
+    size_t nslots = SUITE_FILE_SIZE / io_size;
+    for (size_t i = 0; i < ops; i++) {
+        size_t slot = io_size == SUITE_CHUNK ? i % nslots : next_random(thread) % nslots;
+        pthread_mutex_lock(&fs_lock);
+        ssize_t ret = write ? vsfs_write(thread_files[thread][0], slot * io_size, thread_bufs[thread], io_size)
+                            : vsfs_read(thread_files[thread][0], slot * io_size, thread_bufs[thread], io_size);
+        pthread_mutex_unlock(&fs_lock);
+        if (ret != (ssize_t)io_size) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Sequential zero-copy reads: map each SUITE_CHUNK as spans and unpin them
+static int map_run(size_t arg, int thread, size_t ops) {
+    (void)arg;
+    size_t nslots = SUITE_FILE_SIZE / SUITE_CHUNK;
+    struct iovec spans[SUITE_CHUNK / BLOCK_SIZE];
+    for (size_t i = 0; i < ops; i++) {
+        int nspans = SUITE_CHUNK / BLOCK_SIZE;
+        pthread_mutex_lock(&fs_lock);
+        ssize_t ret = vsfs_map_file(thread_files[thread][0], i % nslots * SUITE_CHUNK, SUITE_CHUNK, spans, &nspans);
+        if (ret >= 0 && vsfs_unmap_file(spans, nspans) < 0) {
+            ret = -1;
+        }
+        pthread_mutex_unlock(&fs_lock);
+        if (ret != SUITE_CHUNK) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#define SEQ_IO(write) ((size_t)SUITE_CHUNK << 1 | (write))
+#define RAND_IO(write) ((size_t)BLOCK_SIZE << 1 | (write))
+
+static const workload_t workloads[] = {
+    {"format", "size_mib=16", 1, 0, true, 16, NULL, NULL, format_run, format_after, suite_unlink},
+    {"format", "size_mib=64", 1, 0, true, 64, NULL, NULL, format_run, format_after, suite_unlink},
+    {"format", "size_mib=256", 1, 0, true, 256, NULL, NULL, format_run, format_after, suite_unlink},
+    {"bitmapalloc", "fill=empty", 2000, 0, false, 0, bitmap_setup, NULL, bitmap_run, NULL, bitmap_teardown},
+    {"bitmapalloc", "fill=half", 50, 0, false, 50, bitmap_setup, NULL, bitmap_run, NULL, bitmap_teardown},
+    {"bitmapalloc", "fill=full", 50, 0, false, 100, bitmap_setup, NULL, bitmap_run, NULL, bitmap_teardown},
+    {"alloc_extent", "run=256,fill=half", 50, 0, true, 256, fragmented_setup, NULL, alloc_extent_run, NULL, image_teardown},
+    {"mount", "size_mib=256,fill=half", 1, 0, true, 1, mount_setup, NULL, mount_run, mount_after, suite_unlink},
+    {"create", "files=256", SUITE_FILES, 0, false, 0, image_setup, NULL, create_files, unlink_after, image_teardown},
+    {"stat", "files=256", 4096, 0, false, SUITE_FILES, image_setup, NULL, stat_run, NULL, image_teardown},
+    {"readdir_plus", "files=256", SUITE_FILES, 0, false, SUITE_FILES, image_setup, NULL, readdir_run, NULL, image_teardown},
+    {"unlink", "files=256", SUITE_FILES, 0, false, 0, image_setup, create_before, unlink_files, NULL, image_teardown},
+    {"create_batch", "files=256", SUITE_FILES, 0, false, 0, image_setup, NULL, create_batch_run, unlink_batch_after, image_teardown},
+    {"unlink_batch", "files=256", SUITE_FILES, 0, false, 0, image_setup, create_batch_before, unlink_batch_run, NULL, image_teardown},
+    {"seq_write", "io_kib=64", SUITE_FILE_SIZE / SUITE_CHUNK, SUITE_CHUNK, false, SEQ_IO(1), io_setup, NULL, io_run, NULL, image_teardown},
+    {"seq_read", "io_kib=64", SUITE_FILE_SIZE / SUITE_CHUNK, SUITE_CHUNK, false, SEQ_IO(0), io_setup, NULL, io_run, NULL, image_teardown},
+    {"seq_map", "io_kib=64", SUITE_FILE_SIZE / SUITE_CHUNK, SUITE_CHUNK, false, 0, io_setup, NULL, map_run, NULL, image_teardown},
+    {"rand_write", "io_kib=4", 256, BLOCK_SIZE, false, RAND_IO(1), io_setup, NULL, io_run, NULL, image_teardown},
+    {"rand_read", "io_kib=4", 256, BLOCK_SIZE, false, RAND_IO(0), io_setup, NULL, io_run, NULL, image_teardown},
+};
+
+// Shared between the timing thread and the workers of one run
+typedef struct {
+    const workload_t *w;
+    int threads;
+    int total_samples;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    double begin[MAX_BENCH_THREADS];    // per-thread timestamps of the current sample
+    double end[MAX_BENCH_THREADS];
+    int failed;
+} run_state_t;
+
+typedef struct {
+    run_state_t *state;
+    int thread;
+} worker_arg_t;
+
+static void *bench_worker(void *p) {
+    worker_arg_t *arg = p;
+    run_state_t *state = arg->state;
+    const workload_t *w = state->w;
+    for (int s = 0; s < state->total_samples; s++) {
+        if (w->before != NULL && w->before(w->arg, arg->thread) < 0) {
+            __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+        }
+        pthread_barrier_wait(&state->start);
+        state->begin[arg->thread] = now_sec();
+        if (w->run(w->arg, arg->thread, w->ops) < 0) {
+            __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+        }
+        state->end[arg->thread] = now_sec();
+        pthread_barrier_wait(&state->done);
+        if (w->after != NULL && w->after(w->arg, arg->thread) < 0) {
+            __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+static double percentile(const double *sorted, int n, double pct) {
+    int rank = (int)(pct / 100.0 * n + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[(rank > n ? n : rank) - 1];
+}
+
+// Run one workload at one thread count and print its result.
+// `first` tracks the JSON separator between results.
+static int run_workload(const workload_t *w, int threads, bool *first) {
+    int total = config.warmup + config.samples;
+    double *times = malloc(total * sizeof(double));
+    run_state_t state = {.w = w, .threads = threads, .total_samples = total};
+    pthread_t tids[MAX_BENCH_THREADS];
+    worker_arg_t args[MAX_BENCH_THREADS];
+
+    for (int t = 0; t < threads; t++) {
+        thread_rng[t] = config.seed * 0x9E3779B97F4A7C15ULL + t + 1;
+    }
+    if (times == NULL || (w->setup != NULL && w->setup(w->arg, threads) < 0)) {
+        free(times);
+        return -1;
+    }
+
+    pthread_barrier_init(&state.start, NULL, threads + 1);
+    pthread_barrier_init(&state.done, NULL, threads + 1);
+    for (int t = 0; t < threads; t++) {
+        args[t] = (worker_arg_t){&state, t};
+        pthread_create(&tids[t], NULL, bench_worker, &args[t]);
+    }
+    // A sample spans from the first thread starting to the last one finishing
+    for (int s = 0; s < total; s++) {
+        pthread_barrier_wait(&state.start);
+        pthread_barrier_wait(&state.done);
+        double begin = state.begin[0], end = state.end[0];
+        for (int t = 1; t < threads; t++) {
+            begin = state.begin[t] < begin ? state.begin[t] : begin;
+            end = state.end[t] > end ? state.end[t] : end;
+        }
+        times[s] = end - begin;
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    pthread_barrier_destroy(&state.start);
+    pthread_barrier_destroy(&state.done);
+    if (w->teardown != NULL) {
+        w->teardown();
+    }
+    if (state.failed) {
+        free(times);
+        return -1;
+    }
+
+    // Per-operation latency of each measured sample; every thread did `ops`
+    double *ns = times + config.warmup;
+    int n = config.samples;
+    for (int s = 0; s < n; s++) {
+        ns[s] = ns[s] * 1e9 / w->ops;
+    }
+    qsort(ns, n, sizeof(double), compare_doubles);
+    double median = percentile(ns, n, 50);
+    double ops_per_sec = threads * 1e9 / median;
+    double mib_per_sec = ops_per_sec * w->bytes_per_op / MIB;
+
+    if (config.json) {
+        printf("%s\n    {\"name\": \"%s\", \"params\": \"%s\", \"threads\": %d, \"ops_per_sample\": %zu, "
+               "\"samples\": %d, \"ns_per_op\": {\"median\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+               "\"min\": %.1f, \"max\": %.1f}, \"ops_per_sec\": %.1f",
+               *first ? "" : ",", w->name, w->params, threads, w->ops, n, median,
+               percentile(ns, n, 90), percentile(ns, n, 99), ns[0], ns[n - 1], ops_per_sec);
+        if (w->bytes_per_op != 0) {
+            printf(", \"mib_per_sec\": %.1f", mib_per_sec);
+        }
+        printf("}");
+    } else {
+        printf("  %-12s %-13s %3d  %12.1f %12.1f %12.1f %14.1f", w->name, w->params, threads, median,
+               percentile(ns, n, 90), percentile(ns, n, 99), ops_per_sec);
+        if (w->bytes_per_op != 0) {
+            printf(" %9.1f MiB/s", mib_per_sec);
+        }
+        printf("\n");
+    }
+    *first = false;
+    free(times);
+    return 0;
+}
+
+static bool selected(const char *name) {
+    return config.filter == NULL || strstr(name, config.filter) != NULL;
+}
+
+static int run_suite() {
+    bool first = true;
+    if (config.json) {
+        printf("{\n  \"suite\": \"vsfs\",\n  \"samples\": %d,\n  \"warmup\": %d,\n  \"seed\": %u,\n  \"results\": [",
+               config.samples, config.warmup, config.seed);
+    } else {
+        printf("Standard workloads (%d samples after %d warmup, seed %u)\n", config.samples, config.warmup, config.seed);
+        printf("  %-12s %-13s %3s  %12s %12s %12s %14s\n", "workload", "params", "thr",
+               "median ns/op", "p90 ns/op", "p99 ns/op", "ops/s");
+    }
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (!selected(workloads[i].name)) {
+            continue;
+        }
+        for (int t = 0; t < config.nthreads; t++) {
+            if (workloads[i].single_threaded && config.threads[t] != 1) {
+                continue;
+            }
+            if (run_workload(&workloads[i], config.threads[t], &first) < 0) {
+                fprintf(stderr, "bench: %s (%s) failed at %d threads\n", workloads[i].name,
+                        workloads[i].params, config.threads[t]);
+                return -1;
+            }
+            fflush(stdout);
+        }
+    }
+
+    printf(config.json ? "\n  ]\n}\n" : "\n");
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--json] [--threads 1,2,4] [--samples N] [--warmup N] [--seed N] [--filter NAME] [--stats]\n",
+            prog);
+}
+
+// Parse the command line into `config`; returns -1 on bad arguments
+static int parse_args(int argc, char **argv) {
+    config = (bench_config_t){.threads = {1, 2, 4}, .nthreads = 3, .samples = 15, .warmup = 3, .seed = 1};
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--json") == 0) {
+            config.json = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--stats") == 0) {
+            config.stats = true;
+            continue;
+        }
+        if (value == NULL) {
+            return -1;
+        }
+        i++;
+        if (strcmp(argv[i - 1], "--threads") == 0) {
+            config.nthreads = 0;
+            char *copy = strdup(value);
+            for (char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                int n = atoi(tok);
+                if (n < 1 || n > MAX_BENCH_THREADS || config.nthreads == MAX_BENCH_THREADS) {
+                    free(copy);
+                    return -1;
+                }
+                config.threads[config.nthreads++] = n;
+            }
+            free(copy);
+        } else if (strcmp(argv[i - 1], "--samples") == 0) {
+            config.samples = atoi(value);
+        } else if (strcmp(argv[i - 1], "--warmup") == 0) {
+            config.warmup = atoi(value);
+        } else if (strcmp(argv[i - 1], "--seed") == 0) {
+            config.seed = (unsigned)strtoul(value, NULL, 0);
+        } else if (strcmp(argv[i - 1], "--filter") == 0) {
+            config.filter = value;
+        } else {
+            return -1;
+        }
+    }
+    return config.nthreads > 0 && config.samples > 0 && config.warmup >= 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv) < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (!config.json) {
+        printf("=== VSFS Benchmarks ===\n\n");
+    }
+    if (run_suite() != 0) {
+        return -1;
+    }
+
+    // Internal statistics go to stderr so they never mix with JSON results
+    vsfs_stats_t stats;
+    if (config.stats && vsfs_get_stats(&stats) == 0) {
+        vsfs_dump_stats(stderr, &stats, config.json);
+    }
+
+    // Feature reports print free-form text, so they are left out of JSON runs
+    if (config.json) {
+        return 0;
+    }
+
+    if (selected("snapshot") && bench_snapshot_writes() != 0) {
+        printf("✗ Snapshot write benchmark failed\n");
+        return -1;
+    }
+
+    if (selected("dedup") && bench_dedup() != 0) {
+        printf("✗ Dedup benchmark failed\n");
+        return -1;
+    }
+
+    if (selected("compression") && bench_compression() != 0) {
+        printf("✗ Compression benchmark failed\n");
+        return -1;
+    }
+
+    if (selected("mount") && bench_mount_options() != 0) {
+        printf("✗ Mount options benchmark failed\n");
+        return -1;
+    }
+
+    if (selected("tail") && bench_tail_packing() != 0) {
+        printf("✗ Tail packing benchmark failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Overwrite every file in full; returns the elapsed time in seconds (-1 on error)
+static double overwrite_files(const int *files, int nfiles, const char *buf, size_t file_size) {
+    double start = now_sec();
+    for (int i = 0; i < nfiles; i++) {
+        if (vsfs_write(files[i], 0, buf, file_size) != (ssize_t)file_size) {
+            return -1;
+        }
+    }
+    return now_sec() - start;
+}
+
+int bench_snapshot_writes() {
+    const char *disk_name = "bench_disk_snapshot";
+    size_t disk_size = 256 * 1024 * 1024;
+    size_t file_size = 1024 * BLOCK_SIZE;
+    const int nfiles = 16;
+    double total = (double)nfiles * file_size / MIB;
+
+    printf("Snapshot write throughput (%d files x %zu KiB)\n", nfiles, file_size / 1024);
+    unlink(disk_name);
+    if (format_disk(disk_name, disk_size, MAX_INODES) < 0) {
+        return -1;
+    }
+
+    char *buf = malloc(file_size);
+    memset(buf, 0x5A, file_size);
+    int files[nfiles];
+    for (int i = 0; i < nfiles; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "file%d", i);
+        files[i] = vsfs_create(ROOT_INODE, name, S_IFREG | 0644);
+        if (files[i] < 0 || vsfs_write(files[i], 0, buf, file_size) != (ssize_t)file_size) {
+            free(buf);
+            return -1;
+        }
+    }
+
+    double plain = overwrite_files(files, nfiles, buf, file_size);
+
+    double start = now_sec();
+    int snap = vsfs_snapshot_create();
+    double create = now_sec() - start;
+
+    double first = overwrite_files(files, nfiles, buf, file_size);   // copies every block
+    double steady = overwrite_files(files, nfiles, buf, file_size);  // blocks are private again
+
+    free(buf);
+    if (snap < 0 || plain < 0 || first < 0 || steady < 0) {
+        return -1;
+    }
+
+    printf("  overwrite, no snapshot:            %8.1f MiB/s\n", total / plain);
+    printf("  snapshot create:                   %8.3f ms\n", create * 1000);
+    printf("  first overwrite after snapshot:    %8.1f MiB/s\n", total / first);
+    printf("  later overwrite with snapshot:     %8.1f MiB/s\n", total / steady);
+    printf("\n");
+
+    cleanup_disk(disk_map, disk_size, disk_fd);
+    unlink(disk_name);
+    return 0;
+}
+
+// Write `nfiles` files whose contents are drawn from `ndistinct` distinct
+// payloads, as in an image full of vendored copies; returns elapsed seconds
+static double write_duplicate_files(int nfiles, int ndistinct, size_t file_size, char *buf) {
+    double start = now_sec();
+    for (int i = 0; i < nfiles; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "lib%d", i);
+        for (size_t off = 0; off < file_size; off += sizeof(int)) {
+            int word = (int)(off * 2654435761u) ^ (i % ndistinct);
+            memcpy(buf + off, &word, sizeof(int));
+        }
+        int file = vsfs_create(ROOT_INODE, name, S_IFREG | 0644);
+        if (file < 0 || vsfs_write(file, 0, buf, file_size) != (ssize_t)file_size) {
+            return -1;
+        }
+    }
+    return now_sec() - start;
+}
+
+int bench_dedup() {
+    const char *disk_name = "bench_disk_dedup";
+    size_t disk_size = 256 * 1024 * 1024;
+    size_t file_size = 256 * BLOCK_SIZE;
+    const int nfiles = 64;
+    const int ndistinct = 8;
+    double total = (double)nfiles * file_size / MIB;
+    char *buf = malloc(file_size);
+
+    printf("Deduplication (%d files x %zu KiB, %d distinct)\n", nfiles, file_size / 1024, ndistinct);
+
+    // Offline pass, in memory and with records spilled to disk
+    size_t limits[] = {64 * 1024 * 1024, 64 * 1024};
+    for (int i = 0; i < 2; i++) {
+        unlink(disk_name);
+        if (format_disk(disk_name, disk_size, MAX_INODES) < 0 ||
+            write_duplicate_files(nfiles, ndistinct, file_size, buf) < 0) {
+            free(buf);
+            return -1;
+        }
+        uint32_t used = sb->num_data_blocks - sb->num_free_blocks;
+
+        double start = now_sec();
+        int saved = vsfs_dedup(limits[i]);
+        double elapsed = now_sec() - start;
+        if (saved < 0) {
+            free(buf);
+            return -1;
+        }
+        printf("  offline, %6zu KiB memory:  saved %5.1f%% of %u blocks in %8.1f ms (%7.1f MiB/s)\n",
+               limits[i] / 1024, 100.0 * saved / used, used, elapsed * 1000, total / elapsed);
+        cleanup_disk(disk_map, disk_size, disk_fd);
+    }
+
+    // Inline mode against plain writes
+    for (int inline_mode = 0; inline_mode < 2; inline_mode++) {
+        unlink(disk_name);
+        if (format_disk(disk_name, disk_size, MAX_INODES) < 0 ||
+            (inline_mode && vsfs_dedup_inline(4096) < 0)) {
+            free(buf);
+            return -1;
+        }
+        uint32_t free_before = sb->num_free_blocks;
+        double elapsed = write_duplicate_files(nfiles, ndistinct, file_size, buf);
+        if (elapsed < 0) {
+            free(buf);
+            return -1;
+        }
+        printf("  %-25s  used %5u blocks, write %7.1f MiB/s\n", inline_mode ? "inline dedup:" : "no dedup:",
+               free_before - sb->num_free_blocks, total / elapsed);
+        cleanup_disk(disk_map, disk_size, disk_fd);
+    }
+    printf("\n");
+
+    free(buf);
+    unlink(disk_name);
+    return 0;
+}
+
+// Fill a buffer with log-like text
+static void fill_log_text(char *buf, size_t len, unsigned seed) {
+    size_t pos = 0;
+    while (pos < len) {
+        char line[128];
+        int n = snprintf(line, sizeof(line), "2026-10-18 12:%02u:%02u INFO worker-%u request %u served in %u ms\n",
+                         seed % 60, (seed / 7) % 60, seed % 8, seed, seed % 97);
+        size_t chunk = (size_t)n < len - pos ? (size_t)n : len - pos;
+        memcpy(buf + pos, line, chunk);
+        pos += chunk;
+        seed = seed * 1103515245 + 12345;
+    }
+}
+
+// Write the image back and drop it from the page cache so the next read hits storage
+static void drop_image_cache(size_t disk_size) {
+    msync(disk_map, disk_size, MS_SYNC);
+    madvise(disk_map, disk_size, MADV_DONTNEED);
+    posix_fadvise(disk_fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// Read every file in full; returns the elapsed time in seconds (-1 on error)
+static double read_files(const int *files, int nfiles, char *buf, size_t file_size) {
+    double start = now_sec();
+    for (int i = 0; i < nfiles; i++) {
+        if (vsfs_read(files[i], 0, buf, file_size) != (ssize_t)file_size) {
+            return -1;
+        }
+    }
+    return now_sec() - start;
+}
+
+int bench_compression() {
+    const char *disk_name = "bench_disk_compress";
+    size_t disk_size = 256 * 1024 * 1024;
+    size_t file_size = 256 * BLOCK_SIZE;
+    const int nfiles = 32;
+    double total = (double)nfiles * file_size / MIB;
+    int levels[] = {0, 1, 3, 6, 9};
+    char *buf = malloc(file_size);
+
+    printf("Compression (%d files x %zu KiB of log text)\n", nfiles, file_size / 1024);
+    printf("  level   ratio    write MiB/s   warm read MiB/s   cold read MiB/s\n");
+    for (int l = 0; l < 5; l++) {
+        unlink(disk_name);
+        if (format_disk(disk_name, disk_size, MAX_INODES) < 0 || vsfs_set_default_compression(levels[l]) < 0) {
+            free(buf);
+            return -1;
+        }
+
+        int files[nfiles];
+        uint32_t free_before = sb->num_free_blocks;
+        double write_time = 0;
+        for (int i = 0; i < nfiles; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "log%d", i);
+            fill_log_text(buf, file_size, i);
+            double start = now_sec();
+            files[i] = vsfs_create(ROOT_INODE, name, S_IFREG | 0644);
+            if (files[i] < 0 || vsfs_write(files[i], 0, buf, file_size) != (ssize_t)file_size) {
+                free(buf);
+                return -1;
+            }
+            write_time += now_sec() - start;
+        }
+        uint32_t used = free_before - sb->num_free_blocks;
+
+        double warm = read_files(files, nfiles, buf, file_size);
+        drop_image_cache(disk_size);
+        double cold = read_files(files, nfiles, buf, file_size);
+        if (warm < 0 || cold < 0) {
+            free(buf);
+            return -1;
+        }
+
+        printf("  %5d   %5.2fx   %11.1f   %15.1f   %15.1f\n", levels[l],
+               (double)nfiles * file_size / ((double)used * BLOCK_SIZE),
+               total / write_time, total / warm, total / cold);
+        cleanup_disk(disk_map, disk_size, disk_fd);
+    }
+    printf("\n");
+
+    free(buf);
+    unlink(disk_name);
+    return 0;
+}
+
+// Page faults taken by this process so far
+static void fault_counts(long *minor, long *major) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    *minor = usage.ru_minflt;
+    *major = usage.ru_majflt;
+}
+
+// Open a disabled user-space dTLB load miss counter (-1 if perf is unavailable)
+static int open_dtlb_counter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int bench_mount_options() {
+    const char *disk_name = "bench_disk_mount";
+    size_t disk_size = 256 * 1024 * 1024;
+    const int ndirs = 32;
+    const int files_per_dir = 256;
+    const int nfiles = ndirs * files_per_dir;
+    const int nstats = 200000;
+
+    printf("Mount options (%d files in %d directories, %d random stats)\n", nfiles, ndirs, nstats);
+    unlink(disk_name);
+    if (format_disk(disk_name, disk_size, 2 * nfiles) < 0) {
+        return -1;
+    }
+    int *files = malloc(nfiles * sizeof(int));
+    for (int d = 0; d < ndirs; d++) {
+        char name[32];
+        snprintf(name, sizeof(name), "dir%d", d);
+        int dir = vsfs_create(ROOT_INODE, name, S_IFDIR | 0755);
+        for (int f = 0; f < files_per_dir && dir >= 0; f++) {
+            snprintf(name, sizeof(name), "file%d", f);
+            files[d * files_per_dir + f] = vsfs_create(dir, name, S_IFREG | 0644);
+            if (files[d * files_per_dir + f] < 0) {
+                dir = -1;
+            }
+        }
+        if (dir < 0) {
+            free(files);
+            return -1;
+        }
+    }
+    unmount_disk();
+
+    map_options_t populate = {.populate_metadata = true};
+    map_options_t random_access = {.populate_metadata = true, .data_advice = MADV_RANDOM};
+    map_options_t huge = {.populate_metadata = true, .huge_pages = true, .data_advice = MADV_RANDOM};
+    const map_options_t *configs[] = {NULL, &populate, &random_access, &huge};
+    const char *labels[] = {"default", "populate", "populate+random", "populate+random+huge"};
+
+    int counter = open_dtlb_counter();
+    printf("  %-22s  mount ms   faults   stat ns   faults(min/maj)   dTLB misses\n", "options");
+    for (int c = 0; c < 4; c++) {
+        // Start every configuration from a cold page cache
+        int fd = open(disk_name, O_RDONLY);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+
+        long minor0, major0, minor1, major1, minor2, major2;
+        fault_counts(&minor0, &major0);
+        double start = now_sec();
+        if (mount_disk(disk_name, configs[c]) < 0) {
+            free(files);
+            return -1;
+        }
+        double mount_time = now_sec() - start;
+        fault_counts(&minor1, &major1);
+
+        if (counter >= 0) {
+            ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+            ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        unsigned seed = 1;
+        inode_t inode;
+        start = now_sec();
+        for (int i = 0; i < nstats; i++) {
+            seed = seed * 1103515245 + 12345;
+            if (vsfs_stat(files[(seed >> 8) % nfiles], &inode) < 0) {
+                free(files);
+                return -1;
+            }
+        }
+        double stat_time = now_sec() - start;
+        long long misses = -1;
+        if (counter >= 0) {
+            ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+                misses = -1;
+            }
+        }
+        fault_counts(&minor2, &major2);
+
+        char tlb[32];
+        if (misses >= 0) {
+            snprintf(tlb, sizeof(tlb), "%lld", misses);
+        } else {
+            snprintf(tlb, sizeof(tlb), "n/a");
+        }
+        printf("  %-22s  %8.2f   %6ld   %7.1f   %7ld/%-7ld   %11s\n", labels[c], mount_time * 1000,
+               (minor1 - minor0) + (major1 - major0), stat_time * 1e9 / nstats,
+               minor2 - minor1, major2 - major1, tlb);
+        unmount_disk();
+    }
+    printf("\n");
+
+    if (counter >= 0) {
+        close(counter);
+    }
+    free(files);
+    unlink(disk_name);
+    return 0;
+}
+
+// Read every small file in full; returns the elapsed time in seconds (-1 on error)
+static double read_small_files(const int *files, const size_t *sizes, int nfiles, char *buf) {
+    double start = now_sec();
+    for (int i = 0; i < nfiles; i++) {
+        if (vsfs_read(files[i], 0, buf, sizes[i]) != (ssize_t)sizes[i]) {
+            return -1;
+        }
+    }
+    return now_sec() - start;
+}
+
+int bench_tail_packing() {
+    const char *disk_name = "bench_disk_tail";
+    size_t disk_size = 64 * 1024 * 1024;
+    const int nfiles = 4000;
+    int *files = malloc(nfiles * sizeof(int));
+    size_t *sizes = malloc(nfiles * sizeof(size_t));
+    char buf[BLOCK_SIZE];
+
+    // Half the files are under 1 KiB, the rest up to 4 KiB
+    uint64_t rng = 42;
+    for (int i = 0; i < nfiles; i++) {
+        rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+        sizes[i] = i % 2 == 0 ? 1 + (rng >> 33) % 1024 : 1025 + (rng >> 33) % (BLOCK_SIZE - 1025);
+    }
+    memset(buf, 'x', sizeof(buf));
+
+    printf("Tail packing (%d files of 1 B - 4 KiB, half under 1 KiB)\n", nfiles);
+    printf("  packing   blocks   bytes/block   create+write files/s   warm read files/s   cold read files/s\n");
+    for (int packed = 0; packed <= 1; packed++) {
+        unlink(disk_name);
+        if (format_disk(disk_name, disk_size, 2 * nfiles) < 0 || vsfs_set_tail_packing(packed) < 0) {
+            free(files);
+            free(sizes);
+            return -1;
+        }
+
+        uint32_t free_before = sb->num_free_blocks;
+        size_t total = 0;
+        double start = now_sec();
+        for (int i = 0; i < nfiles; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "small%d", i);
+            files[i] = vsfs_create(ROOT_INODE, name, S_IFREG | 0644);
+            if (files[i] < 0 || vsfs_write(files[i], 0, buf, sizes[i]) != (ssize_t)sizes[i]) {
+                free(files);
+                free(sizes);
+                return -1;
+            }
+            total += sizes[i];
+        }
+        double write_time = now_sec() - start;
+        uint32_t used = free_before - sb->num_free_blocks;
+
+        double warm = read_small_files(files, sizes, nfiles, buf);
+        drop_image_cache(disk_size);
+        double cold = read_small_files(files, sizes, nfiles, buf);
+        if (warm < 0 || cold < 0) {
+            free(files);
+            free(sizes);
+            return -1;
+        }
+
+        printf("  %7s   %6u   %11.0f   %20.0f   %17.0f   %17.0f\n", packed ? "on" : "off", used,
+               (double)total / used, nfiles / write_time, nfiles / warm, nfiles / cold);
+        cleanup_disk(disk_map, disk_size, disk_fd);
+    }
+    printf("\n");
+
+    free(files);
+    free(sizes);
+    unlink(disk_name);
+    return 0;
+}
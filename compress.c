@@ -0,0 +1,515 @@
+#include "compress.h"
+#include "helpers.h"
+#include "delta.h"
+#include <sys/stat.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define LAST_LITERALS 5     // the input always ends with literals
+#define MATCH_LIMIT 12      // no match starts this close to the end
+#define HASH_LOG 14
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// Append the extra bytes of a length that didn't fit in its token nibble
+static uint8_t *emit_length(uint8_t *op, size_t len) {
+    for (len -= 15; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Append one sequence: literals followed by a match (match_len 0 = last sequence).
+// Returns NULL if it doesn't fit before `oend`.
+static uint8_t *emit_sequence(uint8_t *op, uint8_t *oend, const uint8_t *literals, size_t lit_len,
+                              size_t offset, size_t match_len) {
+    size_t needed = 1 + lit_len / 255 + 1 + lit_len + (match_len ? 2 + match_len / 255 + 1 : 0);
+    if ((size_t)(oend - op) < needed) {
+        return NULL;
+    }
+
+    uint8_t *token = op++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4;
+    if (lit_len >= 15) {
+        op = emit_length(op, lit_len);
+    }
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+
+    if (match_len != 0) {
+        size_t code = match_len - MIN_MATCH;
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        *token |= code < 15 ? code : 15;
+        if (code >= 15) {
+            op = emit_length(op, code);
+        }
+    }
+    return op;
+}
+
+// LZ77 codec with an LZ4-style sequence format. `level` 1 uses a single hash
+// probe per position; higher levels search hash chains 2^(level-1) deep.
+// Returns the compressed size, or 0 if the output would exceed `dst_cap`.
+size_t lz_compress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap, int level) {
+    if (level < 1) {
+        level = 1;
+    }
+    if (level > MAX_COMPRESS_LEVEL) {
+        level = MAX_COMPRESS_LEVEL;
+    }
+
+    int32_t *head = malloc((1 << HASH_LOG) * sizeof(int32_t));
+    int32_t *chain = level > 1 ? malloc(src_len * sizeof(int32_t)) : NULL;
+    if (head == NULL || (level > 1 && chain == NULL)) {
+        free(head);
+        free(chain);
+        return 0;
+    }
+    memset(head, 0xFF, (1 << HASH_LOG) * sizeof(int32_t));   // -1 = empty
+    int max_attempts = 1 << (level - 1);
+
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_cap;
+    size_t anchor = 0;
+    size_t ip = 0;
+    size_t misses = 0;
+
+    while (src_len > MATCH_LIMIT && ip < src_len - MATCH_LIMIT) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = hash4(seq);
+        size_t best_len = 0;
+        size_t best_off = 0;
+
+        int32_t cand = head[h];
+        for (int attempt = 0; cand >= 0 && ip - cand <= MAX_OFFSET && attempt < max_attempts; attempt++) {
+            if (read32(src + cand) == seq) {
+                size_t len = MIN_MATCH;
+                while (ip + len < src_len - LAST_LITERALS && src[cand + len] == src[ip + len]) {
+                    len++;
+                }
+                if (len > best_len) {
+                    best_len = len;
+                    best_off = ip - cand;
+                }
+            }
+            cand = chain != NULL ? chain[cand] : -1;
+        }
+        if (chain != NULL) {
+            chain[ip] = head[h];
+        }
+        head[h] = ip;
+
+        if (best_len == 0) {
+            // Skip faster through data that isn't compressing
+            ip += level == 1 ? 1 + (misses++ >> 6) : 1;
+            continue;
+        }
+        misses = 0;
+
+        op = emit_sequence(op, oend, src + anchor, ip - anchor, best_off, best_len);
+        if (op == NULL) {
+            free(head);
+            free(chain);
+            return 0;
+        }
+
+        // Index the positions covered by the match (just the tail at level 1)
+        size_t end = ip + best_len;
+        size_t p = chain != NULL ? ip + 1 : end - 2;
+        for (; p < end && p < src_len - MATCH_LIMIT; p++) {
+            uint32_t hp = hash4(read32(src + p));
+            if (chain != NULL) {
+                chain[p] = head[hp];
+            }
+            head[hp] = p;
+        }
+        ip = end;
+        anchor = ip;
+    }
+
+    op = emit_sequence(op, oend, src + anchor, src_len - anchor, 0, 0);
+    free(head);
+    free(chain);
+    return op == NULL ? 0 : (size_t)(op - dst);
+}
+
+// Read the extra bytes of a length whose token nibble was 15
+static int read_length(const uint8_t *src, size_t src_len, size_t *ip, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= src_len) {
+            return -1;
+        }
+        b = src[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Returns the decompressed size, or -1 if the input is corrupt or too large
+ssize_t lz_decompress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap) {
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < src_len) {
+        uint8_t token = src[ip++];
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && read_length(src, src_len, &ip, &lit_len) < 0) {
+            return -1;
+        }
+        if (lit_len > src_len - ip || lit_len > dst_cap - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == src_len) {
+            break;  // last sequence has no match
+        }
+
+        if (src_len - ip < 2) {
+            return -1;
+        }
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && read_length(src, src_len, &ip, &match_len) < 0) {
+            return -1;
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > op || match_len > dst_cap - op) {
+            return -1;
+        }
+
+        uint8_t *out = dst + op;
+        const uint8_t *match = out - offset;
+        if (offset >= match_len) {
+            memcpy(out, match, match_len);
+        } else {
+            for (size_t i = 0; i < match_len; i++) {   // overlapping copy repeats the pattern
+                out[i] = match[i];
+            }
+        }
+        op += match_len;
+    }
+
+    return op;
+}
+
+// Compress new data written to a file (only allowed while it is empty)
+int vsfs_set_compression(uint32_t ino, int level) {
+    if (level < 0 || level > MAX_COMPRESS_LEVEL) {
+        fprintf(stderr, "vsfs_set_compression: level %d out of range (0-%d)\n", level, MAX_COMPRESS_LEVEL);
+        return -1;
+    }
+
+    inode_t inode;
+    if (read_inode(ino, &inode) < 0) {
+        return -1;
+    }
+    if (!S_ISREG(inode.mode) || inode.size != 0) {
+        fprintf(stderr, "vsfs_set_compression: inode %u is not an empty regular file\n", ino);
+        return -1;
+    }
+
+    inode.compression = level;
+    return write_inode(ino, &inode);
+}
+
+// Compression level for files created from now on (0 = off)
+int vsfs_set_default_compression(int level) {
+    if (level < 0 || level > MAX_COMPRESS_LEVEL) {
+        fprintf(stderr, "vsfs_set_default_compression: level %d out of range (0-%d)\n", level, MAX_COMPRESS_LEVEL);
+        return -1;
+    }
+    sb->compress_level = level;
+    return 0;
+}
+
+// Compressed length of a cluster (0 = stored raw)
+static uint32_t cluster_length(inode_t *inode, size_t cluster) {
+    if (inode->cluster_map == 0) {
+        return 0;
+    }
+    return ((uint32_t *)block_ptr(inode->cluster_map))[cluster];
+}
+
+// Record a cluster's compressed length, giving the inode a private map first
+static int set_cluster_length(inode_t *inode, size_t cluster, uint32_t length) {
+    if (inode->cluster_map == 0) {
+        if (length == 0) {
+            return 0;
+        }
+        int block = alloc_data_block();
+        if (block < 0) {
+            return -1;
+        }
+        inode->cluster_map = block;
+    } else if (cow_block(&inode->cluster_map) < 0) {
+        return -1;
+    }
+
+    ((uint32_t *)block_ptr(inode->cluster_map))[cluster] = length;
+    delta_mark(inode->cluster_map, 1);
+    return 0;
+}
+
+// Blocks of a cluster a file can address; the last cluster runs past the
+// maximum file size
+static size_t cluster_blocks(size_t cluster) {
+    size_t first = cluster * CLUSTER_BLOCKS;
+    return MAX_FILE_BLOCKS - first < CLUSTER_BLOCKS ? MAX_FILE_BLOCKS - first : CLUSTER_BLOCKS;
+}
+
+// Decompress a whole cluster into `out` (`cap` bytes), zero-filling past the
+// stored data. `scratch` must hold CLUSTER_SIZE bytes.
+static int cluster_load(inode_t *inode, size_t cluster, uint8_t *out, size_t cap, uint8_t *scratch) {
+    size_t first = cluster * CLUSTER_BLOCKS;
+    uint32_t length = cluster_length(inode, cluster);
+
+    if (length == 0) {
+        for (size_t i = 0; i * BLOCK_SIZE < cap; i++) {
+            // Blocks past the maximum file size read as holes
+            int block = i < cluster_blocks(cluster) ? inode_bmap(inode, first + i, false) : 0;
+            size_t chunk = cap - i * BLOCK_SIZE < BLOCK_SIZE ? cap - i * BLOCK_SIZE : BLOCK_SIZE;
+            if (block < 0) {
+                return -1;
+            }
+            if (block == 0) {
+                memset(out + i * BLOCK_SIZE, 0, chunk);
+            } else {
+                memcpy(out + i * BLOCK_SIZE, block_ptr(block), chunk);
+            }
+        }
+        return 0;
+    }
+
+    if (length > CLUSTER_SIZE) {
+        fprintf(stderr, "cluster_load: cluster %zu has bad length %u\n", cluster, length);
+        return -1;
+    }
+
+    // Decompress straight out of the image when the blocks are contiguous
+    size_t nblocks = ceildiv(length, BLOCK_SIZE);
+    int start = inode_bmap(inode, first, false);
+    bool contiguous = start > 0;
+    for (size_t i = 1; i < nblocks && contiguous; i++) {
+        contiguous = inode_bmap(inode, first + i, false) == start + (int)i;
+    }
+
+    const uint8_t *packed = (const uint8_t *)block_ptr(start);
+    if (!contiguous) {
+        for (size_t i = 0; i < nblocks; i++) {
+            int block = inode_bmap(inode, first + i, false);
+            if (block <= 0) {
+                fprintf(stderr, "cluster_load: compressed cluster %zu is missing block %zu\n", cluster, i);
+                return -1;
+            }
+            memcpy(scratch + i * BLOCK_SIZE, block_ptr(block), BLOCK_SIZE);
+        }
+        packed = scratch;
+    }
+
+    ssize_t n = lz_decompress(packed, length, out, cap);
+    if (n < 0) {
+        fprintf(stderr, "cluster_load: cluster %zu is corrupt\n", cluster);
+        return -1;
+    }
+    memset(out + n, 0, cap - n);
+    return 0;
+}
+
+// Store `len` bytes as cluster `cluster`, compressed if that saves a block.
+// `scratch` must hold CLUSTER_SIZE bytes.
+static int cluster_store(inode_t *inode, size_t cluster, const uint8_t *data, size_t len, uint8_t *scratch) {
+    size_t first = cluster * CLUSTER_BLOCKS;
+    size_t nraw = ceildiv(len, BLOCK_SIZE);
+
+    size_t packed_len = 0;
+    if (nraw > 1) {
+        packed_len = lz_compress(data, len, scratch, (nraw - 1) * BLOCK_SIZE, inode->compression);
+    }
+    const uint8_t *src = packed_len != 0 ? scratch : data;
+    size_t src_len = packed_len != 0 ? packed_len : len;
+    size_t nstore = ceildiv(src_len, BLOCK_SIZE);
+
+    for (size_t i = 0; i < nstore; i++) {
+        int block = inode_bmap(inode, first + i, true);
+        if (block < 0) {
+            return -1;
+        }
+        size_t chunk = src_len - i * BLOCK_SIZE < BLOCK_SIZE ? src_len - i * BLOCK_SIZE : BLOCK_SIZE;
+        memcpy(block_ptr(block), src + i * BLOCK_SIZE, chunk);
+        memset(block_ptr(block) + chunk, 0, BLOCK_SIZE - chunk);
+    }
+
+    // The rest of the cluster becomes a hole
+    uint32_t freed[CLUSTER_BLOCKS];
+    size_t nfreed = 0;
+    for (size_t i = nstore; i < cluster_blocks(cluster); i++) {
+        if (inode_bmap(inode, first + i, false) <= 0) {
+            continue;
+        }
+        uint32_t *slot = inode_block_slot(inode, first + i, true);
+        if (slot == NULL) {
+            return -1;
+        }
+        freed[nfreed++] = *slot;
+        *slot = 0;
+    }
+    if (free_data_blocks(freed, nfreed) < 0) {
+        return -1;
+    }
+
+    return set_cluster_length(inode, cluster, packed_len);
+}
+
+// Read from a compressed file; a whole cluster is decompressed straight into `buf`
+ssize_t cluster_read(inode_t *inode, size_t offset, void *buf, size_t len) {
+    if (offset >= inode->size) {
+        return 0;
+    }
+    if (len > inode->size - offset) {
+        len = inode->size - offset;
+    }
+
+    uint8_t *cluster = malloc(CLUSTER_SIZE);
+    uint8_t *scratch = malloc(CLUSTER_SIZE);
+    if (cluster == NULL || scratch == NULL) {
+        fprintf(stderr, "cluster_read: out of memory\n");
+        free(cluster);
+        free(scratch);
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        size_t pos = offset + done;
+        size_t c = pos / CLUSTER_SIZE;
+        size_t lo = pos % CLUSTER_SIZE;
+        size_t chunk = CLUSTER_SIZE - lo < len - done ? CLUSTER_SIZE - lo : len - done;
+        size_t cluster_len = inode->size - c * CLUSTER_SIZE < CLUSTER_SIZE ? inode->size - c * CLUSTER_SIZE : CLUSTER_SIZE;
+
+        int ret;
+        if (lo == 0 && chunk == cluster_len) {
+            ret = cluster_load(inode, c, (uint8_t *)buf + done, chunk, scratch);
+        } else {
+            ret = cluster_load(inode, c, cluster, CLUSTER_SIZE, scratch);
+            memcpy((uint8_t *)buf + done, cluster + lo, chunk);
+        }
+        if (ret < 0) {
+            free(cluster);
+            free(scratch);
+            return -1;
+        }
+        done += chunk;
+    }
+
+    free(cluster);
+    free(scratch);
+    return done;
+}
+
+// Write to a compressed file. Each touched cluster is loaded, patched and
+// compressed again; clusters overwritten in full skip the load.
+ssize_t cluster_write(inode_t *inode, size_t offset, const void *buf, size_t len) {
+    uint8_t *cluster = malloc(CLUSTER_SIZE);
+    uint8_t *scratch = malloc(CLUSTER_SIZE);
+    if (cluster == NULL || scratch == NULL) {
+        fprintf(stderr, "cluster_write: out of memory\n");
+        free(cluster);
+        free(scratch);
+        return -1;
+    }
+
+    size_t end = offset + len;
+    size_t new_size = end > inode->size ? end : inode->size;
+    size_t done = 0;
+    while (done < len) {
+        size_t pos = offset + done;
+        size_t c = pos / CLUSTER_SIZE;
+        size_t start = c * CLUSTER_SIZE;
+        size_t lo = pos - start;
+        size_t chunk = CLUSTER_SIZE - lo < len - done ? CLUSTER_SIZE - lo : len - done;
+        size_t cluster_len = new_size - start < CLUSTER_SIZE ? new_size - start : CLUSTER_SIZE;
+
+        if (lo != 0 || chunk < cluster_len) {
+            if (start >= inode->size) {
+                memset(cluster, 0, CLUSTER_SIZE);
+            } else if (cluster_load(inode, c, cluster, CLUSTER_SIZE, scratch) < 0) {
+                break;
+            }
+        }
+        memcpy(cluster + lo, (const uint8_t *)buf + done, chunk);
+
+        if (cluster_store(inode, c, cluster, cluster_len, scratch) < 0) {
+            break;
+        }
+        done += chunk;
+        if (pos + chunk > inode->size) {
+            inode->size = pos + chunk;
+        }
+    }
+
+    free(cluster);
+    free(scratch);
+    if (done == 0 && len > 0) {
+        return -1;
+    }
+    return done;
+}
+
+// Shrink or extend a compressed file. The cluster holding the new end is
+// rewritten so no compressed stream is ever cut short.
+int cluster_truncate(inode_t *inode, size_t size) {
+    if (size >= inode->size) {
+        inode->size = size;
+        return 0;
+    }
+
+    size_t c = size / CLUSTER_SIZE;
+    size_t rem = size % CLUSTER_SIZE;
+    size_t nclusters = ceildiv(inode->size, CLUSTER_SIZE);
+
+    uint8_t *cluster = malloc(CLUSTER_SIZE);
+    uint8_t *scratch = malloc(CLUSTER_SIZE);
+    if (cluster == NULL || scratch == NULL) {
+        fprintf(stderr, "cluster_truncate: out of memory\n");
+        free(cluster);
+        free(scratch);
+        return -1;
+    }
+
+    int ret = 0;
+    if (rem != 0 && cluster_load(inode, c, cluster, CLUSTER_SIZE, scratch) < 0) {
+        ret = -1;
+    }
+    for (size_t i = c; ret == 0 && i < nclusters; i++) {
+        if (cluster_length(inode, i) != 0 && set_cluster_length(inode, i, 0) < 0) {
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        ret = inode_truncate(inode, c * CLUSTER_SIZE);
+    }
+    if (ret == 0 && rem != 0) {
+        ret = cluster_store(inode, c, cluster, rem, scratch);
+        inode->size = size;
+    }
+
+    free(cluster);
+    free(scratch);
+    return ret;
+}
@@ -0,0 +1,39 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "fs.h"
+
+// Compressed files are stored in clusters of CLUSTER_BLOCKS blocks. A cluster
+// that compresses into fewer blocks uses only the first ones and leaves the
+// rest as holes; its compressed length is recorded in the inode's cluster map
+// block (0 = cluster stored raw).
+#define CLUSTER_BLOCKS 16
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
+#define MAX_COMPRESS_LEVEL 9
+
+// LZ77 codec with an LZ4-style sequence format. `level` 1 uses a single hash
+// probe per position; higher levels search hash chains 2^(level-1) deep.
+// Returns the compressed size, or 0 if the output would exceed `dst_cap`.
+size_t lz_compress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap, int level);
+
+// Returns the decompressed size, or -1 if the input is corrupt or too large
+ssize_t lz_decompress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap);
+
+// Compress new data written to a file (only allowed while it is empty)
+int vsfs_set_compression(uint32_t ino, int level);
+
+// Compression level for files created from now on (0 = off)
+int vsfs_set_default_compression(int level);
+
+// Cluster I/O used by the file operations for compressed inodes
+ssize_t cluster_read(inode_t *inode, size_t offset, void *buf, size_t len);
+ssize_t cluster_write(inode_t *inode, size_t offset, const void *buf, size_t len);
+int cluster_truncate(inode_t *inode, size_t size);
+
+#endif // COMPRESS_H
@@ -0,0 +1,354 @@
+#include "dedup.h"
+#include "helpers.h"
+#include <sys/stat.h>
+
+// Blocks are matched by a 64-bit hash and only shared after a full byte
+// comparison, so a hash collision can never merge different data.
+
+#define MAX_CANDIDATES 4    // distinct contents tracked per hash group
+#define INLINE_WAYS 4       // inline cache associativity
+
+// One data block pointer of a live file
+typedef struct {
+    uint64_t hash;
+    uint32_t block;
+    uint32_t ino;
+    uint32_t lblk;
+} dedup_record_t;
+
+// Inline dedup: a set-associative cache of recently written blocks. A block
+// stays valid in the cache only while its bit in `inline_cached` is set;
+// freeing the block clears the bit, so a reused block is never matched.
+typedef struct {
+    uint64_t hash;
+    uint32_t block;
+} inline_entry_t;
+
+static inline_entry_t *inline_cache = NULL;
+static size_t inline_sets = 0;
+static size_t inline_victim = 0;
+static char *inline_cached = NULL;
+
+static int compare_records(const void *a, const void *b) {
+    const dedup_record_t *x = a;
+    const dedup_record_t *y = b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return (x->block > y->block) - (x->block < y->block);
+}
+
+// Point logical block `lblk` of an inode at `target`, an allocated block with
+// the same contents. The replaced block is returned in `old` for the caller
+// to release (0 if the slot was a hole).
+static int share_block(inode_t *inode, size_t lblk, uint32_t expected, uint32_t target, uint32_t *old) {
+    *old = 0;
+    uint32_t *slot = inode_block_slot(inode, lblk, true);
+    if (slot == NULL) {
+        return -1;
+    }
+    if (*slot != expected || *slot == target) {
+        return 0;   // the file changed under us
+    }
+    if (block_ref(target) < 0) {
+        return 0;   // target has too many references, keep our copy
+    }
+
+    *old = *slot;
+    *slot = target;
+    return 1;
+}
+
+// Call `visit` for every data block of every live regular file
+static int walk_file_blocks(int (*visit)(dedup_record_t *rec, void *arg), void *arg) {
+    for (uint32_t ino = 0; ino < sb->num_max_inodes; ino++) {
+        if (bitmapget(inode_bitmap, sb->num_max_inodes, ino) != 1) {
+            continue;
+        }
+
+        inode_t inode;
+        if (read_inode(ino, &inode) < 0) {
+            return -1;
+        }
+        if (!S_ISREG(inode.mode)) {
+            continue;
+        }
+
+        size_t nblocks = ceildiv(inode.size, BLOCK_SIZE);
+        for (size_t lblk = 0; lblk < nblocks; lblk++) {
+            int block = inode_bmap(&inode, lblk, false);
+            if (block < 0) {
+                return -1;
+            }
+            if (block == 0) {
+                continue;
+            }
+
+            dedup_record_t rec = {0, block, ino, lblk};
+            if (visit(&rec, arg) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int count_record(dedup_record_t *rec, void *arg) {
+    (void)rec;
+    (*(size_t *)arg)++;
+    return 0;
+}
+
+// Records are collected in memory, or hash-partitioned into spill files
+typedef struct {
+    dedup_record_t *records;
+    size_t nrecords;
+    size_t capacity;
+    FILE **spill;
+    size_t nparts;
+} collector_t;
+
+static int collect_record(dedup_record_t *rec, void *arg) {
+    collector_t *c = arg;
+    rec->hash = hash64(block_ptr(rec->block), BLOCK_SIZE, 0);
+
+    if (c->nparts > 1) {
+        if (fwrite(rec, sizeof(*rec), 1, c->spill[rec->hash % c->nparts]) != 1) {
+            perror("vsfs_dedup: spill write");
+            return -1;
+        }
+        return 0;
+    }
+    c->records[c->nrecords++] = *rec;
+    return 0;
+}
+
+// Share every verified duplicate in a batch of records; returns blocks saved
+static int dedup_records(dedup_record_t *records, size_t n) {
+    uint32_t free_before = sb->num_free_blocks;
+    qsort(records, n, sizeof(dedup_record_t), compare_records);
+
+    // Replaced blocks are released together so their discards coalesce
+    uint32_t *released = malloc(n * sizeof(uint32_t));
+    size_t nreleased = 0;
+    if (released == NULL) {
+        fprintf(stderr, "vsfs_dedup: out of memory\n");
+        return -1;
+    }
+
+    size_t group = 0;
+    while (group < n) {
+        uint32_t candidates[MAX_CANDIDATES];
+        int ncandidates = 0;
+
+        size_t i = group;
+        for (; i < n && records[i].hash == records[group].hash; i++) {
+            dedup_record_t *rec = &records[i];
+
+            int match = -1;
+            for (int c = 0; c < ncandidates && match < 0; c++) {
+                if (candidates[c] == rec->block ||
+                    memcmp(block_ptr(candidates[c]), block_ptr(rec->block), BLOCK_SIZE) == 0) {
+                    match = c;
+                }
+            }
+            if (match < 0) {
+                if (ncandidates < MAX_CANDIDATES) {
+                    candidates[ncandidates++] = rec->block;
+                }
+                continue;
+            }
+            if (candidates[match] == rec->block) {
+                continue;   // already shared
+            }
+
+            inode_t inode;
+            uint32_t old;
+            if (read_inode(rec->ino, &inode) < 0 ||
+                share_block(&inode, rec->lblk, rec->block, candidates[match], &old) < 0) {
+                free_data_blocks(released, nreleased);
+                free(released);
+                return -1;
+            }
+            write_inode(rec->ino, &inode);
+            if (old != 0) {
+                released[nreleased++] = old;
+            }
+        }
+        group = i;
+    }
+
+    int ret = free_data_blocks(released, nreleased);
+    free(released);
+    return ret < 0 ? -1 : (int)(sb->num_free_blocks - free_before);
+}
+
+// Share identical data blocks between regular files. Hash records that don't
+// fit in `mem_limit` bytes are spilled to temporary files. Returns the number
+// of blocks freed (-1 on error).
+int vsfs_dedup(size_t mem_limit) {
+    if (refcount_init() < 0) {
+        return -1;
+    }
+
+    // Counting pointers touches metadata only and sizes the partitioning
+    size_t total = 0;
+    if (walk_file_blocks(count_record, &total) < 0) {
+        return -1;
+    }
+
+    collector_t c = {0};
+    int saved = 0;
+    c.capacity = mem_limit / sizeof(dedup_record_t);
+    if (c.capacity == 0) {
+        fprintf(stderr, "vsfs_dedup: memory limit %zu too small\n", mem_limit);
+        return -1;
+    }
+    c.records = malloc(c.capacity * sizeof(dedup_record_t));
+    if (c.records == NULL) {
+        fprintf(stderr, "vsfs_dedup: out of memory\n");
+        return -1;
+    }
+
+    // Twice as many partitions as strictly needed absorbs uneven hash spread
+    c.nparts = total <= c.capacity ? 1 : ceildiv(2 * total, c.capacity);
+    if (c.nparts > 1) {
+        c.spill = calloc(c.nparts, sizeof(FILE *));
+        if (c.spill == NULL) {
+            fprintf(stderr, "vsfs_dedup: out of memory\n");
+            c.nparts = 0;
+            goto fail;
+        }
+        for (size_t p = 0; p < c.nparts; p++) {
+            c.spill[p] = tmpfile();
+            if (c.spill[p] == NULL) {
+                perror("vsfs_dedup: tmpfile");
+                c.nparts = p;
+                goto fail;
+            }
+        }
+    }
+
+    if (walk_file_blocks(collect_record, &c) < 0) {
+        goto fail;
+    }
+
+    if (c.nparts <= 1) {
+        saved = dedup_records(c.records, c.nrecords);
+    } else {
+        for (size_t p = 0; p < c.nparts && saved >= 0; p++) {
+            rewind(c.spill[p]);
+            size_t n;
+            // An overfull partition is deduped a memory load at a time
+            while (saved >= 0 && (n = fread(c.records, sizeof(dedup_record_t), c.capacity, c.spill[p])) > 0) {
+                int r = dedup_records(c.records, n);
+                saved = r < 0 ? -1 : saved + r;
+            }
+            fclose(c.spill[p]);
+        }
+    }
+
+    free(c.spill);
+    free(c.records);
+    return saved;
+
+fail:
+    for (size_t p = 0; p < c.nparts; p++) {
+        fclose(c.spill[p]);
+    }
+    free(c.spill);
+    free(c.records);
+    return -1;
+}
+
+// Dedup full-block writes as they happen, remembering up to `max_entries`
+// recently written blocks (0 turns inline dedup off)
+int vsfs_dedup_inline(size_t max_entries) {
+    free(inline_cache);
+    free(inline_cached);
+    inline_cache = NULL;
+    inline_cached = NULL;
+    inline_sets = 0;
+
+    if (max_entries == 0) {
+        return 0;
+    }
+    if (refcount_init() < 0) {
+        return -1;
+    }
+
+    size_t nsets = ceildiv(max_entries, INLINE_WAYS);
+    inline_cache = calloc(nsets * INLINE_WAYS, sizeof(inline_entry_t));
+    inline_cached = calloc(ceildiv(sb->num_total_blocks, 8), 1);
+    if (inline_cache == NULL || inline_cached == NULL) {
+        fprintf(stderr, "vsfs_dedup_inline: out of memory\n");
+        vsfs_dedup_inline(0);
+        return -1;
+    }
+    inline_sets = nsets;
+    return 0;
+}
+
+bool dedup_inline_enabled() {
+    return inline_sets != 0;
+}
+
+// Try to satisfy a full-block write by sharing an identical cached block.
+// Returns 1 if the block was shared, 0 if the caller must write it, -1 on
+// error. `hash` receives the hash of `buf` for dedup_note_block().
+int dedup_write_block(inode_t *inode, size_t lblk, const void *buf, uint64_t *hash) {
+    *hash = hash64(buf, BLOCK_SIZE, 0);
+
+    inline_entry_t *set = &inline_cache[(*hash % inline_sets) * INLINE_WAYS];
+    inline_entry_t *entry = NULL;
+    for (int way = 0; way < INLINE_WAYS && entry == NULL; way++) {
+        if (set[way].hash == *hash && set[way].block != 0 &&
+            bitmapget(inline_cached, sb->num_total_blocks, set[way].block) == 1 &&
+            memcmp(block_ptr(set[way].block), buf, BLOCK_SIZE) == 0) {
+            entry = &set[way];
+        }
+    }
+    if (entry == NULL) {
+        return 0;
+    }
+
+    uint32_t *slot = inode_block_slot(inode, lblk, true);
+    uint32_t old;
+    if (slot == NULL || share_block(inode, lblk, *slot, entry->block, &old) < 0) {
+        return -1;
+    }
+    if (old != 0) {
+        free_data_blocks(&old, 1);
+    }
+    return *slot == entry->block;
+}
+
+// Remember the block a full-block write landed in, preferring to replace an
+// entry with the same hash or one whose block has been freed
+void dedup_note_block(uint64_t hash, uint32_t block) {
+    inline_entry_t *set = &inline_cache[(hash % inline_sets) * INLINE_WAYS];
+    inline_entry_t *entry = NULL;
+    for (int way = 0; way < INLINE_WAYS && entry == NULL; way++) {
+        if (set[way].hash == hash || set[way].block == 0 ||
+            bitmapget(inline_cached, sb->num_total_blocks, set[way].block) != 1) {
+            entry = &set[way];
+        }
+    }
+    if (entry == NULL) {
+        entry = &set[inline_victim++ % INLINE_WAYS];
+    }
+
+    if (entry->block != 0) {
+        bitmapset(inline_cached, sb->num_total_blocks, entry->block, false);
+    }
+    entry->hash = hash;
+    entry->block = block;
+    bitmapset(inline_cached, sb->num_total_blocks, block, true);
+}
+
+// Drop a freed block from the inline cache
+void dedup_forget_block(uint32_t block) {
+    if (inline_cached != NULL) {
+        bitmapset(inline_cached, sb->num_total_blocks, block, false);
+    }
+}
@@ -0,0 +1,27 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "fs.h"
+
+// Share identical data blocks between regular files. Hash records that don't
+// fit in `mem_limit` bytes are spilled to temporary files. Returns the number
+// of blocks freed (-1 on error).
+int vsfs_dedup(size_t mem_limit);
+
+// Dedup full-block writes as they happen, remembering up to `max_entries`
+// recently written blocks (0 turns inline dedup off)
+int vsfs_dedup_inline(size_t max_entries);
+
+// Hooks used by the write and free paths
+bool dedup_inline_enabled();
+int dedup_write_block(inode_t *inode, size_t lblk, const void *buf, uint64_t *hash);
+void dedup_note_block(uint64_t hash, uint32_t block);
+void dedup_forget_block(uint32_t block);
+
+#endif // DEDUP_H
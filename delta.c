@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+#include "delta.h"
+#include "fs.h"
+#include "helpers.h"
+#include "icache.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+// Blocks of summary in front of the generation table proper
+static uint32_t summary_blocks() {
+    uint32_t table = ceildiv(sb->num_total_blocks, GENS_PER_BLOCK);
+    return ceildiv(table, GENS_PER_BLOCK);
+}
+
+static uint32_t *summary() {
+    return (uint32_t *)block_ptr(sb->gen_table_block);
+}
+
+static uint32_t *generations() {
+    return summary() + (size_t)summary_blocks() * GENS_PER_BLOCK;
+}
+
+void delta_mark(uint32_t block, uint32_t count) {
+    if (sb == NULL || sb->gen_table_block == 0) {
+        return;
+    }
+    uint32_t gen = sb->generation;
+    uint32_t *gens = generations();
+    uint32_t end = count < sb->num_total_blocks - block ? block + count : sb->num_total_blocks;
+    for (uint32_t b = block; b < end; b++) {
+        if (gens[b] != gen) {
+            gens[b] = gen;
+            summary()[b / GENS_PER_BLOCK] = gen;
+        }
+    }
+}
+
+void delta_mark_ptr(const void *addr, size_t len) {
+    const char *p = addr;
+    if (sb == NULL || sb->gen_table_block == 0 || len == 0 || p < disk_map || p >= disk_map + sb->disk_size) {
+        return;
+    }
+    size_t first = (p - disk_map) / BLOCK_SIZE;
+    size_t last = (p + len - 1 - disk_map) / BLOCK_SIZE;
+    delta_mark(first, last - first + 1);
+}
+
+int vsfs_track_changes() {
+    if (sb->gen_table_block != 0) {
+        return 0;
+    }
+
+    // Untouched blocks keep generation 0, older than any delta asks for
+    uint32_t nblocks = summary_blocks() + ceildiv(sb->num_total_blocks, GENS_PER_BLOCK);
+    int start = alloc_data_extent(nblocks);
+    if (start < 0) {
+        return -1;
+    }
+    sb->generation = 1;
+    sb->gen_base = 1;
+    sb->num_gen_blocks = nblocks;
+    sb->gen_table_block = start;
+    return 0;
+}
+
+uint32_t vsfs_generation() {
+    return sb->gen_table_block != 0 ? sb->generation : 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            perror("vsfs_delta_export: write");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static bool block_is_zero(uint32_t block) {
+    const uint64_t *words = (const uint64_t *)block_ptr(block);
+    for (size_t i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++) {
+        if (words[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int write_run(int fd, vsfs_delta_run_t *run) {
+    size_t len = (size_t)run->count * BLOCK_SIZE;
+    run->checksum = run->zero ? 0 : hash64(block_ptr(run->block), len, run->block);
+    if (write_all(fd, run, sizeof(*run)) < 0) {
+        return -1;
+    }
+    return run->zero ? 0 : write_all(fd, block_ptr(run->block), len);
+}
+
+ssize_t vsfs_delta_export(uint32_t since, int fd) {
+    if (sb->gen_table_block == 0) {
+        fprintf(stderr, "vsfs_delta_export: changes aren't being tracked\n");
+        return -1;
+    }
+    if (since < sb->gen_base || since > sb->generation) {
+        fprintf(stderr, "vsfs_delta_export: generation %u is outside the tracked %u to %u\n", since, sb->gen_base,
+                sb->generation);
+        return -1;
+    }
+
+    // Cached inodes reach the table (and get stamped) before anything is read.
+    // Everything written from here on belongs to the next delta.
+    if (icache_writeback() < 0) {
+        return -1;
+    }
+    sb->generation++;
+
+    vsfs_delta_header_t header = {VSFS_DELTA_MAGIC, VSFS_DELTA_VERSION, since, sb->generation,
+                                  sb->disk_size, BLOCK_SIZE};
+    if (write_all(fd, &header, sizeof(header)) < 0) {
+        return -1;
+    }
+
+    // The table itself is the sender's bookkeeping and is never sent, and
+    // blocks freed since they were written hold nothing worth sending
+    uint32_t data_start = data_region_start();
+    uint32_t table_start = sb->gen_table_block;
+    uint32_t table_end = table_start + sb->num_gen_blocks;
+    uint32_t ntable = ceildiv(sb->num_total_blocks, GENS_PER_BLOCK);
+    uint32_t *gens = generations();
+    vsfs_delta_run_t run = {0};
+    uint32_t nruns = 0;
+    ssize_t sent = 0;
+    for (uint32_t t = 0; t < ntable; t++) {
+        if (summary()[t] < since && t != 0) {
+            continue;
+        }
+        uint32_t end = (t + 1) * GENS_PER_BLOCK < sb->num_total_blocks ? (t + 1) * GENS_PER_BLOCK
+                                                                        : sb->num_total_blocks;
+        for (uint32_t b = t * GENS_PER_BLOCK; b < end; b++) {
+            if ((gens[b] < since && b != 0) || (b >= table_start && b < table_end) ||
+                (b >= data_start && bitmapget(data_bitmap, sb->num_total_blocks, b) != 1)) {
+                continue;
+            }
+            bool zero = block_is_zero(b);
+            if (run.count > 0 && (run.block + run.count != b || (bool)run.zero != zero ||
+                                  run.count == VSFS_DELTA_MAX_RUN)) {
+                if (write_run(fd, &run) < 0) {
+                    return -1;
+                }
+                nruns++;
+                run.count = 0;
+            }
+            if (run.count == 0) {
+                run.block = b;
+                run.zero = zero;
+            }
+            run.count++;
+            sent++;
+        }
+    }
+    if (run.count > 0) {
+        if (write_run(fd, &run) < 0) {
+            return -1;
+        }
+        nruns++;
+    }
+
+    vsfs_delta_run_t last = {nruns, 0, 0, 0, 0};
+    if (write_all(fd, &last, sizeof(last)) < 0) {
+        return -1;
+    }
+    return sent;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) {
+            fprintf(stderr, "vsfs_delta_apply: %s\n", n < 0 ? "read failed" : "stream ends early");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            perror("vsfs_delta_apply: pwrite");
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Read the runs of a stream into the image, holding back the superblock
+// (into `super`). Returns the number of blocks applied.
+static ssize_t apply_runs(int image, int fd, const superblock_t *current, char *buf, char *super) {
+    bool have_super = false;
+    uint32_t nruns = 0;
+    ssize_t applied = 0;
+    for (;;) {
+        vsfs_delta_run_t run;
+        if (read_all(fd, &run, sizeof(run)) < 0) {
+            return -1;
+        }
+        if (run.count == 0) {
+            if (run.block != nruns || !have_super) {
+                fprintf(stderr, "vsfs_delta_apply: stream is incomplete\n");
+                return -1;
+            }
+            return applied;
+        }
+        if (run.count > VSFS_DELTA_MAX_RUN || run.block >= current->num_total_blocks ||
+            run.count > current->num_total_blocks - run.block) {
+            fprintf(stderr, "vsfs_delta_apply: run of %u blocks at %u doesn't fit the image\n", run.count,
+                    run.block);
+            return -1;
+        }
+
+        size_t len = (size_t)run.count * BLOCK_SIZE;
+        if (run.zero) {
+            memset(buf, 0, len);
+        } else if (read_all(fd, buf, len) < 0) {
+            return -1;
+        } else if (hash64(buf, len, run.block) != run.checksum) {
+            fprintf(stderr, "vsfs_delta_apply: run at block %u is corrupt\n", run.block);
+            return -1;
+        }
+
+        size_t skip = 0;
+        if (run.block == 0) {
+            memcpy(super, buf, BLOCK_SIZE);
+            have_super = true;
+            skip = BLOCK_SIZE;
+        }
+        if (pwrite_all(image, buf + skip, len - skip, (off_t)run.block * BLOCK_SIZE + skip) < 0) {
+            return -1;
+        }
+        nruns++;
+        applied += run.count;
+    }
+}
+
+ssize_t vsfs_delta_apply(const char *disk_name, int fd) {
+    int image = open(disk_name, O_RDWR);
+    if (image < 0) {
+        perror("vsfs_delta_apply: open");
+        return -1;
+    }
+    char *current = malloc(BLOCK_SIZE);
+    char *super = malloc(BLOCK_SIZE);
+    char *buf = malloc((size_t)VSFS_DELTA_MAX_RUN * BLOCK_SIZE);
+    ssize_t applied = -1;
+    superblock_t *cur = (superblock_t *)current;
+    superblock_t *next = (superblock_t *)super;
+    vsfs_delta_header_t header;
+
+    if (current == NULL || super == NULL || buf == NULL) {
+        fprintf(stderr, "vsfs_delta_apply: out of memory\n");
+    } else if (pread(image, current, BLOCK_SIZE, 0) != BLOCK_SIZE || cur->magic != VSFS_MAGIC ||
+               cur->stripe_members > 1) {
+        fprintf(stderr, "vsfs_delta_apply: %s is not a single-file VSFS image\n", disk_name);
+    } else if (read_all(fd, &header, sizeof(header)) < 0) {
+        // read_all() has said why
+    } else if (header.magic != VSFS_DELTA_MAGIC || header.version != VSFS_DELTA_VERSION ||
+               header.block_size != BLOCK_SIZE || header.disk_size != cur->disk_size) {
+        fprintf(stderr, "vsfs_delta_apply: stream is not a delta for an image like %s\n", disk_name);
+    } else if (header.from_gen > cur->generation || header.to_gen <= cur->generation) {
+        // An image from before tracking started is at generation 0 and
+        // can't take any delta
+        fprintf(stderr, "vsfs_delta_apply: delta from generation %u to %u doesn't apply to generation %u\n",
+                header.from_gen, header.to_gen, cur->generation);
+    } else {
+        applied = apply_runs(image, fd, cur, buf, super);
+    }
+
+    if (applied >= 0) {
+        // The copy's own table wasn't kept up by the blocks it received, so it
+        // only answers for changes from now on. A table that moved here holds
+        // whatever the blocks held before, so it starts out clean.
+        next->gen_base = header.to_gen;
+        if (next->gen_table_block != 0 && next->gen_table_block != cur->gen_table_block) {
+            memset(buf, 0, BLOCK_SIZE);
+            for (uint32_t b = 0; b < next->num_gen_blocks && applied >= 0; b++) {
+                if (pwrite_all(image, buf, BLOCK_SIZE, (off_t)(next->gen_table_block + b) * BLOCK_SIZE) < 0) {
+                    applied = -1;
+                }
+            }
+        }
+        // Everything else is on disk before the superblock points at it
+        if (applied >= 0 && (fdatasync(image) < 0 || pwrite_all(image, super, BLOCK_SIZE, 0) < 0 ||
+                             fdatasync(image) < 0)) {
+            fprintf(stderr, "vsfs_delta_apply: failed to write the superblock\n");
+            applied = -1;
+        }
+    }
+    free(current);
+    free(super);
+    free(buf);
+    if (close(image) < 0) {
+        perror("vsfs_delta_apply: close");
+        applied = -1;
+    }
+    return applied;
+}
@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "mkfs.h"
+
+// Incremental deltas: once change tracking is on, every block the filesystem
+// writes is stamped with the image's current generation in a generation
+// table kept in the data region like the refcount table. The table starts
+// with summary blocks holding the newest stamp in each of its blocks, so
+// finding what changed since a generation reads the summary and only the
+// table blocks it points at, never the data. An export writes the changed
+// blocks as a stream and starts a new generation; applying the stream to an
+// unmounted copy taken at or after the generation it starts from brings the
+// copy up to date. The superblock is always sent and always written last, so
+// an apply cut short can simply be run again.
+#define VSFS_DELTA_MAGIC 0x56444C54 // "VDLT" in hex
+#define VSFS_DELTA_VERSION 1
+#define GENS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define VSFS_DELTA_MAX_RUN 256      // Blocks per run record
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t from_gen;        // Holds every block changed at or after this generation
+    uint32_t to_gen;          // Generation of the image once applied
+    uint32_t disk_size;
+    uint32_t block_size;
+} vsfs_delta_header_t;
+
+// A run of changed blocks, followed by their data unless they are all zeros.
+// A run of no blocks ends the stream, with `block` holding the number of runs.
+typedef struct {
+    uint32_t block;
+    uint32_t count;
+    uint32_t zero;            // Nonzero if the blocks are zeros and no data follows
+    uint32_t reserved;
+    uint64_t checksum;        // hash64 of the data, seeded with the first block
+} vsfs_delta_run_t;
+
+// Start stamping changed blocks; the current generation is the first one a
+// delta can start from
+int vsfs_track_changes();
+
+// Current generation (0 if changes aren't tracked)
+uint32_t vsfs_generation();
+
+// Write every block changed at or after generation `since` to `fd`, then
+// start a new generation. Returns the number of blocks sent, -1 on error.
+ssize_t vsfs_delta_export(uint32_t since, int fd);
+
+// Apply a delta read from `fd` to the unmounted single-file image
+// `disk_name`. Returns the number of blocks applied, -1 on error.
+ssize_t vsfs_delta_apply(const char *disk_name, int fd);
+
+// Stamp blocks about to be written; no-ops unless changes are tracked.
+// delta_mark_ptr ignores memory outside the mapped image.
+void delta_mark(uint32_t block, uint32_t count);
+void delta_mark_ptr(const void *addr, size_t len);
+
+#endif // DELTA_H
@@ -0,0 +1,67 @@
+#include "delta.h"
+#include "fs.h"
+#include "mount.h"
+#include <unistd.h>
+
+// Keeps a copy of an image up to date by shipping only what changed:
+//
+//   vsfs_delta track IMAGE            start tracking changes
+//   vsfs_delta gen IMAGE              print the image's generation
+//   vsfs_delta export IMAGE SINCE     write the changes since SINCE to stdout
+//   vsfs_delta apply COPY             apply a delta from stdin to a copy
+//
+// A copy taken while the image is at generation G takes `export IMAGE G`.
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s track IMAGE | gen IMAGE | export IMAGE SINCE > DELTA | apply COPY < DELTA\n", prog);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3 || (strcmp(argv[1], "export") == 0) != (argc == 4) || argc > 4) {
+        usage(argv[0]);
+        return 2;
+    }
+    const char *cmd = argv[1];
+    const char *image = argv[2];
+
+    if (strcmp(cmd, "apply") == 0) {
+        ssize_t applied = vsfs_delta_apply(image, STDIN_FILENO);
+        if (applied < 0) {
+            return 1;
+        }
+        fprintf(stderr, "%s: applied %zd blocks to %s\n", argv[0], applied, image);
+        return 0;
+    }
+    if (strcmp(cmd, "track") != 0 && strcmp(cmd, "gen") != 0 && strcmp(cmd, "export") != 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (strcmp(cmd, "export") == 0 && isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "%s: not writing a delta to a terminal\n", argv[0]);
+        return 2;
+    }
+
+    if (mount_disk(image, NULL) < 0) {
+        return 1;
+    }
+    int ret = 0;
+    if (strcmp(cmd, "track") == 0) {
+        ret = vsfs_track_changes();
+        if (ret == 0) {
+            fprintf(stderr, "%s: tracking changes to %s from generation %u\n", argv[0], image, vsfs_generation());
+        }
+    } else if (strcmp(cmd, "gen") == 0) {
+        printf("%u\n", vsfs_generation());
+    } else {
+        uint32_t since = strtoul(argv[3], NULL, 0);
+        ssize_t sent = vsfs_delta_export(since, STDOUT_FILENO);
+        ret = sent < 0 ? -1 : 0;
+        if (sent >= 0) {
+            fprintf(stderr, "%s: %zd of %u blocks changed since generation %u, now at %u\n", argv[0], sent,
+                    sb->num_total_blocks, since, vsfs_generation());
+        }
+    }
+    if (unmount_disk() < 0) {
+        ret = -1;
+    }
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,499 @@
+#include "extent.h"
+#include "fs.h"
+#include <pthread.h>
+#include <unistd.h>
+
+#define NIL 0
+#define BY_START 0
+#define BY_SIZE 1
+
+// An extent is a node of both treaps. Nodes live in one array and link by
+// index, so growing the array doesn't invalidate the links; node 0 is the
+// empty sentinel.
+typedef struct {
+    uint32_t start;
+    uint32_t len;
+    uint32_t prio;
+    uint32_t max_len;         // Largest extent in this node's by-start subtree
+    uint32_t child[2][2];     // [BY_START or BY_SIZE][left or right]
+} extent_node_t;
+
+static extent_node_t *nodes;
+static uint32_t nodes_used;       // high-water mark of the array
+static uint32_t nodes_cap;
+static uint32_t free_nodes;       // free list linked through child[BY_START][0]
+static uint32_t roots[2];
+static size_t nextents;
+static bool ready;
+static uint32_t rng = 0x9E3779B9;
+
+static uint32_t node_new(uint32_t start, uint32_t len) {
+    uint32_t n = free_nodes;
+    if (n != NIL) {
+        free_nodes = nodes[n].child[BY_START][0];
+    } else {
+        if (nodes_used == nodes_cap) {
+            uint32_t cap = nodes_cap * 2;
+            extent_node_t *grown = realloc(nodes, cap * sizeof(extent_node_t));
+            if (grown == NULL) {
+                fprintf(stderr, "extent index: out of memory\n");
+                return NIL;
+            }
+            nodes = grown;
+            nodes_cap = cap;
+        }
+        n = nodes_used++;
+    }
+
+    // xorshift32 priorities keep both treaps balanced in expectation
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    memset(&nodes[n], 0, sizeof(extent_node_t));
+    nodes[n].start = start;
+    nodes[n].len = len;
+    nodes[n].max_len = len;
+    nodes[n].prio = rng;
+    nextents++;
+    return n;
+}
+
+static void node_free(uint32_t n) {
+    nodes[n].child[BY_START][0] = free_nodes;
+    free_nodes = n;
+    nextents--;
+}
+
+// Whether node `n` orders before the key (len, start) in `tree`; starts are
+// unique, so they break ties between extents of one size
+static bool node_before(int tree, uint32_t n, uint32_t len, uint32_t start) {
+    if (tree == BY_SIZE && nodes[n].len != len) {
+        return nodes[n].len < len;
+    }
+    return nodes[n].start < start;
+}
+
+static void update(int tree, uint32_t n) {
+    if (tree != BY_START) {
+        return;
+    }
+    uint32_t l = nodes[n].child[BY_START][0], r = nodes[n].child[BY_START][1];
+    uint32_t max = nodes[n].len;
+    if (nodes[l].max_len > max) {
+        max = nodes[l].max_len;
+    }
+    if (nodes[r].max_len > max) {
+        max = nodes[r].max_len;
+    }
+    nodes[n].max_len = max;
+}
+
+// Split a treap into the nodes before (len, start) and the rest
+static void split(int tree, uint32_t t, uint32_t len, uint32_t start, uint32_t *l, uint32_t *r) {
+    if (t == NIL) {
+        *l = *r = NIL;
+        return;
+    }
+    if (node_before(tree, t, len, start)) {
+        split(tree, nodes[t].child[tree][1], len, start, &nodes[t].child[tree][1], r);
+        *l = t;
+    } else {
+        split(tree, nodes[t].child[tree][0], len, start, l, &nodes[t].child[tree][0]);
+        *r = t;
+    }
+    update(tree, t);
+}
+
+// Join two treaps where every node of `a` orders before every node of `b`
+static uint32_t merge(int tree, uint32_t a, uint32_t b) {
+    if (a == NIL || b == NIL) {
+        return a == NIL ? b : a;
+    }
+    if (nodes[a].prio > nodes[b].prio) {
+        nodes[a].child[tree][1] = merge(tree, nodes[a].child[tree][1], b);
+        update(tree, a);
+        return a;
+    }
+    nodes[b].child[tree][0] = merge(tree, a, nodes[b].child[tree][0]);
+    update(tree, b);
+    return b;
+}
+
+static void tree_insert(int tree, uint32_t n) {
+    uint32_t l, r;
+    nodes[n].child[tree][0] = nodes[n].child[tree][1] = NIL;
+    update(tree, n);
+    split(tree, roots[tree], nodes[n].len, nodes[n].start, &l, &r);
+    roots[tree] = merge(tree, merge(tree, l, n), r);
+}
+
+static void tree_remove(int tree, uint32_t n) {
+    uint32_t l, mid, r;
+    split(tree, roots[tree], nodes[n].len, nodes[n].start, &l, &r);
+    split(tree, r, nodes[n].len, nodes[n].start + 1, &mid, &r);
+    roots[tree] = merge(tree, l, r);
+}
+
+static void extent_insert(uint32_t n) {
+    tree_insert(BY_START, n);
+    tree_insert(BY_SIZE, n);
+}
+
+static void extent_remove(uint32_t n) {
+    tree_remove(BY_START, n);
+    tree_remove(BY_SIZE, n);
+}
+
+// Last extent starting at or before `block` (NIL if none)
+static uint32_t find_pred(uint32_t block) {
+    uint32_t t = roots[BY_START], best = NIL;
+    while (t != NIL) {
+        if (nodes[t].start <= block) {
+            best = t;
+            t = nodes[t].child[BY_START][1];
+        } else {
+            t = nodes[t].child[BY_START][0];
+        }
+    }
+    return best;
+}
+
+// First extent starting after `block` (NIL if none)
+static uint32_t find_succ(uint32_t block) {
+    uint32_t t = roots[BY_START], best = NIL;
+    while (t != NIL) {
+        if (nodes[t].start > block) {
+            best = t;
+            t = nodes[t].child[BY_START][0];
+        } else {
+            t = nodes[t].child[BY_START][1];
+        }
+    }
+    return best;
+}
+
+// First extent of at least `count` blocks starting at or after `goal`. The
+// subtree maxima prune every branch that can't hold a fit.
+static uint32_t find_fit_after(uint32_t t, uint32_t goal, uint32_t count) {
+    if (t == NIL || nodes[t].max_len < count) {
+        return NIL;
+    }
+    if (nodes[t].start < goal) {
+        return find_fit_after(nodes[t].child[BY_START][1], goal, count);
+    }
+    uint32_t left = find_fit_after(nodes[t].child[BY_START][0], goal, count);
+    if (left != NIL) {
+        return left;
+    }
+    if (nodes[t].len >= count) {
+        return t;
+    }
+    return find_fit_after(nodes[t].child[BY_START][1], goal, count);
+}
+
+// Smallest extent of at least `count` blocks, lowest start among equals
+static uint32_t find_best_fit(uint32_t count) {
+    uint32_t t = roots[BY_SIZE], best = NIL;
+    while (t != NIL) {
+        if (nodes[t].len >= count) {
+            best = t;
+            t = nodes[t].child[BY_SIZE][0];
+        } else {
+            t = nodes[t].child[BY_SIZE][1];
+        }
+    }
+    return best;
+}
+
+void extent_index_free() {
+    free(nodes);
+    nodes = NULL;
+    nodes_used = nodes_cap = 0;
+    free_nodes = NIL;
+    roots[BY_START] = roots[BY_SIZE] = NIL;
+    nextents = 0;
+    ready = false;
+}
+
+bool extent_index_ready() {
+    return ready;
+}
+
+// Take `count` contiguous free blocks out of the index and return the first
+int extent_take(uint32_t count, uint32_t goal) {
+    if (!ready || count == 0) {
+        return -1;
+    }
+
+    uint32_t n = NIL, at = 0;
+    if (goal != 0) {
+        uint32_t pred = find_pred(goal);
+        if (pred != NIL && (uint64_t)nodes[pred].start + nodes[pred].len >= (uint64_t)goal + count) {
+            n = pred;
+            at = goal;
+        } else {
+            n = find_fit_after(roots[BY_START], goal, count);
+            at = nodes[n].start;
+        }
+    }
+    if (n == NIL) {
+        n = find_best_fit(count);
+        at = nodes[n].start;
+    }
+    if (n == NIL) {
+        return -1;
+    }
+
+    // Whatever is left on either side of the taken run stays free. A run
+    // taken from the middle needs a node for the right side, got before the
+    // index changes so that running out of memory leaves it as it was.
+    uint32_t end = nodes[n].start + nodes[n].len;
+    uint32_t rest = NIL;
+    if (at > nodes[n].start && at + count < end) {
+        rest = node_new(at + count, end - at - count);
+        if (rest == NIL) {
+            return -1;
+        }
+    }
+    extent_remove(n);
+    if (at > nodes[n].start) {
+        nodes[n].len = at - nodes[n].start;
+        extent_insert(n);
+        if (rest != NIL) {
+            extent_insert(rest);
+        }
+    } else if (at + count < end) {
+        nodes[n].start = at + count;
+        nodes[n].len = end - at - count;
+        extent_insert(n);
+    } else {
+        node_free(n);
+    }
+    return at;
+}
+
+// Return a run of blocks to the index, merging it with adjacent extents
+int extent_put(uint32_t start, uint32_t count) {
+    if (!ready || count == 0) {
+        return 0;
+    }
+
+    uint32_t pred = find_pred(start);
+    uint32_t succ = find_succ(start);
+    if ((pred != NIL && nodes[pred].start + nodes[pred].len > start) ||
+        (succ != NIL && start + count > nodes[succ].start)) {
+        fprintf(stderr, "extent_put: blocks %u-%u are already free\n", start, start + count - 1);
+        return -1;
+    }
+
+    bool join_pred = pred != NIL && nodes[pred].start + nodes[pred].len == start;
+    bool join_succ = succ != NIL && start + count == nodes[succ].start;
+    if (join_succ) {
+        extent_remove(succ);
+        count += nodes[succ].len;
+        node_free(succ);
+    }
+    if (join_pred) {
+        extent_remove(pred);
+        nodes[pred].len += count;
+        extent_insert(pred);
+        return 0;
+    }
+
+    uint32_t n = node_new(start, count);
+    if (n == NIL) {
+        return -1;
+    }
+    extent_insert(n);
+    return 0;
+}
+
+size_t extent_count() {
+    return nextents;
+}
+
+uint32_t extent_largest() {
+    return ready ? nodes[roots[BY_START]].max_len : 0;
+}
+
+static int compare_by_size(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    if (nodes[x].len != nodes[y].len) {
+        return nodes[x].len < nodes[y].len ? -1 : 1;
+    }
+    return (nodes[x].start > nodes[y].start) - (nodes[x].start < nodes[y].start);
+}
+
+// Build a treap from nodes listed in key order in O(n): keep the right spine
+// on a stack and hang each node below the last spine node of higher priority.
+// `order` is reused as the stack, since each slot is read before it is reused.
+static uint32_t build_sorted(int tree, uint32_t *order, size_t n) {
+    size_t top = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t x = order[i], last = NIL;
+        while (top > 0 && nodes[order[top - 1]].prio < nodes[x].prio) {
+            last = order[--top];
+            update(tree, last);
+        }
+        nodes[x].child[tree][0] = last;
+        nodes[x].child[tree][1] = NIL;
+        if (top > 0) {
+            nodes[order[top - 1]].child[tree][1] = x;
+        }
+        order[top++] = x;
+    }
+    while (top > 1) {
+        update(tree, order[--top]);
+    }
+    if (top == 0) {
+        return NIL;
+    }
+    update(tree, order[0]);
+    return order[0];
+}
+
+// Free runs found by one build thread in its slice of the bitmap
+typedef struct {
+    uint32_t lo, hi;          // bit range [lo, hi) to scan
+    uint32_t *runs;           // pairs of (start, len)
+    size_t nruns;
+    size_t cap;
+    int failed;
+} build_slice_t;
+
+static void slice_add(build_slice_t *s, uint32_t start, uint32_t len) {
+    if (s->nruns > 0 && s->runs[2 * s->nruns - 2] + s->runs[2 * s->nruns - 1] == start) {
+        s->runs[2 * s->nruns - 1] += len;
+        return;
+    }
+    if (s->nruns == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 256;
+        uint32_t *grown = realloc(s->runs, cap * 2 * sizeof(uint32_t));
+        if (grown == NULL) {
+            s->failed = 1;
+            return;
+        }
+        s->runs = grown;
+        s->cap = cap;
+    }
+    s->runs[2 * s->nruns] = start;
+    s->runs[2 * s->nruns + 1] = len;
+    s->nruns++;
+}
+
+// Collect the free runs of a slice a 64-bit word at a time; only words that
+// are neither full nor empty are looked at bit by bit
+static void *scan_slice(void *arg) {
+    build_slice_t *s = arg;
+    uint32_t bit = s->lo;
+    while (bit < s->hi && !s->failed) {
+        if (bit % 64 == 0 && bit + 64 <= s->hi) {
+            uint64_t word;
+            memcpy(&word, data_bitmap + bit / 8, sizeof(word));
+            if (word == UINT64_MAX) {
+                bit += 64;
+                continue;
+            }
+            if (word == 0) {
+                slice_add(s, bit, 64);
+                bit += 64;
+                continue;
+            }
+        }
+        if (((unsigned char)data_bitmap[bit / 8] >> (bit % 8) & 1) == 0) {
+            slice_add(s, bit, 1);
+        }
+        bit++;
+    }
+    return NULL;
+}
+
+// Rebuild the index from the data bitmap, scanning it on several threads.
+// Slices are word aligned, so each thread only reads its own words; runs
+// that cross a slice boundary are joined while the slices are merged.
+int extent_index_build() {
+    extent_index_free();
+    nodes = calloc(1024, sizeof(extent_node_t));   // node 0 is the sentinel
+    if (nodes == NULL) {
+        fprintf(stderr, "extent_index_build: out of memory\n");
+        return -1;
+    }
+    nodes_cap = 1024;
+    nodes_used = 1;
+
+    uint32_t lo = data_region_start(), hi = sb->num_total_blocks;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = (hi - lo) / EXTENT_BUILD_CHUNK + 1;
+    if (nthreads > cpus) {
+        nthreads = cpus > 0 ? cpus : 1;
+    }
+    if (nthreads > EXTENT_BUILD_THREADS) {
+        nthreads = EXTENT_BUILD_THREADS;
+    }
+
+    build_slice_t slices[EXTENT_BUILD_THREADS];
+    pthread_t tids[EXTENT_BUILD_THREADS];
+    uint32_t per = ((hi - lo) / nthreads + 63) / 64 * 64;
+    for (int t = 0; t < nthreads; t++) {
+        memset(&slices[t], 0, sizeof(build_slice_t));
+        slices[t].lo = t == 0 ? lo : lo / 64 * 64 + t * per;
+        slices[t].hi = t == nthreads - 1 ? hi : lo / 64 * 64 + (t + 1) * per;
+        if (slices[t].hi > hi) {
+            slices[t].hi = hi;
+        }
+        if (slices[t].lo > slices[t].hi) {
+            slices[t].lo = slices[t].hi;
+        }
+    }
+    for (int t = 1; t < nthreads; t++) {
+        if (pthread_create(&tids[t], NULL, scan_slice, &slices[t]) != 0) {
+            scan_slice(&slices[t]);   // run it here instead
+            tids[t] = pthread_self();
+        }
+    }
+    scan_slice(&slices[0]);
+    for (int t = 1; t < nthreads; t++) {
+        if (!pthread_equal(tids[t], pthread_self())) {
+            pthread_join(tids[t], NULL);
+        }
+    }
+
+    // Merge the slices in block order, joining runs across slice boundaries.
+    // Nodes are created in start order, so node i + 1 is the i-th extent.
+    int ret = 0;
+    for (int t = 0; t < nthreads; t++) {
+        if (slices[t].failed) {
+            ret = -1;
+        }
+        for (size_t i = 0; i < slices[t].nruns && ret == 0; i++) {
+            uint32_t start = slices[t].runs[2 * i], len = slices[t].runs[2 * i + 1];
+            uint32_t last = nodes_used - 1;
+            if (last != NIL && nodes[last].start + nodes[last].len == start) {
+                nodes[last].len += len;
+                nodes[last].max_len = nodes[last].len;
+            } else if (node_new(start, len) == NIL) {
+                ret = -1;
+            }
+        }
+        free(slices[t].runs);
+    }
+
+    uint32_t *order = ret == 0 ? malloc((nextents + 1) * sizeof(uint32_t)) : NULL;
+    if (order == NULL) {
+        fprintf(stderr, "extent_index_build: out of memory, falling back to bitmap scans\n");
+        extent_index_free();
+        return -1;
+    }
+    for (size_t i = 0; i < nextents; i++) {
+        order[i] = i + 1;
+    }
+    roots[BY_START] = build_sorted(BY_START, order, nextents);
+    for (size_t i = 0; i < nextents; i++) {
+        order[i] = i + 1;
+    }
+    qsort(order, nextents, sizeof(uint32_t), compare_by_size);
+    roots[BY_SIZE] = build_sorted(BY_SIZE, order, nextents);
+    free(order);
+    ready = true;
+    return 0;
+}
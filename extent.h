@@ -0,0 +1,42 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// In-memory index of the free runs ("extents") of the data region, built from
+// the data bitmap when an image is formatted or mounted and kept in step by
+// the block allocator. The bitmap stays the source of truth; the index only
+// answers where to look. Extents live in two treaps, one ordered by start
+// (augmented with the largest extent below each node) and one by size, so
+// best-fit and near-goal queries take O(log n).
+#define EXTENT_BUILD_THREADS 8          // Most threads scanning the bitmap at build time
+#define EXTENT_BUILD_CHUNK (1u << 18)   // Fewest blocks worth handing to another thread
+
+// Rebuild the index from the data bitmap, scanning it on several threads
+int extent_index_build();
+
+// Drop the index; the allocator scans the bitmap until it is rebuilt
+void extent_index_free();
+
+bool extent_index_ready();
+
+// Take `count` contiguous free blocks out of the index and return the first.
+// With a nonzero `goal` the run starts at `goal` if it can, else at the first
+// extent after it that fits; otherwise (or if nothing after it fits) the
+// smallest extent that fits is used. Returns -1 if no extent is big enough.
+int extent_take(uint32_t count, uint32_t goal);
+
+// Return a run of blocks to the index, merging it with adjacent extents
+int extent_put(uint32_t start, uint32_t count);
+
+// Number of free extents and the length of the largest one
+size_t extent_count();
+uint32_t extent_largest();
+
+#endif // EXTENT_H
@@ -0,0 +1,226 @@
+#include "filemap.h"
+#include "helpers.h"
+#include "stats.h"
+#include "tail.h"
+#include <sys/stat.h>
+
+// Pins live only in this table and never touch the refcounts on disk, so an
+// image that goes away without unmapping has nothing to undo. The free path
+// asks the table before releasing a block and hands a pinned one back here
+// instead, and the write path copies pinned blocks rather than changing them.
+typedef struct {
+    uint32_t block;
+    uint32_t count;
+    bool orphaned;            // No longer referenced; freed with the last pin
+} pin_t;
+
+static pin_t *pins = NULL;    // Sorted by block
+static size_t npins = 0;
+static size_t pins_cap = 0;
+
+// What holes map to
+static const char zero_block[BLOCK_SIZE];
+
+// Index of `block` in the pin table, or of where it would go
+static size_t pin_find(uint32_t block) {
+    size_t lo = 0, hi = npins;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (pins[mid].block < block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool filemap_pinned(uint32_t block) {
+    size_t i = pin_find(block);
+    return i < npins && pins[i].block == block;
+}
+
+// Hand over a pinned block whose last reference was just dropped, to be
+// freed when it is unpinned. Returns false if the block isn't pinned.
+bool filemap_orphan(uint32_t block) {
+    size_t i = pin_find(block);
+    if (i == npins || pins[i].block != block) {
+        return false;
+    }
+    pins[i].orphaned = true;
+    return true;
+}
+
+// Pin a block on behalf of a mapping
+static int pin_block(uint32_t block) {
+    size_t i = pin_find(block);
+    if (i == npins || pins[i].block != block) {
+        if (npins == pins_cap) {
+            size_t cap = pins_cap == 0 ? 64 : 2 * pins_cap;
+            pin_t *grown = realloc(pins, cap * sizeof(pin_t));
+            if (grown == NULL) {
+                fprintf(stderr, "pin_block: out of memory\n");
+                return -1;
+            }
+            pins = grown;
+            pins_cap = cap;
+        }
+        memmove(&pins[i + 1], &pins[i], (npins - i) * sizeof(pin_t));
+        pins[i].block = block;
+        pins[i].count = 0;
+        pins[i].orphaned = false;
+        npins++;
+    }
+    pins[i].count++;
+    return 0;
+}
+
+// Drop a mapping's pin on a block, freeing it if the filesystem let go of
+// it while it was pinned
+static int unpin_block(uint32_t block) {
+    size_t i = pin_find(block);
+    if (i == npins || pins[i].block != block) {
+        fprintf(stderr, "vsfs_unmap_file: block %u is not mapped\n", block);
+        return -1;
+    }
+    if (--pins[i].count > 0) {
+        return 0;
+    }
+    bool orphaned = pins[i].orphaned;
+    memmove(&pins[i], &pins[i + 1], (npins - i - 1) * sizeof(pin_t));
+    npins--;
+    return orphaned ? free_data_blocks(&block, 1) : 0;
+}
+
+// Body of vsfs_map_file
+static ssize_t map_file(uint32_t ino, size_t offset, size_t len, struct iovec *spans, int *nspans) {
+    int room = *nspans;
+    *nspans = 0;
+
+    inode_t inode;
+    if (read_inode(ino, &inode) < 0) {
+        return -1;
+    }
+    if (!S_ISREG(inode.mode) || inode.compression != 0) {
+        fprintf(stderr, "vsfs_map_file: inode %u is not an uncompressed regular file\n", ino);
+        return -1;
+    }
+    if (refcount_init() < 0) {
+        return -1;
+    }
+
+    if (offset >= inode.size) {
+        return 0;
+    }
+    if (len > inode.size - offset) {
+        len = inode.size - offset;
+    }
+
+    // Walk the file a block at a time like inode_read, growing the last span
+    // while the next piece starts where it ends in the image
+    size_t done = 0;
+    int n = 0;
+    while (done < len) {
+        size_t pos = offset + done;
+        size_t block_off = pos % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - block_off < len - done ? BLOCK_SIZE - block_off : len - done;
+
+        int block = inode_bmap(&inode, pos / BLOCK_SIZE, false);
+        if (block < 0) {
+            vsfs_unmap_file(spans, n);
+            return -1;
+        }
+        const char *data;
+        uint32_t pin = block;
+        if (block == 0 && inode.tail_block != 0 && pos >= tail_start(&inode)) {
+            data = tail_data(&inode) + (pos - tail_start(&inode));
+            pin = inode.tail_block;
+        } else if (block == 0) {
+            data = zero_block;   // hole
+        } else {
+            data = block_ptr(block) + block_off;
+        }
+
+        bool extend = n > 0 && pin != 0 && (const char *)spans[n - 1].iov_base + spans[n - 1].iov_len == data;
+        if (!extend && n == room) {
+            break;
+        }
+        if (pin != 0 && pin_block(pin) < 0) {
+            vsfs_unmap_file(spans, n);
+            return -1;
+        }
+        if (extend) {
+            spans[n - 1].iov_len += chunk;
+        } else {
+            spans[n].iov_base = (void *)data;
+            spans[n].iov_len = chunk;
+            n++;
+        }
+        done += chunk;
+    }
+
+    *nspans = n;
+    touch_atime(ino, &inode);
+    return done;
+}
+
+// Map part of a file as read-only spans into the image, pinning its blocks
+ssize_t vsfs_map_file(uint32_t ino, size_t offset, size_t len, struct iovec *spans, int *nspans) {
+    STATS_START(start);
+    ssize_t ret = map_file(ino, offset, len, spans, nspans);
+    STATS_COUNT(VSFS_CTR_BYTES_READ, ret > 0 ? ret : 0);
+    STATS_END(VSFS_OP_MAP, start);
+    return ret;
+}
+
+// Unpin the blocks behind spans returned by vsfs_map_file
+int vsfs_unmap_file(const struct iovec *spans, int nspans) {
+    int ret = 0;
+    for (int i = 0; i < nspans; i++) {
+        const char *base = spans[i].iov_base;
+        if (spans[i].iov_len == 0 || (base >= zero_block && base < zero_block + BLOCK_SIZE)) {
+            continue;
+        }
+        if (base < disk_map || base + spans[i].iov_len > disk_map + sb->disk_size) {
+            fprintf(stderr, "vsfs_unmap_file: span %d is not in the image\n", i);
+            ret = -1;
+            continue;
+        }
+
+        size_t first = (base - disk_map) / BLOCK_SIZE;
+        size_t last = (base + spans[i].iov_len - 1 - disk_map) / BLOCK_SIZE;
+        for (size_t block = first; block <= last; block++) {
+            if (unpin_block(block) < 0) {
+                ret = -1;
+            }
+        }
+    }
+    return ret;
+}
+
+// Drop every pin, freeing blocks only a mapping still held
+int filemap_unpin_all() {
+    pin_t *held = pins;
+    size_t nheld = npins;
+    pins = NULL;              // so the frees below don't find them pinned
+    npins = 0;
+    pins_cap = 0;
+
+    int ret = 0;
+    for (size_t i = 0; i < nheld; i++) {
+        if (held[i].orphaned && free_data_blocks(&held[i].block, 1) < 0) {
+            ret = -1;
+        }
+    }
+    free(held);
+    return ret;
+}
+
+// Forget the pins of an image that is going away. Blocks they kept from
+// being freed are reclaimed when the image is next mounted.
+void filemap_reset() {
+    free(pins);
+    pins = NULL;
+    npins = 0;
+    pins_cap = 0;
+}
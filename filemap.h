@@ -0,0 +1,43 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef FILEMAP_H
+#define FILEMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "fs.h"
+
+// Zero-copy reads: a file's data is handed out as read-only spans pointing
+// into the mapped image, ready for writev() or vmsplice(). Every block behind
+// a span is pinned in memory, so truncating, unlinking or rolling back the
+// file leaves the block allocated until it is unpinned, and writing to the
+// file copies the block instead of changing it under the reader. Holes map to
+// a shared block of zeros. Pins are dropped with vsfs_unmap_file(), or all at
+// once when the image is unmounted. They are never written to the image.
+
+// Map up to `len` bytes of a regular file from `offset`, one span per
+// contiguous on-disk run. `*nspans` is the room in `spans` on entry and the
+// number of spans filled on return. Returns the number of bytes mapped,
+// which is short if the spans run out and 0 at the end of the file.
+// Compressed files can't be mapped.
+ssize_t vsfs_map_file(uint32_t ino, size_t offset, size_t len, struct iovec *spans, int *nspans);
+
+// Unpin the blocks behind spans returned by vsfs_map_file
+int vsfs_unmap_file(const struct iovec *spans, int nspans);
+
+// Whether a block is pinned by a mapping
+bool filemap_pinned(uint32_t block);
+
+// Called by the free path when the last reference to a block goes: keeps the
+// block allocated until its pins are dropped. False if it isn't pinned.
+bool filemap_orphan(uint32_t block);
+
+// Drop every pin (on unmount), or forget them without touching the image
+int filemap_unpin_all();
+void filemap_reset();
+
+#endif // FILEMAP_H
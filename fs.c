@@ -1,3 +1,1684 @@
+#define _GNU_SOURCE
 #include "fs.h"
 #include "mkfs.h"
+#include "helpers.h"
+#include "dedup.h"
+#include "compress.h"
+#include "tail.h"
+#include "extent.h"
+#include "stats.h"
+#include "icache.h"
+#include "trace.h"
+#include "stripe.h"
+#include "delta.h"
+#include "filemap.h"
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
 
+// Pointer to the start of a block in the mapped image
+char *block_ptr(uint32_t block) {
+    return disk_map + (size_t)block * BLOCK_SIZE;
+}
+
+// Index of the first block after the inode table
+uint32_t data_region_start() {
+    return 1 + sb->num_inode_bitmap_blocks + sb->num_data_bitmap_blocks + sb->num_inode_table_blocks;
+}
+
+// Table slot of an inode: the fixed table holds the first num_base_inodes and
+// chunks allocated from the data region hold the rest
+char *inode_slot(uint32_t ino) {
+    if (ino < sb->num_base_inodes) {
+        return inode_table + (size_t)ino * INODE_SIZE;
+    }
+    uint32_t off = ino - sb->num_base_inodes;
+    return block_ptr(sb->inode_chunks[off / INODES_PER_CHUNK]) + (size_t)(off % INODES_PER_CHUNK) * INODE_SIZE;
+}
+
+#define RELATIME_MAX_AGE (24 * 60 * 60)
+
+static int atime_mode = VSFS_RELATIME;
+static bool lazytime = false;
+
+// Timestamp policy from the mount options (see VSFS_RELATIME and friends)
+void set_time_options(int mode, bool lazy) {
+    atime_mode = mode;
+    lazytime = lazy;
+}
+
+// Whether two inodes differ only in their timestamps
+static bool only_times_differ(const inode_t *a, const inode_t *b) {
+    inode_t copy = *b;
+    copy.atime = a->atime;
+    copy.mtime = a->mtime;
+    copy.ctime = a->ctime;
+    return memcmp(a, &copy, sizeof(inode_t)) == 0;
+}
+
+// Whether a read at `now` should move the access time
+static bool atime_needs_update(const inode_t *inode, uint32_t now) {
+    switch (atime_mode) {
+    case VSFS_NOATIME:
+        return false;
+    case VSFS_STRICTATIME:
+        return inode->atime != now;
+    default:
+        return inode->atime <= inode->mtime || inode->atime <= inode->ctime ||
+               now - inode->atime >= RELATIME_MAX_AGE;
+    }
+}
+
+// Move the access time of a file that was just read, if the policy says so
+void touch_atime(uint32_t ino, inode_t *inode) {
+    uint32_t now = time(NULL);
+    if (atime_needs_update(inode, now)) {
+        inode->atime = now;
+        write_inode(ino, inode);
+    }
+}
+
+// Copy an allocated inode out of the inode cache
+int read_inode(uint32_t ino, inode_t *inode) {
+    if (ino >= sb->num_max_inodes) {
+        fprintf(stderr, "read_inode: inode %u out of range (max %u)\n", ino, sb->num_max_inodes - 1);
+        return -1;
+    }
+
+    // Only allocated inodes are cached, so a hit skips the bitmap check
+    inode_t *cached = icache_lookup(ino, false);
+    if (cached == NULL) {
+        if (bitmapget(inode_bitmap, sb->num_max_inodes, ino) != 1) {
+            fprintf(stderr, "read_inode: inode %u is not allocated\n", ino);
+            return -1;
+        }
+        cached = icache_lookup(ino, true);
+        if (cached == NULL) {
+            return -1;
+        }
+    }
+    memcpy(inode, cached, sizeof(inode_t));
+    return 0;
+}
+
+// Copy an inode into the inode cache; the table is updated on writeback
+int write_inode(uint32_t ino, const inode_t *inode) {
+    if (ino >= sb->num_max_inodes) {
+        fprintf(stderr, "write_inode: inode %u out of range (max %u)\n", ino, sb->num_max_inodes - 1);
+        return -1;
+    }
+
+    inode_t *cached = icache_lookup(ino, true);
+    if (cached == NULL) {
+        return -1;
+    }
+    if (memcmp(cached, inode, sizeof(inode_t)) != 0) {
+        bool times_only = lazytime && only_times_differ(cached, inode);
+        memcpy(cached, inode, sizeof(inode_t));
+        if (times_only) {
+            icache_dirty_time(cached);
+        } else {
+            icache_dirty(cached);
+        }
+    }
+    return 0;
+}
+
+// Blocks the inode bitmap has room for where it currently lives
+static uint32_t inode_bitmap_room() {
+    return sb->inode_bitmap_block != 0 ? sb->num_inode_bitmap_ext_blocks : sb->num_inode_bitmap_blocks;
+}
+
+// Move the inode bitmap to a data extent with room for `max` inodes, at least
+// doubling it so that moves stay rare. The fixed blocks stay reserved.
+static int move_inode_bitmap(uint32_t max) {
+    uint32_t old_blocks = inode_bitmap_room();
+    uint32_t needed = ceildiv(max, BLOCK_SIZE * 8);
+    uint32_t nblocks = 2 * old_blocks;
+    while (nblocks < needed) {
+        nblocks *= 2;
+    }
+    int start = alloc_data_extent(nblocks);
+    if (start < 0) {
+        return -1;
+    }
+    memcpy(block_ptr(start), inode_bitmap, (size_t)old_blocks * BLOCK_SIZE);
+
+    uint32_t old_start = sb->inode_bitmap_block;
+    sb->inode_bitmap_block = start;
+    sb->num_inode_bitmap_ext_blocks = nblocks;
+    inode_bitmap = block_ptr(start);
+    if (old_start == 0) {
+        return 0;
+    }
+
+    uint32_t *blocks = malloc(old_blocks * sizeof(uint32_t));
+    if (blocks == NULL) {
+        fprintf(stderr, "move_inode_bitmap: out of memory\n");
+        return -1;
+    }
+    for (uint32_t i = 0; i < old_blocks; i++) {
+        blocks[i] = old_start + i;
+    }
+    int ret = free_data_blocks(blocks, old_blocks);
+    free(blocks);
+    return ret;
+}
+
+// Add a chunk of inode table from the data region, moving the inode bitmap
+// first if it has no room for the new inodes
+static int grow_inode_table() {
+    if (sb->num_inode_chunks == VSFS_MAX_INODE_CHUNKS) {
+        fprintf(stderr, "grow_inode_table: all %d inode chunks in use\n", VSFS_MAX_INODE_CHUNKS);
+        return -1;
+    }
+
+    uint32_t max = sb->num_max_inodes + INODES_PER_CHUNK;
+    if ((uint32_t)ceildiv(max, BLOCK_SIZE * 8) > inode_bitmap_room() && move_inode_bitmap(max) < 0) {
+        return -1;
+    }
+    int chunk = alloc_data_extent(INODE_CHUNK_BLOCKS);
+    if (chunk < 0) {
+        return -1;
+    }
+    sb->inode_chunks[sb->num_inode_chunks++] = chunk;
+    sb->num_max_inodes = max;
+    STATS_COUNT(VSFS_CTR_INODE_CHUNKS, 1);
+    return 0;
+}
+
+// Stamp the bitmap bytes holding bits [first, first + count) as changed
+static void mark_bits(const char *bitmap, size_t first, size_t count) {
+    delta_mark_ptr(&bitmap[first / 8], (first + count - 1) / 8 - first / 8 + 1);
+}
+
+// Allocate a free inode and return its number, growing the table if it is full
+static int alloc_inode() {
+    if (sb->num_used_inodes >= sb->num_max_inodes && grow_inode_table() < 0) {
+        fprintf(stderr, "alloc_inode: no free inodes\n");
+        return -1;
+    }
+    int ino = bitmapalloc(inode_bitmap, sb->num_max_inodes);
+    if (ino < 0) {
+        fprintf(stderr, "alloc_inode: no free inodes\n");
+        return -1;
+    }
+    mark_bits(inode_bitmap, ino, 1);
+    sb->num_used_inodes++;
+    return ino;
+}
+
+// Zero an inode's table slot and return it to the inode bitmap
+static int free_inode(uint32_t ino) {
+    icache_forget(ino);
+    memset(inode_slot(ino), 0, INODE_SIZE);
+    delta_mark_ptr(inode_slot(ino), INODE_SIZE);
+    if (bitmapset(inode_bitmap, sb->num_max_inodes, ino, false) < 0) {
+        return -1;
+    }
+    mark_bits(inode_bitmap, ino, 1);
+    sb->num_used_inodes--;
+    return 0;
+}
+
+// The refcount table, or NULL if no block is shared yet
+static uint16_t *refcount_table() {
+    if (sb->refcount_table_block == 0) {
+        return NULL;
+    }
+    return (uint16_t *)block_ptr(sb->refcount_table_block);
+}
+
+// Number of references to an allocated block. Without a refcount table
+// every allocated block has exactly one owner.
+int block_refcount(uint32_t block) {
+    uint16_t *refcounts = refcount_table();
+    if (refcounts == NULL) {
+        return bitmapget(data_bitmap, sb->num_total_blocks, block);
+    }
+    return refcounts[block];
+}
+
+// Add a reference to an allocated block
+int block_ref(uint32_t block) {
+    uint16_t *refcounts = refcount_table();
+    if (refcounts == NULL) {
+        fprintf(stderr, "block_ref: no refcount table\n");
+        return -1;
+    }
+    if (refcounts[block] == UINT16_MAX) {
+        fprintf(stderr, "block_ref: block %u has too many references\n", block);
+        return -1;
+    }
+    refcounts[block]++;
+    delta_mark_ptr(&refcounts[block], sizeof(uint16_t));
+    return 0;
+}
+
+// Create the refcount table, seeding every allocated block with one reference
+int refcount_init() {
+    if (sb->refcount_table_block != 0) {
+        return 0;
+    }
+
+    size_t nblocks = ceildiv(sb->num_total_blocks * sizeof(uint16_t), BLOCK_SIZE);
+    int start = alloc_data_extent(nblocks);
+    if (start < 0) {
+        return -1;
+    }
+    sb->refcount_table_block = start;
+    sb->num_refcount_blocks = nblocks;
+
+    uint16_t *refcounts = refcount_table();
+    for (uint32_t block = 0; block < sb->num_total_blocks; block++) {
+        refcounts[block] = bitmapget(data_bitmap, sb->num_total_blocks, block);
+    }
+    return 0;
+}
+
+// Free blocks left allocated with no references, which is how a block a
+// mapping held past its last reference looks if the image wasn't unmounted.
+// Returns the number of blocks freed.
+int refcount_reclaim() {
+    uint16_t *refcounts = refcount_table();
+    if (refcounts == NULL) {
+        return 0;
+    }
+
+    int reclaimed = 0;
+    for (uint32_t block = data_region_start(); block < sb->num_total_blocks; block++) {
+        if (refcounts[block] == 0 && bitmapget(data_bitmap, sb->num_total_blocks, block) == 1) {
+            bitmapset(data_bitmap, sb->num_total_blocks, block, false);
+            mark_bits(data_bitmap, block, 1);
+            sb->num_free_blocks++;
+            reclaimed++;
+        }
+    }
+    return reclaimed;
+}
+
+static bool run_is_free(uint32_t start, size_t count) {
+    for (uint32_t block = start; block < start + count; block++) {
+        if (bitmapget(data_bitmap, sb->num_total_blocks, block) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Find `count` contiguous free blocks, starting near `goal` if it is nonzero,
+// and mark them in the bitmap. The free-extent index answers when it is built;
+// the bitmap stays authoritative, so a run it disagrees with rebuilds the index.
+static int claim_run(size_t count, uint32_t goal) {
+    uint32_t nblocks = sb->num_total_blocks;
+    if (extent_index_ready()) {
+        int start = extent_take(count, goal);
+        if (start >= 0 && !run_is_free(start, count)) {
+            fprintf(stderr, "claim_run: free-extent index disagrees with the bitmap, rebuilding\n");
+            start = extent_index_build() == 0 ? extent_take(count, goal) : -1;
+            if (start >= 0 && !run_is_free(start, count)) {
+                return -1;
+            }
+        }
+        if (start < 0) {
+            return -1;
+        }
+        for (uint32_t block = start; block < start + count; block++) {
+            bitmapset(data_bitmap, nblocks, block, true);
+        }
+        mark_bits(data_bitmap, start, count);
+        return start;
+    }
+
+    if (count == 1) {
+        int block = bitmapalloc(data_bitmap, nblocks);
+        if (block >= 0) {
+            mark_bits(data_bitmap, block, 1);
+        }
+        return block;
+    }
+    uint32_t run_start = data_region_start();
+    size_t run_len = 0;
+    for (uint32_t block = run_start; block < nblocks && run_len < count; block++) {
+        if (bitmapget(data_bitmap, nblocks, block) == 1) {
+            run_start = block + 1;
+            run_len = 0;
+        } else {
+            run_len++;
+        }
+    }
+    if (run_len < count) {
+        return -1;
+    }
+    for (uint32_t block = run_start; block < run_start + count; block++) {
+        bitmapset(data_bitmap, nblocks, block, true);
+    }
+    mark_bits(data_bitmap, run_start, count);
+    return run_start;
+}
+
+// Allocate a zeroed data block and return its index (-1 if full)
+int alloc_data_block() {
+    return alloc_data_block_near(0);
+}
+
+// Allocate a zeroed data block at or after `goal` if one is free there
+int alloc_data_block_near(uint32_t goal) {
+    STATS_START(start);
+    int block = claim_run(1, goal);
+    if (block < 0) {
+        fprintf(stderr, "alloc_data_block: no free data blocks\n");
+        return -1;
+    }
+    sb->num_free_blocks--;
+
+    uint16_t *refcounts = refcount_table();
+    if (refcounts != NULL) {
+        refcounts[block] = 1;
+        delta_mark_ptr(&refcounts[block], sizeof(uint16_t));
+    }
+    memset(block_ptr(block), 0, BLOCK_SIZE);
+    delta_mark(block, 1);
+    STATS_COUNT(VSFS_CTR_BLOCKS_ALLOCATED, 1);
+    STATS_END(VSFS_OP_ALLOC, start);
+    return block;
+}
+
+// Allocate `count` contiguous zeroed data blocks and return the first (-1 if none)
+int alloc_data_extent(size_t count) {
+    STATS_START(start);
+    int run_start = count > 0 ? claim_run(count, 0) : -1;
+    if (run_start < 0) {
+        fprintf(stderr, "alloc_data_extent: no run of %zu free blocks\n", count);
+        return -1;
+    }
+
+    uint16_t *refcounts = refcount_table();
+    for (uint32_t block = run_start; block < run_start + count && refcounts != NULL; block++) {
+        refcounts[block] = 1;
+    }
+    if (refcounts != NULL) {
+        delta_mark_ptr(&refcounts[run_start], count * sizeof(uint16_t));
+    }
+    sb->num_free_blocks -= count;
+    memset(block_ptr(run_start), 0, count * BLOCK_SIZE);
+    delta_mark(run_start, count);
+    STATS_COUNT(VSFS_CTR_BLOCKS_ALLOCATED, count);
+    STATS_END(VSFS_OP_ALLOC, start);
+    return run_start;
+}
+
+static int compare_blocks(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Drop one reference to each block in the array; blocks left with no
+// references are freed and their backing storage discarded. The array is
+// sorted and overwritten in place so that each run of adjacent freed blocks
+// costs a single discard call.
+int free_data_blocks(uint32_t *blocks, size_t n) {
+    if (n == 0) {
+        return 0;
+    }
+
+    STATS_START(start);
+    qsort(blocks, n, sizeof(uint32_t), compare_blocks);
+
+    uint16_t *refcounts = refcount_table();
+    size_t nfreed = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t block = blocks[i];
+        if (block < data_region_start() || block >= sb->num_total_blocks) {
+            fprintf(stderr, "free_data_blocks: block %u is not a data block\n", block);
+            return -1;
+        }
+        if (bitmapget(data_bitmap, sb->num_total_blocks, block) != 1) {
+            fprintf(stderr, "free_data_blocks: block %u is already free\n", block);
+            return -1;
+        }
+
+        if (refcounts != NULL) {
+            delta_mark_ptr(&refcounts[block], sizeof(uint16_t));
+        }
+        if (refcounts != NULL && refcounts[block] > 1) {
+            refcounts[block]--;   // still shared
+            continue;
+        }
+        if (refcounts != NULL) {
+            refcounts[block] = 0;
+        }
+        dedup_forget_block(block);
+        if (filemap_orphan(block)) {
+            continue;   // a mapping still reads it and frees it when done
+        }
+        bitmapset(data_bitmap, sb->num_total_blocks, block, false);
+        mark_bits(data_bitmap, block, 1);
+        sb->num_free_blocks++;
+        blocks[nfreed++] = block;
+    }
+
+    size_t run_start = 0;
+    for (size_t i = 0; i < nfreed; i++) {
+        if (i + 1 == nfreed || blocks[i + 1] != blocks[i] + 1) {
+            // Discard is best effort: the blocks are free either way
+            discard_blocks(blocks[run_start], blocks[i] - blocks[run_start] + 1);
+            extent_put(blocks[run_start], blocks[i] - blocks[run_start] + 1);
+            run_start = i + 1;
+        }
+    }
+
+    STATS_COUNT(VSFS_CTR_BLOCKS_FREED, nfreed);
+    STATS_END(VSFS_OP_FREE, start);
+    return 0;
+}
+
+// Release the host storage behind a run of blocks. MADV_REMOVE frees the
+// pages behind the shared mapping together with the file range backing them;
+// if the mapping can't do that we punch the hole through the file instead.
+int discard_blocks(uint32_t start, uint32_t count) {
+    if (count == 0) {
+        return 0;
+    }
+
+    size_t offset = (size_t)start * BLOCK_SIZE;
+    size_t length = (size_t)count * BLOCK_SIZE;
+
+    if (disk_map != NULL && madvise(disk_map + offset, length, MADV_REMOVE) == 0) {
+        return 0;
+    }
+
+    if (stripe_active()) {
+        return stripe_discard(start, count);
+    }
+    if (fallocate(disk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+        return 0;
+    }
+
+    if (errno != EOPNOTSUPP) {
+        perror("discard_blocks: fallocate");
+    }
+    return -1;
+}
+
+// Discard every free run in the data region; returns the number of blocks discarded
+int vsfs_trim() {
+    uint32_t nblocks = sb->num_total_blocks;
+    uint32_t block = data_region_start();
+    int discarded = 0;
+
+    while (block < nblocks) {
+        // Skip fully used bytes without testing each bit
+        if (block % 8 == 0 && (unsigned char)data_bitmap[block / 8] == 0xFF) {
+            block += 8;
+            continue;
+        }
+        if (bitmapget(data_bitmap, nblocks, block) == 1) {
+            block++;
+            continue;
+        }
+
+        uint32_t run_start = block;
+        while (block < nblocks && bitmapget(data_bitmap, nblocks, block) == 0) {
+            block++;
+        }
+        if (discard_blocks(run_start, block - run_start) < 0) {
+            return -1;
+        }
+        discarded += block - run_start;
+    }
+
+    return discarded;
+}
+
+// Give the owner of `*ptr` a private copy of the block if it is shared or
+// mapped, updating the pointer. Returns the block to write to.
+int cow_block(uint32_t *ptr) {
+    if (block_refcount(*ptr) <= 1 && !filemap_pinned(*ptr)) {
+        return *ptr;
+    }
+
+    int block = alloc_data_block();
+    if (block < 0) {
+        return -1;
+    }
+    memcpy(block_ptr(block), block_ptr(*ptr), BLOCK_SIZE);
+
+    uint32_t old = *ptr;
+    *ptr = block;
+    free_data_blocks(&old, 1);   // drops our reference to the shared copy
+    return block;
+}
+
+// Make the inode's indirect block private before its pointers are changed.
+// The copy adds a reference to every block it points to.
+static int own_indirect(inode_t *inode) {
+    if (block_refcount(inode->indirect) <= 1) {
+        return 0;
+    }
+
+    if (cow_block(&inode->indirect) < 0) {
+        return -1;
+    }
+    uint32_t *ptrs = (uint32_t *)block_ptr(inode->indirect);
+    for (size_t i = 0; i < PTRS_PER_BLOCK; i++) {
+        if (ptrs[i] != 0 && block_ref(ptrs[i]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Return the pointer slot holding the address of logical block `lblk`, or
+// NULL if it sits behind a missing indirect block. With `write` set the
+// indirect block is allocated or made private so the slot may be updated,
+// and NULL means the allocation failed.
+uint32_t *inode_block_slot(inode_t *inode, size_t lblk, bool write) {
+    if (lblk >= MAX_FILE_BLOCKS) {
+        fprintf(stderr, "inode_block_slot: block %zu beyond maximum file size\n", lblk);
+        return NULL;
+    }
+
+    if (lblk < NUM_DIRECT_BLOCKS) {
+        return &inode->blocks[lblk];
+    }
+
+    if (inode->indirect == 0) {
+        if (!write) {
+            return NULL;
+        }
+        int block = alloc_data_block();
+        if (block < 0) {
+            return NULL;
+        }
+        inode->indirect = block;
+    } else if (write && own_indirect(inode) < 0) {
+        return NULL;
+    }
+    if (write) {
+        delta_mark(inode->indirect, 1);
+    }
+    return (uint32_t *)block_ptr(inode->indirect) + (lblk - NUM_DIRECT_BLOCKS);
+}
+
+// Map logical block `lblk` of an inode to its on-disk block. Returns 0 for a
+// hole. With `write` set the block is allocated if missing and copied if it
+// is shared, so the result is safe to modify.
+int inode_bmap(inode_t *inode, size_t lblk, bool write) {
+    if (lblk >= MAX_FILE_BLOCKS) {
+        fprintf(stderr, "inode_bmap: block %zu beyond maximum file size\n", lblk);
+        return -1;
+    }
+
+    uint32_t *ptr = inode_block_slot(inode, lblk, write);
+    if (ptr == NULL) {
+        return write ? -1 : 0;
+    }
+
+    if (!write) {
+        return *ptr;
+    }
+    if (*ptr == 0) {
+        // Place the block right after the previous one to keep files contiguous
+        int prev = lblk > 0 ? inode_bmap(inode, lblk - 1, false) : 0;
+        int block = alloc_data_block_near(prev > 0 ? prev + 1 : 0);
+        if (block < 0) {
+            return -1;
+        }
+        *ptr = block;
+        return block;
+    }
+    // A block already private is about to change in place
+    int block = cow_block(ptr);
+    if (block > 0) {
+        delta_mark(block, 1);
+    }
+    return block;
+}
+
+// Drop every block past `size` and zero the tail of the last kept block
+int inode_truncate(inode_t *inode, size_t size) {
+    uint32_t freed[MAX_FILE_BLOCKS + 2];
+    size_t nfreed = 0;
+    size_t keep = ceildiv(size, BLOCK_SIZE);
+
+    // A packed tail is dropped if it is cut off, and otherwise moved back
+    // into a block since it must always end the file
+    if (inode->tail_block != 0 && size != inode->size) {
+        int ret = size <= tail_start(inode) ? tail_release(inode) : tail_unpack(inode);
+        if (ret < 0) {
+            return -1;
+        }
+    }
+
+    for (size_t i = keep; i < NUM_DIRECT_BLOCKS; i++) {
+        if (inode->blocks[i] != 0) {
+            freed[nfreed++] = inode->blocks[i];
+            inode->blocks[i] = 0;
+        }
+    }
+
+    if (inode->indirect != 0) {
+        if (keep <= NUM_DIRECT_BLOCKS && block_refcount(inode->indirect) > 1) {
+            // Someone else still uses the pointers; only drop our reference
+            freed[nfreed++] = inode->indirect;
+            inode->indirect = 0;
+        } else {
+            if (own_indirect(inode) < 0) {
+                return -1;
+            }
+            uint32_t *ptrs = (uint32_t *)block_ptr(inode->indirect);
+            size_t first = keep > NUM_DIRECT_BLOCKS ? keep - NUM_DIRECT_BLOCKS : 0;
+            for (size_t i = first; i < PTRS_PER_BLOCK; i++) {
+                if (ptrs[i] != 0) {
+                    freed[nfreed++] = ptrs[i];
+                    ptrs[i] = 0;
+                }
+            }
+            if (keep <= NUM_DIRECT_BLOCKS) {
+                freed[nfreed++] = inode->indirect;
+                inode->indirect = 0;
+            }
+        }
+    }
+
+    if (size == 0 && inode->cluster_map != 0) {
+        freed[nfreed++] = inode->cluster_map;
+        inode->cluster_map = 0;
+    }
+
+    if (size % BLOCK_SIZE != 0 && size < inode->size && inode_bmap(inode, size / BLOCK_SIZE, false) > 0) {
+        int block = inode_bmap(inode, size / BLOCK_SIZE, true);
+        if (block < 0) {
+            return -1;
+        }
+        memset(block_ptr(block) + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+    }
+
+    inode->size = size;
+    return free_data_blocks(freed, nfreed);
+}
+
+// Start readahead on every stripe member a read touches, one call per run of
+// adjacent blocks, so the members fetch in parallel while the copy waits on
+// the first of them
+static void prefetch_striped(inode_t *inode, size_t offset, size_t len) {
+    uint32_t run_start = 0, run_len = 0;
+    for (size_t lblk = offset / BLOCK_SIZE; lblk <= (offset + len - 1) / BLOCK_SIZE; lblk++) {
+        int block = inode_bmap(inode, lblk, false);
+        if (block > 0 && run_len > 0 && (uint32_t)block == run_start + run_len) {
+            run_len++;
+            continue;
+        }
+        if (run_len > 0) {
+            stripe_prefetch(run_start, run_len);
+        }
+        run_start = block > 0 ? block : 0;
+        run_len = block > 0 ? 1 : 0;
+    }
+    if (run_len > 0) {
+        stripe_prefetch(run_start, run_len);
+    }
+}
+
+// Read up to `len` bytes at `offset` from an inode; returns the number of bytes read
+ssize_t inode_read(inode_t *inode, size_t offset, void *buf, size_t len) {
+    if (inode->compression != 0) {
+        return cluster_read(inode, offset, buf, len);
+    }
+
+    if (offset >= inode->size) {
+        return 0;
+    }
+    if (len > inode->size - offset) {
+        len = inode->size - offset;
+    }
+    if (stripe_active() && len >= stripe_width()) {
+        prefetch_striped(inode, offset, len);
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        size_t pos = offset + done;
+        size_t block_off = pos % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - block_off < len - done ? BLOCK_SIZE - block_off : len - done;
+
+        int block = inode_bmap(inode, pos / BLOCK_SIZE, false);
+        if (block < 0) {
+            return -1;
+        }
+        if (block == 0 && inode->tail_block != 0 && pos >= tail_start(inode)) {
+            memcpy((char *)buf + done, tail_data(inode) + (pos - tail_start(inode)), chunk);
+        } else if (block == 0) {
+            memset((char *)buf + done, 0, chunk);   // hole
+        } else {
+            memcpy((char *)buf + done, block_ptr(block) + block_off, chunk);
+        }
+        done += chunk;
+    }
+    return done;
+}
+
+// Return the directory slot at index `slot`, or NULL if its block is missing.
+// With `write` set the slot's block is made private so it can be modified.
+static dirent_t *dir_slot(inode_t *dir, size_t slot, bool write) {
+    int block = inode_bmap(dir, slot / DIRENTS_PER_BLOCK, write);
+    if (block <= 0) {
+        return NULL;
+    }
+    return (dirent_t *)(block_ptr(block) + (slot % DIRENTS_PER_BLOCK) * sizeof(dirent_t));
+}
+
+// Find the slot holding `name` in a directory; returns its index or -1
+static int dir_find(inode_t *dir, const char *name) {
+    size_t name_len = strlen(name);
+    size_t nslots = dir->size / sizeof(dirent_t);
+
+    for (size_t i = 0; i < nslots; i++) {
+        dirent_t *entry = dir_slot(dir, i, false);
+        if (entry != NULL && entry->name_len == name_len && memcmp(entry->name, name, name_len) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Add an entry to a directory, reusing a free slot if there is one
+static int dir_add(inode_t *dir, const char *name, uint32_t ino, uint8_t file_type) {
+    size_t nslots = dir->size / sizeof(dirent_t);
+    size_t slot = nslots;
+
+    for (size_t i = 0; i < nslots; i++) {
+        dirent_t *candidate = dir_slot(dir, i, false);
+        if (candidate != NULL && candidate->name_len == 0) {
+            slot = i;
+            break;
+        }
+    }
+
+    dirent_t *entry = dir_slot(dir, slot, true);
+    if (entry == NULL) {
+        return -1;
+    }
+    if (slot == nslots) {
+        dir->size += sizeof(dirent_t);
+    }
+
+    entry->inode = ino;
+    entry->rec_len = sizeof(dirent_t);
+    entry->name_len = strlen(name);
+    entry->file_type = file_type;
+    memcpy(entry->name, name, entry->name_len);
+    return 0;
+}
+
+// Whether a directory has no live entries
+static bool dir_empty(inode_t *dir) {
+    size_t nslots = dir->size / sizeof(dirent_t);
+
+    for (size_t i = 0; i < nslots; i++) {
+        dirent_t *entry = dir_slot(dir, i, false);
+        if (entry != NULL && entry->name_len != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Body of vsfs_create
+static int create_file(uint32_t dir_ino, const char *name, uint32_t mode) {
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len > MAX_FILENAME_LEN) {
+        fprintf(stderr, "vsfs_create: invalid name length %zu\n", name_len);
+        return -1;
+    }
+
+    inode_t dir;
+    if (read_inode(dir_ino, &dir) < 0) {
+        return -1;
+    }
+    if (!S_ISDIR(dir.mode)) {
+        fprintf(stderr, "vsfs_create: inode %u is not a directory\n", dir_ino);
+        return -1;
+    }
+    if (dir_find(&dir, name) >= 0) {
+        fprintf(stderr, "vsfs_create: %s already exists\n", name);
+        return -1;
+    }
+
+    int ino = alloc_inode();
+    if (ino < 0) {
+        return -1;
+    }
+
+    bool is_dir = S_ISDIR(mode);
+    inode_t inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.mode = mode;
+    inode.compression = S_ISREG(mode) ? sb->compress_level : 0;
+    inode.nlinks = is_dir ? 2 : 1;
+    inode.atime = inode.mtime = inode.ctime = time(NULL);
+    write_inode(ino, &inode);
+
+    if (dir_add(&dir, name, ino, is_dir ? VSFS_FT_DIR : VSFS_FT_REG) < 0) {
+        free_inode(ino);
+        return -1;
+    }
+    if (is_dir) {
+        dir.nlinks++;
+    }
+    dir.mtime = inode.mtime;
+    write_inode(dir_ino, &dir);
+
+    return ino;
+}
+
+// Body of vsfs_lookup
+static int lookup_name(uint32_t dir_ino, const char *name) {
+    inode_t dir;
+    if (read_inode(dir_ino, &dir) < 0) {
+        return -1;
+    }
+    if (!S_ISDIR(dir.mode)) {
+        fprintf(stderr, "vsfs_lookup: inode %u is not a directory\n", dir_ino);
+        return -1;
+    }
+
+    int slot = dir_find(&dir, name);
+    if (slot < 0) {
+        return -1;
+    }
+    return dir_slot(&dir, slot, false)->inode;
+}
+
+// Body of vsfs_unlink
+static int unlink_name(uint32_t dir_ino, const char *name) {
+    inode_t dir;
+    if (read_inode(dir_ino, &dir) < 0) {
+        return -1;
+    }
+    if (!S_ISDIR(dir.mode)) {
+        fprintf(stderr, "vsfs_unlink: inode %u is not a directory\n", dir_ino);
+        return -1;
+    }
+
+    int slot = dir_find(&dir, name);
+    if (slot < 0) {
+        fprintf(stderr, "vsfs_unlink: %s not found\n", name);
+        return -1;
+    }
+    uint32_t ino = dir_slot(&dir, slot, false)->inode;
+
+    inode_t inode;
+    if (read_inode(ino, &inode) < 0) {
+        return -1;
+    }
+    bool is_dir = S_ISDIR(inode.mode);
+    if (is_dir && !dir_empty(&inode)) {
+        fprintf(stderr, "vsfs_unlink: directory %s is not empty\n", name);
+        return -1;
+    }
+
+    dirent_t *entry = dir_slot(&dir, slot, true);
+    if (entry == NULL) {
+        return -1;
+    }
+    memset(entry, 0, sizeof(dirent_t));
+    if (is_dir) {
+        dir.nlinks--;
+    }
+    dir.mtime = time(NULL);
+    write_inode(dir_ino, &dir);
+
+    inode.nlinks -= is_dir ? 2 : 1;
+    if (inode.nlinks > 0) {
+        return write_inode(ino, &inode);
+    }
+
+    if (inode_truncate(&inode, 0) < 0) {
+        return -1;
+    }
+    return free_inode(ino);
+}
+
+// Body of vsfs_read
+static ssize_t read_file(uint32_t ino, size_t offset, void *buf, size_t len) {
+    inode_t inode;
+    if (read_inode(ino, &inode) < 0) {
+        return -1;
+    }
+
+    ssize_t done = inode_read(&inode, offset, buf, len);
+    if (done < 0) {
+        return -1;
+    }
+    touch_atime(ino, &inode);
+    return done;
+}
+
+// Body of vsfs_write
+static ssize_t write_file(uint32_t ino, size_t offset, const void *buf, size_t len) {
+    inode_t inode;
+    if (read_inode(ino, &inode) < 0) {
+        return -1;
+    }
+    if (S_ISDIR(inode.mode)) {
+        fprintf(stderr, "vsfs_write: inode %u is a directory\n", ino);
+        return -1;
+    }
+    if (offset + len > (size_t)MAX_FILE_BLOCKS * BLOCK_SIZE) {
+        fprintf(stderr, "vsfs_write: write past maximum file size\n");
+        return -1;
+    }
+
+    if (inode.compression != 0) {
+        ssize_t written = cluster_write(&inode, offset, buf, len);
+        inode.mtime = time(NULL);
+        write_inode(ino, &inode);
+        return written;
+    }
+    if (inode.tail_block != 0 && offset + len > tail_start(&inode) && tail_unpack(&inode) < 0) {
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        size_t pos = offset + done;
+        size_t block_off = pos % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - block_off < len - done ? BLOCK_SIZE - block_off : len - done;
+        const char *src = (const char *)buf + done;
+
+        // Full blocks may be shared with an identical block instead of written
+        uint64_t hash = 0;
+        bool dedup = chunk == BLOCK_SIZE && dedup_inline_enabled();
+        if (dedup) {
+            int shared = dedup_write_block(&inode, pos / BLOCK_SIZE, src, &hash);
+            if (shared < 0) {
+                break;
+            }
+            if (shared > 0) {
+                done += chunk;
+                continue;
+            }
+        }
+
+        int block = inode_bmap(&inode, pos / BLOCK_SIZE, true);
+        if (block < 0) {
+            break;
+        }
+        memcpy(block_ptr(block) + block_off, src, chunk);
+        if (dedup) {
+            dedup_note_block(hash, block);
+        }
+        done += chunk;
+    }
+
+    if (offset + done > inode.size) {
+        inode.size = offset + done;
+    }
+    tail_pack(&inode);
+    inode.mtime = time(NULL);
+    write_inode(ino, &inode);
+
+    if (done == 0 && len > 0) {
+        return -1;
+    }
+    return done;
+}
+
+// Body of vsfs_truncate
+static int truncate_file(uint32_t ino, size_t size) {
+    inode_t inode;
+    if (read_inode(ino, &inode) < 0) {
+        return -1;
+    }
+    if (S_ISDIR(inode.mode)) {
+        fprintf(stderr, "vsfs_truncate: inode %u is a directory\n", ino);
+        return -1;
+    }
+    if (size > (size_t)MAX_FILE_BLOCKS * BLOCK_SIZE) {
+        fprintf(stderr, "vsfs_truncate: size %zu past maximum file size\n", size);
+        return -1;
+    }
+
+    int ret = inode.compression != 0 ? cluster_truncate(&inode, size) : inode_truncate(&inode, size);
+    if (ret == 0) {
+        tail_pack(&inode);
+    }
+    inode.mtime = time(NULL);
+    write_inode(ino, &inode);
+    return ret;
+}
+
+// Names of a batch in an open-addressing hash table of indices, so a
+// directory can be matched against the whole batch in one pass
+typedef struct {
+    const char *const *names;
+    int32_t *slots;     // index into names, -1 = empty
+    size_t mask;
+} name_set_t;
+
+static int name_set_find(const name_set_t *set, const char *name, size_t len) {
+    for (size_t i = hash64(name, len, 0) & set->mask;; i = (i + 1) & set->mask) {
+        int32_t idx = set->slots[i];
+        if (idx < 0) {
+            return -1;
+        }
+        if (strlen(set->names[idx]) == len && memcmp(set->names[idx], name, len) == 0) {
+            return idx;
+        }
+    }
+}
+
+// Build the set, rejecting invalid and repeated names
+static int name_set_init(name_set_t *set, const char *const *names, size_t n, const char *caller) {
+    size_t size = 16;
+    while (size < 2 * n) {
+        size *= 2;
+    }
+    set->names = names;
+    set->mask = size - 1;
+    set->slots = malloc(size * sizeof(int32_t));
+    if (set->slots == NULL) {
+        fprintf(stderr, "%s: out of memory\n", caller);
+        return -1;
+    }
+    memset(set->slots, 0xFF, size * sizeof(int32_t));
+
+    for (size_t k = 0; k < n; k++) {
+        size_t len = strlen(names[k]);
+        if (len == 0 || len > MAX_FILENAME_LEN) {
+            fprintf(stderr, "%s: invalid name length %zu\n", caller, len);
+            free(set->slots);
+            return -1;
+        }
+        size_t i = hash64(names[k], len, 0) & set->mask;
+        for (; set->slots[i] >= 0; i = (i + 1) & set->mask) {
+            if (strcmp(names[set->slots[i]], names[k]) == 0) {
+                fprintf(stderr, "%s: %s appears twice\n", caller, names[k]);
+                free(set->slots);
+                return -1;
+            }
+        }
+        set->slots[i] = (int32_t)k;
+    }
+    return 0;
+}
+
+// Visit every slot of a directory block by block; `visit` returns nonzero to stop
+static int dir_scan(inode_t *dir, int (*visit)(dirent_t *entry, size_t slot, void *arg), void *arg) {
+    size_t nslots = dir->size / sizeof(dirent_t);
+    for (size_t base = 0; base < nslots; base += DIRENTS_PER_BLOCK) {
+        int block = inode_bmap(dir, base / DIRENTS_PER_BLOCK, false);
+        if (block <= 0) {
+            continue;
+        }
+        dirent_t *entries = (dirent_t *)block_ptr(block);
+        for (size_t k = 0; k < DIRENTS_PER_BLOCK && base + k < nslots; k++) {
+            int ret = visit(&entries[k], base + k, arg);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+// Reserve `n` inodes in one pass over the bitmap, preferring a contiguous
+// run so their table slots are adjacent; numbers are returned ascending.
+// The table grows first if it can't hold them all.
+static int alloc_inodes(size_t n, uint32_t *inos) {
+    while (sb->num_used_inodes + n > sb->num_max_inodes) {
+        if (grow_inode_table() < 0) {
+            fprintf(stderr, "alloc_inodes: %zu inodes requested, %u free\n", n,
+                    sb->num_max_inodes - sb->num_used_inodes);
+            return -1;
+        }
+    }
+    uint32_t max = sb->num_max_inodes;
+
+    // Track the first n free inodes and the first run of n as we go
+    size_t nfree = 0, run_len = 0;
+    uint32_t run_start = 0;
+    uint32_t ino = 0;
+    while (ino < max && run_len < n) {
+        unsigned char byte = (unsigned char)inode_bitmap[ino / 8];
+        if (ino % 8 == 0 && byte == 0xFF && ino + 8 <= max) {
+            run_len = 0;
+            ino += 8;
+            continue;
+        }
+        if (bitmapget(inode_bitmap, max, ino) == 1) {
+            run_len = 0;
+        } else {
+            if (run_len++ == 0) {
+                run_start = ino;
+            }
+            if (nfree < n) {
+                inos[nfree++] = ino;
+            }
+        }
+        ino++;
+    }
+    STATS_BITMAP_SCAN(ino);
+    if (nfree < n) {
+        fprintf(stderr, "alloc_inodes: inode bitmap disagrees with the superblock\n");
+        return -1;
+    }
+    if (run_len == n) {
+        for (size_t k = 0; k < n; k++) {
+            inos[k] = run_start + k;
+        }
+    }
+
+    for (size_t k = 0; k < n; k++) {
+        bitmapset(inode_bitmap, max, inos[k], true);
+        mark_bits(inode_bitmap, inos[k], 1);
+    }
+    sb->num_used_inodes += n;
+    return 0;
+}
+
+// Reserve `n` data blocks, as one extent if possible; all or nothing
+static int alloc_blocks(size_t n, uint32_t *blocks) {
+    if (n == 0) {
+        return 0;
+    }
+    int start = n > 1 ? alloc_data_extent(n) : -1;
+    for (size_t k = 0; k < n; k++) {
+        int block = start >= 0 ? start + (int)k : alloc_data_block();
+        if (block < 0) {
+            free_data_blocks(blocks, k);
+            return -1;
+        }
+        blocks[k] = block;
+    }
+    return 0;
+}
+
+typedef struct {
+    name_set_t *set;
+    size_t *free_slots;
+    size_t nfree;
+    size_t want;
+} create_scan_t;
+
+static int create_scan_visit(dirent_t *entry, size_t slot, void *arg) {
+    create_scan_t *scan = arg;
+    if (entry->name_len == 0) {
+        if (scan->nfree < scan->want) {
+            scan->free_slots[scan->nfree++] = slot;
+        }
+        return 0;
+    }
+    int idx = name_set_find(scan->set, entry->name, entry->name_len);
+    if (idx >= 0) {
+        fprintf(stderr, "vsfs_create_batch: %s already exists\n", scan->set->names[idx]);
+        return -1;
+    }
+    return 0;
+}
+
+// Body of vsfs_create_batch
+static int create_batch(uint32_t dir_ino, const char *const *names, size_t n, uint32_t mode, uint32_t *out_inos) {
+    inode_t dir;
+    if (read_inode(dir_ino, &dir) < 0) {
+        return -1;
+    }
+    if (!S_ISDIR(dir.mode)) {
+        fprintf(stderr, "vsfs_create_batch: inode %u is not a directory\n", dir_ino);
+        return -1;
+    }
+
+    name_set_t set;
+    if (name_set_init(&set, names, n, "vsfs_create_batch") < 0) {
+        return -1;
+    }
+
+    // One pass over the directory finds clashes and reusable slots
+    size_t *slots = malloc(n * sizeof(size_t));
+    create_scan_t scan = {&set, slots, 0, n};
+    int ret = slots == NULL ? -1 : dir_scan(&dir, create_scan_visit, &scan);
+    free(set.slots);
+    if (ret != 0) {
+        free(slots);
+        return -1;
+    }
+
+    // The rest go on the end, in blocks reserved up front
+    size_t nslots = dir.size / sizeof(dirent_t);
+    for (size_t k = scan.nfree; k < n; k++) {
+        slots[k] = nslots + (k - scan.nfree);
+    }
+    size_t first_new_lblk = (nslots + DIRENTS_PER_BLOCK - 1) / DIRENTS_PER_BLOCK;
+    size_t end_lblk = (slots[n - 1] + DIRENTS_PER_BLOCK) / DIRENTS_PER_BLOCK;
+    size_t nblocks = slots[n - 1] >= nslots && end_lblk > first_new_lblk ? end_lblk - first_new_lblk : 0;
+    if (end_lblk > MAX_FILE_BLOCKS) {
+        fprintf(stderr, "vsfs_create_batch: directory would exceed maximum size\n");
+        free(slots);
+        return -1;
+    }
+
+    // Unshare the directory blocks being reused, and allocate or unshare the
+    // indirect block the new ones hang off, before anything is allocated; from
+    // there on nothing can fail. Unsharing doesn't change what the directory
+    // holds, so if it fails partway the directory is kept as it now is.
+    for (size_t k = 0; k < n; k++) {
+        size_t lblk = slots[k] / DIRENTS_PER_BLOCK;
+        if (lblk < first_new_lblk && inode_bmap(&dir, lblk, true) < 0) {
+            write_inode(dir_ino, &dir);
+            free(slots);
+            return -1;
+        }
+    }
+    if (nblocks > 0 && end_lblk > NUM_DIRECT_BLOCKS && inode_block_slot(&dir, end_lblk - 1, true) == NULL) {
+        write_inode(dir_ino, &dir);
+        free(slots);
+        return -1;
+    }
+
+    uint32_t *blocks = malloc((nblocks + 1) * sizeof(uint32_t));
+    if (blocks == NULL || alloc_blocks(nblocks, blocks) < 0) {
+        write_inode(dir_ino, &dir);
+        free(blocks);
+        free(slots);
+        return -1;
+    }
+    if (alloc_inodes(n, out_inos) < 0) {
+        write_inode(dir_ino, &dir);
+        free_data_blocks(blocks, nblocks);
+        free(blocks);
+        free(slots);
+        return -1;
+    }
+    for (size_t k = 0; k < nblocks; k++) {
+        *inode_block_slot(&dir, first_new_lblk + k, true) = blocks[k];
+    }
+    free(blocks);
+
+    // Fresh inodes are never cached, so they go straight into their table slots
+    bool is_dir = S_ISDIR(mode);
+    inode_t inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.mode = mode;
+    inode.compression = S_ISREG(mode) ? sb->compress_level : 0;
+    inode.nlinks = is_dir ? 2 : 1;
+    inode.atime = inode.mtime = inode.ctime = time(NULL);
+    for (size_t k = 0; k < n; k++) {
+        memcpy(inode_slot(out_inos[k]), &inode, sizeof(inode_t));
+        delta_mark_ptr(inode_slot(out_inos[k]), sizeof(inode_t));
+    }
+
+    // Fill the slots, mapping each directory block once; all of them are
+    // private by now
+    dirent_t *entries = NULL;
+    size_t mapped_lblk = SIZE_MAX;
+    for (size_t k = 0; k < n; k++) {
+        size_t lblk = slots[k] / DIRENTS_PER_BLOCK;
+        if (lblk != mapped_lblk) {
+            entries = (dirent_t *)block_ptr(inode_bmap(&dir, lblk, true));
+            mapped_lblk = lblk;
+        }
+        dirent_t *entry = &entries[slots[k] % DIRENTS_PER_BLOCK];
+        entry->inode = out_inos[k];
+        entry->rec_len = sizeof(dirent_t);
+        entry->name_len = strlen(names[k]);
+        entry->file_type = is_dir ? VSFS_FT_DIR : VSFS_FT_REG;
+        memcpy(entry->name, names[k], entry->name_len);
+        if ((slots[k] + 1) * sizeof(dirent_t) > dir.size) {
+            dir.size = (slots[k] + 1) * sizeof(dirent_t);
+        }
+    }
+    free(slots);
+
+    if (is_dir) {
+        dir.nlinks += n;
+    }
+    dir.mtime = inode.mtime;
+    write_inode(dir_ino, &dir);
+    return (int)n;
+}
+
+typedef struct {
+    name_set_t *set;
+    size_t *slots;          // per name: directory slot, SIZE_MAX if not seen
+    size_t found;
+} unlink_scan_t;
+
+static int unlink_scan_visit(dirent_t *entry, size_t slot, void *arg) {
+    unlink_scan_t *scan = arg;
+    if (entry->name_len == 0) {
+        return 0;
+    }
+    int idx = name_set_find(scan->set, entry->name, entry->name_len);
+    if (idx >= 0) {
+        scan->slots[idx] = slot;
+        scan->found++;
+    }
+    return 0;
+}
+
+// Body of vsfs_unlink_batch
+static int unlink_batch(uint32_t dir_ino, const char *const *names, size_t n) {
+    inode_t dir;
+    if (read_inode(dir_ino, &dir) < 0) {
+        return -1;
+    }
+    if (!S_ISDIR(dir.mode)) {
+        fprintf(stderr, "vsfs_unlink_batch: inode %u is not a directory\n", dir_ino);
+        return -1;
+    }
+
+    name_set_t set;
+    if (name_set_init(&set, names, n, "vsfs_unlink_batch") < 0) {
+        return -1;
+    }
+    size_t *slots = malloc(n * sizeof(size_t));
+    inode_t *inodes = malloc(n * sizeof(inode_t));
+    uint32_t *inos = malloc(n * sizeof(uint32_t));
+    if (slots == NULL || inodes == NULL || inos == NULL) {
+        fprintf(stderr, "vsfs_unlink_batch: out of memory\n");
+        free(set.slots);
+        free(slots);
+        free(inodes);
+        free(inos);
+        return -1;
+    }
+    for (size_t k = 0; k < n; k++) {
+        slots[k] = SIZE_MAX;
+    }
+    unlink_scan_t scan = {&set, slots, 0};
+    dir_scan(&dir, unlink_scan_visit, &scan);
+    free(set.slots);
+
+    // Check everything before changing anything
+    int ret = 0;
+    for (size_t k = 0; k < n && ret == 0; k++) {
+        if (slots[k] == SIZE_MAX) {
+            fprintf(stderr, "vsfs_unlink_batch: %s not found\n", names[k]);
+            ret = -1;
+            break;
+        }
+        inos[k] = dir_slot(&dir, slots[k], false)->inode;
+        if (read_inode(inos[k], &inodes[k]) < 0) {
+            ret = -1;
+        } else if (S_ISDIR(inodes[k].mode) && !dir_empty(&inodes[k])) {
+            fprintf(stderr, "vsfs_unlink_batch: directory %s is not empty\n", names[k]);
+            ret = -1;
+        }
+    }
+
+    // Unshare every directory block holding an entry first, so clearing the
+    // entries can't fail halfway. Unsharing leaves the contents as they were,
+    // so the directory is written back even if it fails.
+    for (size_t k = 0; k < n && ret == 0; k++) {
+        if (dir_slot(&dir, slots[k], true) == NULL) {
+            ret = -1;
+        }
+    }
+    size_t nremoved = 0;
+    for (size_t k = 0; k < n && ret == 0; k++) {
+        // An entry goes only once its inode has been released
+        bool is_dir = S_ISDIR(inodes[k].mode);
+        inodes[k].nlinks -= is_dir ? 2 : 1;
+        if (inodes[k].nlinks > 0) {
+            write_inode(inos[k], &inodes[k]);
+        } else if (inode_truncate(&inodes[k], 0) < 0 || free_inode(inos[k]) < 0) {
+            // Only a damaged inode gets here. Its entry stays, and the inode
+            // keeps what was truncated so it doesn't point at freed blocks.
+            inodes[k].nlinks += is_dir ? 2 : 1;
+            write_inode(inos[k], &inodes[k]);
+            fprintf(stderr, "vsfs_unlink_batch: failed to release %s, %zu of %zu removed\n", names[k], nremoved, n);
+            break;
+        }
+        memset(dir_slot(&dir, slots[k], true), 0, sizeof(dirent_t));
+        if (is_dir) {
+            dir.nlinks--;
+        }
+        nremoved++;
+    }
+    if (nremoved > 0) {
+        dir.mtime = time(NULL);
+    }
+    write_inode(dir_ino, &dir);
+
+    free(slots);
+    free(inodes);
+    free(inos);
+    return ret < 0 || nremoved == 0 ? -1 : (int)nremoved;
+}
+
+// An entry of a listing by inode number, for visiting the table in order
+typedef struct {
+    uint32_t ino;
+    uint32_t index;           // Position of the entry in the caller's buffer
+} listing_order_t;
+
+static int compare_by_inode(const void *a, const void *b) {
+    const listing_order_t *x = a, *y = b;
+    if (x->ino != y->ino) {
+        return x->ino < y->ino ? -1 : 1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// Body of vsfs_readdir_plus
+static int readdir_plus(uint32_t dir_ino, size_t *cursor, dirent_plus_t *buf, size_t max) {
+    inode_t dir;
+    if (read_inode(dir_ino, &dir) < 0) {
+        return -1;
+    }
+    if (!S_ISDIR(dir.mode)) {
+        fprintf(stderr, "vsfs_readdir_plus: inode %u is not a directory\n", dir_ino);
+        return -1;
+    }
+
+    // Gather live entries from the cursor on, a directory block at a time
+    size_t nslots = dir.size / sizeof(dirent_t);
+    size_t slot = *cursor;
+    size_t n = 0;
+    while (slot < nslots && n < max) {
+        int block = inode_bmap(&dir, slot / DIRENTS_PER_BLOCK, false);
+        dirent_t *entries = block > 0 ? (dirent_t *)block_ptr(block) : NULL;
+        for (; slot < nslots && n < max; slot++) {
+            dirent_t *entry = entries != NULL ? &entries[slot % DIRENTS_PER_BLOCK] : NULL;
+            if (entry != NULL && entry->name_len != 0) {
+                buf[n].ino = entry->inode;
+                buf[n].file_type = entry->file_type;
+                memcpy(buf[n].name, entry->name, entry->name_len);
+                buf[n].name[entry->name_len] = '\0';
+                n++;
+            }
+            if ((slot + 1) % DIRENTS_PER_BLOCK == 0) {
+                slot++;
+                break;
+            }
+        }
+    }
+    *cursor = slot;
+    if (n == 0) {
+        return 0;
+    }
+
+    // Visit the inodes in table order: prefetch each run of covering table
+    // blocks, then decode every inode with one pass over the table
+    listing_order_t *order = malloc(n * sizeof(listing_order_t));
+    if (order == NULL) {
+        fprintf(stderr, "vsfs_readdir_plus: out of memory\n");
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        order[i] = (listing_order_t){buf[i].ino, i};
+    }
+    qsort(order, n, sizeof(listing_order_t), compare_by_inode);
+
+    char *run = NULL;
+    size_t run_len = 0;
+    for (size_t i = 0; i <= n; i++) {
+        char *blk = NULL;
+        if (i < n && order[i].ino < sb->num_max_inodes) {
+            blk = disk_map + (size_t)(inode_slot(order[i].ino) - disk_map) / BLOCK_SIZE * BLOCK_SIZE;
+            if (run != NULL && blk >= run && blk <= run + run_len) {
+                size_t len = blk + BLOCK_SIZE - run;
+                run_len = len > run_len ? len : run_len;
+                continue;
+            }
+        }
+        if (run != NULL) {
+            madvise(run, run_len, MADV_WILLNEED);
+        }
+        run = blk;
+        run_len = BLOCK_SIZE;
+    }
+
+    // Cached copies may be newer than the table; everything else is read in
+    // place so a large listing doesn't flush the inode cache
+    for (size_t i = 0; i < n; i++) {
+        dirent_plus_t *ent = &buf[order[i].index];
+        if (ent->ino >= sb->num_max_inodes) {
+            memset(&ent->inode, 0, sizeof(inode_t));
+            continue;
+        }
+        inode_t *cached = icache_lookup(ent->ino, false);
+        memcpy(&ent->inode, cached != NULL ? (char *)cached : inode_slot(ent->ino),
+               sizeof(inode_t));
+    }
+    free(order);
+    return (int)n;
+}
+
+// The public file operations time and trace themselves around the
+// implementations above
+
+// Create a file or directory named `name` in `dir_ino`; returns its inode number
+int vsfs_create(uint32_t dir_ino, const char *name, uint32_t mode) {
+    STATS_START(start);
+    TRACE_START(issued);
+    int ret = create_file(dir_ino, name, mode);
+    TRACE_END(issued, VSFS_OP_CREATE, dir_ino, 0, 0, name, mode, ret);
+    STATS_END(VSFS_OP_CREATE, start);
+    return ret;
+}
+
+// Look up `name` in `dir_ino`; returns its inode number or -1
+int vsfs_lookup(uint32_t dir_ino, const char *name) {
+    STATS_START(start);
+    TRACE_START(issued);
+    int ret = lookup_name(dir_ino, name);
+    TRACE_END(issued, VSFS_OP_LOOKUP, dir_ino, 0, 0, name, 0, ret);
+    STATS_END(VSFS_OP_LOOKUP, start);
+    return ret;
+}
+
+// Remove `name` from `dir_ino`, freeing the inode and its blocks on the last link
+int vsfs_unlink(uint32_t dir_ino, const char *name) {
+    STATS_START(start);
+    TRACE_START(issued);
+    int ret = unlink_name(dir_ino, name);
+    TRACE_END(issued, VSFS_OP_UNLINK, dir_ino, 0, 0, name, 0, ret);
+    STATS_END(VSFS_OP_UNLINK, start);
+    return ret;
+}
+
+// Read up to `len` bytes at `offset`; returns the number of bytes read
+ssize_t vsfs_read(uint32_t ino, size_t offset, void *buf, size_t len) {
+    STATS_START(start);
+    TRACE_START(issued);
+    ssize_t ret = read_file(ino, offset, buf, len);
+    TRACE_END(issued, VSFS_OP_READ, ino, offset, len, NULL, 0, ret);
+    STATS_COUNT(VSFS_CTR_BYTES_READ, ret > 0 ? ret : 0);
+    STATS_END(VSFS_OP_READ, start);
+    return ret;
+}
+
+// Write `len` bytes at `offset`, allocating blocks as needed; returns the
+// number of bytes written, which is short if the disk fills up
+ssize_t vsfs_write(uint32_t ino, size_t offset, const void *buf, size_t len) {
+    STATS_START(start);
+    TRACE_START(issued);
+    ssize_t ret = write_file(ino, offset, buf, len);
+    TRACE_END(issued, VSFS_OP_WRITE, ino, offset, len, NULL, 0, ret);
+    STATS_COUNT(VSFS_CTR_BYTES_WRITTEN, ret > 0 ? ret : 0);
+    STATS_END(VSFS_OP_WRITE, start);
+    return ret;
+}
+
+// Shrink or extend a file to `size` bytes, freeing blocks past the new end
+int vsfs_truncate(uint32_t ino, size_t size) {
+    STATS_START(start);
+    TRACE_START(issued);
+    int ret = truncate_file(ino, size);
+    TRACE_END(issued, VSFS_OP_TRUNCATE, ino, size, 0, NULL, 0, ret);
+    STATS_END(VSFS_OP_TRUNCATE, start);
+    return ret;
+}
+
+// Create `n` entries of the same mode in `dir_ino` with one directory pass,
+// one inode bitmap pass and one block reservation; fills `out_inos`.
+// Nothing is created if any name is invalid, repeated or already present.
+int vsfs_create_batch(uint32_t dir_ino, const char *const *names, size_t n, uint32_t mode, uint32_t *out_inos) {
+    if (n == 0) {
+        return 0;
+    }
+    STATS_START(start);
+    int ret = create_batch(dir_ino, names, n, mode, out_inos);
+    STATS_END(VSFS_OP_CREATE_BATCH, start);
+    return ret;
+}
+
+// Remove `n` entries from `dir_ino` with one directory pass; nothing is
+// removed if any name is missing or names a non-empty directory. A count
+// short of `n` means releasing an inode failed and the rest were kept.
+int vsfs_unlink_batch(uint32_t dir_ino, const char *const *names, size_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    STATS_START(start);
+    int ret = unlink_batch(dir_ino, names, n);
+    STATS_END(VSFS_OP_UNLINK_BATCH, start);
+    return ret;
+}
+
+// List up to `max` entries of a directory with their attributes, resuming
+// at `*cursor` (0 to start); returns the number filled, 0 at the end
+int vsfs_readdir_plus(uint32_t dir_ino, size_t *cursor, dirent_plus_t *buf, size_t max) {
+    STATS_START(start);
+    int ret = readdir_plus(dir_ino, cursor, buf, max);
+    STATS_END(VSFS_OP_READDIR, start);
+    return ret;
+}
+
+// Copy out the attributes of an inode
+int vsfs_stat(uint32_t ino, inode_t *inode) {
+    STATS_START(start);
+    TRACE_START(issued);
+    int ret = read_inode(ino, inode);
+    TRACE_END(issued, VSFS_OP_STAT, ino, 0, 0, NULL, 0, ret);
+    STATS_END(VSFS_OP_STAT, start);
+    return ret;
+}
+
+// Write back cached inodes and flush the image to its backing file. Data
+// blocks are written in place, so syncing one file syncs them all.
+int vsfs_fsync(uint32_t ino) {
+    if (ino >= sb->num_max_inodes || bitmapget(inode_bitmap, sb->num_max_inodes, ino) != 1) {
+        fprintf(stderr, "vsfs_fsync: inode %u is not allocated\n", ino);
+        return -1;
+    }
+    return vsfs_sync();
+}
+
+// Write back every cached inode and flush the whole image
+int vsfs_sync() {
+    STATS_START(start);
+    TRACE_START(issued);
+    icache_writeback();
+    int ret = stripe_active() ? stripe_sync() : msync(disk_map, sb->disk_size, MS_SYNC);
+    if (ret < 0 && !stripe_active()) {
+        perror("vsfs_sync: msync");
+    }
+    TRACE_END(issued, VSFS_OP_FSYNC, 0, 0, 0, NULL, 0, ret);
+    STATS_END(VSFS_OP_FSYNC, start);
+    return ret;
+}
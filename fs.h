@@ -2,3 +2,116 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifndef FS_H
+#define FS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "mkfs.h"
+
+#define ROOT_INODE 0
+#define NUM_DIRECT_BLOCKS 12
+#define PTRS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define MAX_FILE_BLOCKS (NUM_DIRECT_BLOCKS + PTRS_PER_BLOCK)
+
+// A directory is an array of fixed-size dirent_t slots; slot k lives in
+// logical block k / DIRENTS_PER_BLOCK and a slot with name_len 0 is free
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / sizeof(dirent_t))
+
+// Directory entry file types
+#define VSFS_FT_REG 1
+#define VSFS_FT_DIR 2
+
+// A directory entry together with the attributes of the inode it names
+typedef struct {
+    uint32_t ino;
+    uint8_t file_type;
+    char name[MAX_FILENAME_LEN + 1];
+    inode_t inode;
+} dirent_plus_t;
+
+// Pointer to the start of a block in the mapped image
+char *block_ptr(uint32_t block);
+
+// Index of the first block after the inode table
+uint32_t data_region_start();
+
+// Table slot of an inode, in the fixed table or one of its chunks
+char *inode_slot(uint32_t ino);
+
+// Copy an allocated inode out of / into the inode table
+int read_inode(uint32_t ino, inode_t *inode);
+int write_inode(uint32_t ino, const inode_t *inode);
+
+// Timestamp policy from the mount options (see VSFS_RELATIME and friends)
+void set_time_options(int atime_mode, bool lazytime);
+
+// Move the access time of a file that was just read, if the policy says so
+void touch_atime(uint32_t ino, inode_t *inode);
+
+// Allocate a zeroed data block and return its index (-1 if full)
+int alloc_data_block();
+
+// Allocate a zeroed data block at or after `goal` if one is free there
+int alloc_data_block_near(uint32_t goal);
+
+// Allocate `count` contiguous zeroed data blocks and return the first (-1 if none)
+int alloc_data_extent(size_t count);
+
+// Drop a reference to each block, freeing and discarding the ones no longer
+// referenced; sorts and overwrites the array in place
+int free_data_blocks(uint32_t *blocks, size_t n);
+
+// Block reference counts, used once blocks can be shared between owners
+int refcount_init();
+int block_refcount(uint32_t block);
+int block_ref(uint32_t block);
+
+// Free allocated blocks nothing references (left by a crash while mapped)
+int refcount_reclaim();
+
+// Give the owner of `*ptr` a private copy of a shared block; returns the block
+int cow_block(uint32_t *ptr);
+
+// Release the host storage behind a run of blocks (best effort)
+int discard_blocks(uint32_t start, uint32_t count);
+
+// Discard every free run in the data region; returns the number of blocks discarded
+int vsfs_trim();
+
+// Block mapping and I/O on an in-memory inode; `write` makes the block private
+uint32_t *inode_block_slot(inode_t *inode, size_t lblk, bool write);
+int inode_bmap(inode_t *inode, size_t lblk, bool write);
+int inode_truncate(inode_t *inode, size_t size);
+ssize_t inode_read(inode_t *inode, size_t offset, void *buf, size_t len);
+
+// File operations; inodes are addressed by number and names by parent directory
+int vsfs_create(uint32_t dir_ino, const char *name, uint32_t mode);
+int vsfs_lookup(uint32_t dir_ino, const char *name);
+int vsfs_unlink(uint32_t dir_ino, const char *name);
+ssize_t vsfs_read(uint32_t ino, size_t offset, void *buf, size_t len);
+ssize_t vsfs_write(uint32_t ino, size_t offset, const void *buf, size_t len);
+int vsfs_truncate(uint32_t ino, size_t size);
+int vsfs_stat(uint32_t ino, inode_t *inode);
+
+// Create many entries of one directory at once; all or nothing. Returns
+// the number of entries created, or -1.
+int vsfs_create_batch(uint32_t dir_ino, const char *const *names, size_t n, uint32_t mode, uint32_t *out_inos);
+
+// Remove many entries of one directory at once. Every name is checked and
+// every directory block made private before anything is removed, so those
+// failures change nothing and return -1. Entries are then removed in order;
+// if releasing an inode fails (a damaged inode), the entries before it stay
+// removed, the rest are kept, and the number removed is returned.
+int vsfs_unlink_batch(uint32_t dir_ino, const char *const *names, size_t n);
+
+// List a directory with each entry's attributes, in directory order. Inodes
+// are fetched in table order so each table block is visited once per call.
+int vsfs_readdir_plus(uint32_t dir_ino, size_t *cursor, dirent_plus_t *buf, size_t max);
+
+// Persist cached inodes and dirty image pages
+int vsfs_fsync(uint32_t ino);
+int vsfs_sync();
+
+#endif // FS_H
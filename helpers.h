@@ -26,4 +26,7 @@ int bitmapinit(char *bitmap, size_t nbits);
 // Find the first available bit, set it to 1, and return its index (-1 if full)
 int bitmapalloc(char *bitmap, size_t nbits);
 
+// Fast non-cryptographic 64-bit hash of a buffer (XXH64)
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+
 #endif // HELPERS_H
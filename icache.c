@@ -0,0 +1,322 @@
+#include "icache.h"
+#include "stats.h"
+#include "delta.h"
+#include <stddef.h>
+#include <time.h>
+
+#define ICACHE_BUCKETS (2 * ICACHE_CAPACITY)   // power of two; inode numbers are dense
+
+typedef struct icache_entry {
+    inode_t inode;
+    uint32_t ino;
+    uint32_t refs;
+    bool cached;                        // on a hash chain
+    bool dirty;
+    bool lazy;                          // only timestamps changed since writeback
+    time_t lazy_since;
+    struct icache_entry *hash_next;
+    struct icache_entry *lru_prev;      // unpinned entries, most recently used first
+    struct icache_entry *lru_next;
+} icache_entry_t;
+
+static icache_entry_t *entries;
+static icache_entry_t *buckets[ICACHE_BUCKETS];
+static icache_entry_t *free_list;       // linked through lru_next
+static icache_entry_t lru;              // sentinel of the circular LRU list
+static icache_entry_t *dirty[ICACHE_DIRTY_BATCH];
+static size_t ndirty;
+static icache_entry_t *batch[ICACHE_CAPACITY];
+static size_t nlazy;
+static size_t npinned;                  // entries held through icache_get
+static uint32_t lazy_max_age = ICACHE_LAZY_MAX_AGE;
+
+// Allocate the entries on first use
+static int icache_init() {
+    if (entries != NULL) {
+        return 0;
+    }
+    entries = calloc(ICACHE_CAPACITY, sizeof(icache_entry_t));
+    if (entries == NULL) {
+        fprintf(stderr, "icache: out of memory\n");
+        return -1;
+    }
+    lru.lru_prev = lru.lru_next = &lru;
+    for (size_t i = 0; i < ICACHE_CAPACITY; i++) {
+        entries[i].lru_next = free_list;
+        free_list = &entries[i];
+    }
+    return 0;
+}
+
+static icache_entry_t *entry_of(inode_t *inode) {
+    return (icache_entry_t *)((char *)inode - offsetof(icache_entry_t, inode));
+}
+
+static void lru_unlink(icache_entry_t *entry) {
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push(icache_entry_t *entry) {
+    entry->lru_next = lru.lru_next;
+    entry->lru_prev = &lru;
+    lru.lru_next->lru_prev = entry;
+    lru.lru_next = entry;
+}
+
+static void hash_remove(icache_entry_t *entry) {
+    icache_entry_t **link = &buckets[entry->ino & (ICACHE_BUCKETS - 1)];
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    entry->cached = false;
+}
+
+static void dirty_remove(icache_entry_t *entry) {
+    for (size_t i = 0; i < ndirty; i++) {
+        if (dirty[i] == entry) {
+            dirty[i] = dirty[--ndirty];
+            break;
+        }
+    }
+    entry->dirty = false;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    uint32_t x = (*(icache_entry_t *const *)a)->ino;
+    uint32_t y = (*(icache_entry_t *const *)b)->ino;
+    return (x > y) - (x < y);
+}
+
+static void write_entry(icache_entry_t *entry) {
+    memcpy(inode_slot(entry->ino), &entry->inode, sizeof(inode_t));
+    delta_mark_ptr(inode_slot(entry->ino), sizeof(inode_t));
+    if (entry->lazy) {
+        entry->lazy = false;
+        nlazy--;
+    }
+    entry->dirty = false;
+}
+
+// Write back the dirty inodes plus lazy ones: all of them if `all_lazy`,
+// otherwise only those older than the lazy age
+static int flush(bool all_lazy) {
+    size_t n = 0;
+    for (size_t i = 0; i < ndirty; i++) {
+        batch[n++] = dirty[i];
+    }
+    if (nlazy > 0 && entries != NULL) {
+        time_t now = time(NULL);
+        for (size_t i = 0; i < ICACHE_CAPACITY; i++) {
+            icache_entry_t *entry = &entries[i];
+            if (entry->lazy && (all_lazy || now - entry->lazy_since >= (time_t)lazy_max_age)) {
+                batch[n++] = entry;
+            }
+        }
+    }
+    ndirty = 0;
+    if (n == 0) {
+        return 0;
+    }
+
+    // Sorting by inode number writes each table block once, front to back
+    qsort(batch, n, sizeof(icache_entry_t *), compare_entries);
+    for (size_t i = 0; i < n; i++) {
+        write_entry(batch[i]);
+    }
+    STATS_COUNT(VSFS_CTR_INODE_WRITEBACKS, n);
+    return (int)n;
+}
+
+// Copy every modified inode, lazy timestamps included, back to the inode
+// table; returns how many were written
+int icache_writeback() {
+    return flush(true);
+}
+
+// How long a timestamp-only change may stay in memory
+void icache_set_lazy_age(uint32_t seconds) {
+    lazy_max_age = seconds == 0 ? ICACHE_LAZY_MAX_AGE : seconds;
+}
+
+// Find a slot for a new entry: a never-used one, else the least recently used
+// unpinned entry. A dirty victim triggers a writeback of the whole batch.
+static icache_entry_t *icache_victim() {
+    if (free_list != NULL) {
+        icache_entry_t *entry = free_list;
+        free_list = entry->lru_next;
+        entry->lru_next = NULL;
+        return entry;
+    }
+    icache_entry_t *entry = lru.lru_prev;
+    if (entry == &lru) {
+        fprintf(stderr, "icache: every entry is pinned\n");
+        return NULL;
+    }
+    if (entry->dirty) {
+        flush(false);
+    }
+    if (entry->lazy) {
+        write_entry(entry);
+    }
+    lru_unlink(entry);
+    hash_remove(entry);
+    return entry;
+}
+
+static icache_entry_t *icache_find(uint32_t ino) {
+    icache_entry_t *entry = buckets[ino & (ICACHE_BUCKETS - 1)];
+    while (entry != NULL && entry->ino != ino) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+// Find or load the entry for `ino`; `load` false returns NULL on a miss
+static icache_entry_t *icache_entry(uint32_t ino, bool load) {
+    if (icache_init() < 0) {
+        return NULL;
+    }
+
+    icache_entry_t *entry = icache_find(ino);
+    if (entry != NULL || !load) {
+        return entry;
+    }
+
+    STATS_COUNT(VSFS_CTR_ICACHE_MISSES, 1);
+    entry = icache_victim();
+    if (entry == NULL) {
+        return NULL;
+    }
+    memcpy(&entry->inode, inode_slot(ino), sizeof(inode_t));
+    entry->ino = ino;
+    entry->refs = 0;
+    entry->dirty = false;
+    entry->lazy = false;
+    entry->cached = true;
+    entry->hash_next = buckets[ino & (ICACHE_BUCKETS - 1)];
+    buckets[ino & (ICACHE_BUCKETS - 1)] = entry;
+    lru_push(entry);
+    return entry;
+}
+
+// Pin an allocated inode in the cache and return the cached copy (NULL on error)
+inode_t *icache_get(uint32_t ino) {
+    icache_entry_t *entry = icache_entry(ino, true);
+    if (entry == NULL) {
+        return NULL;
+    }
+    if (entry->refs++ == 0) {
+        lru_unlink(entry);
+        npinned++;
+    }
+    return &entry->inode;
+}
+
+// Cached copy of an inode, valid until the next cache call; NULL on a miss
+// unless `load` is set. Unpinned hits move to the front of the LRU.
+inode_t *icache_lookup(uint32_t ino, bool load) {
+    icache_entry_t *entry = icache_entry(ino, load);
+    if (entry == NULL) {
+        return NULL;
+    }
+    if (entry->refs == 0 && lru.lru_next != entry) {
+        lru_unlink(entry);
+        lru_push(entry);
+    }
+    return &entry->inode;
+}
+
+// Unpin an inode returned by icache_get
+void icache_put(inode_t *inode) {
+    icache_entry_t *entry = entry_of(inode);
+    if (--entry->refs > 0) {
+        return;
+    }
+    npinned--;
+    if (entry->cached) {
+        lru_push(entry);
+    } else {
+        // Forgotten while pinned
+        entry->lru_next = free_list;
+        free_list = entry;
+    }
+}
+
+// Mark a cached inode as modified
+void icache_dirty(inode_t *inode) {
+    icache_entry_t *entry = entry_of(inode);
+    if (entry->dirty || !entry->cached) {
+        return;
+    }
+    if (entry->lazy) {
+        entry->lazy = false;
+        nlazy--;
+    }
+    entry->dirty = true;
+    dirty[ndirty++] = entry;
+    if (ndirty >= ICACHE_DIRTY_BATCH) {
+        flush(false);
+    }
+}
+
+// Mark a cached inode whose only change is to its timestamps. It is written
+// back with the next change to anything else, on fsync, or once the oldest
+// unwritten timestamp is older than the lazy age.
+void icache_dirty_time(inode_t *inode) {
+    icache_entry_t *entry = entry_of(inode);
+    if (entry->dirty || !entry->cached) {
+        return;
+    }
+    time_t now = time(NULL);
+    if (!entry->lazy) {
+        entry->lazy = true;
+        entry->lazy_since = now;
+        nlazy++;
+    } else if (now - entry->lazy_since >= (time_t)lazy_max_age) {
+        icache_dirty(inode);
+    }
+}
+
+// Drop a freed inode from the cache, discarding any unwritten changes
+void icache_forget(uint32_t ino) {
+    if (entries == NULL) {
+        return;
+    }
+    icache_entry_t *entry = icache_find(ino);
+    if (entry == NULL) {
+        return;
+    }
+    if (entry->dirty) {
+        dirty_remove(entry);
+    }
+    if (entry->lazy) {
+        entry->lazy = false;
+        nlazy--;
+    }
+    hash_remove(entry);
+    if (entry->refs == 0) {
+        lru_unlink(entry);
+        entry->lru_next = free_list;
+        free_list = entry;
+    }
+}
+
+// Drop every cached inode without writing back (the table was replaced).
+// Pinned entries would be left dangling, so nothing is dropped while any
+// are held.
+int icache_invalidate() {
+    if (npinned > 0) {
+        fprintf(stderr, "icache_invalidate: %zu inodes are still pinned\n", npinned);
+        return -1;
+    }
+    free(entries);
+    entries = NULL;
+    free_list = NULL;
+    ndirty = 0;
+    nlazy = 0;
+    memset(buckets, 0, sizeof(buckets));
+    return 0;
+}
@@ -0,0 +1,50 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef ICACHE_H
+#define ICACHE_H
+
+#include <stdint.h>
+#include "fs.h"
+
+// Decoded inodes are kept in a fixed-size cache hashed by inode number.
+// Modified inodes stay dirty in memory and are copied back to the inode
+// table in table order once ICACHE_DIRTY_BATCH of them accumulate, when a
+// dirty inode is evicted, or on fsync/unmount. Inodes whose only change is
+// a timestamp (lazytime) are held back for up to ICACHE_LAZY_MAX_AGE seconds.
+#define ICACHE_CAPACITY 1024
+#define ICACHE_DIRTY_BATCH 64
+#define ICACHE_LAZY_MAX_AGE (24 * 60 * 60)
+
+// Pin an allocated inode in the cache and return the cached copy (NULL on error)
+inode_t *icache_get(uint32_t ino);
+
+// Cached copy of an inode, valid until the next cache call; NULL on a miss
+// unless `load` is set
+inode_t *icache_lookup(uint32_t ino, bool load);
+
+// Unpin an inode returned by icache_get
+void icache_put(inode_t *inode);
+
+// Mark a cached inode as modified
+void icache_dirty(inode_t *inode);
+
+// Mark a cached inode whose only change is to its timestamps
+void icache_dirty_time(inode_t *inode);
+
+// Copy every modified inode, lazy timestamps included, back to the inode
+// table; returns how many were written
+int icache_writeback();
+
+// How long a timestamp-only change may stay in memory (0 = default)
+void icache_set_lazy_age(uint32_t seconds);
+
+// Drop a freed inode from the cache, discarding any unwritten changes
+void icache_forget(uint32_t ino);
+
+// Drop every cached inode without writing back (the table was replaced);
+// fails while any inode is pinned
+int icache_invalidate();
+
+#endif // ICACHE_H
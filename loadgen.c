@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include "vsfsd.h"
+#include "fs.h"
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Load generator for vsfsd: each client is a thread with its own connection
+// that keeps `depth` requests in flight against its own file. Clients are run
+// at each concurrency level in turn and the latency of every request, from
+// send to response, is kept to report the tail.
+#define MAX_LEVELS 16
+#define MAX_CLIENTS 256
+#define LOAD_FILE_SIZE (256 * 1024)
+
+typedef struct {
+    const char *socket;
+    int levels[MAX_LEVELS];
+    int nlevels;
+    int depth;
+    size_t ops;
+    size_t io_size;
+} load_config_t;
+
+typedef struct {
+    int id;
+    pthread_barrier_t *ready;
+    uint64_t *latencies;      // ns per request, `config.ops` of them
+    double start;
+    double end;
+    int failed;
+} client_t;
+
+static load_config_t config;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+// Send one request and wait for its response; returns the result
+static int64_t call(int fd, vsfsd_req_t *req, const char *name) {
+    vsfsd_resp_t resp;
+    req->magic = VSFSD_MAGIC;
+    req->name_len = name != NULL ? strlen(name) : 0;
+    if (vsfsd_send(fd, req, name) < 0 || vsfsd_recv(fd, &resp) < 0) {
+        return -1;
+    }
+    return resp.result;
+}
+
+// Open (or create) the client's file and fill it
+static int64_t setup_file(int fd, int id, char *shm) {
+    char name[32];
+    snprintf(name, sizeof(name), "load%d", id);
+    vsfsd_req_t req = {0};
+    req.op = VSFSD_OP_LOOKUP;
+    req.ino = ROOT_INODE;
+    int64_t ino = call(fd, &req, name);
+    if (ino < 0) {
+        req.op = VSFSD_OP_CREATE;
+        req.mode = S_IFREG | 0644;
+        ino = call(fd, &req, name);
+    }
+    if (ino < 0) {
+        return -1;
+    }
+
+    memset(shm, 'a' + id % 26, config.io_size);
+    for (size_t off = 0; off < LOAD_FILE_SIZE; off += config.io_size) {
+        req = (vsfsd_req_t){0};
+        req.op = VSFSD_OP_WRITE;
+        req.ino = ino;
+        req.offset = off;
+        req.len = config.io_size;
+        if (call(fd, &req, NULL) != (int64_t)config.io_size) {
+            return -1;
+        }
+    }
+    return ino;
+}
+
+// Send a random request from in-flight slot `slot`: 70% reads, 20% writes
+// and 10% lookups of the file's name
+static int issue(int fd, uint32_t ino, const char *name, int slot, uint64_t seq, double *sent, uint64_t *rng) {
+    vsfsd_req_t req = {0};
+    req.magic = VSFSD_MAGIC;
+    req.id = seq << 16 | slot;
+    req.ino = ino;
+    req.shm_off = slot * config.io_size;
+    req.len = config.io_size;
+    req.offset = next_random(rng) % (LOAD_FILE_SIZE / config.io_size) * config.io_size;
+    int pick = next_random(rng) % 10;
+    req.op = pick < 7 ? VSFSD_OP_READ : pick < 9 ? VSFSD_OP_WRITE : VSFSD_OP_LOOKUP;
+    if (req.op == VSFSD_OP_LOOKUP) {
+        req.ino = ROOT_INODE;
+        req.name_len = strlen(name);
+    }
+    sent[slot] = now_sec();
+    return vsfsd_send(fd, &req, name);
+}
+
+static void *client_main(void *arg) {
+    client_t *client = arg;
+    int shm_fd = -1;
+    size_t shm_size = config.depth * config.io_size;
+    char *shm = vsfsd_shm_create(shm_size, &shm_fd);
+    int fd = shm == NULL ? -1 : vsfsd_connect(config.socket, shm_fd, shm_size);
+    int64_t ino = fd < 0 ? -1 : setup_file(fd, client->id, shm);
+    client->failed = ino < 0;
+    pthread_barrier_wait(client->ready);
+
+    char name[32];
+    snprintf(name, sizeof(name), "load%d", client->id);
+    uint64_t rng = 0x9E3779B97F4A7C15ULL * (client->id + 1);
+    double *sent = malloc(config.depth * sizeof(double));
+    size_t issued = 0, done = 0;
+    client->start = now_sec();
+
+    // Fill the pipeline, then reuse each slot as its response comes back
+    for (int slot = 0; slot < config.depth && issued < config.ops && !client->failed; slot++) {
+        client->failed = issue(fd, ino, name, slot, issued++, sent, &rng) < 0;
+    }
+    while (done < issued && !client->failed) {
+        vsfsd_resp_t resp;
+        if (vsfsd_recv(fd, &resp) < 0 || resp.result < 0) {
+            client->failed = 1;
+            break;
+        }
+        int slot = resp.id & 0xFFFF;
+        client->latencies[done++] = (uint64_t)((now_sec() - sent[slot]) * 1e9);
+        if (issued < config.ops) {
+            client->failed = issue(fd, ino, name, slot, issued++, sent, &rng) < 0;
+        }
+    }
+    client->end = now_sec();
+
+    free(sent);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (shm != NULL) {
+        munmap(shm, shm_size);
+        close(shm_fd);
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+static double percentile(const uint64_t *sorted, size_t n, double pct) {
+    size_t rank = (size_t)(pct / 100.0 * n + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[(rank > n ? n : rank) - 1];
+}
+
+// Run `nclients` clients to completion and print one line of results
+static int run_level(int nclients) {
+    client_t *clients = calloc(nclients, sizeof(client_t));
+    pthread_t *threads = malloc(nclients * sizeof(pthread_t));
+    uint64_t *all = malloc((size_t)nclients * config.ops * sizeof(uint64_t));
+    if (clients == NULL || threads == NULL || all == NULL) {
+        fprintf(stderr, "vsfsd_load: out of memory\n");
+        return -1;
+    }
+    pthread_barrier_t ready;
+    pthread_barrier_init(&ready, NULL, nclients);
+    for (int c = 0; c < nclients; c++) {
+        clients[c].id = c;
+        clients[c].ready = &ready;
+        clients[c].latencies = all + (size_t)c * config.ops;
+        pthread_create(&threads[c], NULL, client_main, &clients[c]);
+    }
+
+    int ret = 0;
+    double start = 0, end = 0;
+    for (int c = 0; c < nclients; c++) {
+        pthread_join(threads[c], NULL);
+        if (clients[c].failed) {
+            ret = -1;
+        }
+        start = c == 0 || clients[c].start < start ? clients[c].start : start;
+        end = clients[c].end > end ? clients[c].end : end;
+    }
+    pthread_barrier_destroy(&ready);
+
+    if (ret == 0) {
+        size_t n = (size_t)nclients * config.ops;
+        qsort(all, n, sizeof(uint64_t), compare_u64);
+        printf("  %7d %14.1f %10.1f %10.1f %10.1f %10.1f\n", nclients, n / (end - start),
+               percentile(all, n, 50) / 1e3, percentile(all, n, 99) / 1e3, percentile(all, n, 99.9) / 1e3,
+               all[n - 1] / 1e3);
+        fflush(stdout);
+    }
+    free(clients);
+    free(threads);
+    free(all);
+    return ret;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--socket PATH] [--clients 1,2,4,8,16] [--depth N] [--ops N] [--io-kib N]\n", prog);
+}
+
+// Parse the command line into `config`; returns -1 on bad arguments
+static int parse_args(int argc, char **argv) {
+    config = (load_config_t){.socket = VSFSD_SOCKET, .levels = {1, 2, 4, 8, 16}, .nlevels = 5, .depth = 16,
+                             .ops = 20000, .io_size = 4096};
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            return -1;
+        }
+        i++;
+        if (strcmp(argv[i - 1], "--socket") == 0) {
+            config.socket = value;
+        } else if (strcmp(argv[i - 1], "--clients") == 0) {
+            config.nlevels = 0;
+            char *copy = strdup(value);
+            for (char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+                int n = atoi(tok);
+                if (n < 1 || n > MAX_CLIENTS || config.nlevels == MAX_LEVELS) {
+                    free(copy);
+                    return -1;
+                }
+                config.levels[config.nlevels++] = n;
+            }
+            free(copy);
+        } else if (strcmp(argv[i - 1], "--depth") == 0) {
+            config.depth = atoi(value);
+        } else if (strcmp(argv[i - 1], "--ops") == 0) {
+            config.ops = strtoul(value, NULL, 0);
+        } else if (strcmp(argv[i - 1], "--io-kib") == 0) {
+            config.io_size = strtoul(value, NULL, 0) * 1024;
+        } else {
+            return -1;
+        }
+    }
+    return config.nlevels > 0 && config.depth > 0 && config.depth <= 0xFFFF && config.ops > 0 &&
+                   config.io_size > 0 && config.io_size <= LOAD_FILE_SIZE
+               ? 0
+               : -1;
+}
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv) < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    printf("=== vsfsd load: depth %d, %zu ops per client, %zu KiB I/O (70%% read, 20%% write, 10%% lookup) ===\n\n",
+           config.depth, config.ops, config.io_size / 1024);
+    printf("  %7s %14s %10s %10s %10s %10s\n", "clients", "ops/s", "p50 us", "p99 us", "p99.9 us", "max us");
+    for (int l = 0; l < config.nlevels; l++) {
+        if (run_level(config.levels[l]) < 0) {
+            fprintf(stderr, "vsfsd_load: run with %d clients failed\n", config.levels[l]);
+            return 1;
+        }
+    }
+    return 0;
+}
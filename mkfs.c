@@ -1,13 +1,19 @@
 #define _POSIX_C_SOURCE 200809L
 #include "mkfs.h"
+#include "fs.h"
+#include "dedup.h"
+#include "mount.h"
+#include "stats.h"
+#include "icache.h"
+#include "extent.h"
+#include "filemap.h"
 #include "helpers.h"
+#include "stripe.h"
 #include <unistd.h>
 #include <time.h>
 #include <assert.h>
 #include <sys/stat.h>
 
-#define VSFS_MAGIC 0x56534653 // "VSFS" in hex
-
 // Global filesystem pointers
 superblock_t *sb = NULL;
 char *inode_bitmap = NULL;
@@ -15,8 +21,45 @@ char *data_bitmap = NULL;
 char *inode_table = NULL;
 char *data_section = NULL;
 
+// Backing image of the formatted filesystem
+char *disk_map = NULL;
+int disk_fd = -1;
+
 int format_disk(const char *disk_name, size_t disk_size, size_t max_files) {
+    return format_disk_opts(disk_name, disk_size, max_files, NULL);
+}
+
+static int format_image(const char *const *disk_names, int ndisks, size_t stripe_size, size_t disk_size,
+                        size_t max_files, const map_options_t *opts);
+
+int format_disk_opts(const char *disk_name, size_t disk_size, size_t max_files, const map_options_t *opts) {
+    STATS_START(start);
+    int ret = format_image(&disk_name, 1, 0, disk_size, max_files, opts);
+    STATS_END(VSFS_OP_FORMAT, start);
+    return ret;
+}
+
+int format_disk_striped(const char *const *disk_names, int ndisks, size_t stripe_size, size_t disk_size,
+                        size_t max_files, const map_options_t *opts) {
+    STATS_START(start);
+    int ret = format_image(disk_names, ndisks, stripe_size, disk_size, max_files, opts);
+    STATS_END(VSFS_OP_FORMAT, start);
+    return ret;
+}
+
+static int format_image(const char *const *disk_names, int ndisks, size_t stripe_size, size_t disk_size,
+                        size_t max_files, const map_options_t *opts) {
+    // Anything cached belongs to the previous image, which is unmounted
+    // first so its mapping, descriptors and pins don't outlive it
+    if (sb != NULL) {
+        icache_writeback();
+    }
+    if (icache_invalidate() < 0 || (sb != NULL && unmount_disk() < 0)) {
+        return -1;
+    }
+
     assert(sizeof(superblock_t) <= BLOCK_SIZE);   // superblock needs to fit in a block
+    assert(sizeof(inode_t) <= INODE_SIZE);        // inode needs to fit in its table slot
 
     if (disk_size < 2 * BLOCK_SIZE) {   // superblock and at least 1 bitmap block
         fprintf(stderr, "Disk size is too small\n");
@@ -28,41 +71,83 @@ int format_disk(const char *disk_name, size_t disk_size, size_t max_files) {
         return -1;
     }
 
-    int fd = open(disk_name, O_RDWR | O_CREAT, 0644);
-    if (fd < 0) {
-        perror("Failed to open disk");
-        return -1; // Return -1 on error
-    }
-
-    // Ensure the file is at least N bytes
-    if (ftruncate(fd, disk_size) == -1) {
-        perror("ftruncate");
-        close(fd);
+    if (ndisks < 1 || ndisks > VSFS_MAX_STRIPE_MEMBERS) {
+        fprintf(stderr, "format_disk: %d backing files (1 to %d allowed)\n", ndisks, VSFS_MAX_STRIPE_MEMBERS);
         return -1;
     }
 
-     // Map the file into memory
-    char *map = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (map == MAP_FAILED) {
-        perror("mmap");
-        close(fd);
-        return -1;
-    }
+    int fd;
+    char *map;
+    size_t num_total_blocks, num_inode_table_blocks, num_data_blocks, num_inode_bitmap_blocks, num_data_bitmap_blocks;
+    stripe_geometry_t geometry = {0};
+    if (ndisks == 1) {
+        fd = open(disk_names[0], O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            perror("Failed to open disk");
+            return -1; // Return -1 on error
+        }
 
-    memset(map, 0, disk_size); // Initialize the mapped memory to zero
+        // Ensure the file is at least N bytes
+        if (ftruncate(fd, disk_size) == -1) {
+            perror("ftruncate");
+            close(fd);
+            return -1;
+        }
+
+        // Map the file into memory
+        map = map_image(fd, disk_size, opts);
+        if (map == NULL) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        // Striping starts at the data region, so its place is needed before mapping
+        stripe_size = stripe_size != 0 ? stripe_size : VSFS_STRIPE_DEFAULT;
+        if (stripe_size % BLOCK_SIZE != 0 ||
+            calculate_layout(NULL, disk_size, max_files, &num_total_blocks, &num_inode_table_blocks, &num_data_blocks,
+                             &num_data_bitmap_blocks, &num_inode_bitmap_blocks) < 0) {
+            fprintf(stderr, "format_disk: can't stripe %zu bytes in %zu-byte units\n", disk_size, stripe_size);
+            return -1;
+        }
+        geometry.members = ndisks;
+        geometry.unit_blocks = stripe_size / BLOCK_SIZE;
+        geometry.start = 1 + num_inode_bitmap_blocks + num_data_bitmap_blocks + num_inode_table_blocks;
+        geometry.total_blocks = num_total_blocks;
+        disk_size = num_total_blocks * BLOCK_SIZE;
+
+        fd = stripe_open(disk_names, &geometry, true);
+        if (fd < 0) {
+            return -1;
+        }
+        map = map_striped(opts);
+        if (map == NULL) {
+            stripe_detach();
+            close(fd);
+            return -1;
+        }
+    }
+    disk_map = map;
+    disk_fd = fd;
 
     // Calculate layout for the filesystem
-    size_t num_total_blocks, num_inode_table_blocks, num_data_blocks, num_inode_bitmap_blocks, num_data_bitmap_blocks;
     if (calculate_layout(map, disk_size, max_files, &num_total_blocks, &num_inode_table_blocks, &num_data_blocks, &num_data_bitmap_blocks, &num_inode_bitmap_blocks) < 0) {
         cleanup_disk(map, disk_size, fd);
         return -1;
     }
 
+    // Zero the metadata region and punch out the data region instead of
+    // memsetting the whole image, so a fresh image takes no host space for data
+    memset(map, 0, data_section - map);
+    discard_blocks(1 + num_inode_bitmap_blocks + num_data_bitmap_blocks + num_inode_table_blocks, num_data_blocks);
+
     // Write superblock
     if (write_superblock(map, disk_size, max_files, num_total_blocks, num_inode_table_blocks, num_data_blocks, num_inode_bitmap_blocks, num_data_bitmap_blocks) < 0) {
         cleanup_disk(map, disk_size, fd);
         return -1;
     }
+    sb->stripe_members = geometry.members;
+    sb->stripe_unit_blocks = geometry.unit_blocks;
+    sb->stripe_start = geometry.start;
 
     // Initialize inode table
     if (initialize_inode_table() < 0) {
@@ -88,8 +173,14 @@ int format_disk(const char *disk_name, size_t disk_size, size_t max_files) {
         return -1;
     }
 
-    // Cleanup and return
-    // cleanup_disk(map, disk_size, fd);
+    // Apply mapping hints now that the regions are known
+    if (apply_map_options(opts) < 0) {
+        cleanup_disk(map, disk_size, fd);
+        return -1;
+    }
+
+    // The allocator scans the bitmap if the index can't be built
+    extent_index_build();
     return 0;
 }
 
@@ -123,6 +214,21 @@ int write_superblock(char *disk_map, size_t disk_size, size_t max_files,
     sb->num_max_inodes = max_files;
     sb->num_used_inodes = 0; 
     sb->num_free_blocks = num_data_blocks;
+    sb->refcount_table_block = 0;   // created on demand by the first snapshot
+    sb->num_refcount_blocks = 0;
+    sb->compress_level = 0;
+    sb->tail_packing = 0;
+    memset(sb->frag_blocks, 0, sizeof(sb->frag_blocks));
+    memset(sb->snapshots, 0, sizeof(sb->snapshots));
+    sb->num_base_inodes = max_files;   // the table grows in chunks from here
+    sb->inode_bitmap_block = 0;
+    sb->num_inode_bitmap_ext_blocks = 0;
+    sb->num_inode_chunks = 0;
+    memset(sb->inode_chunks, 0, sizeof(sb->inode_chunks));
+    sb->gen_table_block = 0;    // created by vsfs_track_changes()
+    sb->num_gen_blocks = 0;
+    sb->generation = 0;
+    sb->gen_base = 0;
     
     return 0;
 }
@@ -154,8 +260,8 @@ int initialize_data_bitmap() {
         return -1;
     }
     
-    // Mark block 0 (superblock) and both bitmaps' blocks as used
-    for (size_t i = 0; i < 1 + sb->num_inode_bitmap_blocks + sb->num_data_bitmap_blocks; i++) {
+    // Mark block 0 (superblock), both bitmaps' blocks and the inode table as used
+    for (size_t i = 0; i < 1 + sb->num_inode_bitmap_blocks + sb->num_data_bitmap_blocks + sb->num_inode_table_blocks; i++) {
         // debug
         if (sb->num_total_blocks <= i) {
             printf("debug");
@@ -199,6 +305,8 @@ int create_root_directory() {
     assert(sb->num_used_inodes < sb->num_max_inodes);
 
     inode_t root_inode;
+    memset(&root_inode, 0, sizeof(root_inode));
+    root_inode.mode = S_IFDIR | 0755;
     root_inode.size = 0;
     root_inode.atime = time(NULL);
     root_inode.mtime = time(NULL);
@@ -239,7 +347,7 @@ int calculate_layout(char *disk_map, size_t disk_size, size_t max_files,
     *num_total_blocks = disk_size / BLOCK_SIZE;
     *num_inode_bitmap_blocks = ceildiv(max_files, BLOCK_SIZE * 8);
     *num_data_bitmap_blocks = ceildiv(*num_total_blocks, BLOCK_SIZE * 8);
-    *num_inode_table_blocks = (max_files * INODE_SIZE) / BLOCK_SIZE;
+    *num_inode_table_blocks = ceildiv(max_files * INODE_SIZE, BLOCK_SIZE);
 
     // if superblock, bitmaps, inode table don't fit, then our disk
     // doesn't have enough space to accomodate this number of inodes
@@ -254,6 +362,10 @@ int calculate_layout(char *disk_map, size_t disk_size, size_t max_files,
     assert(*num_inode_bitmap_blocks >= 1);   // at least 1 inode bitmap block
     assert(*num_total_blocks == num_superblock_blocks + *num_inode_bitmap_blocks + *num_data_bitmap_blocks + *num_inode_table_blocks + *num_data_blocks);
 
+    // Only the counts are wanted before the image is mapped
+    if (disk_map == NULL) {
+        return 0;
+    }
     inode_bitmap = disk_map + BLOCK_SIZE;
     data_bitmap = inode_bitmap + *num_inode_bitmap_blocks * BLOCK_SIZE;
     inode_table = data_bitmap + *num_data_bitmap_blocks * BLOCK_SIZE;
@@ -264,6 +376,12 @@ int calculate_layout(char *disk_map, size_t disk_size, size_t max_files,
 
 
 void cleanup_disk(char *disk_map, size_t disk_size, int fd) {
+    // Write cached inodes back while the table is still mapped
+    if (sb != NULL) {
+        icache_writeback();
+    }
+    icache_invalidate();   // pinned inodes stay behind, with a warning
+
     // Unmap the memory-mapped file
     if (disk_map != MAP_FAILED) {
         if (munmap(disk_map, disk_size) == -1) {
@@ -278,10 +396,18 @@ void cleanup_disk(char *disk_map, size_t disk_size, int fd) {
         }
     }
     
+    // Drop in-memory state tied to this image
+    stripe_detach();
+    vsfs_dedup_inline(0);
+    extent_index_free();
+    filemap_reset();
+
     // Clear the global filesystem pointers
     sb = NULL;
     inode_bitmap = NULL;
     data_bitmap = NULL;
     inode_table = NULL;
     data_section = NULL;
+    disk_map = NULL;
+    disk_fd = -1;
 }
\ No newline at end of file
@@ -5,11 +5,31 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+#ifndef MKFS_H
+#define MKFS_H
 
 #define BLOCK_SIZE 4096 // Size of a block in bytes
 #define MAX_FILENAME_LEN 255
 #define MAX_INODES 1024
-#define INODE_SIZE 64
+#define INODE_SIZE 128  // Size of an inode table slot (inode_t must fit)
+#define VSFS_MAX_SNAPSHOTS 8
+#define VSFS_FRAG_HINTS 8     // Fragment blocks the superblock remembers for new tails
+#define VSFS_MAX_INODE_CHUNKS 512   // Inode table chunks the superblock can map
+#define INODE_CHUNK_BLOCKS 8        // Blocks per inode table chunk
+#define INODES_PER_CHUNK (INODE_CHUNK_BLOCKS * BLOCK_SIZE / INODE_SIZE)
+#define VSFS_MAGIC 0x56534653 // "VSFS" in hex
+
+// VSFS snapshot record: copies of the inode bitmap and inode table that
+// share every data block with the live tree through block refcounts
+typedef struct {
+    uint32_t inode_bitmap_block;  // First block of the inode bitmap copy (0 = unused slot)
+    uint32_t inode_table_block;   // First block of the inode table copy
+    uint32_t num_used_inodes;     // Number of used inodes when the snapshot was taken
+    uint32_t num_max_inodes;      // Size of the inode table when the snapshot was taken
+    uint32_t ctime;               // Creation time
+} snapshot_t;
 
 // VSFS Superblock structure
 typedef struct {
@@ -21,9 +41,27 @@ typedef struct {
     uint32_t num_data_blocks;     // Number of blocks used for data
     uint32_t num_data_bitmap_blocks;   // Number of blocks used for data bitmap
     uint32_t num_inode_bitmap_blocks;  // Number of blocks used for inode bitmap
-    uint32_t num_max_inodes;    // Maximum number of files in the filesystem
+    uint32_t num_max_inodes;    // Number of inodes in the table, including its chunks
     uint32_t num_used_inodes; // Number of used inodes
     uint32_t num_free_blocks;     // Number of free data blocks
+    uint32_t refcount_table_block;  // First block of the block refcount table (0 = none)
+    uint32_t num_refcount_blocks;   // Number of blocks used for the refcount table
+    uint32_t compress_level;        // Compression level for new files (0 = off)
+    uint32_t tail_packing;          // Pack small file tails into fragment blocks (0 = off)
+    uint32_t frag_blocks[VSFS_FRAG_HINTS];  // Fragment blocks with room for new tails (0 = none)
+    snapshot_t snapshots[VSFS_MAX_SNAPSHOTS];  // Snapshot records
+    uint32_t num_base_inodes;       // Inodes in the fixed table after the bitmaps (max_files at format)
+    uint32_t inode_bitmap_block;    // First block of the inode bitmap once moved to the data region (0 = not moved)
+    uint32_t num_inode_bitmap_ext_blocks;   // Blocks in the moved inode bitmap
+    uint32_t num_inode_chunks;      // Inode table chunks allocated from the data region
+    uint32_t inode_chunks[VSFS_MAX_INODE_CHUNKS];  // First block of each chunk, in inode order
+    uint32_t stripe_members;        // Backing files the image is striped across (0 = a single file)
+    uint32_t stripe_unit_blocks;    // Blocks per stripe unit
+    uint32_t stripe_start;          // First striped block; those before sit on the first member
+    uint32_t gen_table_block;       // First block of the block generation table (0 = changes not tracked)
+    uint32_t num_gen_blocks;        // Blocks in the generation table, its summary included
+    uint32_t generation;            // Generation blocks written now are stamped with
+    uint32_t gen_base;              // Oldest generation a delta can start from
 } superblock_t;
 
 // VSFS Inode structure
@@ -35,6 +73,12 @@ typedef struct {
     uint32_t nlinks;          // Number of hard links
     uint32_t blocks[12];      // Direct block pointers (12 direct blocks)
     uint32_t indirect;        // Indirect block pointer
+    uint32_t mode;            // File type and permissions (0 = free inode)
+    uint32_t compression;     // Compression level (0 = stored uncompressed)
+    uint32_t cluster_map;     // Block of compressed cluster lengths (0 = none)
+    uint32_t tail_block;      // Fragment block holding the file's tail (0 = none)
+    uint16_t tail_offset;     // Byte offset of the tail in its fragment block
+    uint16_t tail_len;        // Length of the tail (size % BLOCK_SIZE)
 } inode_t;
 
 // VSFS Directory entry structure
@@ -53,8 +97,34 @@ extern char *data_bitmap;
 extern char *inode_table;
 extern char *data_section;
 
+// Backing image of the formatted filesystem
+extern char *disk_map;
+extern int disk_fd;
+
+// Access time policies
+#define VSFS_RELATIME 0       // Update atime only when older than mtime/ctime or a day old
+#define VSFS_STRICTATIME 1    // Update atime on every read
+#define VSFS_NOATIME 2        // Never update atime on reads
+
+// How the image is mapped into memory and how timestamps are kept
+// (NULL = plain shared mapping, relatime)
+typedef struct {
+    bool populate_metadata;   // Prefault superblock, bitmaps and inode table
+    bool huge_pages;          // Align the mapping and request transparent huge pages for metadata
+    int metadata_advice;      // madvise() hint for the metadata region (0 = none)
+    int data_advice;          // madvise() hint for the data region (0 = none)
+    int atime_mode;           // VSFS_RELATIME, VSFS_STRICTATIME or VSFS_NOATIME
+    bool lazytime;            // Keep timestamp-only inode changes in memory
+    uint32_t lazytime_age;    // Seconds before a lazy timestamp is written anyway (0 = one day)
+} map_options_t;
+
 // Function declarations for VSFS formatting
 int format_disk(const char *disk_name, size_t disk_size, size_t max_files);
+int format_disk_opts(const char *disk_name, size_t disk_size, size_t max_files, const map_options_t *opts);
+// Format an image of `disk_size` bytes striped across `ndisks` backing files
+// in units of `stripe_size` bytes (0 = VSFS_STRIPE_DEFAULT)
+int format_disk_striped(const char *const *disk_names, int ndisks, size_t stripe_size, size_t disk_size,
+                        size_t max_files, const map_options_t *opts);
 int write_superblock(char *disk_map, size_t disk_size, size_t max_files, 
                     size_t num_total_blocks, size_t num_inode_table_blocks, size_t num_data_blocks, 
                     size_t num_data_bitmap_blocks, size_t num_inode_bitmap_blocks);
@@ -65,4 +135,6 @@ int create_root_directory();
 int calculate_layout(char *disk_map, size_t disk_size, size_t max_files, 
                     size_t *num_total_blocks, size_t *num_inode_table_blocks, size_t *num_data_blocks, 
                     size_t *num_data_bitmap_blocks, size_t *num_inode_bitmap_blocks);
-void cleanup_disk(char *disk_map, size_t disk_size, int fd);
\ No newline at end of file
+void cleanup_disk(char *disk_map, size_t disk_size, int fd);
+
+#endif // MKFS_H
@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include "mount.h"
+#include "fs.h"
+#include "stats.h"
+#include "icache.h"
+#include "extent.h"
+#include "filemap.h"
+#include "stripe.h"
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23   // Linux 5.14
+#endif
+
+// Map an image file shared and writable, on a huge page boundary if requested.
+// Returns NULL on error.
+char *map_image(int fd, size_t size, const map_options_t *opts) {
+    if (opts == NULL || !opts->huge_pages) {
+        char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            return NULL;
+        }
+        return map;
+    }
+
+    // Reserve enough address space to place the image on a huge page boundary,
+    // map it over the aligned part and give back the rest of the reservation
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t map_len = (size + page - 1) / page * page;
+    size_t span = map_len + HUGE_PAGE_SIZE;
+    char *reserve = mmap(NULL, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserve == MAP_FAILED) {
+        perror("mmap reserve");
+        return NULL;
+    }
+
+    char *aligned = (char *)(((uintptr_t)reserve + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    char *map = mmap(aligned, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        munmap(reserve, span);
+        return NULL;
+    }
+
+    if (aligned > reserve) {
+        munmap(reserve, aligned - reserve);
+    }
+    if (reserve + span > aligned + map_len) {
+        munmap(aligned + map_len, reserve + span - (aligned + map_len));
+    }
+    return map;
+}
+
+// Fault in a range of the mapping writable so later accesses don't trap.
+// Kernels without MADV_POPULATE_WRITE get a read of every page instead.
+static void populate_range(char *start, size_t len) {
+    if (len == 0 || madvise(start, len, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    volatile char sink = 0;
+    for (size_t off = 0; off < len; off += page) {
+        sink ^= ((volatile char *)start)[off];
+    }
+    (void)sink;
+}
+
+// Apply timestamp options, then prefaulting, huge page and access hints to
+// the mapped regions
+int apply_map_options(const map_options_t *opts) {
+    set_time_options(opts != NULL ? opts->atime_mode : VSFS_RELATIME, opts != NULL && opts->lazytime);
+    icache_set_lazy_age(opts != NULL ? opts->lazytime_age : 0);
+    if (opts == NULL) {
+        return 0;
+    }
+
+    size_t meta_len = (size_t)data_region_start() * BLOCK_SIZE;
+    size_t data_len = sb->disk_size - meta_len;
+
+    // Transparent huge pages only take effect where the kernel supports them
+    // for the backing file (tmpfs, or read-only file THP), so failure is not fatal
+    if (opts->huge_pages) {
+        size_t huge_len = (meta_len + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        if (huge_len > sb->disk_size) {
+            huge_len = sb->disk_size;
+        }
+        if (madvise(disk_map, huge_len, MADV_HUGEPAGE) < 0) {
+            perror("apply_map_options: MADV_HUGEPAGE");
+        }
+    }
+
+    if (opts->metadata_advice != 0 && madvise(disk_map, meta_len, opts->metadata_advice) < 0) {
+        perror("apply_map_options: metadata advice");
+        return -1;
+    }
+    if (opts->data_advice != 0 && data_len > 0 && madvise(disk_map + meta_len, data_len, opts->data_advice) < 0) {
+        perror("apply_map_options: data advice");
+        return -1;
+    }
+
+    // The refcount table sits in the data region but is as hot as the bitmaps
+    if (opts->populate_metadata) {
+        populate_range(disk_map, meta_len);
+        if (sb->refcount_table_block != 0) {
+            populate_range(block_ptr(sb->refcount_table_block), (size_t)sb->num_refcount_blocks * BLOCK_SIZE);
+        }
+    }
+
+    return 0;
+}
+
+// Body of mount_disk and mount_disk_striped
+static int mount_image(const char *const *disk_names, int ndisks, const map_options_t *opts) {
+    // Anything cached belongs to the previous image, which is unmounted
+    // first so its mapping, descriptors and pins don't outlive it
+    if (sb != NULL) {
+        icache_writeback();
+    }
+    if (icache_invalidate() < 0 || (sb != NULL && unmount_disk() < 0)) {
+        return -1;
+    }
+
+    const char *disk_name = disk_names[0];
+    int fd = open(disk_name, O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open disk");
+        return -1;
+    }
+
+    superblock_t super;
+    if (pread(fd, &super, sizeof(super), 0) != sizeof(super)) {
+        fprintf(stderr, "mount_disk: failed to read superblock\n");
+        close(fd);
+        return -1;
+    }
+    if (super.magic != VSFS_MAGIC) {
+        fprintf(stderr, "mount_disk: %s is not a VSFS image\n", disk_name);
+        close(fd);
+        return -1;
+    }
+
+    if (ndisks != (super.stripe_members > 1 ? (int)super.stripe_members : 1)) {
+        fprintf(stderr, "mount_disk: %s needs %u backing files, %d given\n", disk_name,
+                super.stripe_members > 1 ? super.stripe_members : 1, ndisks);
+        close(fd);
+        return -1;
+    }
+
+    char *map;
+    if (ndisks == 1) {
+        struct stat st;
+        if (fstat(fd, &st) < 0 || (size_t)st.st_size < super.disk_size) {
+            fprintf(stderr, "mount_disk: image is smaller than its superblock says\n");
+            close(fd);
+            return -1;
+        }
+        map = map_image(fd, super.disk_size, opts);
+    } else {
+        // The first member is opened again with the others
+        close(fd);
+        stripe_geometry_t geometry = {super.stripe_members, super.stripe_unit_blocks, super.stripe_start,
+                                      super.num_total_blocks};
+        fd = stripe_open(disk_names, &geometry, false);
+        if (fd < 0) {
+            return -1;
+        }
+        map = map_striped(opts);
+        if (map == NULL) {
+            stripe_detach();
+        }
+    }
+    if (map == NULL) {
+        close(fd);
+        return -1;
+    }
+    disk_map = map;
+    disk_fd = fd;
+
+    size_t num_total_blocks, num_inode_table_blocks, num_data_blocks, num_data_bitmap_blocks, num_inode_bitmap_blocks;
+    if (calculate_layout(map, super.disk_size, super.num_base_inodes, &num_total_blocks, &num_inode_table_blocks,
+                         &num_data_blocks, &num_data_bitmap_blocks, &num_inode_bitmap_blocks) < 0 ||
+        num_inode_table_blocks != super.num_inode_table_blocks ||
+        num_data_bitmap_blocks != super.num_data_bitmap_blocks ||
+        num_inode_bitmap_blocks != super.num_inode_bitmap_blocks ||
+        super.num_inode_chunks > VSFS_MAX_INODE_CHUNKS ||
+        super.num_max_inodes != super.num_base_inodes + super.num_inode_chunks * INODES_PER_CHUNK ||
+        (ndisks > 1 && super.stripe_start != 1 + num_inode_bitmap_blocks + num_data_bitmap_blocks +
+                                                 num_inode_table_blocks)) {
+        fprintf(stderr, "mount_disk: superblock layout is inconsistent\n");
+        cleanup_disk(map, super.disk_size, fd);
+        return -1;
+    }
+    sb = (superblock_t *)map;
+    if (sb->inode_bitmap_block != 0) {
+        inode_bitmap = block_ptr(sb->inode_bitmap_block);   // outgrew its fixed blocks
+    }
+
+    if (apply_map_options(opts) < 0) {
+        cleanup_disk(map, super.disk_size, fd);
+        return -1;
+    }
+    refcount_reclaim();     // before the index, so it sees the freed blocks
+    extent_index_build();   // the allocator scans the bitmap without it
+    return 0;
+}
+
+// Map an existing image and set up the global filesystem pointers
+int mount_disk(const char *disk_name, const map_options_t *opts) {
+    STATS_START(start);
+    int ret = mount_image(&disk_name, 1, opts);
+    STATS_END(VSFS_OP_MOUNT, start);
+    return ret;
+}
+
+// Map an image striped across `ndisks` backing files, given in stripe order
+int mount_disk_striped(const char *const *disk_names, int ndisks, const map_options_t *opts) {
+    STATS_START(start);
+    int ret = mount_image(disk_names, ndisks, opts);
+    STATS_END(VSFS_OP_MOUNT, start);
+    return ret;
+}
+
+// Flush the image to its backing file and unmap it
+int unmount_disk() {
+    if (sb == NULL) {
+        fprintf(stderr, "unmount_disk: no image mounted\n");
+        return -1;
+    }
+
+    // Spans into the image die with it, so their pins go first
+    size_t disk_size = sb->disk_size;
+    int ret = filemap_unpin_all();
+    if (vsfs_sync() < 0) {
+        ret = -1;
+    }
+    cleanup_disk(disk_map, disk_size, disk_fd);
+    return ret;
+}
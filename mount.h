@@ -0,0 +1,29 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef MOUNT_H
+#define MOUNT_H
+
+#include "mkfs.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Map an image file shared and writable, on a huge page boundary if requested.
+// Returns NULL on error.
+char *map_image(int fd, size_t size, const map_options_t *opts);
+
+// Apply timestamp options, then prefaulting, huge page and access hints to
+// the mapped regions
+int apply_map_options(const map_options_t *opts);
+
+// Map an existing image and set up the global filesystem pointers
+int mount_disk(const char *disk_name, const map_options_t *opts);
+
+// Map an image striped across `ndisks` backing files, given in stripe order
+int mount_disk_striped(const char *const *disk_names, int ndisks, const map_options_t *opts);
+
+// Flush the image to its backing file and unmap it
+int unmount_disk();
+
+#endif // MOUNT_H
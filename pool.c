@@ -0,0 +1,189 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+typedef struct {
+    pool_fn_t fn;
+    void *arg;
+} task_t;
+
+// A growable ring of tasks; the owner takes from the head, thieves from the tail
+typedef struct {
+    pthread_mutex_t lock;
+    task_t *tasks;
+    size_t head;
+    size_t count;
+    size_t cap;
+} deque_t;
+
+typedef struct {
+    pool_t *pool;
+    int id;
+    pthread_t thread;
+} worker_t;
+
+struct pool {
+    int nworkers;
+    worker_t workers[POOL_MAX_WORKERS];
+    deque_t deques[POOL_MAX_WORKERS];
+    atomic_uint next;          // Worker that gets the next outside submission
+    atomic_uint_fast64_t steals;
+
+    // Idle workers sleep until `pending` is nonzero; it only goes up under `lock`
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    atomic_size_t pending;
+    atomic_bool stopping;
+};
+
+static int deque_push(deque_t *dq, task_t task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->cap) {
+        size_t cap = dq->cap == 0 ? 64 : 2 * dq->cap;
+        task_t *grown = malloc(cap * sizeof(task_t));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&dq->lock);
+            fprintf(stderr, "pool_submit: out of memory\n");
+            return -1;
+        }
+        for (size_t i = 0; i < dq->count; i++) {
+            grown[i] = dq->tasks[(dq->head + i) % dq->cap];
+        }
+        free(dq->tasks);
+        dq->tasks = grown;
+        dq->head = 0;
+        dq->cap = cap;
+    }
+    dq->tasks[(dq->head + dq->count) % dq->cap] = task;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+// Take the oldest task (the owner's end) or the newest (a thief's end)
+static bool deque_take(deque_t *dq, bool oldest, task_t *task) {
+    pthread_mutex_lock(&dq->lock);
+    bool found = dq->count > 0;
+    if (found) {
+        if (oldest) {
+            *task = dq->tasks[dq->head];
+            dq->head = (dq->head + 1) % dq->cap;
+        } else {
+            *task = dq->tasks[(dq->head + dq->count - 1) % dq->cap];
+        }
+        dq->count--;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+// Find work for worker `id`: its own deque first, then the others in turn
+static bool find_task(pool_t *pool, int id, task_t *task) {
+    if (deque_take(&pool->deques[id], true, task)) {
+        return true;
+    }
+    for (int i = 1; i < pool->nworkers; i++) {
+        if (deque_take(&pool->deques[(id + i) % pool->nworkers], false, task)) {
+            atomic_fetch_add(&pool->steals, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *worker = arg;
+    pool_t *pool = worker->pool;
+    for (;;) {
+        task_t task;
+        if (find_task(pool, worker->id, &task)) {
+            atomic_fetch_sub(&pool->pending, 1);
+            task.fn(task.arg);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (atomic_load(&pool->pending) == 0 && !atomic_load(&pool->stopping)) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        bool done = atomic_load(&pool->pending) == 0 && atomic_load(&pool->stopping);
+        pthread_mutex_unlock(&pool->lock);
+        if (done) {
+            return NULL;
+        }
+    }
+}
+
+pool_t *pool_create(int nworkers) {
+    if (nworkers < 1 || nworkers > POOL_MAX_WORKERS) {
+        fprintf(stderr, "pool_create: %d workers (1 to %d allowed)\n", nworkers, POOL_MAX_WORKERS);
+        return NULL;
+    }
+    pool_t *pool = calloc(1, sizeof(pool_t));
+    if (pool == NULL) {
+        fprintf(stderr, "pool_create: out of memory\n");
+        return NULL;
+    }
+    pool->nworkers = nworkers;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    for (int i = 0; i < POOL_MAX_WORKERS; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0) {
+            fprintf(stderr, "pool_create: failed to start worker %d\n", i);
+            pool->nworkers = i;
+            pool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+int pool_submit(pool_t *pool, pool_fn_t fn, void *arg) {
+    if (atomic_load(&pool->stopping)) {
+        fprintf(stderr, "pool_submit: pool is shutting down\n");
+        return -1;
+    }
+
+    // Count the task before it can be taken, so `pending` never goes negative
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->pending, 1);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    unsigned id = atomic_fetch_add(&pool->next, 1) % pool->nworkers;
+    task_t task = {fn, arg};
+    if (deque_push(&pool->deques[id], task) < 0) {
+        atomic_fetch_sub(&pool->pending, 1);
+        return -1;
+    }
+    return 0;
+}
+
+void pool_destroy(pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->stopping, true);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->nworkers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (int i = 0; i < POOL_MAX_WORKERS; i++) {
+        free(pool->deques[i].tasks);
+        pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool);
+}
+
+uint64_t pool_steals(pool_t *pool) {
+    return atomic_load(&pool->steals);
+}
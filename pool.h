@@ -0,0 +1,32 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Work-stealing thread pool. Every worker owns a deque of tasks and takes
+// the oldest one from its own deque first; a worker with nothing left steals
+// the newest task of another worker. Tasks submitted from outside the pool
+// are dealt to the workers round robin.
+#define POOL_MAX_WORKERS 64
+
+typedef void (*pool_fn_t)(void *arg);
+typedef struct pool pool_t;
+
+// Start `nworkers` workers (NULL on error)
+pool_t *pool_create(int nworkers);
+
+// Queue a task; returns -1 if the pool is shutting down or out of memory
+int pool_submit(pool_t *pool, pool_fn_t fn, void *arg);
+
+// Run every queued task, then stop the workers and free the pool
+void pool_destroy(pool_t *pool);
+
+// Number of tasks taken from another worker's deque so far
+uint64_t pool_steals(pool_t *pool);
+
+#endif // POOL_H
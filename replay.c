@@ -0,0 +1,501 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include "fs.h"
+#include "mkfs.h"
+#include "mount.h"
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Replays a trace against a freshly formatted image. Calls are split between
+// threads by the file they act on, so each file's calls keep their recorded
+// order; a call that also depends on another file (a create in a directory
+// made during the trace, or a name last used by another file) waits for that
+// call first. Files the trace uses without creating them existed before
+// recording began, so they are made up front and filled as far as they were
+// read. The library isn't thread-safe, so the calls themselves run one at a
+// time under a lock; the threads let independent files keep their own timing
+// and queue behind each other as they would have when recorded.
+#define NO_FILE UINT32_MAX
+#define NO_INODE UINT32_MAX
+
+typedef struct {
+    const char *trace;
+    const char *image;
+    size_t size_mib;
+    size_t max_files;
+    int threads;
+    bool original_timing;
+    double speed;
+} replay_config_t;
+
+// A file as the trace sees it; one inode number may be several files over
+// a trace if it is freed and reused
+typedef struct {
+    uint32_t ino;             // Inode in the replay image, once it exists
+    uint32_t orig_ino;        // Inode when recorded (NO_INODE if never seen)
+    uint32_t parent;          // File of the directory holding its name, if known
+    uint32_t name_hash;
+    bool named;
+    bool dir;
+    bool preexisting;         // Must be made before the replay starts
+    uint64_t size;            // Bytes to fill a pre-existing file with
+    ssize_t created_by;       // Step that creates it (-1 if none)
+} file_t;
+
+// A record ready to replay
+typedef struct {
+    vsfs_trace_record_t rec;
+    uint32_t file;            // File acted on, which picks the thread
+    uint32_t parent;          // Directory for name operations
+    ssize_t after;            // Step to wait for first (-1 if none)
+    uint64_t latency_ns;
+    bool mismatch;            // Result differs from the recorded one
+} step_t;
+
+// Last use of a name: (directory file, name hash) -> file and step
+typedef struct {
+    uint64_t key;
+    uint32_t file;
+    ssize_t last_step;
+    bool used;
+} name_slot_t;
+
+typedef struct {
+    int id;
+    size_t *steps;
+    size_t nsteps;
+    char *buf;
+} replayer_t;
+
+static replay_config_t config;
+static file_t *files;
+static size_t nfiles, files_cap;
+static step_t *steps;
+static size_t nsteps;
+static uint8_t *done;
+static name_slot_t *names;
+static size_t names_cap;
+static uint32_t max_len;
+static char *write_buf;
+static uint64_t replay_start;
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t new_file(uint32_t orig_ino, bool preexisting) {
+    if (nfiles == files_cap) {
+        files_cap = files_cap == 0 ? 1024 : 2 * files_cap;
+        file_t *grown = realloc(files, files_cap * sizeof(file_t));
+        if (grown == NULL) {
+            fprintf(stderr, "vsfs_replay: out of memory\n");
+            exit(1);
+        }
+        files = grown;
+    }
+    files[nfiles] = (file_t){.ino = NO_INODE, .orig_ino = orig_ino, .parent = NO_FILE, .preexisting = preexisting,
+                             .created_by = -1};
+    return nfiles++;
+}
+
+static name_slot_t *name_slot(uint32_t dir, uint32_t hash) {
+    uint64_t key = (uint64_t)dir << 32 | hash;
+    size_t i = (key * 0x9E3779B97F4A7C15ULL) >> 20 & (names_cap - 1);
+    while (names[i].used && names[i].key != key) {
+        i = (i + 1) & (names_cap - 1);
+    }
+    if (!names[i].used) {
+        names[i] = (name_slot_t){.key = key, .file = NO_FILE, .last_step = -1, .used = true};
+    }
+    return &names[i];
+}
+
+static ssize_t latest(ssize_t a, ssize_t b) {
+    return a > b ? a : b;
+}
+
+// Work out, in recorded order, which file each call acts on and what it must
+// wait for. `current` maps recorded inode numbers to the files holding them.
+static int prepare(vsfs_trace_record_t *records, size_t n) {
+    uint32_t max_ino = 0;
+    for (size_t i = 0; i < n; i++) {
+        max_ino = records[i].ino > max_ino ? records[i].ino : max_ino;
+        if ((records[i].op == VSFS_OP_CREATE || records[i].op == VSFS_OP_LOOKUP) && records[i].result > 0) {
+            max_ino = (uint32_t)records[i].result > max_ino ? (uint32_t)records[i].result : max_ino;
+        }
+        if (records[i].op == VSFS_OP_READ || records[i].op == VSFS_OP_WRITE) {
+            max_len = records[i].len > max_len ? records[i].len : max_len;
+        }
+    }
+    uint32_t *current = malloc(((size_t)max_ino + 1) * sizeof(uint32_t));
+    steps = calloc(n > 0 ? n : 1, sizeof(step_t));
+    done = calloc(n > 0 ? n : 1, 1);
+    for (names_cap = 1024; names_cap < 2 * n; names_cap *= 2) {
+    }
+    names = calloc(names_cap, sizeof(name_slot_t));
+    if (current == NULL || steps == NULL || done == NULL || names == NULL) {
+        fprintf(stderr, "vsfs_replay: out of memory\n");
+        return -1;
+    }
+    for (uint32_t ino = 0; ino <= max_ino; ino++) {
+        current[ino] = NO_FILE;
+    }
+    current[ROOT_INODE] = new_file(ROOT_INODE, false);
+    files[current[ROOT_INODE]].ino = ROOT_INODE;
+    files[current[ROOT_INODE]].dir = true;
+
+    for (size_t i = 0; i < n; i++) {
+        vsfs_trace_record_t *rec = &records[i];
+        step_t *step = &steps[i];
+        *step = (step_t){.rec = *rec, .file = NO_FILE, .parent = NO_FILE, .after = -1};
+        bool ok = rec->result >= 0;
+
+        if (rec->op == VSFS_OP_CREATE || rec->op == VSFS_OP_LOOKUP || rec->op == VSFS_OP_UNLINK) {
+            if (current[rec->ino] == NO_FILE) {
+                current[rec->ino] = new_file(rec->ino, true);
+            }
+            uint32_t dir = current[rec->ino];
+            files[dir].dir = true;
+            name_slot_t *slot = name_slot(dir, rec->name_hash);
+            step->parent = dir;
+            step->file = dir;
+            step->after = latest(files[dir].created_by, slot->last_step);
+
+            if (rec->op == VSFS_OP_CREATE && ok) {
+                uint32_t f = new_file(rec->result, false);
+                files[f].created_by = i;
+                files[f].dir = S_ISDIR(rec->mode);
+                current[rec->result] = f;
+                slot->file = f;
+                step->file = f;
+            } else if (rec->op == VSFS_OP_LOOKUP && ok) {
+                uint32_t f = current[rec->result];
+                if (f == NO_FILE) {
+                    f = current[rec->result] = new_file(rec->result, true);
+                }
+                if (files[f].preexisting && !files[f].named) {
+                    files[f].parent = dir;
+                    files[f].name_hash = rec->name_hash;
+                    files[f].named = true;
+                }
+                slot->file = f;
+                step->file = f;
+            } else if (rec->op == VSFS_OP_UNLINK && ok) {
+                uint32_t f = slot->file;
+                if (f == NO_FILE) {
+                    f = new_file(NO_INODE, true);
+                    files[f].parent = dir;
+                    files[f].name_hash = rec->name_hash;
+                    files[f].named = true;
+                }
+                if (files[f].orig_ino != NO_INODE && current[files[f].orig_ino] == f) {
+                    current[files[f].orig_ino] = NO_FILE;
+                }
+                slot->file = NO_FILE;
+                step->file = f;
+            }
+            slot->last_step = i;
+        } else if (rec->op == VSFS_OP_FSYNC) {
+            step->file = current[ROOT_INODE];
+        } else {
+            uint32_t f = rec->ino <= max_ino ? current[rec->ino] : NO_FILE;
+            if (f == NO_FILE && ok) {
+                f = current[rec->ino] = new_file(rec->ino, true);
+            } else if (f == NO_FILE) {
+                f = new_file(rec->ino, false);     // Never existed; the call fails again
+            }
+            if (files[f].preexisting && rec->op == VSFS_OP_READ && ok &&
+                rec->offset + rec->result > files[f].size) {
+                files[f].size = rec->offset + rec->result;
+            }
+            step->file = f;
+        }
+    }
+    nsteps = n;
+    free(current);
+    return 0;
+}
+
+// Make a file that existed before the trace, and its directory first
+static int materialize(uint32_t f) {
+    file_t *file = &files[f];
+    if (file->ino != NO_INODE || !file->preexisting) {
+        return 0;
+    }
+    uint32_t parent = file->named ? file->parent : 0;
+    if (materialize(parent) < 0) {
+        return -1;
+    }
+    char name[32];
+    if (file->named) {
+        snprintf(name, sizeof(name), "f%08x", file->name_hash);
+    } else {
+        snprintf(name, sizeof(name), "i%u", file->orig_ino);
+    }
+    int ino = vsfs_create(files[parent].ino, name, file->dir ? S_IFDIR | 0755 : S_IFREG | 0644);
+    if (ino < 0) {
+        fprintf(stderr, "vsfs_replay: failed to make %s, which existed before the trace\n", name);
+        return -1;
+    }
+    file->ino = ino;
+    char chunk[BLOCK_SIZE * 16];
+    memset(chunk, 'p', sizeof(chunk));
+    for (uint64_t off = 0; off < file->size; off += sizeof(chunk)) {
+        size_t len = file->size - off < sizeof(chunk) ? file->size - off : sizeof(chunk);
+        if (vsfs_write(ino, off, chunk, len) != (ssize_t)len) {
+            fprintf(stderr, "vsfs_replay: failed to fill %s\n", name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t file_ino(uint32_t f) {
+    return __atomic_load_n(&files[f].ino, __ATOMIC_ACQUIRE);
+}
+
+// Run one step; returns the result to compare with the recorded one
+static int64_t execute(step_t *step, char *buf) {
+    vsfs_trace_record_t *rec = &step->rec;
+    char name[32];
+    snprintf(name, sizeof(name), "f%08x", rec->name_hash);
+    inode_t inode;
+    int64_t ret = -1;
+
+    pthread_mutex_lock(&fs_lock);
+    switch (rec->op) {
+    case VSFS_OP_CREATE:
+        ret = vsfs_create(file_ino(step->parent), name, rec->mode);
+        if (ret >= 0 && step->file != step->parent) {
+            __atomic_store_n(&files[step->file].ino, (uint32_t)ret, __ATOMIC_RELEASE);
+        }
+        break;
+    case VSFS_OP_LOOKUP:
+        ret = vsfs_lookup(file_ino(step->parent), name);
+        break;
+    case VSFS_OP_UNLINK:
+        ret = vsfs_unlink(file_ino(step->parent), name);
+        break;
+    case VSFS_OP_READ:
+        ret = vsfs_read(file_ino(step->file), rec->offset, buf, rec->len);
+        break;
+    case VSFS_OP_WRITE:
+        ret = vsfs_write(file_ino(step->file), rec->offset, write_buf, rec->len);
+        break;
+    case VSFS_OP_TRUNCATE:
+        ret = vsfs_truncate(file_ino(step->file), rec->offset);
+        break;
+    case VSFS_OP_STAT:
+        ret = vsfs_stat(file_ino(step->file), &inode);
+        break;
+    case VSFS_OP_FSYNC:
+        ret = vsfs_sync();
+        break;
+    default:
+        fprintf(stderr, "vsfs_replay: unknown operation %u\n", rec->op);
+        break;
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return ret;
+}
+
+static void *replayer_main(void *arg) {
+    replayer_t *replayer = arg;
+    for (size_t k = 0; k < replayer->nsteps; k++) {
+        step_t *step = &steps[replayer->steps[k]];
+        if (config.original_timing) {
+            uint64_t due = replay_start + (uint64_t)(step->rec.time_ns / config.speed);
+            struct timespec ts = {due / 1000000000ULL, due % 1000000000ULL};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+            }
+        }
+
+        // Latency runs from when the call is due, so waiting for the calls it
+        // depends on and for the lock counts, as it would for a real client
+        uint64_t begin = trace_clock();
+        if (step->after >= 0) {
+            while (!__atomic_load_n(&done[step->after], __ATOMIC_ACQUIRE)) {
+                sched_yield();
+            }
+        }
+        int64_t ret = execute(step, replayer->buf);
+        step->latency_ns = trace_clock() - begin;
+        bool sized = step->rec.op == VSFS_OP_READ || step->rec.op == VSFS_OP_WRITE;
+        step->mismatch = sized ? ret != step->rec.result : (ret < 0) != (step->rec.result < 0);
+        __atomic_store_n(&done[replayer->steps[k]], 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+static double percentile(const uint64_t *sorted, size_t n, double pct) {
+    size_t rank = (size_t)(pct / 100.0 * n + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[(rank > n ? n : rank) - 1];
+}
+
+// One line of the report for the steps of `op`, or all of them if op < 0
+static void report_line(const char *label, int op, uint64_t *scratch) {
+    size_t n = 0, mismatched = 0;
+    for (size_t i = 0; i < nsteps; i++) {
+        if (op < 0 || steps[i].rec.op == op) {
+            scratch[n++] = steps[i].latency_ns;
+            mismatched += steps[i].mismatch;
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+    qsort(scratch, n, sizeof(uint64_t), compare_u64);
+    printf("  %-10s %10zu %10zu %10.1f %10.1f %10.1f %10.1f\n", label, n, mismatched,
+           percentile(scratch, n, 50) / 1e3, percentile(scratch, n, 99) / 1e3, percentile(scratch, n, 99.9) / 1e3,
+           scratch[n - 1] / 1e3);
+}
+
+static int replay() {
+    replayer_t *replayers = calloc(config.threads, sizeof(replayer_t));
+    pthread_t *threads = malloc(config.threads * sizeof(pthread_t));
+    write_buf = malloc(max_len > 0 ? max_len : 1);
+    if (replayers == NULL || threads == NULL || write_buf == NULL) {
+        fprintf(stderr, "vsfs_replay: out of memory\n");
+        return -1;
+    }
+    memset(write_buf, 'r', max_len);
+    for (size_t i = 0; i < nsteps; i++) {
+        replayers[steps[i].file % config.threads].nsteps++;
+    }
+    for (int t = 0; t < config.threads; t++) {
+        replayers[t].id = t;
+        replayers[t].steps = malloc((replayers[t].nsteps > 0 ? replayers[t].nsteps : 1) * sizeof(size_t));
+        replayers[t].buf = malloc(max_len > 0 ? max_len : 1);
+        if (replayers[t].steps == NULL || replayers[t].buf == NULL) {
+            fprintf(stderr, "vsfs_replay: out of memory\n");
+            return -1;
+        }
+        replayers[t].nsteps = 0;
+    }
+    for (size_t i = 0; i < nsteps; i++) {
+        replayer_t *replayer = &replayers[steps[i].file % config.threads];
+        replayer->steps[replayer->nsteps++] = i;
+    }
+
+    replay_start = trace_clock() + 1000000;
+    for (int t = 0; t < config.threads; t++) {
+        pthread_create(&threads[t], NULL, replayer_main, &replayers[t]);
+    }
+    for (int t = 0; t < config.threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    double elapsed = (trace_clock() - replay_start) / 1e9;
+    double recorded = nsteps > 0 ? steps[nsteps - 1].rec.time_ns / 1e9 : 0;
+
+    printf("  %-10s %10s %10s %10s %10s %10s %10s\n", "op", "calls", "mismatched", "p50 us", "p99 us", "p99.9 us",
+           "max us");
+    uint64_t *scratch = malloc((nsteps > 0 ? nsteps : 1) * sizeof(uint64_t));
+    if (scratch == NULL) {
+        fprintf(stderr, "vsfs_replay: out of memory\n");
+        return -1;
+    }
+    for (int op = 0; op < VSFS_NUM_OPS; op++) {
+        report_line(vsfs_op_name(op), op, scratch);
+    }
+    report_line("total", -1, scratch);
+    printf("\n  %zu calls in %.3f s: %.1f ops/s (recorded over %.3f s)\n", nsteps, elapsed,
+           elapsed > 0 ? nsteps / elapsed : 0, recorded);
+
+    free(scratch);
+    for (int t = 0; t < config.threads; t++) {
+        free(replayers[t].steps);
+        free(replayers[t].buf);
+    }
+    free(replayers);
+    free(threads);
+    free(write_buf);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s TRACE [--image PATH] [--size MIB] [--max-files N] [--threads N] [--timing fast|original] "
+            "[--speed X]\n",
+            prog);
+}
+
+// Parse the command line into `config`; returns -1 on bad arguments
+static int parse_args(int argc, char **argv) {
+    config = (replay_config_t){.image = "replay.img", .size_mib = 256, .max_files = MAX_INODES, .threads = 1,
+                               .speed = 1.0};
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (argv[i][0] != '-') {
+            if (config.trace != NULL) {
+                return -1;
+            }
+            config.trace = argv[i];
+            continue;
+        }
+        if (value == NULL) {
+            return -1;
+        }
+        i++;
+        if (strcmp(argv[i - 1], "--image") == 0) {
+            config.image = value;
+        } else if (strcmp(argv[i - 1], "--size") == 0) {
+            config.size_mib = strtoul(value, NULL, 0);
+        } else if (strcmp(argv[i - 1], "--max-files") == 0) {
+            config.max_files = strtoul(value, NULL, 0);
+        } else if (strcmp(argv[i - 1], "--threads") == 0) {
+            config.threads = atoi(value);
+        } else if (strcmp(argv[i - 1], "--timing") == 0 && strcmp(value, "fast") == 0) {
+            config.original_timing = false;
+        } else if (strcmp(argv[i - 1], "--timing") == 0 && strcmp(value, "original") == 0) {
+            config.original_timing = true;
+        } else if (strcmp(argv[i - 1], "--speed") == 0) {
+            config.speed = atof(value);
+        } else {
+            return -1;
+        }
+    }
+    return config.trace != NULL && config.threads > 0 && config.speed > 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv) < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    vsfs_trace_record_t *records;
+    ssize_t n = vsfs_trace_load(config.trace, &records);
+    if (n < 0 || prepare(records, n) < 0) {
+        return 1;
+    }
+    free(records);
+    if (format_disk(config.image, config.size_mib * 1024 * 1024, config.max_files) < 0) {
+        return 1;
+    }
+    size_t made = 0;
+    for (uint32_t f = 0; f < nfiles; f++) {
+        made += files[f].preexisting;
+        if (materialize(f) < 0) {
+            unmount_disk();
+            return 1;
+        }
+    }
+
+    printf("=== Replay of %s: %zu calls, %zu files made beforehand, %d threads, %s timing ===\n\n", config.trace,
+           nsteps, made, config.threads, config.original_timing ? "original" : "fast");
+    int ret = replay();
+    if (unmount_disk() < 0) {
+        ret = -1;
+    }
+    return ret < 0 ? 1 : 0;
+}
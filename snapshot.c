@@ -0,0 +1,265 @@
+#include "snapshot.h"
+#include "icache.h"
+#include "helpers.h"
+#include "delta.h"
+#include <time.h>
+
+// A snapshot is a copy of the inode bitmap and inode table. Taking one adds a
+// reference to every block the copied inodes point at directly; blocks behind
+// an indirect block are reached through it and keep their own counts until
+// the indirect block is copied on write. Creation therefore touches metadata
+// only, and later writes copy just the blocks they modify. The table copy is
+// contiguous: the fixed table followed by each chunk the table had then.
+
+// Look up a snapshot record by id
+static snapshot_t *get_snapshot(int id) {
+    if (id < 0 || id >= VSFS_MAX_SNAPSHOTS || sb->snapshots[id].inode_bitmap_block == 0) {
+        fprintf(stderr, "snapshot: no snapshot with id %d\n", id);
+        return NULL;
+    }
+    return &sb->snapshots[id];
+}
+
+// Number of inode chunks in a table of `max` inodes
+static uint32_t table_chunks(uint32_t max) {
+    return (max - sb->num_base_inodes) / INODES_PER_CHUNK;
+}
+
+// Number of blocks in the bitmap and table copies of a table of `max` inodes
+static size_t bitmap_copy_blocks(uint32_t max) {
+    return ceildiv(max, BLOCK_SIZE * 8);
+}
+
+static size_t table_copy_blocks(uint32_t max) {
+    return sb->num_inode_table_blocks + (size_t)table_chunks(max) * INODE_CHUNK_BLOCKS;
+}
+
+// Number of blocks holding a snapshot's metadata copy
+static size_t snapshot_blocks(uint32_t max) {
+    return bitmap_copy_blocks(max) + table_copy_blocks(max);
+}
+
+// Slot of an inode in a table copy, or in the live table if `itable` is NULL
+static char *table_slot(char *itable, uint32_t ino) {
+    if (itable == NULL) {
+        return inode_slot(ino);
+    }
+    if (ino < sb->num_base_inodes) {
+        return itable + (size_t)ino * INODE_SIZE;
+    }
+    return itable + (size_t)sb->num_inode_table_blocks * BLOCK_SIZE + (size_t)(ino - sb->num_base_inodes) * INODE_SIZE;
+}
+
+// Copy the first `max` inodes of the live table into a table copy, or back
+// out of it when `save` is false
+static void copy_table(char *itable, uint32_t max, bool save) {
+    size_t len = (size_t)sb->num_inode_table_blocks * BLOCK_SIZE;
+    memcpy(save ? itable : inode_table, save ? inode_table : itable, len);
+    delta_mark_ptr(save ? itable : inode_table, len);
+    for (uint32_t c = 0; c < table_chunks(max); c++) {
+        char *live = block_ptr(sb->inode_chunks[c]);
+        char *copy = itable + len + (size_t)c * INODE_CHUNK_BLOCKS * BLOCK_SIZE;
+        memcpy(save ? copy : live, save ? live : copy, INODE_CHUNK_BLOCKS * BLOCK_SIZE);
+        delta_mark_ptr(save ? copy : live, INODE_CHUNK_BLOCKS * BLOCK_SIZE);
+    }
+}
+
+// The blocks an inode points at directly, which a snapshot of it references.
+// Returns how many were stored in `refs`.
+static size_t inode_refs(const inode_t *inode, uint32_t refs[NUM_DIRECT_BLOCKS + 3]) {
+    size_t n = 0;
+    for (int i = 0; i < NUM_DIRECT_BLOCKS; i++) {
+        if (inode->blocks[i] != 0) {
+            refs[n++] = inode->blocks[i];
+        }
+    }
+    uint32_t others[] = {inode->indirect, inode->cluster_map, inode->tail_block};
+    for (size_t i = 0; i < sizeof(others) / sizeof(others[0]); i++) {
+        if (others[i] != 0) {
+            refs[n++] = others[i];
+        }
+    }
+    return n;
+}
+
+// Drop the first `count` references ref_tree took for a table
+static void unref_tree(char *ibm, char *itable, uint32_t max, size_t count) {
+    for (uint32_t ino = 0; ino < max && count > 0; ino++) {
+        if (bitmapget(ibm, max, ino) != 1) {
+            continue;
+        }
+
+        inode_t inode;
+        memcpy(&inode, table_slot(itable, ino), sizeof(inode_t));
+        uint32_t refs[NUM_DIRECT_BLOCKS + 3];
+        size_t n = inode_refs(&inode, refs);
+        n = n < count ? n : count;
+        free_data_blocks(refs, n);   // the live tree still holds each of them
+        count -= n;
+    }
+}
+
+// Add a reference to each block pointed at by the first `max` inodes of a
+// table. On failure the references already taken are dropped again.
+static int ref_tree(char *ibm, char *itable, uint32_t max) {
+    size_t taken = 0;
+    for (uint32_t ino = 0; ino < max; ino++) {
+        if (bitmapget(ibm, max, ino) != 1) {
+            continue;
+        }
+
+        inode_t inode;
+        memcpy(&inode, table_slot(itable, ino), sizeof(inode_t));
+        uint32_t refs[NUM_DIRECT_BLOCKS + 3];
+        size_t n = inode_refs(&inode, refs);
+        for (size_t i = 0; i < n; i++) {
+            if (block_ref(refs[i]) < 0) {
+                unref_tree(ibm, itable, max, taken);
+                return -1;
+            }
+            taken++;
+        }
+    }
+    return 0;
+}
+
+// Drop the references held by an inode table, freeing blocks nobody else uses
+static int release_tree(char *ibm, char *itable, uint32_t max) {
+    for (uint32_t ino = 0; ino < max; ino++) {
+        if (bitmapget(ibm, max, ino) != 1) {
+            continue;
+        }
+
+        inode_t inode;
+        memcpy(&inode, table_slot(itable, ino), sizeof(inode_t));
+        if (inode_truncate(&inode, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Free the blocks holding a metadata copy of a table of `max` inodes
+static int free_snapshot_blocks(uint32_t start, uint32_t max) {
+    size_t nblocks = snapshot_blocks(max);
+    uint32_t *blocks = malloc(nblocks * sizeof(uint32_t));
+    if (blocks == NULL) {
+        fprintf(stderr, "free_snapshot_blocks: out of memory\n");
+        return -1;
+    }
+    for (size_t i = 0; i < nblocks; i++) {
+        blocks[i] = start + i;
+    }
+    int ret = free_data_blocks(blocks, nblocks);
+    free(blocks);
+    return ret;
+}
+
+// Take a snapshot of the live tree; returns its id (-1 on error)
+int vsfs_snapshot_create() {
+    int id = -1;
+    for (int i = 0; i < VSFS_MAX_SNAPSHOTS && id < 0; i++) {
+        if (sb->snapshots[i].inode_bitmap_block == 0) {
+            id = i;
+        }
+    }
+    if (id < 0) {
+        fprintf(stderr, "vsfs_snapshot_create: all %d snapshot slots in use\n", VSFS_MAX_SNAPSHOTS);
+        return -1;
+    }
+
+    if (refcount_init() < 0) {
+        return -1;
+    }
+
+    uint32_t max = sb->num_max_inodes;
+    int start = alloc_data_extent(snapshot_blocks(max));
+    if (start < 0) {
+        return -1;
+    }
+    char *ibm = block_ptr(start);
+    char *itable = block_ptr(start + bitmap_copy_blocks(max));
+    icache_writeback();
+    memcpy(ibm, inode_bitmap, bitmap_copy_blocks(max) * BLOCK_SIZE);
+    copy_table(itable, max, true);
+
+    if (ref_tree(ibm, itable, max) < 0) {
+        free_snapshot_blocks(start, max);
+        return -1;
+    }
+
+    snapshot_t *snap = &sb->snapshots[id];
+    snap->inode_bitmap_block = start;
+    snap->inode_table_block = start + bitmap_copy_blocks(max);
+    snap->num_used_inodes = sb->num_used_inodes;
+    snap->num_max_inodes = max;
+    snap->ctime = time(NULL);
+    return id;
+}
+
+// Delete a snapshot, freeing the blocks only it references
+int vsfs_snapshot_delete(int id) {
+    snapshot_t *snap = get_snapshot(id);
+    if (snap == NULL) {
+        return -1;
+    }
+
+    if (release_tree(block_ptr(snap->inode_bitmap_block), block_ptr(snap->inode_table_block), snap->num_max_inodes) < 0) {
+        return -1;
+    }
+
+    int ret = free_snapshot_blocks(snap->inode_bitmap_block, snap->num_max_inodes);
+    memset(snap, 0, sizeof(snapshot_t));
+    return ret;
+}
+
+// Replace the live tree with the contents of a snapshot (the snapshot is kept)
+int vsfs_snapshot_rollback(int id) {
+    snapshot_t *snap = get_snapshot(id);
+    if (snap == NULL) {
+        return -1;
+    }
+
+    // The cached inodes describe the tree being replaced
+    icache_writeback();
+    if (icache_invalidate() < 0 || release_tree(inode_bitmap, NULL, sb->num_max_inodes) < 0) {
+        return -1;
+    }
+
+    uint32_t max = snap->num_max_inodes;
+    memcpy(inode_bitmap, block_ptr(snap->inode_bitmap_block), bitmap_copy_blocks(max) * BLOCK_SIZE);
+    delta_mark_ptr(inode_bitmap, bitmap_copy_blocks(max) * BLOCK_SIZE);
+    copy_table(block_ptr(snap->inode_table_block), max, false);
+    sb->num_used_inodes = snap->num_used_inodes;
+
+    // Chunks added since the snapshot stay allocated, but empty
+    for (uint32_t ino = max; ino < sb->num_max_inodes; ino++) {
+        bitmapset(inode_bitmap, sb->num_max_inodes, ino, false);
+    }
+    if (sb->num_max_inodes > max) {
+        delta_mark_ptr(&inode_bitmap[max / 8], ceildiv(sb->num_max_inodes, 8) - max / 8);
+    }
+    for (uint32_t c = table_chunks(max); c < sb->num_inode_chunks; c++) {
+        memset(block_ptr(sb->inode_chunks[c]), 0, INODE_CHUNK_BLOCKS * BLOCK_SIZE);
+        delta_mark(sb->inode_chunks[c], INODE_CHUNK_BLOCKS);
+    }
+
+    return ref_tree(inode_bitmap, NULL, sb->num_max_inodes);
+}
+
+// Read from a file as it was when the snapshot was taken
+ssize_t vsfs_snapshot_read(int id, uint32_t ino, size_t offset, void *buf, size_t len) {
+    snapshot_t *snap = get_snapshot(id);
+    if (snap == NULL) {
+        return -1;
+    }
+
+    if (ino >= snap->num_max_inodes || bitmapget(block_ptr(snap->inode_bitmap_block), snap->num_max_inodes, ino) != 1) {
+        fprintf(stderr, "vsfs_snapshot_read: inode %u not in snapshot %d\n", ino, id);
+        return -1;
+    }
+
+    inode_t inode;
+    memcpy(&inode, table_slot(block_ptr(snap->inode_table_block), ino), sizeof(inode_t));
+    return inode_read(&inode, offset, buf, len);
+}
@@ -0,0 +1,24 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "fs.h"
+
+// Take a snapshot of the live tree; returns its id (-1 on error)
+int vsfs_snapshot_create();
+
+// Delete a snapshot, freeing the blocks only it references
+int vsfs_snapshot_delete(int id);
+
+// Replace the live tree with the contents of a snapshot (the snapshot is kept)
+int vsfs_snapshot_rollback(int id);
+
+// Read from a file as it was when the snapshot was taken
+ssize_t vsfs_snapshot_read(int id, uint32_t ino, size_t offset, void *buf, size_t len);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+#include "stats.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/resource.h>
+
+static const char *op_names[VSFS_NUM_OPS] = {
+    "format", "mount", "fsync", "alloc", "free", "create",
+    "lookup", "unlink", "read", "write", "truncate", "stat",
+    "create_batch", "unlink_batch", "readdir_plus", "map_file",
+};
+
+static const char *counter_names[VSFS_NUM_COUNTERS] = {
+    "bytes_read", "bytes_written", "blocks_allocated", "blocks_freed",
+    "icache_misses", "inode_writebacks", "inode_chunks",
+};
+
+const char *vsfs_op_name(vsfs_op_t op) {
+    return op < VSFS_NUM_OPS ? op_names[op] : "unknown";
+}
+
+const char *vsfs_counter_name(vsfs_counter_t counter) {
+    return counter < VSFS_NUM_COUNTERS ? counter_names[counter] : "unknown";
+}
+
+// Upper bound of the bucket holding the `pct` percentile (0 if empty)
+uint64_t histogram_percentile(const vsfs_histogram_t *hist, double pct) {
+    if (hist->sampled == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(pct / 100.0 * hist->sampled + 0.5);
+    rank = rank == 0 ? 1 : rank;
+    uint64_t seen = 0;
+    for (int b = 0; b < VSFS_HIST_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if (seen >= rank) {
+            uint64_t bound = b == 0 ? 0 : (b == 63 ? UINT64_MAX : (1ULL << b) - 1);
+            return bound < hist->max ? bound : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+#ifdef VSFS_STATS
+
+// Each thread records into its own block with plain relaxed stores, so the
+// hot path takes no lock and shares no cache lines; readers merge the blocks
+typedef struct thread_stats {
+    vsfs_stats_t stats;
+    struct thread_stats *next;
+} thread_stats_t;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_stats_t *registry;
+static _Thread_local thread_stats_t *local_stats;
+static long base_minor_faults, base_major_faults;
+static unsigned sample_every = 4;
+static _Thread_local unsigned sample_countdown;
+
+static thread_stats_t *my_stats() {
+    if (local_stats == NULL) {
+        // Blocks are never freed so that counts outlive their thread
+        thread_stats_t *block = calloc(1, sizeof(thread_stats_t));
+        if (block == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&registry_lock);
+        block->next = registry;
+        registry = block;
+        pthread_mutex_unlock(&registry_lock);
+        local_stats = block;
+    }
+    return local_stats;
+}
+
+// Only the owning thread writes its block, so a load and a relaxed store
+// suffice; the atomic store just keeps concurrent readers well-defined
+static inline void bump(uint64_t *field, uint64_t n) {
+    __atomic_store_n(field, *field + n, __ATOMIC_RELAXED);
+}
+
+static void histogram_add(vsfs_histogram_t *hist, uint64_t value) {
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    bucket = bucket < VSFS_HIST_BUCKETS ? bucket : VSFS_HIST_BUCKETS - 1;
+    bump(&hist->buckets[bucket], 1);
+    bump(&hist->count, 1);
+    bump(&hist->sampled, 1);
+    bump(&hist->sum, value);
+    if (value > hist->max) {
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Timestamps come from the TSC where there is one: clock_gettime() costs
+// 20-40 ns even through the vDSO, which would double the cost of a stat.
+// Ticks are scaled to nanoseconds when recorded. Even rdtsc is slow under
+// some hypervisors, so only one operation in `sample_every` is timed.
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+static double ns_per_tick = 1.0;
+
+// Calibrate against the monotonic clock over ~1 ms at start-up
+__attribute__((constructor)) static void calibrate_clock() {
+    uint64_t ns0 = monotonic_ns(), tsc0 = __rdtsc();
+    uint64_t ns1;
+    while ((ns1 = monotonic_ns()) - ns0 < 1000000) {
+    }
+    uint64_t ticks = __rdtsc() - tsc0;
+    if (ticks > 0) {
+        ns_per_tick = (double)(ns1 - ns0) / ticks;
+    }
+}
+
+static uint64_t read_clock() {
+    return __rdtsc();
+}
+
+// The TSC of another core may be behind the one the operation started on;
+// a negative interval counts as 0
+static uint64_t elapsed_ns(uint64_t start) {
+    int64_t ticks = (int64_t)(__rdtsc() - start);
+    return ticks > 0 ? (uint64_t)(ticks * ns_per_tick) : 0;
+}
+#else
+static uint64_t read_clock() {
+    return monotonic_ns();
+}
+
+static uint64_t elapsed_ns(uint64_t start) {
+    return monotonic_ns() - start;
+}
+#endif
+
+// Start time of an operation, or 0 if this one isn't sampled
+uint64_t stats_clock() {
+    if (sample_countdown > 0) {
+        sample_countdown--;
+        return 0;
+    }
+    sample_countdown = sample_every - 1;
+    return read_clock() | 1;
+}
+
+void stats_record_op(vsfs_op_t op, uint64_t start) {
+    thread_stats_t *block = my_stats();
+    if (block == NULL) {
+        return;
+    }
+    if (start == 0) {
+        bump(&block->stats.ops[op].count, 1);
+    } else {
+        histogram_add(&block->stats.ops[op], elapsed_ns(start));
+    }
+}
+
+// Time one operation in `every` per thread (default 4); counts stay exact
+void vsfs_set_stats_sampling(unsigned every) {
+    sample_every = every == 0 ? 1 : every;
+    sample_countdown = 0;
+}
+
+void stats_count(vsfs_counter_t counter, uint64_t n) {
+    thread_stats_t *block = my_stats();
+    if (block != NULL) {
+        bump(&block->stats.counters[counter], n);
+    }
+}
+
+void stats_bitmap_scan(uint64_t bits) {
+    thread_stats_t *block = my_stats();
+    if (block != NULL) {
+        histogram_add(&block->stats.bitmap_scan, bits);
+    }
+}
+
+static void merge_histogram(vsfs_histogram_t *out, vsfs_histogram_t *in) {
+    out->count += __atomic_load_n(&in->count, __ATOMIC_RELAXED);
+    out->sampled += __atomic_load_n(&in->sampled, __ATOMIC_RELAXED);
+    out->sum += __atomic_load_n(&in->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&in->max, __ATOMIC_RELAXED);
+    out->max = max > out->max ? max : out->max;
+    for (int b = 0; b < VSFS_HIST_BUCKETS; b++) {
+        out->buckets[b] += __atomic_load_n(&in->buckets[b], __ATOMIC_RELAXED);
+    }
+}
+
+static void fault_counts(long *minor, long *major) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    *minor = usage.ru_minflt;
+    *major = usage.ru_majflt;
+}
+
+// Merge every thread's statistics into `out`
+int vsfs_get_stats(vsfs_stats_t *out) {
+    if (out == NULL) {
+        fprintf(stderr, "vsfs_get_stats: out is NULL\n");
+        return -1;
+    }
+    memset(out, 0, sizeof(vsfs_stats_t));
+
+    pthread_mutex_lock(&registry_lock);
+    for (thread_stats_t *block = registry; block != NULL; block = block->next) {
+        for (int op = 0; op < VSFS_NUM_OPS; op++) {
+            merge_histogram(&out->ops[op], &block->stats.ops[op]);
+        }
+        merge_histogram(&out->bitmap_scan, &block->stats.bitmap_scan);
+        for (int c = 0; c < VSFS_NUM_COUNTERS; c++) {
+            out->counters[c] += __atomic_load_n(&block->stats.counters[c], __ATOMIC_RELAXED);
+        }
+    }
+    long minor, major;
+    fault_counts(&minor, &major);
+    out->minor_faults = minor - base_minor_faults;
+    out->major_faults = major - base_major_faults;
+    pthread_mutex_unlock(&registry_lock);
+    return 0;
+}
+
+// Zero all statistics (updates racing with a reset may be lost)
+void vsfs_reset_stats() {
+    pthread_mutex_lock(&registry_lock);
+    for (thread_stats_t *block = registry; block != NULL; block = block->next) {
+        uint64_t *words = (uint64_t *)&block->stats;
+        for (size_t i = 0; i < offsetof(vsfs_stats_t, minor_faults) / sizeof(uint64_t); i++) {
+            __atomic_store_n(&words[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+    fault_counts(&base_minor_faults, &base_major_faults);
+    pthread_mutex_unlock(&registry_lock);
+}
+
+#else
+
+int vsfs_get_stats(vsfs_stats_t *out) {
+    (void)out;
+    fprintf(stderr, "vsfs_get_stats: built without VSFS_STATS\n");
+    return -1;
+}
+
+void vsfs_set_stats_sampling(unsigned every) {
+    (void)every;
+}
+
+void vsfs_reset_stats() {
+}
+
+#endif // VSFS_STATS
+
+static void dump_histogram_json(FILE *out, const char *name, const vsfs_histogram_t *hist, bool last) {
+    fprintf(out, "    \"%s\": {\"count\": %llu, \"mean\": %.1f, \"p50\": %llu, \"p99\": %llu, \"max\": %llu, \"buckets\": [",
+            name, (unsigned long long)hist->count, hist->sampled ? (double)hist->sum / hist->sampled : 0.0,
+            (unsigned long long)histogram_percentile(hist, 50), (unsigned long long)histogram_percentile(hist, 99),
+            (unsigned long long)hist->max);
+    // Trailing empty buckets are left out
+    int used = VSFS_HIST_BUCKETS;
+    while (used > 0 && hist->buckets[used - 1] == 0) {
+        used--;
+    }
+    for (int b = 0; b < used; b++) {
+        fprintf(out, "%s%llu", b ? ", " : "", (unsigned long long)hist->buckets[b]);
+    }
+    fprintf(out, "]}%s\n", last ? "" : ",");
+}
+
+// Write statistics as a text table or a JSON object
+int vsfs_dump_stats(FILE *out, const vsfs_stats_t *stats, bool json) {
+    if (out == NULL || stats == NULL) {
+        fprintf(stderr, "vsfs_dump_stats: NULL argument\n");
+        return -1;
+    }
+
+    if (json) {
+        fprintf(out, "{\n  \"ops\": {\n");
+        for (int op = 0; op < VSFS_NUM_OPS; op++) {
+            dump_histogram_json(out, op_names[op], &stats->ops[op], op == VSFS_NUM_OPS - 1);
+        }
+        fprintf(out, "  },\n  \"histograms\": {\n");
+        dump_histogram_json(out, "bitmap_scan_bits", &stats->bitmap_scan, true);
+        fprintf(out, "  },\n  \"counters\": {");
+        for (int c = 0; c < VSFS_NUM_COUNTERS; c++) {
+            fprintf(out, "%s\"%s\": %llu", c ? ", " : "", counter_names[c], (unsigned long long)stats->counters[c]);
+        }
+        fprintf(out, "},\n  \"page_faults\": {\"minor\": %ld, \"major\": %ld}\n}\n",
+                stats->minor_faults, stats->major_faults);
+        return 0;
+    }
+
+    fprintf(out, "%-10s %10s %10s %10s %10s %10s\n", "op", "count", "mean ns", "p50 ns", "p99 ns", "max ns");
+    for (int op = 0; op < VSFS_NUM_OPS; op++) {
+        const vsfs_histogram_t *hist = &stats->ops[op];
+        if (hist->count == 0) {
+            continue;
+        }
+        double mean = hist->sampled ? (double)hist->sum / hist->sampled : 0.0;
+        fprintf(out, "%-10s %10llu %10.0f %10llu %10llu %10llu\n", op_names[op], (unsigned long long)hist->count,
+                mean, (unsigned long long)histogram_percentile(hist, 50),
+                (unsigned long long)histogram_percentile(hist, 99), (unsigned long long)hist->max);
+    }
+    const vsfs_histogram_t *scan = &stats->bitmap_scan;
+    fprintf(out, "bitmap scans: %llu, mean %.1f bits, p99 %llu bits, max %llu bits\n", (unsigned long long)scan->count,
+            scan->sampled ? (double)scan->sum / scan->sampled : 0.0, (unsigned long long)histogram_percentile(scan, 99),
+            (unsigned long long)scan->max);
+    for (int c = 0; c < VSFS_NUM_COUNTERS; c++) {
+        fprintf(out, "%s: %llu\n", counter_names[c], (unsigned long long)stats->counters[c]);
+    }
+    fprintf(out, "page faults: %ld minor, %ld major\n", stats->minor_faults, stats->major_faults);
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Operations with a latency histogram
+typedef enum {
+    VSFS_OP_FORMAT,
+    VSFS_OP_MOUNT,
+    VSFS_OP_FSYNC,
+    VSFS_OP_ALLOC,
+    VSFS_OP_FREE,
+    VSFS_OP_CREATE,
+    VSFS_OP_LOOKUP,
+    VSFS_OP_UNLINK,
+    VSFS_OP_READ,
+    VSFS_OP_WRITE,
+    VSFS_OP_TRUNCATE,
+    VSFS_OP_STAT,
+    VSFS_OP_CREATE_BATCH,
+    VSFS_OP_UNLINK_BATCH,
+    VSFS_OP_READDIR,
+    VSFS_OP_MAP,
+    VSFS_NUM_OPS
+} vsfs_op_t;
+
+// Plain event counters
+typedef enum {
+    VSFS_CTR_BYTES_READ,
+    VSFS_CTR_BYTES_WRITTEN,
+    VSFS_CTR_BLOCKS_ALLOCATED,
+    VSFS_CTR_BLOCKS_FREED,
+    VSFS_CTR_ICACHE_MISSES,
+    VSFS_CTR_INODE_WRITEBACKS,
+    VSFS_CTR_INODE_CHUNKS,
+    VSFS_NUM_COUNTERS
+} vsfs_counter_t;
+
+// Bucket b counts values in [2^(b-1), 2^b); bucket 0 counts zeros
+#define VSFS_HIST_BUCKETS 64
+
+// `count` is every event; `sampled` of them carry a value in sum/max/buckets
+typedef struct {
+    uint64_t count;
+    uint64_t sampled;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[VSFS_HIST_BUCKETS];
+} vsfs_histogram_t;
+
+// Merged statistics since start-up or the last reset. Latencies are in
+// nanoseconds and taken for one operation in every `vsfs_set_stats_sampling`;
+// bitmap_scan holds the number of bits each bitmapalloc examined.
+typedef struct {
+    vsfs_histogram_t ops[VSFS_NUM_OPS];
+    vsfs_histogram_t bitmap_scan;
+    uint64_t counters[VSFS_NUM_COUNTERS];
+    long minor_faults;
+    long major_faults;
+} vsfs_stats_t;
+
+// Merge every thread's statistics into `out`; -1 if built without VSFS_STATS
+int vsfs_get_stats(vsfs_stats_t *out);
+
+// Time one operation in `every` per thread (default 4); counts stay exact
+void vsfs_set_stats_sampling(unsigned every);
+
+// Zero all statistics (updates racing with a reset may be lost)
+void vsfs_reset_stats();
+
+// Write statistics as a text table or a JSON object
+int vsfs_dump_stats(FILE *out, const vsfs_stats_t *stats, bool json);
+
+// Upper bound of the bucket holding the `pct` percentile (0 if empty)
+uint64_t histogram_percentile(const vsfs_histogram_t *hist, double pct);
+
+const char *vsfs_op_name(vsfs_op_t op);
+const char *vsfs_counter_name(vsfs_counter_t counter);
+
+// Recording hooks; they compile to nothing unless VSFS_STATS is defined
+#ifdef VSFS_STATS
+uint64_t stats_clock();
+void stats_record_op(vsfs_op_t op, uint64_t start);
+void stats_count(vsfs_counter_t counter, uint64_t n);
+void stats_bitmap_scan(uint64_t bits);
+
+#define STATS_START(var) uint64_t var = stats_clock()
+#define STATS_END(op, var) stats_record_op(op, var)
+#define STATS_COUNT(counter, n) stats_count(counter, n)
+#define STATS_BITMAP_SCAN(bits) stats_bitmap_scan(bits)
+#else
+#define STATS_START(var) ((void)0)
+#define STATS_END(op, var) ((void)0)
+#define STATS_COUNT(counter, n) ((void)0)
+#define STATS_BITMAP_SCAN(bits) ((void)0)
+#endif
+
+#endif // STATS_H
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include "stripe.h"
+#include "mount.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+static stripe_geometry_t geometry;
+static int member_fds[VSFS_MAX_STRIPE_MEMBERS];
+
+bool stripe_active() {
+    return geometry.members > 1;
+}
+
+size_t stripe_width() {
+    return stripe_active() ? (size_t)geometry.members * geometry.unit_blocks * BLOCK_SIZE : 0;
+}
+
+// The piece of a run starting at `block` that stays on one member: which
+// member, where it starts there (in blocks) and how many blocks it has
+static uint32_t locate_piece(uint32_t block, uint32_t *member, uint64_t *member_block) {
+    if (block < geometry.start) {
+        *member = 0;
+        *member_block = block;
+        return geometry.start - block;
+    }
+    uint32_t rel = block - geometry.start;
+    uint32_t unit = rel / geometry.unit_blocks;
+    uint32_t within = rel % geometry.unit_blocks;
+    *member = unit % geometry.members;
+    *member_block = (*member == 0 ? geometry.start : 0) + (uint64_t)(unit / geometry.members) * geometry.unit_blocks +
+                    within;
+    uint32_t piece = geometry.unit_blocks - within;
+    return piece < geometry.total_blocks - block ? piece : geometry.total_blocks - block;
+}
+
+// Blocks member `m` holds: the metadata for the first, plus its units, of
+// which the last of the image may be short
+static uint64_t member_blocks(uint32_t m) {
+    uint64_t data = geometry.total_blocks - geometry.start;
+    uint64_t nunits = (data + geometry.unit_blocks - 1) / geometry.unit_blocks;
+    uint64_t blocks = m == 0 ? geometry.start : 0;
+    if (m < nunits) {
+        blocks += ((nunits - 1 - m) / geometry.members + 1) * geometry.unit_blocks;
+        if ((nunits - 1) % geometry.members == m) {
+            blocks -= nunits * geometry.unit_blocks - data;
+        }
+    }
+    return blocks;
+}
+
+int stripe_open(const char *const *disk_names, const stripe_geometry_t *geo, bool format) {
+    if (geo->members < 2 || geo->members > VSFS_MAX_STRIPE_MEMBERS || geo->unit_blocks == 0 ||
+        geo->start >= geo->total_blocks) {
+        fprintf(stderr, "stripe_open: bad stripe geometry (%u members, %u-block units)\n", geo->members,
+                geo->unit_blocks);
+        return -1;
+    }
+    if ((geo->total_blocks - geo->start + geo->unit_blocks - 1) / geo->unit_blocks > VSFS_MAX_STRIPE_UNITS) {
+        fprintf(stderr, "stripe_open: stripe unit of %u blocks is too small for the image\n", geo->unit_blocks);
+        return -1;
+    }
+    geometry = *geo;
+
+    for (uint32_t m = 0; m < geometry.members; m++) {
+        member_fds[m] = open(disk_names[m], O_RDWR | (format ? O_CREAT : 0), 0644);
+        off_t size = member_blocks(m) * BLOCK_SIZE;
+        struct stat st;
+        if (member_fds[m] < 0) {
+            perror("stripe_open: open");
+        } else if (format && ftruncate(member_fds[m], size) < 0) {
+            perror("stripe_open: ftruncate");
+        } else if (!format && (fstat(member_fds[m], &st) < 0 || st.st_size < size)) {
+            fprintf(stderr, "stripe_open: %s is smaller than its stripe needs\n", disk_names[m]);
+        } else {
+            continue;
+        }
+        for (uint32_t k = 0; k <= m; k++) {
+            if (member_fds[k] >= 0) {
+                close(member_fds[k]);
+            }
+        }
+        geometry.members = 0;
+        return -1;
+    }
+    return member_fds[0];
+}
+
+char *map_striped(const map_options_t *opts) {
+    bool huge = opts != NULL && opts->huge_pages;
+    size_t map_len = (size_t)geometry.total_blocks * BLOCK_SIZE;
+    size_t span = map_len + (huge ? HUGE_PAGE_SIZE : 0);
+    char *reserve = mmap(NULL, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserve == MAP_FAILED) {
+        perror("map_striped: mmap reserve");
+        return NULL;
+    }
+    char *base = huge ? (char *)(((uintptr_t)reserve + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1))
+                      : reserve;
+
+    uint32_t piece;
+    for (uint32_t block = 0; block < geometry.total_blocks; block += piece) {
+        uint32_t m;
+        uint64_t member_block;
+        piece = locate_piece(block, &m, &member_block);
+        if (mmap(base + (size_t)block * BLOCK_SIZE, (size_t)piece * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, member_fds[m], member_block * BLOCK_SIZE) == MAP_FAILED) {
+            perror("map_striped: mmap");
+            munmap(reserve, span);
+            return NULL;
+        }
+    }
+
+    if (base > reserve) {
+        munmap(reserve, base - reserve);
+    }
+    if (reserve + span > base + map_len) {
+        munmap(base + map_len, reserve + span - (base + map_len));
+    }
+    return base;
+}
+
+void stripe_detach() {
+    for (uint32_t m = 1; m < geometry.members; m++) {
+        if (close(member_fds[m]) < 0) {
+            perror("stripe_detach: close");
+        }
+    }
+    geometry.members = 0;
+}
+
+int stripe_locate(uint32_t block, uint32_t *member, off_t *offset) {
+    if (!stripe_active() || block >= geometry.total_blocks) {
+        fprintf(stderr, "stripe_locate: block %u is not in a striped image\n", block);
+        return -1;
+    }
+    uint64_t member_block;
+    locate_piece(block, member, &member_block);
+    *offset = member_block * BLOCK_SIZE;
+    return 0;
+}
+
+static void *sync_member(void *arg) {
+    int *fd = arg;
+    if (fdatasync(*fd) < 0) {
+        perror("stripe_sync: fdatasync");
+        *fd = -1;
+    }
+    return NULL;
+}
+
+// Pages dirtied through the shared mapping belong to the members' page
+// cache, so flushing each member file flushes the image
+int stripe_sync() {
+    pthread_t threads[VSFS_MAX_STRIPE_MEMBERS];
+    int fds[VSFS_MAX_STRIPE_MEMBERS];
+    bool started[VSFS_MAX_STRIPE_MEMBERS] = {false};
+    for (uint32_t m = 0; m < geometry.members; m++) {
+        fds[m] = member_fds[m];
+        if (m > 0) {
+            started[m] = pthread_create(&threads[m], NULL, sync_member, &fds[m]) == 0;
+        }
+    }
+    int ret = 0;
+    for (uint32_t m = 0; m < geometry.members; m++) {
+        if (started[m]) {
+            pthread_join(threads[m], NULL);
+        } else {
+            sync_member(&fds[m]);
+        }
+        ret = fds[m] < 0 ? -1 : ret;
+    }
+    return ret;
+}
+
+// A run covers consecutive units, which sit back to back in each member, so
+// one readahead per member covers it; each member's pieces come in order
+void stripe_prefetch(uint32_t block, uint32_t count) {
+    off_t lo[VSFS_MAX_STRIPE_MEMBERS], hi[VSFS_MAX_STRIPE_MEMBERS];
+    for (uint32_t m = 0; m < geometry.members; m++) {
+        lo[m] = -1;
+    }
+    if (block >= geometry.total_blocks) {
+        return;
+    }
+    count = count < geometry.total_blocks - block ? count : geometry.total_blocks - block;
+    while (count > 0) {
+        uint32_t m;
+        uint64_t member_block;
+        uint32_t piece = locate_piece(block, &m, &member_block);
+        piece = piece < count ? piece : count;
+        if (lo[m] < 0) {
+            lo[m] = member_block * BLOCK_SIZE;
+        }
+        hi[m] = (member_block + piece) * BLOCK_SIZE;
+        block += piece;
+        count -= piece;
+    }
+    for (uint32_t m = 0; m < geometry.members; m++) {
+        if (lo[m] >= 0) {
+            posix_fadvise(member_fds[m], lo[m], hi[m] - lo[m], POSIX_FADV_WILLNEED);
+        }
+    }
+}
+
+int stripe_discard(uint32_t block, uint32_t count) {
+    while (count > 0 && block < geometry.total_blocks) {
+        uint32_t m;
+        uint64_t member_block;
+        uint32_t piece = locate_piece(block, &m, &member_block);
+        piece = piece < count ? piece : count;
+        if (fallocate(member_fds[m], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, member_block * BLOCK_SIZE,
+                      (off_t)piece * BLOCK_SIZE) < 0) {
+            if (errno != EOPNOTSUPP) {
+                perror("stripe_discard: fallocate");
+            }
+            return -1;
+        }
+        block += piece;
+        count -= piece;
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "mkfs.h"
+
+// Striped images: the image is spread over several backing files (members),
+// typically one per device. Everything before the data region lives at the
+// start of the first member; the data region after it is cut into stripe
+// units of `unit_blocks` blocks dealt round-robin to the members. Each unit
+// is mapped from its member into one contiguous reservation, so the rest of
+// the filesystem sees a single flat image as before. Syncs flush every member
+// at once from its own thread, and large reads start readahead on every
+// member the read touches before copying.
+#define VSFS_MAX_STRIPE_MEMBERS 16
+#define VSFS_STRIPE_DEFAULT (256 * 1024)   // Stripe unit if none is given
+#define VSFS_MAX_STRIPE_UNITS 32768        // Mappings one image may use
+
+typedef struct {
+    uint32_t members;         // Backing files (0 = not striped)
+    uint32_t unit_blocks;     // Blocks per stripe unit
+    uint32_t start;           // First striped block; those before sit on member 0
+    uint32_t total_blocks;
+} stripe_geometry_t;
+
+// Open the members of an image with this geometry. On format they are created
+// and sized; otherwise they must be at least as large as the geometry needs.
+// The first member's descriptor is returned (-1 on error); all of them stay
+// open until stripe_detach().
+int stripe_open(const char *const *disk_names, const stripe_geometry_t *geometry, bool format);
+
+// Map the open members as one image, on a huge page boundary if requested
+char *map_striped(const map_options_t *opts);
+
+// Close every member but the first, which the caller owns as disk_fd
+void stripe_detach();
+
+bool stripe_active();
+
+// Bytes per full stripe across all members (0 if not striped)
+size_t stripe_width();
+
+// Which member holds `block`, and at what byte offset
+int stripe_locate(uint32_t block, uint32_t *member, off_t *offset);
+
+// Flush every member in parallel
+int stripe_sync();
+
+// Start readahead on each member for a run of blocks
+void stripe_prefetch(uint32_t block, uint32_t count);
+
+// Punch out a run of blocks through the members
+int stripe_discard(uint32_t block, uint32_t count);
+
+#endif // STRIPE_H
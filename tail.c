@@ -0,0 +1,221 @@
+#include "tail.h"
+#include "helpers.h"
+#include "filemap.h"
+#include "delta.h"
+#include <sys/stat.h>
+
+// Units of a fragment are only ever taken from the free map and returned to
+// it while no snapshot exists. A snapshot may still read a tail the live tree
+// has dropped, so while one exists freed units stay marked until the whole
+// fragment block is freed. The same goes for a block a mapping has pinned.
+// Tails are never rewritten in place: changing a packed file first moves its
+// tail back into a private block.
+
+static frag_header_t *frag_header(uint32_t block) {
+    return (frag_header_t *)block_ptr(block);
+}
+
+static bool snapshots_exist() {
+    for (int i = 0; i < VSFS_MAX_SNAPSHOTS; i++) {
+        if (sb->snapshots[i].inode_bitmap_block != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Mask of `units` units starting at `unit`
+static uint64_t unit_mask(uint32_t unit, uint32_t units) {
+    uint64_t bits = units == 64 ? ~0ULL : (1ULL << units) - 1;
+    return bits << unit;
+}
+
+// Number of free units in a fragment block
+static int frag_free_units(uint32_t block) {
+    return FRAG_UNITS - __builtin_popcountll(frag_header(block)->map);
+}
+
+// Mark the first run of `units` free units in a fragment block; returns the
+// first unit, or -1 if the block has no such run
+static int frag_take(uint32_t block, uint32_t units) {
+    frag_header_t *hdr = frag_header(block);
+    for (uint32_t unit = 1; unit + units <= FRAG_UNITS; unit++) {
+        uint64_t mask = unit_mask(unit, units);
+        if ((hdr->map & mask) == 0) {
+            hdr->map |= mask;
+            delta_mark(block, 1);   // the tail is written in right after
+            return unit;
+        }
+    }
+    return -1;
+}
+
+// Whether the hinted block is still a live fragment block
+static bool frag_hint_valid(uint32_t block) {
+    return block >= data_region_start() && block < sb->num_total_blocks && block_refcount(block) > 0 &&
+           frag_header(block)->magic == FRAG_MAGIC;
+}
+
+// Offer a fragment block to the superblock's hints, replacing a stale hint
+// or else the hinted block with the least room if this one has more
+static void frag_remember(uint32_t block) {
+    int victim = -1;
+    int most = frag_free_units(block);
+    for (int i = 0; i < VSFS_FRAG_HINTS; i++) {
+        if (sb->frag_blocks[i] == block) {
+            return;
+        }
+    }
+    for (int i = 0; i < VSFS_FRAG_HINTS && most >= 0; i++) {
+        uint32_t hint = sb->frag_blocks[i];
+        if (!frag_hint_valid(hint)) {
+            victim = i;
+            most = -1;
+        } else if (frag_free_units(hint) < most) {
+            victim = i;
+            most = frag_free_units(hint);
+        }
+    }
+    if (victim >= 0) {
+        sb->frag_blocks[victim] = block;
+    }
+}
+
+static void frag_forget(uint32_t block) {
+    for (int i = 0; i < VSFS_FRAG_HINTS; i++) {
+        if (sb->frag_blocks[i] == block) {
+            sb->frag_blocks[i] = 0;
+        }
+    }
+}
+
+// Allocate `units` units for a tail from the first hinted block with room,
+// or from a new fragment block. Returns the block with a reference taken for
+// the caller and sets `offset`.
+static int frag_alloc(uint32_t units, uint16_t *offset) {
+    if (refcount_init() < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < VSFS_FRAG_HINTS; i++) {
+        uint32_t block = sb->frag_blocks[i];
+        int unit = frag_hint_valid(block) ? frag_take(block, units) : -1;
+        if (unit < 0) {
+            continue;
+        }
+        if (block_ref(block) < 0) {
+            frag_header(block)->map &= ~unit_mask(unit, units);
+            delta_mark(block, 1);
+            continue;
+        }
+        *offset = unit * FRAG_UNIT;
+        return block;
+    }
+
+    // A new block's own reference goes to its first tail
+    int block = alloc_data_block();
+    if (block < 0) {
+        return -1;
+    }
+    frag_header_t *hdr = frag_header(block);
+    hdr->magic = FRAG_MAGIC;
+    hdr->map = 1;
+    *offset = frag_take(block, units) * FRAG_UNIT;
+    frag_remember(block);
+    return block;
+}
+
+// Pack the tails of regular files written from now on (persisted in the superblock)
+int vsfs_set_tail_packing(bool enabled) {
+    sb->tail_packing = enabled;
+    return 0;
+}
+
+// Offset of the first byte stored in the tail
+size_t tail_start(const inode_t *inode) {
+    return inode->size - inode->tail_len;
+}
+
+// Pointer to the tail's bytes in its fragment block
+const char *tail_data(const inode_t *inode) {
+    return block_ptr(inode->tail_block) + inode->tail_offset;
+}
+
+// Move a file's last partial block into a fragment if packing is on and the
+// tail is small; does nothing (and succeeds) otherwise
+int tail_pack(inode_t *inode) {
+    size_t len = inode->size % BLOCK_SIZE;
+    if (!sb->tail_packing || !S_ISREG(inode->mode) || inode->compression != 0 || inode->tail_block != 0 ||
+        len == 0 || len > TAIL_MAX_LEN) {
+        return 0;
+    }
+
+    // Holes have nothing to pack, and shared blocks are cheaper left shared
+    size_t lblk = inode->size / BLOCK_SIZE;
+    int block = inode_bmap(inode, lblk, false);
+    if (block <= 0 || block_refcount(block) > 1) {
+        return block < 0 ? -1 : 0;
+    }
+
+    uint32_t *slot = inode_block_slot(inode, lblk, true);
+    if (slot == NULL) {
+        return -1;
+    }
+    uint16_t offset;
+    int frag = frag_alloc(ceildiv(len, FRAG_UNIT), &offset);
+    if (frag < 0) {
+        return -1;
+    }
+    memcpy(block_ptr(frag) + offset, block_ptr(block), len);
+
+    uint32_t freed[2] = {*slot, 0};
+    size_t nfreed = 1;
+    *slot = 0;
+    if (lblk == NUM_DIRECT_BLOCKS) {
+        // The tail was the only block behind the indirect block
+        freed[nfreed++] = inode->indirect;
+        inode->indirect = 0;
+    }
+    inode->tail_block = frag;
+    inode->tail_offset = offset;
+    inode->tail_len = len;
+    return free_data_blocks(freed, nfreed);
+}
+
+// Move a packed tail back into a block of its own
+int tail_unpack(inode_t *inode) {
+    if (inode->tail_block == 0) {
+        return 0;
+    }
+
+    // The slot is a hole, so this allocates a fresh zeroed block
+    int block = inode_bmap(inode, tail_start(inode) / BLOCK_SIZE, true);
+    if (block < 0) {
+        return -1;
+    }
+    memcpy(block_ptr(block), tail_data(inode), inode->tail_len);
+    return tail_release(inode);
+}
+
+// Drop a packed tail and the inode's reference to its fragment block
+int tail_release(inode_t *inode) {
+    uint32_t block = inode->tail_block;
+    if (block == 0) {
+        return 0;
+    }
+
+    if (block_refcount(block) == 1) {
+        frag_forget(block);   // the block is about to be freed
+    } else {
+        if (!snapshots_exist() && !filemap_pinned(block)) {
+            frag_header(block)->map &= ~unit_mask(inode->tail_offset / FRAG_UNIT, ceildiv(inode->tail_len, FRAG_UNIT));
+            delta_mark(block, 1);
+        }
+        frag_remember(block);
+    }
+
+    inode->tail_block = 0;
+    inode->tail_offset = 0;
+    inode->tail_len = 0;
+    return free_data_blocks(&block, 1);
+}
@@ -0,0 +1,45 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef TAIL_H
+#define TAIL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "fs.h"
+
+// The last partial block of a small regular file can be packed into a shared
+// fragment block. A fragment block is handed out in FRAG_UNIT-byte units; its
+// first unit holds a header with a map of the used units. Each packed tail
+// holds one reference to its fragment block, so the block is freed with the
+// last tail in it and snapshots share tails like any other block.
+#define FRAG_UNIT 64
+#define FRAG_UNITS (BLOCK_SIZE / FRAG_UNIT)
+#define FRAG_MAGIC 0x46524147 // "FRAG" in hex
+#define TAIL_MAX_LEN (BLOCK_SIZE * 3 / 4)   // longer tails keep their own block
+
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t map;             // Bit i set = unit i in use (unit 0 is this header)
+} frag_header_t;
+
+// Pack the tails of regular files written from now on (persisted in the superblock)
+int vsfs_set_tail_packing(bool enabled);
+
+// Offset of the first byte stored in the tail, and a pointer to the tail's bytes
+size_t tail_start(const inode_t *inode);
+const char *tail_data(const inode_t *inode);
+
+// Move a file's last partial block into a fragment if packing is on and the
+// tail is small; does nothing (and succeeds) otherwise
+int tail_pack(inode_t *inode);
+
+// Move a packed tail back into a block of its own
+int tail_unpack(inode_t *inode);
+
+// Drop a packed tail and the inode's reference to its fragment block
+int tail_release(inode_t *inode);
+
+#endif // TAIL_H
@@ -1,12 +1,31 @@
+#define _POSIX_C_SOURCE 200809L
 #include "fs.h"
 #include "mkfs.h"
 #include "helpers.h"
+#include "snapshot.h"
+#include "dedup.h"
+#include "compress.h"
+#include "mount.h"
+#include "stats.h"
+#include "icache.h"
+#include "tail.h"
+#include "extent.h"
+#include "filemap.h"
+#include "vsfsd.h"
+#include "trace.h"
+#include "stripe.h"
+#include "delta.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <assert.h>
+#include <time.h>
 
 // Define VSFS_MAGIC for testing
 #define VSFS_MAGIC 0x56534653 // "VSFS" in hex
@@ -27,6 +46,25 @@ int test_basic_formatting();
 int test_different_disk_sizes();
 int test_different_max_files();
 int test_edge_cases();
+int test_file_operations();
+int test_block_discard();
+int test_snapshots();
+int test_dedup();
+int test_compression();
+int test_mount_options();
+int test_stats();
+int test_inode_cache();
+int test_timestamps();
+int test_batch_ops();
+int test_readdir_plus();
+int test_tail_packing();
+int test_extent_index();
+int test_inode_growth();
+int test_file_mapping();
+int test_vsfsd();
+int test_trace();
+int test_striping();
+int test_delta();
 
 int main() {
     printf("=== VSFS Filesystem Setup Tests ===\n\n");
@@ -75,6 +113,215 @@ int main() {
     }
     printf("\n");
     
+    // Test 5: File operations
+    printf("Test 5: File operations\n");
+    if (test_file_operations() == 0) {
+        printf("✓ File operations test passed\n");
+    } else {
+        printf("✗ File operations test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 6: Block discard
+    printf("Test 6: Discarding freed blocks\n");
+    if (test_block_discard() == 0) {
+        printf("✓ Block discard test passed\n");
+    } else {
+        printf("✗ Block discard test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 7: Snapshots
+    printf("Test 7: Copy-on-write snapshots\n");
+    if (test_snapshots() == 0) {
+        printf("✓ Snapshot test passed\n");
+    } else {
+        printf("✗ Snapshot test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 8: Deduplication
+    printf("Test 8: Block deduplication\n");
+    if (test_dedup() == 0) {
+        printf("✓ Deduplication test passed\n");
+    } else {
+        printf("✗ Deduplication test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 9: Compression
+    printf("Test 9: Transparent compression\n");
+    if (test_compression() == 0) {
+        printf("✓ Compression test passed\n");
+    } else {
+        printf("✗ Compression test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 10: Mounting with mapping options
+    printf("Test 10: Mount and mapping options\n");
+    if (test_mount_options() == 0) {
+        printf("✓ Mount test passed\n");
+    } else {
+        printf("✗ Mount test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 11: Statistics
+    printf("Test 11: Operation statistics\n");
+    if (test_stats() == 0) {
+        printf("✓ Statistics test passed\n");
+    } else {
+        printf("✗ Statistics test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 12: Inode cache
+    printf("Test 12: Inode cache and writeback\n");
+    if (test_inode_cache() == 0) {
+        printf("✓ Inode cache test passed\n");
+    } else {
+        printf("✗ Inode cache test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 13: Timestamp policies
+    printf("Test 13: noatime, relatime and lazytime\n");
+    if (test_timestamps() == 0) {
+        printf("✓ Timestamp test passed\n");
+    } else {
+        printf("✗ Timestamp test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 14: Batched create and unlink
+    printf("Test 14: Batched create and unlink\n");
+    if (test_batch_ops() == 0) {
+        printf("✓ Batch operations test passed\n");
+    } else {
+        printf("✗ Batch operations test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 15: Directory listing with attributes
+    printf("Test 15: Directory listing with attributes\n");
+    if (test_readdir_plus() == 0) {
+        printf("✓ Readdir plus test passed\n");
+    } else {
+        printf("✗ Readdir plus test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 16: Tail packing
+    printf("Test 16: Tail packing\n");
+    if (test_tail_packing() == 0) {
+        printf("✓ Tail packing test passed\n");
+    } else {
+        printf("✗ Tail packing test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 17: Free-extent index
+    printf("Test 17: Free-extent index\n");
+    if (test_extent_index() == 0) {
+        printf("✓ Free-extent index test passed\n");
+    } else {
+        printf("✗ Free-extent index test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 18: Inode table growth
+    printf("Test 18: Inode table growth\n");
+    if (test_inode_growth() == 0) {
+        printf("✓ Inode table growth test passed\n");
+    } else {
+        printf("✗ Inode table growth test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 19: Zero-copy file mapping
+    printf("Test 19: Zero-copy file mapping\n");
+    if (test_file_mapping() == 0) {
+        printf("✓ Zero-copy file mapping test passed\n");
+    } else {
+        printf("✗ Zero-copy file mapping test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 20: vsfsd server
+    printf("Test 20: vsfsd server\n");
+    if (test_vsfsd() == 0) {
+        printf("✓ vsfsd server test passed\n");
+    } else {
+        printf("✗ vsfsd server test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 21: Operation tracing
+    printf("Test 21: Operation tracing\n");
+    if (test_trace() == 0) {
+        printf("✓ Operation tracing test passed\n");
+    } else {
+        printf("✗ Operation tracing test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 22: Striped images
+    printf("Test 22: Striped images\n");
+    if (test_striping() == 0) {
+        printf("✓ Striped image test passed\n");
+    } else {
+        printf("✗ Striped image test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
+    // Test 23: Incremental deltas
+    printf("Test 23: Incremental deltas\n");
+    if (test_delta() == 0) {
+        printf("✓ Incremental delta test passed\n");
+    } else {
+        printf("✗ Incremental delta test failed\n");
+        printf("❌ Test suite terminated due to failure\n");
+        return -1;
+    }
+    printf("\n");
+    
     // All tests passed
     printf("=== Test Summary ===\n");
     printf("🎉 All tests passed!\n");
@@ -270,138 +517,1233 @@ int test_edge_cases() {
     return 0;
 }
 
-int test_disk_file_creation(const char *disk_name, size_t expected_size) {
-    struct stat st;
+int test_file_operations() {
+    const char *disk_name = "test_disk_files_ops";
+    unlink(disk_name);
     
-    if (stat(disk_name, &st) != 0) {
-        printf("    ✗ Disk file was not created\n");
+    if (format_disk(disk_name, BLOCK_SIZE * 200, 100) < 0) {
+        printf("    ✗ Failed to format disk\n");
         return -1;
     }
     
-    if ((size_t)st.st_size != expected_size) {
-        printf("    ✗ Disk file size mismatch: expected %zu, got %ld\n", 
-               expected_size, st.st_size);
+    int dir = vsfs_create(ROOT_INODE, "dir", S_IFDIR | 0755);
+    int file = vsfs_create(dir, "file", S_IFREG | 0644);
+    if (dir < 0 || file < 0) {
+        printf("    ✗ Failed to create directory and file\n");
+        return -1;
+    }
+    if (vsfs_lookup(ROOT_INODE, "dir") != dir || vsfs_lookup(dir, "file") != file) {
+        printf("    ✗ Lookup returned the wrong inode\n");
+        return -1;
+    }
+    if (vsfs_create(dir, "file", S_IFREG | 0644) >= 0) {
+        printf("    ✗ Creating a duplicate name should fail\n");
+        return -1;
+    }
+    printf("    ✓ Create and lookup work\n");
+    
+    // Write across the direct/indirect boundary and read it back
+    size_t len = (NUM_DIRECT_BLOCKS + 4) * BLOCK_SIZE + 123;
+    char *data = malloc(len);
+    char *back = malloc(len);
+    for (size_t i = 0; i < len; i++) {
+        data[i] = (char)(i * 7 + 3);
+    }
+    if (vsfs_write(file, 0, data, len) != (ssize_t)len) {
+        printf("    ✗ Failed to write file\n");
+        free(data);
+        free(back);
+        return -1;
+    }
+    if (vsfs_read(file, 0, back, len) != (ssize_t)len || memcmp(data, back, len) != 0) {
+        printf("    ✗ Read data does not match written data\n");
+        free(data);
+        free(back);
+        return -1;
+    }
+    printf("    ✓ Write and read back %zu bytes\n", len);
+    
+    // Truncating into a block must zero its tail
+    if (vsfs_truncate(file, 100) < 0 || vsfs_truncate(file, 200) < 0 ||
+        vsfs_read(file, 0, back, 200) != 200 || memcmp(data, back, 100) != 0) {
+        printf("    ✗ Truncate failed\n");
+        free(data);
+        free(back);
+        return -1;
+    }
+    for (int i = 100; i < 200; i++) {
+        if (back[i] != 0) {
+            printf("    ✗ Byte %d past the truncation point is not zero\n", i);
+            free(data);
+            free(back);
+            return -1;
+        }
+    }
+    printf("    ✓ Truncate shrinks and zero-extends\n");
+    free(data);
+    free(back);
+    
+    if (vsfs_unlink(ROOT_INODE, "dir") == 0) {
+        printf("    ✗ Unlinking a non-empty directory should fail\n");
         return -1;
     }
+    if (vsfs_unlink(dir, "file") < 0 || vsfs_unlink(ROOT_INODE, "dir") < 0 ||
+        vsfs_lookup(ROOT_INODE, "dir") >= 0 || sb->num_used_inodes != 1) {
+        printf("    ✗ Unlink failed\n");
+        return -1;
+    }
+    printf("    ✓ Unlink frees files and empty directories\n");
     
-    printf("    ✓ Disk file created with correct size\n");
+    unlink(disk_name);
     return 0;
 }
 
-int test_superblock_validity(const char *disk_name) {
-    int fd = open(disk_name, O_RDONLY);
-    if (fd < 0) {
-        printf("    ✗ Failed to open disk file for reading\n");
-        return -1;
+// Bytes of host storage allocated to a file
+static size_t disk_usage(const char *disk_name) {
+    struct stat st;
+    if (stat(disk_name, &st) != 0) {
+        return 0;
     }
+    return (size_t)st.st_blocks * 512;
+}
+
+int test_block_discard() {
+    const char *disk_name = "test_disk_discard";
+    size_t disk_size = BLOCK_SIZE * 2000;
+    unlink(disk_name);
     
-    superblock_t sb;
-    if (read(fd, &sb, sizeof(sb)) != sizeof(sb)) {
-        printf("    ✗ Failed to read superblock\n");
-        close(fd);
+    if (format_disk(disk_name, disk_size, 100) < 0) {
+        printf("    ✗ Failed to format disk\n");
         return -1;
     }
-    
-    // Test magic number
-    if (sb.magic != VSFS_MAGIC) {
-        printf("    ✗ Invalid magic number: 0x%08x (expected 0x%08x)\n", 
-               sb.magic, VSFS_MAGIC);
-        close(fd);
+    size_t formatted = disk_usage(disk_name);
+    if (formatted >= disk_size / 2) {
+        printf("    ✗ Fresh image uses %zu bytes, data region should not be allocated\n", formatted);
         return -1;
     }
-    
-    // Test block size
-    if (sb.block_size != BLOCK_SIZE) {
-        printf("    ✗ Invalid block size: %u (expected %d)\n", 
-               sb.block_size, BLOCK_SIZE);
-        close(fd);
+    printf("    ✓ Fresh image uses %zu of %zu bytes\n", formatted, disk_size);
+    
+    uint32_t free_before = sb->num_free_blocks;
+    int file = vsfs_create(ROOT_INODE, "big", S_IFREG | 0644);
+    size_t len = 512 * BLOCK_SIZE;
+    char *data = malloc(len);
+    memset(data, 0xAB, len);
+    if (file < 0 || vsfs_write(file, 0, data, len) != (ssize_t)len) {
+        printf("    ✗ Failed to write file\n");
+        free(data);
+        return -1;
+    }
+    free(data);
+    msync(disk_map, disk_size, MS_SYNC);
+    size_t written = disk_usage(disk_name);
+    if (written < formatted + len) {
+        printf("    ✗ Image should have grown by at least %zu bytes\n", len);
         return -1;
     }
     
-    // Test used inodes (should be 1 after root directory creation)
-    if (sb.num_used_inodes != 1) {
-        printf("    ✗ Invalid used inodes: %u (expected 1)\n", sb.num_used_inodes);
-        close(fd);
+    // Truncate gives back half the data, unlink the rest
+    if (vsfs_truncate(file, len / 2) < 0 || disk_usage(disk_name) > written - len / 2 + BLOCK_SIZE) {
+        printf("    ✗ Truncate did not release host storage\n");
+        return -1;
+    }
+    if (vsfs_unlink(ROOT_INODE, "big") < 0 || disk_usage(disk_name) > formatted + 2 * BLOCK_SIZE) {
+        printf("    ✗ Unlink did not release host storage (%zu bytes in use)\n", disk_usage(disk_name));
+        return -1;
+    }
+    if (sb->num_free_blocks != free_before - 1) {   // root directory block stays
+        printf("    ✗ Free block count %u, expected %u\n", sb->num_free_blocks, free_before - 1);
+        return -1;
+    }
+    printf("    ✓ Truncate and unlink release host storage\n");
+    
+    // Dirty free blocks behind the allocator's back, then trim them away
+    memset(data_section + BLOCK_SIZE * 100, 0xCD, BLOCK_SIZE * 100);
+    msync(disk_map, disk_size, MS_SYNC);
+    int trimmed = vsfs_trim();
+    if (trimmed < 0 || disk_usage(disk_name) > formatted + 2 * BLOCK_SIZE) {
+        printf("    ✗ Trim did not release free blocks\n");
         return -1;
     }
+    printf("    ✓ Trim discarded %d free blocks\n", trimmed);
     
-    printf("    ✓ Superblock is valid\n");
-    close(fd);
+    cleanup_disk(disk_map, disk_size, disk_fd);
+    unlink(disk_name);
     return 0;
 }
 
-int test_filesystem_layout(const char *disk_name, size_t expected_disk_size, size_t expected_max_files) {
-    int fd = open(disk_name, O_RDONLY);
-    if (fd < 0) {
-        printf("    ✗ Failed to open disk file\n");
+int test_snapshots() {
+    const char *disk_name = "test_disk_snapshot";
+    size_t disk_size = BLOCK_SIZE * 500;
+    unlink(disk_name);
+    
+    if (format_disk(disk_name, disk_size, 100) < 0) {
+        printf("    ✗ Failed to format disk\n");
         return -1;
     }
     
-    superblock_t sb;
-    if (read(fd, &sb, sizeof(sb)) != sizeof(sb)) {
-        printf("    ✗ Failed to read superblock\n");
-        close(fd);
+    // A file large enough to use the indirect block
+    size_t len = (NUM_DIRECT_BLOCKS + 8) * BLOCK_SIZE;
+    char *old_data = malloc(len);
+    char *new_data = malloc(len);
+    char *back = malloc(len);
+    memset(old_data, 'a', len);
+    memset(new_data, 'b', len);
+    
+    int file = vsfs_create(ROOT_INODE, "file", S_IFREG | 0644);
+    if (file < 0 || vsfs_write(file, 0, old_data, len) != (ssize_t)len) {
+        printf("    ✗ Failed to write file\n");
         return -1;
     }
+    uint32_t free_before = sb->num_free_blocks;
     
-    // Test disk size
-    if (sb.disk_size != expected_disk_size) {
-        printf("    ✗ Disk size mismatch: %u (expected %zu)\n", 
-               sb.disk_size, expected_disk_size);
-        close(fd);
+    int snap = vsfs_snapshot_create();
+    if (snap < 0) {
+        printf("    ✗ Failed to create snapshot\n");
         return -1;
     }
+    uint32_t free_after_snapshot = sb->num_free_blocks;
+    printf("    ✓ Snapshot %d created using %u blocks\n", snap, free_before - free_after_snapshot);
     
-    // Test max files
-    if (sb.num_max_inodes != expected_max_files) {
-        printf("    ✗ Max files mismatch: %u (expected %zu)\n", 
-               sb.num_max_inodes, expected_max_files);
-        close(fd);
+    // Overwrite one block in the indirect range: only it and the indirect block are copied
+    if (vsfs_write(file, (NUM_DIRECT_BLOCKS + 2) * BLOCK_SIZE, new_data, BLOCK_SIZE) != BLOCK_SIZE ||
+        sb->num_free_blocks != free_after_snapshot - 2) {
+        printf("    ✗ Overwrite should copy exactly 2 blocks, copied %u\n", free_after_snapshot - sb->num_free_blocks);
+        return -1;
+    }
+    if (vsfs_snapshot_read(snap, file, 0, back, len) != (ssize_t)len || memcmp(back, old_data, len) != 0) {
+        printf("    ✗ Snapshot contents changed after overwrite\n");
         return -1;
     }
+    printf("    ✓ Overwrite copies only modified blocks\n");
     
-    // Test total blocks calculation
-    size_t expected_total_blocks = expected_disk_size / BLOCK_SIZE;
-    if (sb.num_total_blocks != expected_total_blocks) {
-        printf("    ✗ Total blocks mismatch: %u (expected %zu)\n", 
-               sb.num_total_blocks, expected_total_blocks);
-        close(fd);
+    // Deleting the live file leaves the snapshot intact
+    if (vsfs_unlink(ROOT_INODE, "file") < 0 ||
+        vsfs_snapshot_read(snap, file, 0, back, len) != (ssize_t)len || memcmp(back, old_data, len) != 0) {
+        printf("    ✗ Snapshot contents lost after unlink\n");
         return -1;
     }
     
-    // Test layout consistency
-    size_t calculated_total = 1 + sb.num_inode_bitmap_blocks + sb.num_data_bitmap_blocks + sb.num_inode_table_blocks + sb.num_data_blocks;
-    if (calculated_total != sb.num_total_blocks) {
-        printf("    ✗ Layout inconsistency: 1 + %u + %u + %u + %u = %zu != %u\n",
-               sb.num_inode_bitmap_blocks, sb.num_data_bitmap_blocks, sb.num_inode_table_blocks, sb.num_data_blocks,
-               calculated_total, sb.num_total_blocks);
-        close(fd);
+    if (vsfs_snapshot_rollback(snap) < 0 || vsfs_lookup(ROOT_INODE, "file") != file ||
+        vsfs_read(file, 0, back, len) != (ssize_t)len || memcmp(back, old_data, len) != 0) {
+        printf("    ✗ Rollback did not restore the file\n");
         return -1;
     }
+    printf("    ✓ Rollback restores unlinked file\n");
     
-    printf("    ✓ Filesystem layout is consistent\n");
-    close(fd);
+    // Everything but the refcount table, which outlives the snapshot, comes back
+    if (vsfs_snapshot_delete(snap) < 0 || sb->num_free_blocks != free_before - sb->num_refcount_blocks) {
+        printf("    ✗ Deleting the snapshot leaked blocks: %u free, expected %u\n",
+               sb->num_free_blocks, free_before - sb->num_refcount_blocks);
+        return -1;
+    }
+    printf("    ✓ Deleting the snapshot frees its blocks\n");
+    
+    // A snapshot that can't reference every block gives back what it took
+    int late = vsfs_create(ROOT_INODE, "late", S_IFREG | 0644);
+    inode_t late_inode, file_inode;
+    if (late < 0 || vsfs_write(late, 0, old_data, BLOCK_SIZE) != BLOCK_SIZE || vsfs_stat(late, &late_inode) < 0 ||
+        vsfs_stat(file, &file_inode) < 0) {
+        printf("    ✗ Failed to write file\n");
+        return -1;
+    }
+    uint16_t *refcounts = (uint16_t *)block_ptr(sb->refcount_table_block);
+    refcounts[late_inode.blocks[0]] = UINT16_MAX;
+    uint32_t free_before_fail = sb->num_free_blocks;
+    if (vsfs_snapshot_create() >= 0 || sb->num_free_blocks != free_before_fail ||
+        block_refcount(file_inode.blocks[0]) != 1 || block_refcount(file_inode.indirect) != 1) {
+        printf("    ✗ Failed snapshot leaked its blocks or references\n");
+        return -1;
+    }
+    refcounts[late_inode.blocks[0]] = 1;
+    printf("    ✓ A failed snapshot leaves no blocks or references behind\n");
+    
+    free(old_data);
+    free(new_data);
+    free(back);
+    cleanup_disk(disk_map, disk_size, disk_fd);
+    unlink(disk_name);
     return 0;
 }
 
-int test_inode_table_initialization(const char *disk_name) {
-    int fd = open(disk_name, O_RDONLY);
-    if (fd < 0) {
-        printf("    ✗ Failed to open disk file\n");
+int test_dedup() {
+    const char *disk_name = "test_disk_dedup";
+    size_t disk_size = BLOCK_SIZE * 1000;
+    size_t nblocks = 20;
+    size_t len = nblocks * BLOCK_SIZE;
+    unlink(disk_name);
+    
+    if (format_disk(disk_name, disk_size, 100) < 0) {
+        printf("    ✗ Failed to format disk\n");
         return -1;
     }
     
-    superblock_t sb;
-    if (read(fd, &sb, sizeof(sb)) != sizeof(sb)) {
-        printf("    ✗ Failed to read superblock\n");
-        close(fd);
-        return -1;
+    // Four copies of the same file plus one whose blocks are all distinct
+    char *data = malloc(len);
+    char *back = malloc(len);
+    for (size_t i = 0; i < len; i++) {
+        data[i] = (char)(i / BLOCK_SIZE + 1);
+    }
+    int files[5];
+    for (int i = 0; i < 5; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "copy%d", i);
+        files[i] = vsfs_create(ROOT_INODE, name, S_IFREG | 0644);
+        if (i == 4) {
+            data[0] = 'x';
+        }
+        if (files[i] < 0 || vsfs_write(files[i], 0, data, len) != (ssize_t)len) {
+            printf("    ✗ Failed to write file %d\n", i);
+            return -1;
+        }
     }
+    data[0] = 1;
     
-    // Seek to inode table
-    if (lseek(fd, BLOCK_SIZE + sb.num_inode_bitmap_blocks * BLOCK_SIZE + sb.num_data_bitmap_blocks * BLOCK_SIZE, SEEK_SET) == -1) {
-        printf("    ✗ Failed to seek to inode table\n");
-        close(fd);
+    // A tiny memory limit forces the hash records to spill to disk
+    int saved = vsfs_dedup(1024);
+    // Copies 1-3 share everything with copy 0; the last file keeps its first block
+    if (saved != (int)(4 * nblocks - 1)) {
+        printf("    ✗ Dedup freed %d blocks, expected %zu\n", saved, 4 * nblocks - 1);
+        return -1;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (vsfs_read(files[i], 0, back, len) != (ssize_t)len || memcmp(back, data, len) != 0) {
+            printf("    ✗ File %d changed after dedup\n", i);
+            return -1;
+        }
+    }
+    printf("    ✓ Offline dedup freed %d blocks\n", saved);
+    
+    // Writing to a shared block must not leak into the other copies
+    if (vsfs_write(files[0], 0, "changed", 7) != 7 ||
+        vsfs_read(files[1], 0, back, len) != (ssize_t)len || memcmp(back, data, len) != 0) {
+        printf("    ✗ Write to a deduplicated block changed another file\n");
+        return -1;
+    }
+    printf("    ✓ Shared blocks are copied on write\n");
+    
+    // Inline mode shares blocks while writing
+    if (vsfs_dedup_inline(256) < 0) {
+        printf("    ✗ Failed to enable inline dedup\n");
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        data[i] = (char)(i / BLOCK_SIZE + 100);
+    }
+    uint32_t free_before = sb->num_free_blocks;
+    for (int i = 0; i < 3; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "inline%d", i);
+        int file = vsfs_create(ROOT_INODE, name, S_IFREG | 0644);
+        if (file < 0 || vsfs_write(file, 0, data, len) != (ssize_t)len ||
+            vsfs_read(file, 0, back, len) != (ssize_t)len || memcmp(back, data, len) != 0) {
+            printf("    ✗ Inline dedup write %d failed\n", i);
+            return -1;
+        }
+    }
+    // One copy of the data plus an indirect block per file
+    if (free_before - sb->num_free_blocks != nblocks + 3) {
+        printf("    ✗ Inline dedup used %u blocks, expected %zu\n", free_before - sb->num_free_blocks, nblocks + 3);
+        return -1;
+    }
+    printf("    ✓ Inline dedup stored three copies in %u blocks\n", free_before - sb->num_free_blocks);
+    
+    free(data);
+    free(back);
+    cleanup_disk(disk_map, disk_size, disk_fd);
+    unlink(disk_name);
+    return 0;
+}
+
+// Fill a buffer with log-like text
+static void fill_log_text(char *buf, size_t len, unsigned seed) {
+    size_t pos = 0;
+    while (pos < len) {
+        char line[128];
+        int n = snprintf(line, sizeof(line), "2026-10-18 12:%02u:%02u INFO worker-%u request %u served in %u ms\n",
+                         seed % 60, (seed / 7) % 60, seed % 8, seed, seed % 97);
+        size_t chunk = (size_t)n < len - pos ? (size_t)n : len - pos;
+        memcpy(buf + pos, line, chunk);
+        pos += chunk;
+        seed = seed * 1103515245 + 12345;
+    }
+}
+
+int test_compression() {
+    const char *disk_name = "test_disk_compress";
+    size_t disk_size = BLOCK_SIZE * 1000;
+    unlink(disk_name);
+    
+    // Codec round trips on text, zeros, random bytes and tiny inputs at every level
+    size_t max_len = CLUSTER_SIZE;
+    uint8_t *src = malloc(max_len);
+    uint8_t *packed = malloc(max_len);
+    uint8_t *back = malloc(max_len);
+    size_t lens[] = {1, 13, 100, 4096, CLUSTER_SIZE};
+    for (int kind = 0; kind < 3; kind++) {
+        if (kind == 0) {
+            fill_log_text((char *)src, max_len, 1);
+        } else if (kind == 1) {
+            memset(src, 0, max_len);
+        } else {
+            for (size_t i = 0; i < max_len; i++) {
+                src[i] = (uint8_t)(rand() >> 7);
+            }
+        }
+        for (int level = 1; level <= MAX_COMPRESS_LEVEL; level++) {
+            for (int l = 0; l < 5; l++) {
+                size_t packed_len = lz_compress(src, lens[l], packed, max_len, level);
+                if (packed_len == 0) {
+                    continue;   // didn't fit, which is allowed for random data
+                }
+                if (lz_decompress(packed, packed_len, back, max_len) != (ssize_t)lens[l] ||
+                    memcmp(src, back, lens[l]) != 0) {
+                    printf("    ✗ Round trip failed (data %d, level %d, length %zu)\n", kind, level, lens[l]);
+                    return -1;
+                }
+            }
+        }
+    }
+    size_t packed_len = lz_compress(src, 4096, packed, max_len, 1);
+    packed[packed_len / 2] ^= 0x5A;
+    lz_decompress(packed, packed_len, back, 4096);   // must not overrun, result unchecked
+    if (lz_decompress(packed, packed_len - 1, back, 10) >= 0 && packed_len > 10) {
+        printf("    ✗ Truncated input into a small buffer should be rejected\n");
+        return -1;
+    }
+    printf("    ✓ Codec round trips at every level\n");
+    
+    if (format_disk(disk_name, disk_size, 100) < 0 || vsfs_set_default_compression(3) < 0) {
+        printf("    ✗ Failed to format disk\n");
+        return -1;
+    }
+    
+    // Shadow every operation in memory and compare
+    size_t len = 3 * CLUSTER_SIZE + 1000;
+    char *shadow = calloc(len + CLUSTER_SIZE, 1);
+    char *data = malloc(len + CLUSTER_SIZE);
+    fill_log_text(shadow, len, 42);
+    
+    int file = vsfs_create(ROOT_INODE, "log", S_IFREG | 0644);
+    uint32_t free_before = sb->num_free_blocks;
+    if (file < 0 || vsfs_write(file, 0, shadow, len) != (ssize_t)len) {
+        printf("    ✗ Failed to write compressed file\n");
+        return -1;
+    }
+    uint32_t used = free_before - sb->num_free_blocks;
+    if (used * 2 > (size_t)ceildiv(len, BLOCK_SIZE)) {
+        printf("    ✗ Compressed file uses %u blocks for %zu bytes\n", used, len);
+        return -1;
+    }
+    printf("    ✓ %zu bytes of text stored in %u blocks\n", len, used);
+    
+    // Unaligned overwrite straddling two clusters, then an extension past the end
+    fill_log_text(shadow + CLUSTER_SIZE - 300, 5000, 7);
+    if (vsfs_write(file, CLUSTER_SIZE - 300, shadow + CLUSTER_SIZE - 300, 5000) != 5000) {
+        printf("    ✗ Overwrite failed\n");
+        return -1;
+    }
+    memset(shadow + len, 'z', 700);
+    if (vsfs_write(file, len + 300, shadow + len, 400) != 400) {
+        printf("    ✗ Extending write failed\n");
+        return -1;
+    }
+    memmove(shadow + len + 300, shadow + len, 400);
+    memset(shadow + len, 0, 300);
+    len += 700;
+    
+    if (vsfs_read(file, 0, data, len) != (ssize_t)len || memcmp(data, shadow, len) != 0 ||
+        vsfs_read(file, 12345, data, 777) != 777 || memcmp(data, shadow + 12345, 777) != 0) {
+        printf("    ✗ Read back does not match after overwrite\n");
+        return -1;
+    }
+    printf("    ✓ Partial overwrites and extension read back correctly\n");
+    
+    // Truncate into the middle of a compressed cluster, then grow again
+    size_t cut = CLUSTER_SIZE + 9999;
+    if (vsfs_truncate(file, cut) < 0 || vsfs_truncate(file, cut + 5000) < 0) {
+        printf("    ✗ Truncate failed\n");
+        return -1;
+    }
+    memset(shadow + cut, 0, 5000);
+    if (vsfs_read(file, 0, data, cut + 5000) != (ssize_t)(cut + 5000) || memcmp(data, shadow, cut + 5000) != 0) {
+        printf("    ✗ Read back does not match after truncate\n");
+        return -1;
+    }
+    printf("    ✓ Truncate inside a compressed cluster\n");
+    
+    if (vsfs_unlink(ROOT_INODE, "log") < 0 || sb->num_free_blocks != free_before) {
+        printf("    ✗ Unlink leaked blocks\n");
+        return -1;
+    }
+    printf("    ✓ Unlink frees the clusters and cluster map\n");
+    cleanup_disk(disk_map, disk_size, disk_fd);
+    
+    // The last cluster runs past the maximum file size; incompressible data
+    // there is stored raw and must not reach for blocks beyond the limit
+    size_t max_size = (size_t)MAX_FILE_BLOCKS * BLOCK_SIZE;
+    char *full = malloc(max_size);
+    for (size_t i = 0; i < max_size; i++) {
+        full[i] = (char)(rand() >> 7);
+    }
+    disk_size = BLOCK_SIZE * 1200;
+    if (format_disk(disk_name, disk_size, 16) < 0 || vsfs_set_default_compression(3) < 0 ||
+        (file = vsfs_create(ROOT_INODE, "full", S_IFREG | 0644)) < 0 ||
+        vsfs_write(file, 0, full, max_size) != (ssize_t)max_size) {
+        printf("    ✗ Failed to write a compressed file of the maximum size\n");
+        return -1;
+    }
+    size_t near_end = 1030 * BLOCK_SIZE;
+    memset(full + near_end, 'q', 100);
+    if (vsfs_write(file, near_end, full + near_end, 100) != 100 || vsfs_read(file, near_end - 50, data, 200) != 200 ||
+        memcmp(data, full + near_end - 50, 200) != 0 || vsfs_read(file, 0, data, 1000) != 1000 ||
+        memcmp(data, full, 1000) != 0) {
+        printf("    ✗ Last cluster of a maximum-size file doesn't read back\n");
+        return -1;
+    }
+    printf("    ✓ Last cluster of a maximum-size file reads and writes\n");
+    
+    free(full);
+    free(src);
+    free(packed);
+    free(back);
+    free(shadow);
+    free(data);
+    cleanup_disk(disk_map, disk_size, disk_fd);
+    unlink(disk_name);
+    return 0;
+}
+
+static long minor_faults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+int test_mount_options() {
+    const char *disk_name = "test_disk_mount";
+    size_t disk_size = BLOCK_SIZE * 2000;
+    unlink(disk_name);
+    
+    map_options_t opts = {
+        .populate_metadata = true,
+        .huge_pages = true,
+        .metadata_advice = POSIX_MADV_RANDOM,
+        .data_advice = POSIX_MADV_RANDOM,
+    };
+    if (format_disk_opts(disk_name, disk_size, 512, &opts) < 0) {
+        printf("    ✗ Failed to format disk with mapping options\n");
+        return -1;
+    }
+    if ((uintptr_t)disk_map % HUGE_PAGE_SIZE != 0) {
+        printf("    ✗ Huge page mapping is not aligned\n");
+        return -1;
+    }
+    
+    char data[3 * BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)(i * 7);
+    }
+    int dir = vsfs_create(ROOT_INODE, "dir", S_IFDIR | 0755);
+    int file = dir < 0 ? -1 : vsfs_create(dir, "file", S_IFREG | 0644);
+    if (file < 0 || vsfs_write(file, 0, data, sizeof(data)) != sizeof(data)) {
+        printf("    ✗ Failed to populate disk\n");
+        return -1;
+    }
+    uint32_t free_blocks = sb->num_free_blocks;
+    if (unmount_disk() < 0 || sb != NULL) {
+        printf("    ✗ Unmount failed\n");
+        return -1;
+    }
+    
+    // Remount without options, then with them; contents must survive both
+    for (int pass = 0; pass < 2; pass++) {
+        if (mount_disk(disk_name, pass == 0 ? NULL : &opts) < 0) {
+            printf("    ✗ Mount failed (pass %d)\n", pass);
+            return -1;
+        }
+        char back[sizeof(data)];
+        if (vsfs_lookup(ROOT_INODE, "dir") != dir || vsfs_lookup(dir, "file") != file ||
+            vsfs_read(file, 0, back, sizeof(back)) != sizeof(back) || memcmp(back, data, sizeof(data)) != 0 ||
+            sb->num_free_blocks != free_blocks) {
+            printf("    ✗ Contents differ after remount (pass %d)\n", pass);
+            return -1;
+        }
+        if (pass == 1) {
+            // Metadata was prefaulted, so walking it should barely fault
+            long before = minor_faults();
+            volatile char sink = 0;
+            for (size_t off = 0; off < (size_t)data_region_start() * BLOCK_SIZE; off += BLOCK_SIZE) {
+                sink ^= disk_map[off];
+            }
+            (void)sink;
+            long faults = minor_faults() - before;
+            if (faults > 2) {
+                printf("    ✗ %ld faults walking prefaulted metadata\n", faults);
+                return -1;
+            }
+        }
+        if (unmount_disk() < 0) {
+            printf("    ✗ Unmount failed (pass %d)\n", pass);
+            return -1;
+        }
+    }
+    printf("    ✓ Contents persist across unmount and remount\n");
+    printf("    ✓ Prefaulted metadata is resident after mount\n");
+    
+    // Mounting or formatting over a mounted image unmounts it first, so the
+    // new image reuses its descriptor instead of leaking it
+    const char *other_name = "test_disk_mount_other";
+    int first_fd = mount_disk(disk_name, NULL) < 0 ? -1 : disk_fd;
+    if (first_fd < 0 || mount_disk(disk_name, NULL) < 0 || disk_fd != first_fd ||
+        format_disk(other_name, disk_size, 64) < 0 || disk_fd != first_fd ||
+        mount_disk(disk_name, NULL) < 0 || disk_fd != first_fd || vsfs_lookup(ROOT_INODE, "dir") != dir) {
+        printf("    ✗ Replacing a mounted image leaked its descriptor\n");
+        return -1;
+    }
+    unmount_disk();
+    unlink(other_name);
+    printf("    ✓ Mounting over a mounted image releases it\n");
+    
+    // A file that isn't an image is rejected
+    FILE *junk = fopen(disk_name, "r+");
+    fwrite("junk", 1, 4, junk);
+    fclose(junk);
+    if (mount_disk(disk_name, NULL) == 0) {
+        printf("    ✗ Mounted an image with a bad magic number\n");
+        return -1;
+    }
+    printf("    ✓ Bad magic number is rejected\n");
+    
+    unlink(disk_name);
+    return 0;
+}
+
+#ifdef VSFS_STATS
+#define STAT_CALLS_PER_THREAD 1000
+
+static void *stat_worker(void *arg) {
+    inode_t inode;
+    for (int i = 0; i < STAT_CALLS_PER_THREAD; i++) {
+        vsfs_stat(*(int *)arg, &inode);
+    }
+    return NULL;
+}
+
+int test_stats() {
+    const char *disk_name = "test_disk_stats";
+    size_t disk_size = BLOCK_SIZE * 1000;
+    unlink(disk_name);
+    
+    vsfs_set_stats_sampling(1);
+    vsfs_reset_stats();
+    if (format_disk(disk_name, disk_size, 100) < 0) {
+        printf("    ✗ Failed to format disk\n");
+        return -1;
+    }
+    char data[3 * BLOCK_SIZE];
+    memset(data, 'q', sizeof(data));
+    int file = vsfs_create(ROOT_INODE, "file", S_IFREG | 0644);
+    if (file < 0 || vsfs_write(file, 0, data, sizeof(data)) != sizeof(data) ||
+        vsfs_read(file, 100, data, 1000) != 1000 || vsfs_lookup(ROOT_INODE, "missing") >= 0) {
+        printf("    ✗ Failed to run operations\n");
+        return -1;
+    }
+    
+    vsfs_stats_t stats;
+    if (vsfs_get_stats(&stats) < 0) {
+        printf("    ✗ vsfs_get_stats failed\n");
+        return -1;
+    }
+    if (stats.ops[VSFS_OP_FORMAT].count != 1 || stats.ops[VSFS_OP_CREATE].count != 1 ||
+        stats.ops[VSFS_OP_WRITE].count != 1 || stats.ops[VSFS_OP_READ].count != 1 ||
+        stats.ops[VSFS_OP_LOOKUP].count != 1 || stats.counters[VSFS_CTR_BYTES_WRITTEN] != sizeof(data) ||
+        stats.counters[VSFS_CTR_BYTES_READ] != 1000 || stats.counters[VSFS_CTR_BLOCKS_ALLOCATED] < 3 ||
+        stats.bitmap_scan.count == 0 || stats.ops[VSFS_OP_WRITE].sum == 0) {
+        printf("    ✗ Counts don't match the operations performed\n");
+        return -1;
+    }
+    const vsfs_histogram_t *write = &stats.ops[VSFS_OP_WRITE];
+    if (histogram_percentile(write, 50) == 0 || histogram_percentile(write, 50) > write->max) {
+        printf("    ✗ Latency percentile out of range\n");
+        return -1;
+    }
+    printf("    ✓ Operation counts, bytes and latencies recorded\n");
+    
+    // Counts from other threads are merged on demand (the threads take turns,
+    // since the filesystem itself is not thread-safe)
+    for (int t = 0; t < 2; t++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, stat_worker, &file);
+        pthread_join(thread, NULL);
+    }
+    vsfs_get_stats(&stats);
+    if (stats.ops[VSFS_OP_STAT].count != 2 * STAT_CALLS_PER_THREAD) {
+        printf("    ✗ Expected %d stats, merged %llu\n", 2 * STAT_CALLS_PER_THREAD,
+               (unsigned long long)stats.ops[VSFS_OP_STAT].count);
+        return -1;
+    }
+    printf("    ✓ Per-thread statistics merge\n");
+    
+    FILE *out = tmpfile();
+    char text[64] = {0};
+    vsfs_dump_stats(out, &stats, true);
+    rewind(out);
+    if (fread(text, 1, sizeof(text) - 1, out) == 0 || strncmp(text, "{\n  \"ops\": {", 12) != 0) {
+        printf("    ✗ JSON dump malformed\n");
+        return -1;
+    }
+    fclose(out);
+    
+    vsfs_reset_stats();
+    vsfs_get_stats(&stats);
+    if (stats.ops[VSFS_OP_STAT].count != 0 || stats.counters[VSFS_CTR_BYTES_WRITTEN] != 0) {
+        printf("    ✗ Reset left counts behind\n");
+        return -1;
+    }
+    vsfs_set_stats_sampling(4);
+    printf("    ✓ Dump and reset\n");
+    
+    cleanup_disk(disk_map, disk_size, disk_fd);
+    unlink(disk_name);
+    return 0;
+}
+#else
+int test_stats() {
+    printf("    - Built without VSFS_STATS, skipping\n");
+    return 0;
+}
+#endif
+
+int test_inode_cache() {
+    const char *disk_name = "test_disk_icache";
+    size_t disk_size = BLOCK_SIZE * 4000;
+    const int nfiles = ICACHE_CAPACITY + ICACHE_CAPACITY / 2;
+    unlink(disk_name);
+    
+    if (format_disk(disk_name, disk_size, nfiles + 1) < 0) {
+        printf("    ✗ Failed to format disk\n");
+        return -1;
+    }
+    
+    // Updates stay in the cache until fsync
+    int file = vsfs_create(ROOT_INODE, "hot", S_IFREG | 0644);
+    inode_t on_disk;
+    for (int i = 0; i < 100; i++) {
+        if (vsfs_write(file, i * 10, "0123456789", 10) != 10) {
+            printf("    ✗ Write failed\n");
+            return -1;
+        }
+    }
+    memcpy(&on_disk, inode_table + (size_t)file * INODE_SIZE, sizeof(inode_t));
+    if (on_disk.size != 0) {
+        printf("    ✗ Hot inode was written to the table on every update\n");
+        return -1;
+    }
+    if (vsfs_fsync(file) < 0) {
+        printf("    ✗ fsync failed\n");
+        return -1;
+    }
+    memcpy(&on_disk, inode_table + (size_t)file * INODE_SIZE, sizeof(inode_t));
+    if (on_disk.size != 1000) {
+        printf("    ✗ fsync did not write the inode back (size %u)\n", on_disk.size);
+        return -1;
+    }
+    printf("    ✓ Dirty inode stays cached until fsync\n");
+    
+    // More files than the cache holds, so dirty inodes get evicted
+    for (int i = 1; i < nfiles; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "f%d", i);
+        int ino = vsfs_create(ROOT_INODE, name, S_IFREG | 0644);
+        if (ino < 0 || vsfs_write(ino, 0, name, strlen(name)) != (ssize_t)strlen(name)) {
+            printf("    ✗ Failed to create %s\n", name);
+            return -1;
+        }
+    }
+    if (vsfs_unlink(ROOT_INODE, "f7") < 0) {
+        printf("    ✗ Unlink failed\n");
+        return -1;
+    }
+    cleanup_disk(disk_map, disk_size, disk_fd);
+    
+    if (mount_disk(disk_name, NULL) < 0) {
+        printf("    ✗ Remount failed\n");
+        return -1;
+    }
+    inode_t inode;
+    if (vsfs_lookup(ROOT_INODE, "f7") >= 0 || vsfs_stat(file, &inode) < 0 || inode.size != 1000) {
+        printf("    ✗ Inode state lost across remount\n");
+        return -1;
+    }
+    for (int i = 1; i < nfiles; i++) {
+        char name[32], back[32] = {0};
+        snprintf(name, sizeof(name), "f%d", i);
+        if (i == 7) {
+            continue;
+        }
+        int ino = vsfs_lookup(ROOT_INODE, name);
+        if (ino < 0 || vsfs_stat(ino, &inode) < 0 || inode.size != strlen(name) ||
+            vsfs_read(ino, 0, back, sizeof(back)) != (ssize_t)strlen(name) || strcmp(back, name) != 0) {
+            printf("    ✗ %s lost after eviction and remount\n", name);
+            return -1;
+        }
+    }
+    printf("    ✓ %d inodes survive eviction, unmount and remount\n", nfiles);
+    
+    // A pinned inode is never evicted, however many others are loaded
+    inode_t *pinned = icache_get(file);
+    for (int i = 1; i < nfiles; i++) {
+        vsfs_stat(i, &inode);
+    }
+    if (pinned == NULL || icache_lookup(file, false) != pinned || pinned->size != 1000) {
+        printf("    ✗ Pinned inode was evicted\n");
+        return -1;
+    }
+    if (mount_disk(disk_name, NULL) == 0 || icache_lookup(file, false) != pinned) {
+        printf("    ✗ Remounted while an inode was pinned\n");
+        return -1;
+    }
+    icache_put(pinned);
+    printf("    ✓ Pinned inodes stay resident and hold off a remount\n");
+    
+    unmount_disk();
+    unlink(disk_name);
+    return 0;
+}
+
+// Set a file's timestamps relative to now
+static int set_times(int ino, int atime_ago, int mtime_ago) {
+    inode_t inode;
+    uint32_t now = time(NULL);
+    if (read_inode(ino, &inode) < 0) {
+        return -1;
+    }
+    inode.atime = now - atime_ago;
+    inode.mtime = inode.ctime = now - mtime_ago;
+    return write_inode(ino, &inode);
+}
+
+static uint32_t file_atime(int ino) {
+    inode_t inode;
+    vsfs_stat(ino, &inode);
+    return inode.atime;
+}
+
+int test_timestamps() {
+    const char *disk_name = "test_disk_times";
+    size_t disk_size = BLOCK_SIZE * 1000;
+    const int day = 24 * 60 * 60;
+    char buf[100];
+    unlink(disk_name);
+    
+    // noatime: reads never move atime
+    map_options_t opts = {.atime_mode = VSFS_NOATIME};
+    if (format_disk_opts(disk_name, disk_size, 100, &opts) < 0) {
+        printf("    ✗ Failed to format disk\n");
+        return -1;
+    }
+    int file = vsfs_create(ROOT_INODE, "file", S_IFREG | 0644);
+    if (file < 0 || vsfs_write(file, 0, "timestamps", 10) != 10 || set_times(file, 2 * day, 3 * day) < 0) {
+        printf("    ✗ Failed to create file\n");
+        return -1;
+    }
+    uint32_t old_atime = file_atime(file);
+    vsfs_read(file, 0, buf, 10);
+    if (file_atime(file) != old_atime) {
+        printf("    ✗ noatime updated atime\n");
+        return -1;
+    }
+    printf("    ✓ noatime leaves atime alone\n");
+    unmount_disk();
+    
+    // relatime: only an atime older than mtime or a day is refreshed
+    if (mount_disk(disk_name, NULL) < 0) {
+        printf("    ✗ Remount failed\n");
+        return -1;
+    }
+    set_times(file, 60, 120);
+    old_atime = file_atime(file);
+    vsfs_read(file, 0, buf, 10);
+    if (file_atime(file) != old_atime) {
+        printf("    ✗ relatime refreshed a recent atime\n");
+        return -1;
+    }
+    set_times(file, 120, 60);
+    vsfs_read(file, 0, buf, 10);
+    if (file_atime(file) <= old_atime) {
+        printf("    ✗ relatime kept an atime older than mtime\n");
+        return -1;
+    }
+    set_times(file, 2 * day, 3 * day);
+    vsfs_read(file, 0, buf, 10);
+    if (file_atime(file) < (uint32_t)time(NULL) - 60) {
+        printf("    ✗ relatime kept a day-old atime\n");
+        return -1;
+    }
+    printf("    ✓ relatime refreshes only stale access times\n");
+    unmount_disk();
+    
+    // lazytime: atime changes stay in memory until fsync
+    opts = (map_options_t){.atime_mode = VSFS_STRICTATIME, .lazytime = true};
+    if (mount_disk(disk_name, &opts) < 0) {
+        printf("    ✗ Remount failed\n");
+        return -1;
+    }
+    set_times(file, 2 * day, 3 * day);
+    vsfs_fsync(file);
+    size_t table_size = (size_t)sb->num_inode_table_blocks * BLOCK_SIZE;
+    char *table_copy = malloc(table_size);
+    memcpy(table_copy, inode_table, table_size);
+    for (int i = 0; i < 100; i++) {
+        vsfs_read(file, 0, buf, 10);
+    }
+    if (memcmp(table_copy, inode_table, table_size) != 0) {
+        printf("    ✗ Reads under lazytime wrote the inode table\n");
+        return -1;
+    }
+    if (file_atime(file) < (uint32_t)time(NULL) - 60) {
+        printf("    ✗ lazytime lost the in-memory atime\n");
+        return -1;
+    }
+    vsfs_fsync(file);
+    inode_t on_disk;
+    memcpy(&on_disk, inode_table + (size_t)file * INODE_SIZE, sizeof(inode_t));
+    if (on_disk.atime != file_atime(file)) {
+        printf("    ✗ fsync did not persist the lazy atime\n");
+        return -1;
+    }
+    printf("    ✓ lazytime keeps reads free of inode table writes until fsync\n");
+    
+    // Any other change writes the timestamps along with it, here when enough
+    // new inodes are dirtied to trigger a batch writeback
+    set_times(file, 2 * day, 3 * day);
+    vsfs_read(file, 0, buf, 10);
+    if (vsfs_truncate(file, 5) < 0) {
+        printf("    ✗ Truncate failed\n");
+        return -1;
+    }
+    for (int i = 0; i < ICACHE_DIRTY_BATCH; i++) {
+        snprintf(buf, sizeof(buf), "batch%d", i);
+        vsfs_create(ROOT_INODE, buf, S_IFREG | 0644);
+    }
+    memcpy(&on_disk, inode_table + (size_t)file * INODE_SIZE, sizeof(inode_t));
+    if (on_disk.size != 5 || on_disk.atime != file_atime(file)) {
+        printf("    ✗ Lazy atime not written with the next real change\n");
+        return -1;
+    }
+    printf("    ✓ Lazy timestamps ride along with other inode changes\n");
+    
+    free(table_copy);
+    unmount_disk();
+    unlink(disk_name);
+    return 0;
+}
+
+int test_batch_ops() {
+    const char *disk_name = "test_disk_batch";
+    size_t disk_size = BLOCK_SIZE * 2000;
+    const size_t n = 500;
+    unlink(disk_name);
+    
+    if (format_disk(disk_name, disk_size, 1000) < 0) {
+        printf("    ✗ Failed to format disk\n");
+        return -1;
+    }
+    int dir = vsfs_create(ROOT_INODE, "dir", S_IFDIR | 0755);
+    if (dir < 0 || vsfs_create(dir, "single", S_IFREG | 0644) < 0) {
+        printf("    ✗ Failed to create directory\n");
+        return -1;
+    }
+    uint32_t free_inodes = sb->num_max_inodes - sb->num_used_inodes;
+    uint32_t free_blocks = sb->num_free_blocks;
+    
+    char (*storage)[24] = malloc(n * sizeof(*storage));
+    const char **names = malloc(n * sizeof(char *));
+    uint32_t *inos = malloc(n * sizeof(uint32_t));
+    for (size_t i = 0; i < n; i++) {
+        snprintf(storage[i], sizeof(storage[i]), "b%zu", i);
+        names[i] = storage[i];
+    }
+    
+    // Clashes, within the batch or with the directory, leave nothing behind
+    names[n - 1] = "b0";
+    if (vsfs_create_batch(dir, names, n, S_IFREG | 0644, inos) >= 0) {
+        printf("    ✗ Batch with a repeated name was accepted\n");
+        return -1;
+    }
+    names[n - 1] = "single";
+    if (vsfs_create_batch(dir, names, n, S_IFREG | 0644, inos) >= 0) {
+        printf("    ✗ Batch clashing with an existing entry was accepted\n");
+        return -1;
+    }
+    names[n - 1] = storage[n - 1];
+    if (sb->num_max_inodes - sb->num_used_inodes != free_inodes || sb->num_free_blocks != free_blocks) {
+        printf("    ✗ Rejected batch leaked inodes or blocks\n");
+        return -1;
+    }
+    printf("    ✓ Clashing batches are rejected without side effects\n");
+    
+    if (vsfs_create_batch(dir, names, n, S_IFREG | 0644, inos) != (int)n) {
+        printf("    ✗ Batch create failed\n");
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        inode_t inode;
+        if (vsfs_lookup(dir, names[i]) != (int)inos[i] || vsfs_stat(inos[i], &inode) < 0 ||
+            !S_ISREG(inode.mode) || inode.nlinks != 1 || (i > 0 && inos[i] != inos[i - 1] + 1)) {
+            printf("    ✗ Entry %s missing or not in a contiguous inode run\n", names[i]);
+            return -1;
+        }
+    }
+    if (vsfs_write(inos[3], 0, "data", 4) != 4) {
+        printf("    ✗ Batch-created file is not writable\n");
+        return -1;
+    }
+    printf("    ✓ %zu entries created with contiguous inodes\n", n);
+    
+    // Unlink every other entry, then refill the gaps with a second batch
+    const char **half = malloc(n / 2 * sizeof(char *));
+    for (size_t i = 0; i < n / 2; i++) {
+        half[i] = names[2 * i];
+    }
+    const char *missing[] = {"b1", "nope"};
+    if (vsfs_unlink_batch(dir, missing, 2) >= 0 || vsfs_lookup(dir, "b1") < 0) {
+        printf("    ✗ Unlink batch with a missing name was applied\n");
+        return -1;
+    }
+    uint32_t dir_size_before;
+    inode_t dir_inode;
+    vsfs_stat(dir, &dir_inode);
+    dir_size_before = dir_inode.size;
+    if (vsfs_unlink_batch(dir, half, n / 2) != (int)(n / 2) || vsfs_lookup(dir, "b0") >= 0 ||
+        vsfs_lookup(dir, "b1") != (int)inos[1]) {
+        printf("    ✗ Unlink batch failed\n");
+        return -1;
+    }
+    for (size_t i = 0; i < n / 2; i++) {
+        snprintf(storage[2 * i], sizeof(storage[0]), "r%zu", i);
+    }
+    if (vsfs_create_batch(dir, half, n / 2, S_IFREG | 0644, inos) != (int)(n / 2) ||
+        vsfs_lookup(dir, "r7") != (int)inos[7]) {
+        printf("    ✗ Refill batch failed\n");
+        return -1;
+    }
+    vsfs_stat(dir, &dir_inode);
+    if (dir_inode.size != dir_size_before) {
+        printf("    ✗ Refill grew the directory instead of reusing free slots\n");
+        return -1;
+    }
+    printf("    ✓ Unlink batch frees slots that later batches reuse\n");
+    
+    // Removing everything returns the inodes and blocks
+    for (size_t i = 0; i < n; i++) {
+        if (i % 2 == 1) {
+            snprintf(storage[i], sizeof(storage[0]), "b%zu", i);
+        }
+        names[i] = storage[i];
+    }
+    if (vsfs_unlink_batch(dir, names, n) != (int)n ||
+        sb->num_max_inodes - sb->num_used_inodes != free_inodes) {
+        printf("    ✗ Unlinking everything did not free every inode\n");
+        return -1;
+    }
+    printf("    ✓ Unlinking the batch frees every inode\n");
+    
+    // An inode that can't be released stops the batch there, keeping its
+    // entry and everything after it
+    const char *damaged[] = {"d0", "d1", "d2"};
+    inode_t bad;
+    if (vsfs_create_batch(dir, damaged, 3, S_IFREG | 0644, inos) != 3 || vsfs_write(inos[1], 0, "x", 1) != 1 ||
+        vsfs_stat(inos[1], &bad) < 0) {
+        printf("    ✗ Failed to set up a damaged inode\n");
+        return -1;
+    }
+    bad.blocks[0] = 1;   // an inode bitmap block, which no file can own
+    write_inode(inos[1], &bad);
+    if (vsfs_unlink_batch(dir, damaged, 3) != 1 || vsfs_lookup(dir, "d0") >= 0 ||
+        vsfs_lookup(dir, "d1") != (int)inos[1] || vsfs_lookup(dir, "d2") != (int)inos[2] ||
+        vsfs_stat(inos[1], &bad) < 0 || bad.nlinks != 1) {
+        printf("    ✗ A failed release did not stop the batch at that entry\n");
+        return -1;
+    }
+    printf("    ✓ A damaged inode stops the batch and the count says where\n");
+    
+    // With the directory shared by a snapshot and the disk full, batches
+    // that would need to copy a directory block fail without side effects
+    const char *kept[] = {"k0", "k1"};
+    const char *more[] = {"y0", "y1"};
+    if (vsfs_create_batch(dir, kept, 2, S_IFREG | 0644, inos) != 2 || vsfs_snapshot_create() < 0) {
+        printf("    ✗ Failed to set up a shared directory\n");
+        return -1;
+    }
+    static char chunk[64 * 1024];
+    for (int f = 0; sb->num_free_blocks > 0; f++) {
+        char name[16];
+        snprintf(name, sizeof(name), "fill%d", f);
+        int ino = vsfs_create(ROOT_INODE, name, S_IFREG | 0644);
+        for (size_t off = 0; ino >= 0 && sb->num_free_blocks > 0 && off + sizeof(chunk) <= (size_t)MAX_FILE_BLOCKS * BLOCK_SIZE;
+             off += sizeof(chunk)) {
+            vsfs_write(ino, off, chunk, sizeof(chunk));
+        }
+        if (ino < 0) {
+            printf("    ✗ Failed to fill the disk\n");
+            return -1;
+        }
+    }
+    uint32_t used_inodes = sb->num_used_inodes;
+    if (vsfs_create_batch(dir, more, 2, S_IFREG | 0644, inos) >= 0 || sb->num_used_inodes != used_inodes ||
+        vsfs_lookup(dir, "y0") >= 0) {
+        printf("    ✗ Batch create on a full disk leaked inodes\n");
+        return -1;
+    }
+    if (vsfs_unlink_batch(dir, kept, 2) >= 0 || sb->num_used_inodes != used_inodes ||
+        vsfs_lookup(dir, "k0") < 0 || vsfs_lookup(dir, "k1") < 0) {
+        printf("    ✗ Unlink batch on a full disk removed entries\n");
+        return -1;
+    }
+    printf("    ✓ Batches that can't unshare the directory change nothing\n");
+    
+    free(storage);
+    free(names);
+    free(half);
+    free(inos);
+    cleanup_disk(disk_map, disk_size, disk_fd);
+    unlink(disk_name);
+    return 0;
+}
+
+int test_disk_file_creation(const char *disk_name, size_t expected_size) {
+    struct stat st;
+    
+    if (stat(disk_name, &st) != 0) {
+        printf("    ✗ Disk file was not created\n");
+        return -1;
+    }
+    
+    if ((size_t)st.st_size != expected_size) {
+        printf("    ✗ Disk file size mismatch: expected %zu, got %ld\n", 
+               expected_size, st.st_size);
+        return -1;
+    }
+    
+    printf("    ✓ Disk file created with correct size\n");
+    return 0;
+}
+
+int test_superblock_validity(const char *disk_name) {
+    int fd = open(disk_name, O_RDONLY);
+    if (fd < 0) {
+        printf("    ✗ Failed to open disk file for reading\n");
+        return -1;
+    }
+    
+    superblock_t sb;
+    if (read(fd, &sb, sizeof(sb)) != sizeof(sb)) {
+        printf("    ✗ Failed to read superblock\n");
+        close(fd);
+        return -1;
+    }
+    
+    // Test magic number
+    if (sb.magic != VSFS_MAGIC) {
+        printf("    ✗ Invalid magic number: 0x%08x (expected 0x%08x)\n", 
+               sb.magic, VSFS_MAGIC);
+        close(fd);
+        return -1;
+    }
+    
+    // Test block size
+    if (sb.block_size != BLOCK_SIZE) {
+        printf("    ✗ Invalid block size: %u (expected %d)\n", 
+               sb.block_size, BLOCK_SIZE);
+        close(fd);
+        return -1;
+    }
+    
+    // Test used inodes (should be 1 after root directory creation)
+    if (sb.num_used_inodes != 1) {
+        printf("    ✗ Invalid used inodes: %u (expected 1)\n", sb.num_used_inodes);
+        close(fd);
+        return -1;
+    }
+    
+    printf("    ✓ Superblock is valid\n");
+    close(fd);
+    return 0;
+}
+
+int test_filesystem_layout(const char *disk_name, size_t expected_disk_size, size_t expected_max_files) {
+    int fd = open(disk_name, O_RDONLY);
+    if (fd < 0) {
+        printf("    ✗ Failed to open disk file\n");
+        return -1;
+    }
+    
+    superblock_t sb;
+    if (read(fd, &sb, sizeof(sb)) != sizeof(sb)) {
+        printf("    ✗ Failed to read superblock\n");
+        close(fd);
+        return -1;
+    }
+    
+    // Test disk size
+    if (sb.disk_size != expected_disk_size) {
+        printf("    ✗ Disk size mismatch: %u (expected %zu)\n", 
+               sb.disk_size, expected_disk_size);
+        close(fd);
+        return -1;
+    }
+    
+    // Test max files
+    if (sb.num_max_inodes != expected_max_files) {
+        printf("    ✗ Max files mismatch: %u (expected %zu)\n", 
+               sb.num_max_inodes, expected_max_files);
+        close(fd);
+        return -1;
+    }
+    
+    // Test total blocks calculation
+    size_t expected_total_blocks = expected_disk_size / BLOCK_SIZE;
+    if (sb.num_total_blocks != expected_total_blocks) {
+        printf("    ✗ Total blocks mismatch: %u (expected %zu)\n", 
+               sb.num_total_blocks, expected_total_blocks);
+        close(fd);
+        return -1;
+    }
+    
+    // Test layout consistency
+    size_t calculated_total = 1 + sb.num_inode_bitmap_blocks + sb.num_data_bitmap_blocks + sb.num_inode_table_blocks + sb.num_data_blocks;
+    if (calculated_total != sb.num_total_blocks) {
+        printf("    ✗ Layout inconsistency: 1 + %u + %u + %u + %u = %zu != %u\n",
+               sb.num_inode_bitmap_blocks, sb.num_data_bitmap_blocks, sb.num_inode_table_blocks, sb.num_data_blocks,
+               calculated_total, sb.num_total_blocks);
+        close(fd);
+        return -1;
+    }
+    
+    printf("    ✓ Filesystem layout is consistent\n");
+    close(fd);
+    return 0;
+}
+
+int test_inode_table_initialization(const char *disk_name) {
+    int fd = open(disk_name, O_RDONLY);
+    if (fd < 0) {
+        printf("    ✗ Failed to open disk file\n");
+        return -1;
+    }
+    
+    superblock_t sb;
+    if (read(fd, &sb, sizeof(sb)) != sizeof(sb)) {
+        printf("    ✗ Failed to read superblock\n");
+        close(fd);
+        return -1;
+    }
+    
+    // Seek to inode table
+    if (lseek(fd, BLOCK_SIZE + sb.num_inode_bitmap_blocks * BLOCK_SIZE + sb.num_data_bitmap_blocks * BLOCK_SIZE, SEEK_SET) == -1) {
+        printf("    ✗ Failed to seek to inode table\n");
+        close(fd);
         return -1;
     }
     
@@ -413,186 +1755,1416 @@ int test_inode_table_initialization(const char *disk_name) {
             close(fd);
             return -1;
         }
-        
-        inode_t test_inode;
-        if (read(fd, &test_inode, sizeof(test_inode)) != sizeof(test_inode)) {
-            printf("    ✗ Failed to read inode %d\n", i);
-            close(fd);
+        
+        inode_t test_inode;
+        if (read(fd, &test_inode, sizeof(test_inode)) != sizeof(test_inode)) {
+            printf("    ✗ Failed to read inode %d\n", i);
+            close(fd);
+            return -1;
+        }
+        
+        // All inodes except root should be zeroed
+        if (test_inode.size != 0 || test_inode.nlinks != 0 || 
+            test_inode.atime != 0 || test_inode.mtime != 0 || test_inode.ctime != 0) {
+            printf("    ✗ Inode %d should be zeroed, but has non-zero values\n", i);
+            close(fd);
+            return -1;
+        }
+    }
+    
+    printf("    ✓ Inode table initialized correctly (free inodes are zeroed)\n");
+    close(fd);
+    return 0;
+}
+
+int test_bitmap_initialization(const char *disk_name) {
+    int fd = open(disk_name, O_RDONLY);
+    if (fd < 0) {
+        printf("    ✗ Failed to open disk file\n");
+        return -1;
+    }
+    
+    superblock_t sb;
+    if (read(fd, &sb, sizeof(sb)) != sizeof(sb)) {
+        printf("    ✗ Failed to read superblock\n");
+        close(fd);
+        return -1;
+    }
+    
+    // Seek to data bitmap (after inode bitmap)
+    if (lseek(fd, BLOCK_SIZE + sb.num_inode_bitmap_blocks * BLOCK_SIZE, SEEK_SET) == -1) {
+        printf("    ✗ Failed to seek to data bitmap\n");
+        close(fd);
+        return -1;
+    }
+    
+    // Read data bitmap data
+    size_t bitmap_size = sb.num_data_bitmap_blocks * BLOCK_SIZE;
+    char *bitmap_data = malloc(bitmap_size);
+    if (!bitmap_data) {
+        printf("    ✗ Failed to allocate memory for bitmap\n");
+        close(fd);
+        return -1;
+    }
+    
+    if (read(fd, bitmap_data, bitmap_size) != (ssize_t)bitmap_size) {
+        printf("    ✗ Failed to read bitmap data\n");
+        free(bitmap_data);
+        close(fd);
+        return -1;
+    }
+    
+    // Test that metadata blocks are marked as used
+    size_t num_metadata_blocks = 1 + sb.num_inode_bitmap_blocks + sb.num_data_bitmap_blocks;
+    for (size_t i = 0; i < num_metadata_blocks; i++) {
+        int block_status = bitmapget(bitmap_data, sb.num_total_blocks, i);
+        if (block_status != 1) {
+            printf("    ✗ Block %zu (metadata) should be marked as used, got %d\n", i, block_status);
+            free(bitmap_data);
+            close(fd);
+            return -1;
+        }
+    }
+    
+    // Test that data blocks are free (0)
+    int free_blocks = 0;
+    size_t start_data_blocks = num_metadata_blocks + sb.num_inode_table_blocks;
+    size_t end_test = (start_data_blocks + 100 < sb.num_total_blocks) ? start_data_blocks + 100 : sb.num_total_blocks;
+    
+    for (size_t i = start_data_blocks; i < end_test; i++) {
+        int status = bitmapget(bitmap_data, sb.num_total_blocks, i);
+        if (status == 0) {
+            free_blocks++;
+        } else if (status < 0) {
+            printf("    ✗ Error reading bitmap at index %zu\n", i);
+            free(bitmap_data);
+            close(fd);
+            return -1;
+        }
+    }
+    
+    // Most data blocks should be free initially
+    size_t num_data_blocks_tested = end_test - start_data_blocks;
+    if (num_data_blocks_tested > 0 && free_blocks < (int)(num_data_blocks_tested * 0.9)) {
+        printf("    ✗ Too few free data blocks found: %d out of %zu\n", free_blocks, num_data_blocks_tested);
+        free(bitmap_data);
+        close(fd);
+        return -1;
+    }
+    
+    printf("    ✓ Bitmap initialized correctly (metadata blocks used, data blocks free)\n");
+    free(bitmap_data);
+    close(fd);
+    return 0;
+}
+
+int test_root_directory_creation(const char *disk_name) {
+    int fd = open(disk_name, O_RDONLY);
+    if (fd < 0) {
+        printf("    ✗ Failed to open disk file\n");
+        return -1;
+    }
+    
+    superblock_t sb;
+    if (read(fd, &sb, sizeof(sb)) != sizeof(sb)) {
+        printf("    ✗ Failed to read superblock\n");
+        close(fd);
+        return -1;
+    }
+    
+    // Seek to inode table
+    if (lseek(fd, BLOCK_SIZE + sb.num_inode_bitmap_blocks * BLOCK_SIZE + sb.num_data_bitmap_blocks * BLOCK_SIZE, SEEK_SET) == -1) {
+        printf("    ✗ Failed to seek to inode table\n");
+        close(fd);
+        return -1;
+    }
+    
+    // Read root inode (inode 0)
+    inode_t root_inode;
+    if (read(fd, &root_inode, sizeof(root_inode)) != sizeof(root_inode)) {
+        printf("    ✗ Failed to read root inode\n");
+        close(fd);
+        return -1;
+    }
+    
+    // Test root inode properties
+    if (root_inode.size != 0) {
+        printf("    ✗ Root inode size should be 0, got %u\n", root_inode.size);
+        close(fd);
+        return -1;
+    }
+    
+    if (root_inode.nlinks != 2) {
+        printf("    ✗ Root inode nlinks should be 2, got %u\n", root_inode.nlinks);
+        close(fd);
+        return -1;
+    }
+    
+    // Test that root inode has valid timestamps
+    if (root_inode.atime == 0 || root_inode.mtime == 0 || root_inode.ctime == 0) {
+        printf("    ✗ Root inode timestamps should be set\n");
+        close(fd);
+        return -1;
+    }
+    
+    printf("    ✓ Root directory inode structure is correct\n");
+    close(fd);
+    return 0;
+}
+
+size_t calculate_minimum_blocks(size_t max_files) {
+    // Calculate minimum blocks needed for a filesystem with max_files
+    // This mirrors the logic in calculate_layout() in mkfs.c
+    
+    size_t num_superblock_blocks = 1;
+    size_t num_inode_bitmap_blocks = ceildiv(max_files, BLOCK_SIZE * 8);
+    size_t num_inode_table_blocks = ceildiv(max_files * INODE_SIZE, BLOCK_SIZE);
+    
+    // For data bitmap, we need to know total blocks, so we calculate iteratively
+    // Start with minimum estimate
+    size_t total_blocks = num_superblock_blocks + num_inode_bitmap_blocks + num_inode_table_blocks + 1; // +1 for data bitmap
+    
+    // Recalculate data bitmap with the estimated total
+    size_t num_data_bitmap_blocks = ceildiv(total_blocks, BLOCK_SIZE * 8);
+    
+    // Recalculate total with correct data bitmap size
+    total_blocks = num_superblock_blocks + num_inode_bitmap_blocks + num_inode_table_blocks + num_data_bitmap_blocks;
+    
+    // If data bitmap size changed, recalculate once more
+    size_t new_data_bitmap_blocks = ceildiv(total_blocks, BLOCK_SIZE * 8);
+    if (new_data_bitmap_blocks != num_data_bitmap_blocks) {
+        total_blocks = num_superblock_blocks + num_inode_bitmap_blocks + num_inode_table_blocks + new_data_bitmap_blocks;
+    }
+    
+    return total_blocks;
+}
+
+int test_readdir_plus() {
+    const char *disk_name = "test_disk_readdir";
+    const size_t n = 300;
+    unlink(disk_name);
+    
+    if (format_disk(disk_name, BLOCK_SIZE * 2000, 1000) < 0) {
+        printf("    ✗ Failed to format disk\n");
+        return -1;
+    }
+    int dir = vsfs_create(ROOT_INODE, "dir", S_IFDIR | 0755);
+    int file = vsfs_create(ROOT_INODE, "file", S_IFREG | 0644);
+    if (dir < 0 || file < 0) {
+        printf("    ✗ Failed to create directory\n");
+        return -1;
+    }
+    
+    // Interleave the entries with inodes allocated elsewhere so that
+    // directory order and inode order disagree
+    char name[32];
+    bool *seen = calloc(n, sizeof(bool));
+    for (size_t i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "e%zu", n - 1 - i);
+        if (vsfs_create(dir, name, S_IFREG | 0644) < 0) {
+            printf("    ✗ Failed to create %s\n", name);
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < n; i += 10) {
+        snprintf(name, sizeof(name), "e%zu", i);
+        if (vsfs_unlink(dir, name) < 0) {
+            printf("    ✗ Failed to unlink %s\n", name);
+            return -1;
+        }
+        seen[i] = true;
+    }
+    
+    // Leave one inode dirty in the cache; the listing must see its new size
+    int dirty = vsfs_lookup(dir, "e7");
+    if (dirty < 0 || vsfs_write(dirty, 0, "hello", 5) != 5) {
+        printf("    ✗ Failed to write e7\n");
+        return -1;
+    }
+    
+    dirent_plus_t buf[32];
+    size_t cursor = 0, listed = 0;
+    int got;
+    while ((got = vsfs_readdir_plus(dir, &cursor, buf, 32)) > 0) {
+        for (int i = 0; i < got; i++) {
+            inode_t inode;
+            size_t idx = strtoul(buf[i].name + 1, NULL, 10);
+            if (buf[i].name[0] != 'e' || idx >= n || seen[idx] || vsfs_lookup(dir, buf[i].name) != (int)buf[i].ino ||
+                vsfs_stat(buf[i].ino, &inode) < 0 || memcmp(&inode, &buf[i].inode, sizeof(inode_t)) != 0) {
+                printf("    ✗ Bad or repeated entry %s\n", buf[i].name);
+                return -1;
+            }
+            seen[idx] = true;
+            listed++;
+        }
+    }
+    if (got < 0 || listed != n - n / 10) {
+        printf("    ✗ Listed %zu of %zu entries\n", listed, n - n / 10);
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!seen[i]) {
+            printf("    ✗ Entry e%zu was not listed\n", i);
+            return -1;
+        }
+    }
+    printf("    ✓ %zu entries listed in batches of 32 with matching attributes\n", listed);
+    
+    inode_t dirty_inode;
+    vsfs_stat(dirty, &dirty_inode);
+    if (dirty_inode.size != 5) {
+        printf("    ✗ Cached size was not reported\n");
+        return -1;
+    }
+    cursor = 0;
+    if (vsfs_readdir_plus(file, &cursor, buf, 32) >= 0) {
+        printf("    ✗ Listing a regular file succeeded\n");
+        return -1;
+    }
+    printf("    ✓ Cached attributes are reported and files are rejected\n");
+    
+    free(seen);
+    cleanup_disk(disk_map, sb->disk_size, disk_fd);
+    unlink(disk_name);
+    return 0;
+}
+
+// Contents of small file `i` in the tail packing test
+static size_t tail_file_fill(size_t i, char *buf, int seed) {
+    size_t len = 100 + i * 5;
+    for (size_t j = 0; j < len; j++) {
+        buf[j] = (char)(i * 7 + j + seed);
+    }
+    return len;
+}
+
+static int tail_file_check(int snap, uint32_t ino, size_t i, int seed) {
+    char want[BLOCK_SIZE], got[BLOCK_SIZE];
+    size_t len = tail_file_fill(i, want, seed);
+    ssize_t n = snap < 0 ? vsfs_read(ino, 0, got, sizeof(got)) : vsfs_snapshot_read(snap, ino, 0, got, sizeof(got));
+    return n == (ssize_t)len && memcmp(want, got, len) == 0 ? 0 : -1;
+}
+
+int test_tail_packing() {
+    const char *disk_name = "test_disk_tail";
+    const size_t n = 200;
+    unlink(disk_name);
+    
+    if (format_disk(disk_name, BLOCK_SIZE * 2000, 1000) < 0) {
+        printf("    ✗ Failed to format disk\n");
+        return -1;
+    }
+    vsfs_set_tail_packing(true);
+    uint32_t free_before = sb->num_free_blocks;
+    inode_t inode;
+    
+    char buf[2 * BLOCK_SIZE];
+    uint32_t inos[200];
+    for (size_t i = 0; i < n; i++) {
+        snprintf(buf, sizeof(buf), "small%zu", i);
+        int ino = vsfs_create(ROOT_INODE, buf, S_IFREG | 0644);
+        size_t len = tail_file_fill(i, buf, 0);
+        if (ino < 0 || vsfs_write(ino, 0, buf, len) != (ssize_t)len) {
+            printf("    ✗ Failed to write small file %zu\n", i);
+            return -1;
+        }
+        inos[i] = ino;
+    }
+    // Fragment blocks only: the refcount table and the root directory don't count
+    vsfs_stat(ROOT_INODE, &inode);
+    uint32_t dir_blocks = ceildiv(inode.size / sizeof(dirent_t), DIRENTS_PER_BLOCK) + (inode.indirect != 0);
+    uint32_t used = free_before - sb->num_free_blocks - sb->num_refcount_blocks - dir_blocks;
+    for (size_t i = 0; i < n; i++) {
+        if (tail_file_check(-1, inos[i], i, 0) < 0) {
+            printf("    ✗ Small file %zu reads back wrong\n", i);
+            return -1;
+        }
+    }
+    if (used * 4 > n) {
+        printf("    ✗ %zu small files used %u blocks\n", n, used);
+        return -1;
+    }
+    printf("    ✓ %zu files of 100-1095 bytes packed into %u blocks\n", n, used);
+    
+    // Tails follow the end of a file as it grows and shrinks, and long
+    // tails get a block of their own
+    memset(buf, 'g', sizeof(buf));
+    char got[BLOCK_SIZE];
+    if (vsfs_write(inos[5], 125, buf, 5000) != 5000 || vsfs_stat(inos[5], &inode) < 0 || inode.tail_len != 5125 - 4096 ||
+        vsfs_read(inos[5], 5000, got, 200) != 125 || memcmp(got, buf, 125) != 0) {
+        printf("    ✗ Grown file has the wrong tail\n");
+        return -1;
+    }
+    if (vsfs_write(inos[5], 5125, buf, 3000) != 3000 || vsfs_stat(inos[5], &inode) < 0 || inode.tail_block != 0) {
+        printf("    ✗ Long tail was packed\n");
+        return -1;
+    }
+    if (vsfs_truncate(inos[5], 4096 + 50) < 0 || vsfs_stat(inos[5], &inode) < 0 || inode.tail_block == 0 ||
+        inode.tail_len != 50 || vsfs_read(inos[5], 4096, got, 100) != 50 || memcmp(got, buf, 50) != 0) {
+        printf("    ✗ Truncated file was not repacked\n");
+        return -1;
+    }
+    
+    // A tail past the indirect block takes the indirect block's place
+    int big = vsfs_create(ROOT_INODE, "big", S_IFREG | 0644);
+    size_t big_size = NUM_DIRECT_BLOCKS * BLOCK_SIZE + 300;
+    for (size_t off = 0; off < big_size; off += 300) {
+        memset(buf, 'a' + off / 300 % 26, 300);
+        if (vsfs_write(big, off, buf, off + 300 > big_size ? big_size - off : 300) < 0) {
+            printf("    ✗ Failed to write large file\n");
+            return -1;
+        }
+    }
+    if (vsfs_stat(big, &inode) < 0 || inode.indirect != 0 || inode.tail_len != 300) {
+        printf("    ✗ Large file tail was not packed in place of the indirect block\n");
+        return -1;
+    }
+    for (size_t off = 0; off < big_size; off += 300) {
+        size_t len = off + 300 > big_size ? big_size - off : 300;
+        if (vsfs_read(big, off, got, len) != (ssize_t)len || got[0] != 'a' + (char)(off / 300 % 26) ||
+            got[len - 1] != got[0]) {
+            printf("    ✗ Large file reads back wrong at %zu\n", off);
+            return -1;
+        }
+    }
+    printf("    ✓ Tails move in and out of fragments as files grow and shrink\n");
+    
+    // Snapshots keep the tails the live tree drops or rewrites
+    int snap = vsfs_snapshot_create();
+    size_t len = tail_file_fill(7, buf, 1);
+    if (snap < 0 || vsfs_write(inos[7], 0, buf, len) != (ssize_t)len || vsfs_unlink(ROOT_INODE, "small8") < 0) {
+        printf("    ✗ Failed to change files after the snapshot\n");
+        return -1;
+    }
+    for (size_t i = 0; i < 40; i++) {
+        snprintf(buf, sizeof(buf), "late%zu", i);
+        int ino = vsfs_create(ROOT_INODE, buf, S_IFREG | 0644);
+        len = tail_file_fill(i, buf, 2);
+        if (ino < 0 || vsfs_write(ino, 0, buf, len) != (ssize_t)len) {
+            printf("    ✗ Failed to write late file %zu\n", i);
+            return -1;
+        }
+    }
+    if (tail_file_check(snap, inos[7], 7, 0) < 0 || tail_file_check(snap, inos[8], 8, 0) < 0 ||
+        tail_file_check(-1, inos[7], 7, 1) < 0 || tail_file_check(-1, inos[9], 9, 0) < 0) {
+        printf("    ✗ Snapshot or live tails were overwritten\n");
+        return -1;
+    }
+    printf("    ✓ Tails dropped or rewritten after a snapshot stay readable in it\n");
+    
+    // Removing everything returns every fragment block
+    if (vsfs_snapshot_delete(snap) < 0) {
+        printf("    ✗ Failed to delete snapshot\n");
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        snprintf(buf, sizeof(buf), "small%zu", i);
+        if (i != 8 && vsfs_unlink(ROOT_INODE, buf) < 0) {
+            printf("    ✗ Failed to unlink %s\n", buf);
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < 40; i++) {
+        snprintf(buf, sizeof(buf), "late%zu", i);
+        vsfs_unlink(ROOT_INODE, buf);
+    }
+    vsfs_unlink(ROOT_INODE, "big");
+    vsfs_stat(ROOT_INODE, &inode);
+    dir_blocks = ceildiv(inode.size / sizeof(dirent_t), DIRENTS_PER_BLOCK) + (inode.indirect != 0);
+    if (sb->num_free_blocks + sb->num_refcount_blocks + dir_blocks != free_before) {
+        printf("    ✗ %d blocks leaked\n", (int)(free_before - sb->num_free_blocks - sb->num_refcount_blocks - dir_blocks));
+        return -1;
+    }
+    printf("    ✓ Unlinking every file frees every fragment block\n");
+    
+    cleanup_disk(disk_map, sb->disk_size, disk_fd);
+    unlink(disk_name);
+    return 0;
+}
+
+// Check the free-extent index against the free runs of the data bitmap
+static int extent_index_matches_bitmap() {
+    size_t runs = 0;
+    uint32_t largest = 0, run = 0;
+    for (uint32_t block = data_region_start(); block <= sb->num_total_blocks; block++) {
+        if (block < sb->num_total_blocks && bitmapget(data_bitmap, sb->num_total_blocks, block) == 0) {
+            run++;
+            continue;
+        }
+        if (run > 0) {
+            runs++;
+            largest = run > largest ? run : largest;
+        }
+        run = 0;
+    }
+    if (extent_count() != runs || extent_largest() != largest) {
+        printf("    ✗ Index has %zu extents (largest %u), bitmap has %zu (largest %u)\n", extent_count(),
+               extent_largest(), runs, largest);
+        return -1;
+    }
+    return 0;
+}
+
+int test_extent_index() {
+    const char *disk_name = "test_disk_extent";
+    unlink(disk_name);
+    
+    if (format_disk(disk_name, BLOCK_SIZE * 4096, 256) < 0) {
+        printf("    ✗ Failed to format disk\n");
+        return -1;
+    }
+    if (!extent_index_ready() || extent_count() != 1 || extent_largest() != sb->num_free_blocks) {
+        printf("    ✗ Fresh image is not one free extent\n");
+        return -1;
+    }
+    
+    // Files grow into the blocks right after their previous block
+    int file = vsfs_create(ROOT_INODE, "seq", S_IFREG | 0644);
+    char buf[BLOCK_SIZE];
+    memset(buf, 's', sizeof(buf));
+    inode_t inode;
+    for (int i = 0; i < NUM_DIRECT_BLOCKS; i++) {
+        if (vsfs_write(file, (size_t)i * BLOCK_SIZE, buf, BLOCK_SIZE) != BLOCK_SIZE) {
+            printf("    ✗ Failed to write block %d\n", i);
+            return -1;
+        }
+        alloc_data_block();   // interleaved allocations don't split the file
+    }
+    vsfs_stat(file, &inode);
+    for (int i = 1; i < NUM_DIRECT_BLOCKS; i++) {
+        if (inode.blocks[i] != inode.blocks[i - 1] + 1 && inode.blocks[i] != inode.blocks[i - 1] + 2) {
+            printf("    ✗ Block %d of the file is not near block %d\n", i, i - 1);
+            return -1;
+        }
+    }
+    printf("    ✓ Writes allocate near the previous block of the file\n");
+    
+    // Punch single-block holes, then holes of 3, 5 and 8 blocks
+    uint32_t singles[300];
+    for (int i = 0; i < 300; i++) {
+        singles[i] = alloc_data_block();
+    }
+    for (int i = 0; i < 300; i += 2) {
+        free_data_blocks(&singles[i], 1);
+    }
+    int base = alloc_data_extent(40);
+    uint32_t holes[][2] = {{2, 3}, {10, 5}, {20, 8}};
+    for (int h = 0; h < 3; h++) {
+        uint32_t blocks[8];
+        for (uint32_t k = 0; k < holes[h][1]; k++) {
+            blocks[k] = base + holes[h][0] + k;
+        }
+        free_data_blocks(blocks, holes[h][1]);
+    }
+    if (base < 0 || extent_index_matches_bitmap() < 0) {
+        return -1;
+    }
+    if (alloc_data_extent(4) != base + 10 || alloc_data_extent(6) != base + 20) {
+        printf("    ✗ Extents were not allocated best fit\n");
+        return -1;
+    }
+    if (alloc_data_block_near(base + 2) != base + 2 || alloc_data_block_near(base + 2) != base + 3 ||
+        alloc_data_block_near(base + 5) != base + 14) {
+        printf("    ✗ Blocks were not allocated near the goal\n");
+        return -1;
+    }
+    if (extent_index_matches_bitmap() < 0) {
+        return -1;
+    }
+    printf("    ✓ Best-fit and near-goal allocations pick the expected runs\n");
+    
+    // Random churn keeps the index in step with the bitmap
+    uint32_t held[512];
+    size_t nheld = 0;
+    srand(17);
+    for (int i = 0; i < 5000; i++) {
+        if (nheld < 512 && (nheld == 0 || rand() % 3 != 0)) {
+            int block = rand() % 2 ? alloc_data_block() : alloc_data_block_near(rand() % sb->num_total_blocks);
+            if (block < 0) {
+                printf("    ✗ Allocation failed with free space left\n");
+                return -1;
+            }
+            held[nheld++] = block;
+        } else {
+            size_t k = rand() % nheld;
+            free_data_blocks(&held[k], 1);
+            held[k] = held[--nheld];
+        }
+    }
+    if (extent_index_matches_bitmap() < 0) {
+        return -1;
+    }
+    size_t count = extent_count();
+    uint32_t largest = extent_largest();
+    if (unmount_disk() < 0 || mount_disk(disk_name, NULL) < 0 || extent_count() != count ||
+        extent_largest() != largest) {
+        printf("    ✗ Index rebuilt at mount differs\n");
+        return -1;
+    }
+    for (int i = 0; i < 200; i++) {
+        int block = i % 2 ? alloc_data_extent(1 + i % 7) : alloc_data_block_near(rand() % sb->num_total_blocks);
+        if (block < 0) {
+            printf("    ✗ Allocation from the rebuilt index failed\n");
+            return -1;
+        }
+    }
+    if (extent_index_matches_bitmap() < 0) {
+        return -1;
+    }
+    printf("    ✓ Index matches the bitmap after churn and after a remount (%zu extents)\n", count);
+    
+    unmount_disk();
+    unlink(disk_name);
+    return 0;
+}
+
+int test_inode_growth() {
+    const char *disk_name = "test_disk_inode_growth";
+    const size_t ndirs = 3, per_dir = 11000;
+    unlink(disk_name);
+    
+    if (format_disk(disk_name, BLOCK_SIZE * 8192, 16) < 0) {
+        printf("    ✗ Failed to format disk\n");
+        return -1;
+    }
+    uint32_t free_blocks = sb->num_free_blocks;
+    
+    // Creating past the fixed table adds chunks from the data region
+    char name[32];
+    int inos[600];
+    for (int i = 0; i < 600; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        inos[i] = vsfs_create(ROOT_INODE, name, S_IFREG | 0644);
+        if (inos[i] < 0 || vsfs_write(inos[i], 0, name, strlen(name)) != (ssize_t)strlen(name)) {
+            printf("    ✗ Failed to create file %d\n", i);
+            return -1;
+        }
+    }
+    if (sb->num_inode_chunks != 3 || sb->num_max_inodes != 16 + 3 * INODES_PER_CHUNK ||
+        sb->num_base_inodes != 16 || free_blocks - sb->num_free_blocks < 3 * INODE_CHUNK_BLOCKS) {
+        printf("    ✗ Table has %u chunks and %u inodes\n", sb->num_inode_chunks, sb->num_max_inodes);
+        return -1;
+    }
+    printf("    ✓ 600 files on a 16-inode format grew the table by %u chunks\n", sb->num_inode_chunks);
+    
+    // A snapshot copies the chunks it covers; rolling back empties later ones
+    int snap = vsfs_snapshot_create();
+    char buf[32];
+    for (int i = 600; i < 900; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        if (vsfs_create(ROOT_INODE, name, S_IFREG | 0644) < 0) {
+            printf("    ✗ Failed to create file %d\n", i);
+            return -1;
+        }
+    }
+    vsfs_write(inos[599], 0, "changed", 7);
+    if (snap < 0 || sb->num_inode_chunks != 4 || vsfs_snapshot_read(snap, inos[599], 0, buf, 4) != 4 ||
+        memcmp(buf, "f599", 4) != 0) {
+        printf("    ✗ Snapshot of a grown table reads wrong\n");
+        return -1;
+    }
+    if (vsfs_snapshot_rollback(snap) < 0 || vsfs_snapshot_delete(snap) < 0 || sb->num_used_inodes != 601 ||
+        vsfs_lookup(ROOT_INODE, "f700") >= 0 || vsfs_read(inos[599], 0, buf, 4) != 4 || memcmp(buf, "f599", 4) != 0) {
+        printf("    ✗ Rollback across a grown table failed\n");
+        return -1;
+    }
+    for (int i = 600; i < 900; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        if (vsfs_create(ROOT_INODE, name, S_IFREG | 0644) < 0) {
+            printf("    ✗ Failed to recreate file %d after rollback\n", i);
+            return -1;
+        }
+    }
+    if (sb->num_inode_chunks != 4) {
+        printf("    ✗ Rollback lost the chunks added after the snapshot\n");
+        return -1;
+    }
+    printf("    ✓ Snapshots and rollback cover the chunks\n");
+    
+    // Past the fixed bitmap's 32768 bits the bitmap moves to the data region
+    char (*storage)[24] = malloc(per_dir * sizeof(*storage));
+    const char **names = malloc(per_dir * sizeof(char *));
+    uint32_t *batch = malloc(per_dir * sizeof(uint32_t));
+    for (size_t i = 0; i < per_dir; i++) {
+        snprintf(storage[i], sizeof(storage[i]), "n%zu", i);
+        names[i] = storage[i];
+    }
+    int dirs[3];
+    uint32_t last = 0;
+    for (size_t d = 0; d < ndirs; d++) {
+        snprintf(name, sizeof(name), "d%zu", d);
+        dirs[d] = vsfs_create(ROOT_INODE, name, S_IFDIR | 0755);
+        if (dirs[d] < 0 || vsfs_create_batch(dirs[d], names, per_dir, S_IFREG | 0644, batch) != (int)per_dir) {
+            printf("    ✗ Failed to fill directory %zu\n", d);
+            return -1;
+        }
+        last = batch[per_dir - 1];
+    }
+    if (sb->inode_bitmap_block == 0 || sb->num_max_inodes <= BLOCK_SIZE * 8 || last < BLOCK_SIZE * 8) {
+        printf("    ✗ Inode bitmap did not move (%u inodes)\n", sb->num_max_inodes);
+        return -1;
+    }
+    uint32_t used = sb->num_used_inodes;
+    if (unmount_disk() < 0 || mount_disk(disk_name, NULL) < 0 || sb->num_used_inodes != used ||
+        vsfs_lookup(dirs[ndirs - 1], names[per_dir - 1]) != (int)last || vsfs_lookup(ROOT_INODE, "f599") != inos[599]) {
+        printf("    ✗ Grown table did not survive a remount\n");
+        return -1;
+    }
+    printf("    ✓ %u inodes after the bitmap moved, intact across a remount\n", sb->num_max_inodes);
+    
+    // Freed inodes are reused before the table grows again
+    uint32_t max = sb->num_max_inodes;
+    if (vsfs_unlink_batch(dirs[0], names, per_dir) != (int)per_dir ||
+        vsfs_create_batch(dirs[0], names, per_dir, S_IFREG | 0644, batch) != (int)per_dir || sb->num_max_inodes != max) {
+        printf("    ✗ Freed inodes were not reused\n");
+        return -1;
+    }
+    printf("    ✓ Freed inodes are reused without growing the table\n");
+    
+    free(storage);
+    free(names);
+    free(batch);
+    unmount_disk();
+    unlink(disk_name);
+    return 0;
+}
+
+int test_file_mapping() {
+    const char *disk_name = "test_disk_filemap";
+    const char *out_name = "test_filemap_out";
+    unlink(disk_name);
+    
+    if (format_disk(disk_name, BLOCK_SIZE * 4096, 256) < 0 || refcount_init() < 0) {
+        printf("    ✗ Failed to format disk\n");
+        return -1;
+    }
+    uint32_t free_blocks = sb->num_free_blocks;
+    
+    // A contiguous file maps as one span that writev() can send as is
+    char data[3 * BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = 'a' + i % 26;
+    }
+    int file = vsfs_create(ROOT_INODE, "a", S_IFREG | 0644);
+    if (file < 0 || vsfs_write(file, 0, data, sizeof(data)) != (ssize_t)sizeof(data)) {
+        printf("    ✗ Failed to write file\n");
+        return -1;
+    }
+    struct iovec spans[8];
+    int nspans = 8;
+    if (vsfs_map_file(file, 0, SIZE_MAX, spans, &nspans) != (ssize_t)sizeof(data) || nspans != 1 ||
+        spans[0].iov_len != sizeof(data) || (char *)spans[0].iov_base < data_section ||
+        memcmp(spans[0].iov_base, data, sizeof(data)) != 0) {
+        printf("    ✗ Contiguous file did not map as one span\n");
+        return -1;
+    }
+    int first = ((char *)spans[0].iov_base - disk_map) / BLOCK_SIZE;
+    if (block_refcount(first) != 1) {
+        printf("    ✗ Mapping changed the refcount of block %d\n", first);
+        return -1;
+    }
+    char out[3 * BLOCK_SIZE];
+    int fd = open(out_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || writev(fd, spans, nspans) != (ssize_t)sizeof(data) ||
+        pread(fd, out, sizeof(out), 0) != (ssize_t)sizeof(out) || memcmp(out, data, sizeof(data)) != 0) {
+        printf("    ✗ writev() from the spans wrote the wrong bytes\n");
+        return -1;
+    }
+    close(fd);
+    unlink(out_name);
+    printf("    ✓ 3-block file maps as 1 span and writes out with writev()\n");
+    
+    // Pinned blocks outlive the file and keep their contents across writes.
+    // Besides the root directory's block, "a" holds 3 blocks and "b" 1 plus
+    // the copy its write made, of which only the copy is left after unmapping.
+    int other = vsfs_create(ROOT_INODE, "b", S_IFREG | 0644);
+    struct iovec other_span;
+    int nother = 1;
+    if (other < 0 || vsfs_write(other, 0, data, BLOCK_SIZE) != BLOCK_SIZE ||
+        vsfs_map_file(other, 0, BLOCK_SIZE, &other_span, &nother) != BLOCK_SIZE ||
+        vsfs_write(other, 0, "overwritten", 11) != 11 || vsfs_read(other, 0, out, 11) != 11 ||
+        memcmp(out, "overwritten", 11) != 0 || memcmp(other_span.iov_base, data, BLOCK_SIZE) != 0) {
+        printf("    ✗ Writing a mapped block changed the mapping\n");
+        return -1;
+    }
+    if (vsfs_unlink(ROOT_INODE, "a") < 0 || memcmp(spans[0].iov_base, data, sizeof(data)) != 0 ||
+        free_blocks - sb->num_free_blocks != 6) {
+        printf("    ✗ Unlinking a mapped file freed its blocks\n");
+        return -1;
+    }
+    if (vsfs_unmap_file(spans, nspans) < 0 || vsfs_unmap_file(&other_span, nother) < 0 ||
+        free_blocks - sb->num_free_blocks != 2) {
+        printf("    ✗ Unmapping did not free the unlinked blocks\n");
+        return -1;
+    }
+    if (vsfs_unmap_file(spans, nspans) == 0) {
+        printf("    ✗ Spans were unmapped twice\n");
+        return -1;
+    }
+    printf("    ✓ Mapped blocks survive unlink and overwrite until unmapped\n");
+    
+    // Holes map to zeros and a packed tail maps into its fragment block
+    vsfs_set_tail_packing(true);
+    file = vsfs_create(ROOT_INODE, "c", S_IFREG | 0644);
+    if (file < 0 || vsfs_write(file, 0, data, BLOCK_SIZE) != BLOCK_SIZE ||
+        vsfs_write(file, 2 * BLOCK_SIZE, data, 500) != 500) {
+        printf("    ✗ Failed to write sparse file\n");
+        return -1;
+    }
+    inode_t inode;
+    vsfs_stat(file, &inode);
+    nspans = 8;
+    if (inode.tail_block == 0 || vsfs_map_file(file, 0, SIZE_MAX, spans, &nspans) != 2 * BLOCK_SIZE + 500 ||
+        nspans != 3 || spans[1].iov_len != BLOCK_SIZE || spans[2].iov_len != 500 ||
+        memcmp(spans[0].iov_base, data, BLOCK_SIZE) != 0 || memcmp(spans[2].iov_base, data, 500) != 0) {
+        printf("    ✗ Sparse packed file mapped wrong\n");
+        return -1;
+    }
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        if (((char *)spans[1].iov_base)[i] != 0) {
+            printf("    ✗ Hole did not map to zeros\n");
+            return -1;
+        }
+    }
+    if (vsfs_truncate(file, 0) < 0 || memcmp(spans[2].iov_base, data, 500) != 0) {
+        printf("    ✗ Truncating the file freed its mapped tail\n");
+        return -1;
+    }
+    vsfs_write(file, 0, "zzzz", 4);   // a new tail must not reuse the pinned units
+    if (memcmp(spans[2].iov_base, data, 500) != 0 || vsfs_unmap_file(spans, nspans) < 0) {
+        printf("    ✗ A new tail overwrote the mapped one\n");
+        return -1;
+    }
+    printf("    ✓ Holes map to zeros and mapped tails stay put\n");
+    
+    // Running out of spans maps a prefix; compressed files aren't mappable
+    vsfs_truncate(file, 0);
+    vsfs_write(file, 0, data, BLOCK_SIZE);
+    vsfs_write(file, 3 * BLOCK_SIZE, data, BLOCK_SIZE);
+    nspans = 1;
+    if (vsfs_map_file(file, 0, SIZE_MAX, spans, &nspans) != BLOCK_SIZE || nspans != 1) {
+        printf("    ✗ Map with one span did not stop after the first run\n");
+        return -1;
+    }
+    int compressed = -1;
+    if (vsfs_set_default_compression(1) == 0) {
+        compressed = vsfs_create(ROOT_INODE, "z", S_IFREG | 0644);
+    }
+    vsfs_set_default_compression(0);
+    int nz = 1;
+    struct iovec zspan;
+    if (compressed < 0 || vsfs_write(compressed, 0, data, BLOCK_SIZE) != BLOCK_SIZE ||
+        vsfs_map_file(compressed, 0, BLOCK_SIZE, &zspan, &nz) >= 0) {
+        printf("    ✗ Compressed file was mapped\n");
+        return -1;
+    }
+    
+    // Unmounting drops the pins that are left
+    vsfs_stat(file, &inode);
+    int block = inode_bmap(&inode, 0, false);
+    if (unmount_disk() < 0 || mount_disk(disk_name, NULL) < 0 || block_refcount(block) != 1) {
+        printf("    ✗ Unmount left block %d pinned\n", block);
+        return -1;
+    }
+    printf("    ✓ Short maps, compressed files and unmount with pins behave\n");
+    
+    // Going away without unmapping leaves the unlinked file's blocks
+    // allocated with no references, and the next mount frees them
+    nspans = 8;
+    free_blocks = sb->num_free_blocks;
+    if (vsfs_map_file(file, 0, SIZE_MAX, spans, &nspans) < 0 || vsfs_unlink(ROOT_INODE, "c") < 0 ||
+        sb->num_free_blocks != free_blocks || block_refcount(block) != 0 ||
+        bitmapget(data_bitmap, sb->num_total_blocks, block) != 1) {
+        printf("    ✗ Unlinking the mapped file freed its blocks\n");
+        return -1;
+    }
+    icache_writeback();
+    cleanup_disk(disk_map, sb->disk_size, disk_fd);
+    if (mount_disk(disk_name, NULL) < 0 || sb->num_free_blocks != free_blocks + 2 ||
+        bitmapget(data_bitmap, sb->num_total_blocks, block) != 0) {
+        printf("    ✗ Remount did not reclaim the blocks the mapping held\n");
+        return -1;
+    }
+    printf("    ✓ Blocks held by a mapping are reclaimed after a crash\n");
+    
+    unmount_disk();
+    unlink(disk_name);
+    return 0;
+}
+
+static void *vsfsd_thread(void *arg) {
+    static int ret;
+    ret = vsfsd_serve(arg, 4);
+    return &ret;
+}
+
+// Send a request for a name operation or I/O through the shared buffer
+static int vsfsd_request(int fd, uint16_t op, uint64_t id, uint32_t ino, const char *name, uint64_t offset,
+                         uint32_t len, uint32_t shm_off) {
+    vsfsd_req_t req = {0};
+    req.magic = VSFSD_MAGIC;
+    req.op = op;
+    req.id = id;
+    req.ino = ino;
+    req.name_len = name != NULL ? strlen(name) : 0;
+    req.offset = offset;
+    req.len = len;
+    req.shm_off = shm_off;
+    req.mode = S_IFREG | 0644;
+    return vsfsd_send(fd, &req, name);
+}
+
+int test_vsfsd() {
+    const char *disk_name = "test_disk_vsfsd";
+    const char *sock_name = "test_vsfsd.sock";
+    const size_t shm_size = 64 * 1024;
+    unlink(disk_name);
+    
+    if (format_disk(disk_name, BLOCK_SIZE * 1024, 64) < 0) {
+        printf("    ✗ Failed to format disk\n");
+        return -1;
+    }
+    pthread_t server;
+    pthread_create(&server, NULL, vsfsd_thread, (void *)sock_name);
+    
+    int shm_fd;
+    char *shm = vsfsd_shm_create(shm_size, &shm_fd);
+    int fd = -1;
+    for (int tries = 0; tries < 100 && fd < 0 && shm != NULL; tries++) {
+        fd = vsfsd_connect(sock_name, shm_fd, shm_size);
+        if (fd < 0) {
+            nanosleep(&(struct timespec){0, 10000000}, NULL);
+        }
+    }
+    if (fd < 0) {
+        printf("    ✗ Failed to connect to the server\n");
+        return -1;
+    }
+    
+    vsfsd_resp_t resp;
+    if (vsfsd_request(fd, VSFSD_OP_CREATE, 1, ROOT_INODE, "served", 0, 0, 0) < 0 || vsfsd_recv(fd, &resp) < 0 ||
+        resp.id != 1 || resp.result <= 0) {
+        printf("    ✗ Create over the socket failed\n");
+        return -1;
+    }
+    uint32_t ino = resp.result;
+    
+    // Eight writes in flight at once, each from its own part of the buffer
+    const int nwrites = 8;
+    for (int i = 0; i < nwrites; i++) {
+        memset(shm + i * BLOCK_SIZE, 'a' + i, BLOCK_SIZE);
+        if (vsfsd_request(fd, VSFSD_OP_WRITE, 100 + i, ino, NULL, (uint64_t)i * BLOCK_SIZE, BLOCK_SIZE,
+                          i * BLOCK_SIZE) < 0) {
+            printf("    ✗ Failed to send write %d\n", i);
+            return -1;
+        }
+    }
+    uint32_t seen = 0;
+    for (int i = 0; i < nwrites; i++) {
+        if (vsfsd_recv(fd, &resp) < 0 || resp.id < 100 || resp.id >= 100 + (uint64_t)nwrites ||
+            resp.result != BLOCK_SIZE || (seen & 1u << (resp.id - 100))) {
+            printf("    ✗ Pipelined write got a bad response\n");
             return -1;
         }
-        
-        // All inodes except root should be zeroed
-        if (test_inode.size != 0 || test_inode.nlinks != 0 || 
-            test_inode.atime != 0 || test_inode.mtime != 0 || test_inode.ctime != 0) {
-            printf("    ✗ Inode %d should be zeroed, but has non-zero values\n", i);
-            close(fd);
+        seen |= 1u << (resp.id - 100);
+    }
+    printf("    ✓ %d pipelined writes each answered once\n", nwrites);
+    
+    // Read it all back into the other half of the buffer, then check a stat and a lookup
+    memset(shm, 0, shm_size);
+    size_t size = (size_t)nwrites * BLOCK_SIZE;
+    if (vsfsd_request(fd, VSFSD_OP_READ, 200, ino, NULL, 0, size, shm_size / 2) < 0 ||
+        vsfsd_request(fd, VSFSD_OP_STAT, 201, ino, NULL, 0, 0, 0) < 0 ||
+        vsfsd_request(fd, VSFSD_OP_LOOKUP, 202, ROOT_INODE, "served", 0, 0, 0) < 0) {
+        printf("    ✗ Failed to send requests\n");
+        return -1;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (vsfsd_recv(fd, &resp) < 0 || (resp.id == 200 && resp.result != (int64_t)size) ||
+            (resp.id == 201 && resp.result != 0) || (resp.id == 202 && resp.result != ino)) {
+            printf("    ✗ Request %lu got %ld\n", (unsigned long)resp.id, (long)resp.result);
+            return -1;
+        }
+    }
+    for (int i = 0; i < nwrites; i++) {
+        if (shm[shm_size / 2 + i * BLOCK_SIZE] != 'a' + i || shm[shm_size / 2 + (i + 1) * BLOCK_SIZE - 1] != 'a' + i) {
+            printf("    ✗ Data read through the buffer is wrong at block %d\n", i);
             return -1;
         }
     }
+    inode_t inode;
+    memcpy(&inode, shm, sizeof(inode));
+    if (inode.size != size) {
+        printf("    ✗ Stat through the buffer returned size %u\n", inode.size);
+        return -1;
+    }
+    printf("    ✓ Reads, stats and lookups come back through the shared buffer\n");
     
-    printf("    ✓ Inode table initialized correctly (free inodes are zeroed)\n");
+    // Bad requests fail on their own; a corrupt header drops the connection
+    if (vsfsd_request(fd, VSFSD_OP_READ, 300, ino, NULL, 0, BLOCK_SIZE, shm_size - 1) < 0 ||
+        vsfsd_request(fd, 99, 301, ino, NULL, 0, 0, 0) < 0 || vsfsd_recv(fd, &resp) < 0 || resp.result != -1 ||
+        vsfsd_recv(fd, &resp) < 0 || resp.result != -1) {
+        printf("    ✗ Bad requests were not refused\n");
+        return -1;
+    }
+    vsfsd_req_t junk;
+    memset(&junk, 0xAB, sizeof(junk));
+    if (send(fd, &junk, sizeof(junk), MSG_NOSIGNAL) != sizeof(junk) || recv(fd, &resp, sizeof(resp), 0) != 0) {
+        printf("    ✗ Corrupt header did not close the connection\n");
+        return -1;
+    }
     close(fd);
+    printf("    ✓ Bad requests are refused and a corrupt stream is dropped\n");
+    
+    // The server worked on the image this process has mounted
+    vsfsd_stop();
+    int *ret;
+    pthread_join(server, (void **)&ret);
+    char buf[BLOCK_SIZE];
+    if (*ret != 0 || access(sock_name, F_OK) == 0 || vsfs_lookup(ROOT_INODE, "served") != (int)ino ||
+        vsfs_read(ino, (nwrites - 1) * BLOCK_SIZE, buf, BLOCK_SIZE) != BLOCK_SIZE || buf[0] != 'a' + nwrites - 1) {
+        printf("    ✗ Server did not shut down cleanly\n");
+        return -1;
+    }
+    printf("    ✓ Server stops, removes its socket and leaves the writes in the image\n");
+    
+    munmap(shm, shm_size);
+    close(shm_fd);
+    unmount_disk();
+    unlink(disk_name);
     return 0;
 }
 
-int test_bitmap_initialization(const char *disk_name) {
-    int fd = open(disk_name, O_RDONLY);
-    if (fd < 0) {
-        printf("    ✗ Failed to open disk file\n");
-        return -1;
+#define TRACE_THREAD_CALLS 3000
+
+static void *trace_stat_thread(void *arg) {
+    inode_t inode;
+    for (int i = 0; i < TRACE_THREAD_CALLS; i++) {
+        vsfs_stat(*(uint32_t *)arg, &inode);
     }
+    return NULL;
+}
+
+int test_trace() {
+    const char *disk_name = "test_disk_trace";
+    const char *trace_name = "test_trace.bin";
+    unlink(disk_name);
     
-    superblock_t sb;
-    if (read(fd, &sb, sizeof(sb)) != sizeof(sb)) {
-        printf("    ✗ Failed to read superblock\n");
-        close(fd);
+    if (format_disk(disk_name, BLOCK_SIZE * 1024, 64) < 0) {
+        printf("    ✗ Failed to format disk\n");
         return -1;
     }
-    
-    // Seek to data bitmap (after inode bitmap)
-    if (lseek(fd, BLOCK_SIZE + sb.num_inode_bitmap_blocks * BLOCK_SIZE, SEEK_SET) == -1) {
-        printf("    ✗ Failed to seek to data bitmap\n");
-        close(fd);
+    int before = vsfs_create(ROOT_INODE, "untraced", S_IFREG | 0644);
+    if (vsfs_trace_start(trace_name) < 0 || vsfs_trace_start(trace_name) == 0) {
+        printf("    ✗ Trace should start once\n");
         return -1;
     }
     
-    // Read data bitmap data
-    size_t bitmap_size = sb.num_data_bitmap_blocks * BLOCK_SIZE;
-    char *bitmap_data = malloc(bitmap_size);
-    if (!bitmap_data) {
-        printf("    ✗ Failed to allocate memory for bitmap\n");
-        close(fd);
+    // A few calls from this thread, and enough stats from another to fill its ring twice over
+    char buf[100] = "traced";
+    int ino = vsfs_create(ROOT_INODE, "traced", S_IFREG | 0600);
+    vsfs_write(ino, 10, buf, sizeof(buf));
+    vsfs_read(ino, 0, buf, sizeof(buf));
+    vsfs_lookup(ROOT_INODE, "missing");
+    pthread_t other;
+    pthread_create(&other, NULL, trace_stat_thread, &before);
+    pthread_join(other, NULL);
+    vsfs_truncate(ino, 5);
+    vsfs_unlink(ROOT_INODE, "traced");
+    if (vsfs_trace_stop() < 0 || vsfs_trace_stop() == 0) {
+        printf("    ✗ Trace should stop once\n");
         return -1;
     }
+    vsfs_lookup(ROOT_INODE, "untraced");
     
-    if (read(fd, bitmap_data, bitmap_size) != (ssize_t)bitmap_size) {
-        printf("    ✗ Failed to read bitmap data\n");
-        free(bitmap_data);
-        close(fd);
+    vsfs_trace_record_t *recs;
+    ssize_t n = vsfs_trace_load(trace_name, &recs);
+    if (n != 6 + TRACE_THREAD_CALLS) {
+        printf("    ✗ Trace holds %zd records, expected %d\n", n, 6 + TRACE_THREAD_CALLS);
         return -1;
     }
     
-    // Test that metadata blocks are marked as used
-    size_t num_metadata_blocks = 1 + sb.num_inode_bitmap_blocks + sb.num_data_bitmap_blocks;
-    for (size_t i = 0; i < num_metadata_blocks; i++) {
-        int block_status = bitmapget(bitmap_data, sb.num_total_blocks, i);
-        if (block_status != 1) {
-            printf("    ✗ Block %zu (metadata) should be marked as used, got %d\n", i, block_status);
-            free(bitmap_data);
-            close(fd);
+    // Pick out this thread's calls; the other thread's are all stats of `before`
+    vsfs_trace_record_t mine[6];
+    int nmine = 0;
+    uint16_t main_thread = recs[0].thread;
+    for (ssize_t i = 0; i < n; i++) {
+        if (i > 0 && recs[i].time_ns < recs[i - 1].time_ns) {
+            printf("    ✗ Loaded trace is not in time order\n");
             return -1;
         }
-    }
-    
-    // Test that data blocks are free (0)
-    int free_blocks = 0;
-    size_t start_data_blocks = num_metadata_blocks + sb.num_inode_table_blocks;
-    size_t end_test = (start_data_blocks + 100 < sb.num_total_blocks) ? start_data_blocks + 100 : sb.num_total_blocks;
-    
-    for (size_t i = start_data_blocks; i < end_test; i++) {
-        int status = bitmapget(bitmap_data, sb.num_total_blocks, i);
-        if (status == 0) {
-            free_blocks++;
-        } else if (status < 0) {
-            printf("    ✗ Error reading bitmap at index %zu\n", i);
-            free(bitmap_data);
-            close(fd);
+        if (recs[i].thread == main_thread && nmine < 6) {
+            mine[nmine++] = recs[i];
+        } else if (recs[i].op != VSFS_OP_STAT || recs[i].ino != (uint32_t)before || recs[i].result != 0) {
+            printf("    ✗ Unexpected record from thread %u\n", recs[i].thread);
             return -1;
         }
     }
+    uint32_t hash = trace_name_hash("traced");
+    if (nmine != 6 || mine[0].op != VSFS_OP_CREATE || mine[0].ino != ROOT_INODE || mine[0].result != ino ||
+        mine[0].mode != (S_IFREG | 0600) || mine[0].name_hash != hash || mine[1].op != VSFS_OP_WRITE ||
+        mine[1].offset != 10 || mine[1].len != sizeof(buf) || mine[1].result != sizeof(buf) ||
+        mine[2].op != VSFS_OP_READ || mine[2].result != sizeof(buf) || mine[3].op != VSFS_OP_LOOKUP ||
+        mine[3].result != -1 || mine[3].name_hash != trace_name_hash("missing") ||
+        mine[4].op != VSFS_OP_TRUNCATE || mine[4].offset != 5 || mine[5].op != VSFS_OP_UNLINK ||
+        mine[5].name_hash != hash || mine[5].result != 0) {
+        printf("    ✗ Recorded calls don't match what was made\n");
+        return -1;
+    }
+    free(recs);
+    printf("    ✓ %zd calls from two threads recorded in order, none before or after\n", n);
     
-    // Most data blocks should be free initially
-    size_t num_data_blocks_tested = end_test - start_data_blocks;
-    if (num_data_blocks_tested > 0 && free_blocks < (int)(num_data_blocks_tested * 0.9)) {
-        printf("    ✗ Too few free data blocks found: %d out of %zu\n", free_blocks, num_data_blocks_tested);
-        free(bitmap_data);
-        close(fd);
+    // A new trace starts empty even though the other thread's ring was used before
+    if (vsfs_trace_start(trace_name) < 0) {
+        return -1;
+    }
+    vsfs_sync();
+    if (vsfs_trace_stop() < 0 || vsfs_trace_load(trace_name, &recs) != 1 || recs[0].op != VSFS_OP_FSYNC) {
+        printf("    ✗ Second trace should hold only its own sync\n");
         return -1;
     }
+    free(recs);
+    printf("    ✓ A second trace records only its own calls\n");
     
-    printf("    ✓ Bitmap initialized correctly (metadata blocks used, data blocks free)\n");
-    free(bitmap_data);
-    close(fd);
+    unmount_disk();
+    unlink(disk_name);
+    unlink(trace_name);
     return 0;
 }
 
-int test_root_directory_creation(const char *disk_name) {
-    int fd = open(disk_name, O_RDONLY);
-    if (fd < 0) {
-        printf("    ✗ Failed to open disk file\n");
+int test_striping() {
+    char dir[] = "/tmp/vsfs_stripe_XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        printf("    ✗ Failed to make a temporary directory\n");
         return -1;
     }
+    const int nmembers = 3;
+    char paths[3][64];
+    const char *members[3];
+    for (int m = 0; m < nmembers; m++) {
+        snprintf(paths[m], sizeof(paths[m]), "%s/member%d", dir, m);
+        members[m] = paths[m];
+    }
     
-    superblock_t sb;
-    if (read(fd, &sb, sizeof(sb)) != sizeof(sb)) {
-        printf("    ✗ Failed to read superblock\n");
-        close(fd);
+    // 8 MiB striped in 64 KiB units, so a 1 MiB file crosses every member several times
+    const size_t unit = 64 * 1024;
+    const size_t disk_size = 8 * 1024 * 1024;
+    if (format_disk_striped(members, nmembers, unit, disk_size, 64, NULL) < 0) {
+        printf("    ✗ Failed to format a striped image\n");
         return -1;
     }
-    
-    // Seek to inode table
-    if (lseek(fd, BLOCK_SIZE + sb.num_inode_bitmap_blocks * BLOCK_SIZE + sb.num_data_bitmap_blocks * BLOCK_SIZE, SEEK_SET) == -1) {
-        printf("    ✗ Failed to seek to inode table\n");
-        close(fd);
+    struct stat st;
+    off_t total = 0;
+    for (int m = 0; m < nmembers; m++) {
+        if (stat(members[m], &st) < 0 || st.st_size < (off_t)(disk_size / nmembers) - (off_t)unit) {
+            printf("    ✗ Member %d holds %ld bytes, not its share\n", m, (long)st.st_size);
+            return -1;
+        }
+        total += st.st_size;
+    }
+    if (total != (off_t)disk_size || !stripe_active() || stripe_width() != nmembers * unit) {
+        printf("    ✗ Members add up to %ld bytes\n", (long)total);
         return -1;
     }
+    printf("    ✓ Image spread over %d members of about %zu KiB each\n", nmembers, disk_size / nmembers / 1024);
     
-    // Read root inode (inode 0)
-    inode_t root_inode;
-    if (read(fd, &root_inode, sizeof(root_inode)) != sizeof(root_inode)) {
-        printf("    ✗ Failed to read root inode\n");
-        close(fd);
+    size_t file_size = 1024 * 1024;
+    char *data = malloc(file_size);
+    char *back = malloc(file_size);
+    for (size_t i = 0; i < file_size; i++) {
+        data[i] = (char)(i * 7 + i / BLOCK_SIZE);
+    }
+    int ino = vsfs_create(ROOT_INODE, "striped", S_IFREG | 0644);
+    if (ino < 0 || vsfs_write(ino, 0, data, file_size) != (ssize_t)file_size || vsfs_sync() < 0) {
+        printf("    ✗ Failed to write the file\n");
         return -1;
     }
     
-    // Test root inode properties
-    if (root_inode.size != 0) {
-        printf("    ✗ Root inode size should be 0, got %u\n", root_inode.size);
+    // Each block of the file is on the member and at the offset its stripe says
+    inode_t inode;
+    vsfs_stat(ino, &inode);
+    bool members_used[3] = {false};
+    for (size_t lblk = 0; lblk < file_size / BLOCK_SIZE; lblk++) {
+        uint32_t member;
+        off_t offset;
+        char block[BLOCK_SIZE];
+        int fd;
+        if (stripe_locate(inode_bmap(&inode, lblk, false), &member, &offset) < 0 ||
+            (fd = open(members[member], O_RDONLY)) < 0) {
+            printf("    ✗ Can't locate block %zu\n", lblk);
+            return -1;
+        }
+        ssize_t got = pread(fd, block, BLOCK_SIZE, offset);
         close(fd);
+        if (got != BLOCK_SIZE || memcmp(block, data + lblk * BLOCK_SIZE, BLOCK_SIZE) != 0) {
+            printf("    ✗ Block %zu is not where its stripe puts it\n", lblk);
+            return -1;
+        }
+        members_used[member] = true;
+    }
+    if (!members_used[0] || !members_used[1] || !members_used[2]) {
+        printf("    ✗ The file did not reach every member\n");
         return -1;
     }
+    printf("    ✓ A 1 MiB file is spread over all members, each block where its stripe says\n");
     
-    if (root_inode.nlinks != 2) {
-        printf("    ✗ Root inode nlinks should be 2, got %u\n", root_inode.nlinks);
-        close(fd);
+    // Remount from the member files and read it back in one go, which prefetches across members
+    if (unmount_disk() < 0 || mount_disk_striped(members, nmembers, NULL) < 0 ||
+        vsfs_read(ino, 0, back, file_size) != (ssize_t)file_size || memcmp(data, back, file_size) != 0) {
+        printf("    ✗ File did not survive a remount\n");
         return -1;
     }
+    unmount_disk();
+    if (mount_disk(members[0], NULL) == 0 || mount_disk_striped(members, 2, NULL) == 0) {
+        printf("    ✗ Mounted with the wrong members\n");
+        return -1;
+    }
+    printf("    ✓ Remounts from its members and refuses a partial set\n");
     
-    // Test that root inode has valid timestamps
-    if (root_inode.atime == 0 || root_inode.mtime == 0 || root_inode.ctime == 0) {
-        printf("    ✗ Root inode timestamps should be set\n");
-        close(fd);
+    // A plain image formatted afterwards is not striped
+    if (format_disk("test_disk_unstriped", BLOCK_SIZE * 64, 16) < 0 || stripe_active()) {
+        printf("    ✗ Plain image after a striped one\n");
         return -1;
     }
+    unmount_disk();
+    unlink("test_disk_unstriped");
     
-    printf("    ✓ Root directory inode structure is correct\n");
-    close(fd);
+    free(data);
+    free(back);
+    for (int m = 0; m < nmembers; m++) {
+        unlink(members[m]);
+    }
+    rmdir(dir);
     return 0;
 }
 
-size_t calculate_minimum_blocks(size_t max_files) {
-    // Calculate minimum blocks needed for a filesystem with max_files
-    // This mirrors the logic in calculate_layout() in mkfs.c
+// Read a whole unmounted image into memory
+static char *load_image(const char *path, size_t size) {
+    char *image = malloc(size);
+    FILE *file = fopen(path, "rb");
+    if (image == NULL || file == NULL || fread(image, 1, size, file) != size) {
+        free(image);
+        image = NULL;
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+    return image;
+}
+
+// Whether a copy brought up to date by deltas matches the image it follows:
+// its metadata, every block the image uses but the generation table, and the
+// superblock, whose copy only answers for deltas from its latest one on
+static bool images_match(const char *live_path, const char *copy_path, size_t size) {
+    char *live = load_image(live_path, size);
+    char *copy = load_image(copy_path, size);
+    bool match = live != NULL && copy != NULL;
+    if (match) {
+        superblock_t *lsb = (superblock_t *)live;
+        superblock_t *csb = (superblock_t *)copy;
+        csb->gen_base = lsb->gen_base;
+        char *bitmap = live + (size_t)(1 + lsb->num_inode_bitmap_blocks) * BLOCK_SIZE;
+        uint32_t data_start = 1 + lsb->num_inode_bitmap_blocks + lsb->num_data_bitmap_blocks +
+                              lsb->num_inode_table_blocks;
+        for (uint32_t b = 0; b < lsb->num_total_blocks && match; b++) {
+            bool in_table = b >= lsb->gen_table_block && b < lsb->gen_table_block + lsb->num_gen_blocks;
+            bool used = b < data_start || bitmapget(bitmap, lsb->num_total_blocks, b) == 1;
+            if (used && !in_table && memcmp(live + (size_t)b * BLOCK_SIZE, copy + (size_t)b * BLOCK_SIZE, BLOCK_SIZE) != 0) {
+                printf("    ✗ Block %u differs between the image and its copy\n", b);
+                match = false;
+            }
+        }
+    }
+    free(live);
+    free(copy);
+    return match;
+}
+
+// Export the changes since `since` into `path`; returns the blocks sent
+static ssize_t export_to(const char *path, uint32_t since) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t sent = vsfs_delta_export(since, fd);
+    close(fd);
+    return sent;
+}
+
+static ssize_t apply_from(const char *path, const char *image) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t applied = vsfs_delta_apply(image, fd);
+    close(fd);
+    return applied;
+}
+
+int test_delta() {
+    const char *live = "test_disk_delta";
+    const char *copy = "test_disk_delta_copy";
+    const char *stream = "test_delta.stream";
+    const size_t disk_size = 4 * 1024 * 1024;
+    if (format_disk(live, disk_size, 16) < 0) {
+        printf("    ✗ Failed to format the image\n");
+        return -1;
+    }
     
-    size_t num_superblock_blocks = 1;
-    size_t num_inode_bitmap_blocks = ceildiv(max_files, BLOCK_SIZE * 8);
-    size_t num_inode_table_blocks = ceildiv(max_files * INODE_SIZE, BLOCK_SIZE);
+    char data[96 * 1024];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)(i * 13 + i / BLOCK_SIZE);
+    }
+    int old = vsfs_create(ROOT_INODE, "old", S_IFREG | 0644);
+    int gone = vsfs_create(ROOT_INODE, "gone", S_IFREG | 0644);
+    if (old < 0 || gone < 0 || vsfs_write(old, 0, data, 64 * 1024) != 64 * 1024 ||
+        vsfs_write(gone, 0, data, 8192) != 8192) {
+        printf("    ✗ Failed to write the first files\n");
+        return -1;
+    }
+    if (vsfs_generation() != 0 || export_to(stream, 1) >= 0) {
+        printf("    ✗ Exported a delta without tracking changes\n");
+        return -1;
+    }
+    if (vsfs_track_changes() < 0 || vsfs_generation() != 1) {
+        printf("    ✗ Failed to start tracking changes\n");
+        return -1;
+    }
     
-    // For data bitmap, we need to know total blocks, so we calculate iteratively
-    // Start with minimum estimate
-    size_t total_blocks = num_superblock_blocks + num_inode_bitmap_blocks + num_inode_table_blocks + 1; // +1 for data bitmap
+    // The copy is taken at generation 1
+    uint32_t base = vsfs_generation();
+    char *snapshot_of_live = NULL;
+    if (unmount_disk() < 0 || (snapshot_of_live = load_image(live, disk_size)) == NULL) {
+        printf("    ✗ Failed to copy the image\n");
+        return -1;
+    }
+    FILE *file = fopen(copy, "wb");
+    if (file == NULL || fwrite(snapshot_of_live, 1, disk_size, file) != disk_size || fclose(file) != 0) {
+        printf("    ✗ Failed to copy the image\n");
+        return -1;
+    }
+    free(snapshot_of_live);
     
-    // Recalculate data bitmap with the estimated total
-    size_t num_data_bitmap_blocks = ceildiv(total_blocks, BLOCK_SIZE * 8);
+    // Change the image in every way that writes something
+    if (mount_disk(live, NULL) < 0) {
+        printf("    ✗ Failed to remount the image\n");
+        return -1;
+    }
+    int big = vsfs_create(ROOT_INODE, "big", S_IFREG | 0644);
+    int tiny = vsfs_create(ROOT_INODE, "tiny", S_IFREG | 0644);
+    int packed = vsfs_create(ROOT_INODE, "packed", S_IFREG | 0644);
+    char zeros[64 * 1024] = {0};
+    bool ok = big >= 0 && tiny >= 0 && packed >= 0 &&
+              vsfs_write(old, 5 * BLOCK_SIZE, "rewritten", 9) == 9 &&
+              vsfs_write(big, 0, data, sizeof(data)) == (ssize_t)sizeof(data) &&
+              vsfs_unlink(ROOT_INODE, "gone") == 0 &&
+              vsfs_truncate(old, 50000) == 0 &&
+              vsfs_set_tail_packing(true) == 0 &&
+              vsfs_write(tiny, 0, "a small tail", 12) == 12 &&
+              vsfs_set_compression(packed, 1) == 0 &&
+              vsfs_write(packed, 0, zeros, sizeof(zeros)) == (ssize_t)sizeof(zeros);
+    int snap = ok ? vsfs_snapshot_create() : -1;
+    ok = snap >= 0 && vsfs_write(big, 0, "after the snapshot", 18) == 18;
+    for (int i = 0; i < 20 && ok; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "many%d", i);
+        ok = vsfs_create(ROOT_INODE, name, S_IFREG | 0644) >= 0;
+    }
+    if (!ok || sb->num_inode_chunks == 0) {
+        printf("    ✗ Failed to change the image\n");
+        return -1;
+    }
     
-    // Recalculate total with correct data bitmap size
-    total_blocks = num_superblock_blocks + num_inode_bitmap_blocks + num_inode_table_blocks + num_data_bitmap_blocks;
+    ssize_t sent = export_to(stream, base);
+    uint32_t gen = vsfs_generation();
+    uint32_t total = sb->num_total_blocks;
+    if (sent <= 0 || gen != base + 1 || (uint32_t)sent > total / 4) {
+        printf("    ✗ Export sent %zd of %u blocks and moved to generation %u\n", sent, total, gen);
+        return -1;
+    }
+    if (unmount_disk() < 0 || apply_from(stream, copy) != sent || !images_match(live, copy, disk_size)) {
+        printf("    ✗ Copy doesn't match the image after the delta\n");
+        return -1;
+    }
+    printf("    ✓ %zd of %u blocks sent bring the copy up to date\n", sent, total);
+    
+    // The copy mounts and reads back, snapshot included
+    char back[32];
+    if (mount_disk(copy, NULL) < 0 || vsfs_generation() != gen || vsfs_lookup(ROOT_INODE, "gone") >= 0 ||
+        vsfs_read(big, 0, back, 18) != 18 || memcmp(back, "after the snapshot", 18) != 0 ||
+        vsfs_snapshot_read(snap, big, 0, back, 18) != 18 || memcmp(back, data, 18) != 0 ||
+        vsfs_read(tiny, 0, back, 12) != 12 || memcmp(back, "a small tail", 12) != 0 ||
+        export_to(stream, base) >= 0 || unmount_disk() < 0) {
+        printf("    ✗ Copy doesn't read back like the image\n");
+        return -1;
+    }
+    printf("    ✓ Copy mounts with the new files, the snapshot and the tails, and exports only from now on\n");
     
-    // If data bitmap size changed, recalculate once more
-    size_t new_data_bitmap_blocks = ceildiv(total_blocks, BLOCK_SIZE * 8);
-    if (new_data_bitmap_blocks != num_data_bitmap_blocks) {
-        total_blocks = num_superblock_blocks + num_inode_bitmap_blocks + num_inode_table_blocks + new_data_bitmap_blocks;
+    // A one-byte change makes a delta of a handful of blocks: the block, the
+    // superblock, its inode and, as the snapshot shares it, the allocation
+    // of its private copy
+    if (mount_disk(live, NULL) < 0 || vsfs_write(old, 0, "x", 1) != 1) {
+        printf("    ✗ Failed to change the image again\n");
+        return -1;
     }
+    ssize_t small = export_to(stream, gen);
+    if (small <= 0 || small > 8 || unmount_disk() < 0 || apply_from(stream, copy) != small ||
+        !images_match(live, copy, disk_size)) {
+        printf("    ✗ Second delta sent %zd blocks or didn't apply\n", small);
+        return -1;
+    }
+    printf("    ✓ A one-byte write sends %zd blocks\n", small);
     
-    return total_blocks;
+    // A delta the copy already has is refused
+    if (apply_from(stream, copy) >= 0 || !images_match(live, copy, disk_size)) {
+        printf("    ✗ Applied a stale delta\n");
+        return -1;
+    }
+    
+    // A corrupt delta is refused before the superblock moves on, and the
+    // intact one still applies afterwards
+    size_t stream_len = 0;
+    char *intact = NULL;
+    if (mount_disk(live, NULL) < 0 || vsfs_write(big, 0, data, 3 * BLOCK_SIZE) != 3 * BLOCK_SIZE ||
+        export_to(stream, vsfs_generation()) <= 0 || unmount_disk() < 0) {
+        printf("    ✗ Failed to export a third delta\n");
+        return -1;
+    }
+    struct stat st;
+    if (stat(stream, &st) == 0) {
+        stream_len = st.st_size;
+        intact = load_image(stream, stream_len);
+    }
+    if (intact == NULL) {
+        printf("    ✗ Failed to read the third delta\n");
+        return -1;
+    }
+    size_t last_block = stream_len - sizeof(vsfs_delta_run_t) - 100;
+    intact[last_block] ^= 1;
+    file = fopen(stream, "wb");
+    bool written = file != NULL && fwrite(intact, 1, stream_len, file) == stream_len;
+    if (file != NULL) {
+        fclose(file);
+    }
+    intact[last_block] ^= 1;
+    if (!written || apply_from(stream, copy) >= 0) {
+        printf("    ✗ Applied a corrupt delta\n");
+        return -1;
+    }
+    file = fopen(stream, "wb");
+    written = file != NULL && fwrite(intact, 1, stream_len, file) == stream_len;
+    if (file != NULL) {
+        fclose(file);
+    }
+    free(intact);
+    if (!written || apply_from(stream, copy) <= 0 || !images_match(live, copy, disk_size)) {
+        printf("    ✗ Intact delta didn't apply after a corrupt one\n");
+        return -1;
+    }
+    printf("    ✓ Stale and corrupt deltas are refused, and a retry applies cleanly\n");
+    
+    unlink(live);
+    unlink(copy);
+    unlink(stream);
+    return 0;
 }
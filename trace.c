@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+bool trace_active = false;
+
+// A thread's ring. Only its own thread adds records, at `head`; whoever
+// holds `file_lock` writes them out from `tail`, so neither end needs more
+// than an atomic load and store.
+typedef struct trace_ring {
+    vsfs_trace_record_t records[VSFS_TRACE_RING];
+    uint64_t head;
+    uint64_t tail;
+    uint64_t session;         // Trace the buffered records belong to
+    uint64_t last_ns;         // Time of the newest record
+    uint16_t thread;
+    struct trace_ring *next;
+} trace_ring_t;
+
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *rings;   // Never freed, so a ring can outlive its thread
+static uint16_t nrings;
+static _Thread_local trace_ring_t *local_ring;
+static int trace_fd = -1;
+static bool write_failed;
+static uint64_t session;      // Bumped by every vsfs_trace_start
+static uint64_t start_ns;
+
+uint64_t trace_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 32-bit FNV-1a
+uint32_t trace_name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = name; *c != '\0'; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    return hash;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            perror("vsfs_trace: write");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Write out a ring's records; called with `file_lock` held. Records of an
+// earlier trace, or written after a failure, are dropped.
+static void drain(trace_ring_t *ring) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    bool keep = trace_fd >= 0 && !write_failed && ring->session == session;
+    while (ring->tail < head) {
+        size_t at = ring->tail % VSFS_TRACE_RING;
+        size_t n = head - ring->tail < VSFS_TRACE_RING - at ? head - ring->tail : VSFS_TRACE_RING - at;
+        if (keep && write_all(trace_fd, &ring->records[at], n * sizeof(vsfs_trace_record_t)) < 0) {
+            write_failed = true;
+            keep = false;
+            __atomic_store_n(&trace_active, false, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&ring->tail, ring->tail + n, __ATOMIC_RELEASE);
+    }
+}
+
+static trace_ring_t *my_ring() {
+    if (local_ring == NULL) {
+        trace_ring_t *ring = calloc(1, sizeof(trace_ring_t));
+        if (ring == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&file_lock);
+        ring->thread = nrings++;
+        ring->next = rings;
+        rings = ring;
+        pthread_mutex_unlock(&file_lock);
+        local_ring = ring;
+    }
+    return local_ring;
+}
+
+void trace_record(uint64_t issued, vsfs_op_t op, uint32_t ino, uint64_t offset, size_t len, const char *name,
+                  uint32_t mode, int64_t result) {
+    uint64_t current = __atomic_load_n(&session, __ATOMIC_ACQUIRE);
+    trace_ring_t *ring = my_ring();
+    if (ring == NULL || !__atomic_load_n(&trace_active, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (ring->session != current) {
+        // First record of a new trace; anything left from the last one goes
+        pthread_mutex_lock(&file_lock);
+        drain(ring);
+        ring->session = current;
+        ring->last_ns = 0;
+        pthread_mutex_unlock(&file_lock);
+    }
+    if (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == VSFS_TRACE_RING) {
+        pthread_mutex_lock(&file_lock);
+        drain(ring);
+        pthread_mutex_unlock(&file_lock);
+    }
+
+    // A thread's records get strictly increasing times, so sorting by time
+    // and thread keeps each thread's calls in the order they were made
+    uint64_t time = issued > start_ns ? issued - start_ns : 0;
+    time = time > ring->last_ns ? time : ring->last_ns + 1;
+    ring->last_ns = time;
+
+    vsfs_trace_record_t *rec = &ring->records[ring->head % VSFS_TRACE_RING];
+    rec->time_ns = time;
+    rec->offset = offset;
+    rec->ino = ino;
+    rec->len = len > UINT32_MAX ? UINT32_MAX : len;
+    rec->name_hash = name != NULL ? trace_name_hash(name) : 0;
+    rec->mode = mode;
+    rec->result = result > INT32_MAX ? INT32_MAX : (result < 0 ? -1 : result);
+    rec->op = op;
+    rec->thread = ring->thread;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+int vsfs_trace_start(const char *path) {
+    pthread_mutex_lock(&file_lock);
+    if (trace_fd >= 0) {
+        pthread_mutex_unlock(&file_lock);
+        fprintf(stderr, "vsfs_trace_start: already tracing\n");
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        pthread_mutex_unlock(&file_lock);
+        perror("vsfs_trace_start: open");
+        return -1;
+    }
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    vsfs_trace_header_t header = {VSFS_TRACE_MAGIC, VSFS_TRACE_VERSION,
+                                  (uint64_t)wall.tv_sec * 1000000000ULL + wall.tv_nsec};
+    if (write_all(fd, &header, sizeof(header)) < 0) {
+        pthread_mutex_unlock(&file_lock);
+        close(fd);
+        return -1;
+    }
+
+    trace_fd = fd;
+    write_failed = false;
+    start_ns = trace_clock();
+    __atomic_store_n(&session, session + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&trace_active, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&file_lock);
+    return 0;
+}
+
+int vsfs_trace_stop() {
+    pthread_mutex_lock(&file_lock);
+    if (trace_fd < 0) {
+        pthread_mutex_unlock(&file_lock);
+        fprintf(stderr, "vsfs_trace_stop: not tracing\n");
+        return -1;
+    }
+    __atomic_store_n(&trace_active, false, __ATOMIC_RELAXED);
+    for (trace_ring_t *ring = rings; ring != NULL; ring = ring->next) {
+        drain(ring);
+    }
+    int ret = write_failed ? -1 : 0;
+    if (close(trace_fd) < 0) {
+        perror("vsfs_trace_stop: close");
+        ret = -1;
+    }
+    trace_fd = -1;
+    pthread_mutex_unlock(&file_lock);
+    return ret;
+}
+
+static int compare_records(const void *a, const void *b) {
+    const vsfs_trace_record_t *x = a, *y = b;
+    if (x->time_ns != y->time_ns) {
+        return x->time_ns < y->time_ns ? -1 : 1;
+    }
+    return (x->thread > y->thread) - (x->thread < y->thread);
+}
+
+ssize_t vsfs_trace_load(const char *path, vsfs_trace_record_t **records) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("vsfs_trace_load: fopen");
+        return -1;
+    }
+    vsfs_trace_header_t header;
+    struct stat st;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != VSFS_TRACE_MAGIC ||
+        header.version != VSFS_TRACE_VERSION || fstat(fileno(file), &st) < 0 ||
+        (st.st_size - sizeof(header)) % sizeof(vsfs_trace_record_t) != 0) {
+        fprintf(stderr, "vsfs_trace_load: %s is not a complete trace\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    size_t n = (st.st_size - sizeof(header)) / sizeof(vsfs_trace_record_t);
+    *records = malloc(n > 0 ? n * sizeof(vsfs_trace_record_t) : 1);
+    if (*records == NULL || fread(*records, sizeof(vsfs_trace_record_t), n, file) != n) {
+        fprintf(stderr, "vsfs_trace_load: failed to read %s\n", path);
+        free(*records);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    qsort(*records, n, sizeof(vsfs_trace_record_t), compare_records);
+    return n;
+}
@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "stats.h"
+
+// Operation traces: while tracing is on, every call through the public file
+// operations (create, lookup, unlink, read, write, truncate, stat and sync)
+// is appended to a trace file as one fixed-size record. Each thread fills a
+// ring of its own with no locking; a full ring is written out by the thread
+// that filled it, so the only shared state on the hot path is the file
+// lock, taken once per VSFS_TRACE_RING records. Records of different
+// threads therefore reach the file out of order; readers sort them by time.
+// Names aren't kept, only a hash of them, which is enough to tell names
+// apart when the trace is replayed.
+#define VSFS_TRACE_MAGIC 0x56545243 // "VTRC" in hex
+#define VSFS_TRACE_VERSION 1
+#define VSFS_TRACE_RING 1024       // Records buffered per thread
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t wall_ns;         // Wall-clock time the trace started, for reference
+} vsfs_trace_header_t;
+
+typedef struct {
+    uint64_t time_ns;         // When the call was made, since the trace started
+    uint64_t offset;          // Read or write offset, or the size for truncate
+    uint32_t ino;             // File, or parent directory for name operations
+    uint32_t len;             // Bytes asked to read or write
+    uint32_t name_hash;       // trace_name_hash() of the name for name operations
+    uint32_t mode;            // Mode of a created file
+    int32_t result;           // What the call returned: an inode, a byte count or -1
+    uint16_t op;              // vsfs_op_t
+    uint16_t thread;          // Recording thread, numbered from 0
+} vsfs_trace_record_t;
+
+// Start recording every thread's calls to `path`, replacing the file
+int vsfs_trace_start(const char *path);
+
+// Write out every thread's buffered records and close the trace (calls
+// racing with the stop may be dropped)
+int vsfs_trace_stop();
+
+// Load a whole trace sorted by time into `*records` (to be freed)
+ssize_t vsfs_trace_load(const char *path, vsfs_trace_record_t **records);
+
+uint32_t trace_name_hash(const char *name);
+
+// Recording hooks for the public operations. TRACE_START notes when a call
+// began (0 if tracing is off) and TRACE_END records it; with tracing off
+// they cost one relaxed load.
+extern bool trace_active;
+uint64_t trace_clock();
+void trace_record(uint64_t issued, vsfs_op_t op, uint32_t ino, uint64_t offset, size_t len, const char *name,
+                  uint32_t mode, int64_t result);
+
+#define TRACE_START(var) uint64_t var = __atomic_load_n(&trace_active, __ATOMIC_RELAXED) ? trace_clock() : 0
+#define TRACE_END(var, ...) ((var) != 0 ? trace_record(var, __VA_ARGS__) : (void)0)
+
+#endif // TRACE_H
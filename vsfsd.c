@@ -0,0 +1,491 @@
+#define _GNU_SOURCE
+#include "vsfsd.h"
+#include "fs.h"
+#include "pool.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// One thread owns the listening socket and reads every connection through
+// epoll, cutting the byte stream into requests. Each request becomes a pool
+// task holding a reference to its connection; the worker that runs it sends
+// the response itself, so a slow operation never holds up the reader.
+#define CONN_INBUF (64 * 1024)
+#define FRAME_MAX (sizeof(vsfsd_req_t) + MAX_FILENAME_LEN)
+#define MAX_EVENTS 64
+
+typedef struct conn {
+    int fd;
+    int shm_fd;               // Received with HELLO (-1 until then)
+    char *shm;                // Attached shared buffer (NULL until HELLO)
+    size_t shm_size;
+    atomic_int refs;          // The reader's, plus one per request in flight
+    pthread_mutex_t send_lock;
+    bool broken;              // A response could not be sent
+    struct conn *next;        // Open connections, kept by the reader
+    size_t inlen;
+    char inbuf[CONN_INBUF];
+} conn_t;
+
+typedef struct {
+    conn_t *conn;
+    vsfsd_req_t req;
+    char name[MAX_FILENAME_LEN + 1];
+} request_t;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+// The filesystem is not thread-safe, so file operations take turns
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void vsfsd_stop() {
+    stop_requested = 1;
+}
+
+static int send_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static conn_t *conn_new(int fd) {
+    conn_t *conn = malloc(sizeof(conn_t));
+    if (conn == NULL) {
+        fprintf(stderr, "vsfsd: out of memory\n");
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->shm_fd = -1;
+    conn->shm = NULL;
+    conn->shm_size = 0;
+    atomic_init(&conn->refs, 1);
+    pthread_mutex_init(&conn->send_lock, NULL);
+    conn->broken = false;
+    conn->next = NULL;
+    conn->inlen = 0;
+    return conn;
+}
+
+static void conn_put(conn_t *conn) {
+    if (atomic_fetch_sub(&conn->refs, 1) != 1) {
+        return;
+    }
+    close(conn->fd);
+    if (conn->shm != NULL) {
+        munmap(conn->shm, conn->shm_size);
+    }
+    if (conn->shm_fd >= 0) {
+        close(conn->shm_fd);
+    }
+    pthread_mutex_destroy(&conn->send_lock);
+    free(conn);
+}
+
+static void respond(conn_t *conn, uint64_t id, int64_t result) {
+    vsfsd_resp_t resp = {id, result};
+    pthread_mutex_lock(&conn->send_lock);
+    if (!conn->broken && send_all(conn->fd, &resp, sizeof(resp)) < 0) {
+        conn->broken = true;   // the peer is gone; the reader will see it too
+    }
+    pthread_mutex_unlock(&conn->send_lock);
+}
+
+// Pointer to `len` bytes of the connection's buffer at `off`, or NULL if
+// they don't fit in it
+static char *shm_range(conn_t *conn, uint32_t off, size_t len) {
+    if (conn->shm == NULL || (uint64_t)off + len > conn->shm_size) {
+        fprintf(stderr, "vsfsd: request data outside the shared buffer\n");
+        return NULL;
+    }
+    return conn->shm + off;
+}
+
+static int64_t execute(conn_t *conn, const vsfsd_req_t *req, const char *name) {
+    bool named = req->op == VSFSD_OP_CREATE || req->op == VSFSD_OP_LOOKUP || req->op == VSFSD_OP_UNLINK;
+    if (named && req->name_len == 0) {
+        fprintf(stderr, "vsfsd: request %lu has no name\n", (unsigned long)req->id);
+        return -1;
+    }
+
+    // Bulk data moves through the shared buffer
+    char *data = NULL;
+    if (req->op == VSFSD_OP_READ || req->op == VSFSD_OP_WRITE || req->op == VSFSD_OP_STAT) {
+        data = shm_range(conn, req->shm_off, req->op == VSFSD_OP_STAT ? sizeof(inode_t) : req->len);
+        if (data == NULL) {
+            return -1;
+        }
+    }
+
+    int64_t ret;
+    pthread_mutex_lock(&fs_lock);
+    switch (req->op) {
+    case VSFSD_OP_CREATE:
+        ret = vsfs_create(req->ino, name, req->mode);
+        break;
+    case VSFSD_OP_LOOKUP:
+        ret = vsfs_lookup(req->ino, name);
+        break;
+    case VSFSD_OP_UNLINK:
+        ret = vsfs_unlink(req->ino, name);
+        break;
+    case VSFSD_OP_READ:
+        ret = vsfs_read(req->ino, req->offset, data, req->len);
+        break;
+    case VSFSD_OP_WRITE:
+        ret = vsfs_write(req->ino, req->offset, data, req->len);
+        break;
+    case VSFSD_OP_STAT:
+        ret = vsfs_stat(req->ino, (inode_t *)data);
+        break;
+    case VSFSD_OP_SYNC:
+        ret = vsfs_sync();
+        break;
+    default:
+        fprintf(stderr, "vsfsd: unknown op %u\n", req->op);
+        ret = -1;
+        break;
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return ret;
+}
+
+// Pool task: run one request and answer it
+static void run_request(void *arg) {
+    request_t *r = arg;
+    respond(r->conn, r->req.id, execute(r->conn, &r->req, r->name));
+    conn_put(r->conn);
+    free(r);
+}
+
+// Attach the shared buffer whose descriptor arrived with the HELLO message
+static int hello(conn_t *conn, const vsfsd_req_t *req) {
+    struct stat st;
+    if (conn->shm != NULL || conn->shm_fd < 0 || req->len == 0 || req->len > VSFSD_MAX_SHM ||
+        fstat(conn->shm_fd, &st) < 0 || (size_t)st.st_size < req->len) {
+        fprintf(stderr, "vsfsd: bad hello\n");
+        return -1;
+    }
+    char *shm = mmap(NULL, req->len, PROT_READ | PROT_WRITE, MAP_SHARED, conn->shm_fd, 0);
+    if (shm == MAP_FAILED) {
+        perror("vsfsd: mmap");
+        return -1;
+    }
+    conn->shm = shm;
+    conn->shm_size = req->len;
+    return 0;
+}
+
+// Hand every complete request in the input buffer to the pool. Returns -1
+// if the stream is corrupt and the connection should be dropped.
+static int dispatch(conn_t *conn, pool_t *pool) {
+    size_t pos = 0;
+    while (conn->inlen - pos >= sizeof(vsfsd_req_t)) {
+        vsfsd_req_t req;
+        memcpy(&req, conn->inbuf + pos, sizeof(req));
+        if (req.magic != VSFSD_MAGIC || req.name_len > MAX_FILENAME_LEN) {
+            fprintf(stderr, "vsfsd: bad request header, closing connection\n");
+            return -1;
+        }
+        size_t frame = sizeof(req) + req.name_len;
+        if (conn->inlen - pos < frame) {
+            break;
+        }
+
+        if (req.op == VSFSD_OP_HELLO) {
+            respond(conn, req.id, hello(conn, &req));
+        } else {
+            request_t *r = malloc(sizeof(request_t));
+            if (r == NULL) {
+                fprintf(stderr, "vsfsd: out of memory\n");
+                respond(conn, req.id, -1);
+            } else {
+                r->conn = conn;
+                r->req = req;
+                memcpy(r->name, conn->inbuf + pos + sizeof(req), req.name_len);
+                r->name[req.name_len] = '\0';
+                atomic_fetch_add(&conn->refs, 1);
+                if (pool_submit(pool, run_request, r) < 0) {
+                    respond(conn, req.id, -1);
+                    conn_put(conn);
+                    free(r);
+                }
+            }
+        }
+        pos += frame;
+    }
+
+    memmove(conn->inbuf, conn->inbuf + pos, conn->inlen - pos);
+    conn->inlen -= pos;
+    return 0;
+}
+
+// Read what the socket has and dispatch it. Returns -1 once the connection
+// is closed or broken.
+static int read_conn(conn_t *conn, pool_t *pool) {
+    for (;;) {
+        char cbuf[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = {conn->inbuf + conn->inlen, CONN_INBUF - conn->inlen};
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        ssize_t n = recvmsg(conn->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(c), sizeof(int));
+                if (conn->shm_fd < 0) {
+                    conn->shm_fd = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+        conn->inlen += n;
+        if (dispatch(conn, pool) < 0) {
+            return -1;
+        }
+    }
+}
+
+static void close_conn(int ep, conn_t **conns, conn_t *conn) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, conn->fd, NULL);
+    for (conn_t **p = conns; *p != NULL; p = &(*p)->next) {
+        if (*p == conn) {
+            *p = conn->next;
+            break;
+        }
+    }
+    conn_put(conn);
+}
+
+static int listen_on(const char *path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "vsfsd_serve: socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("vsfsd_serve: socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror("vsfsd_serve: bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int vsfsd_serve(const char *path, int nworkers) {
+    if (sb == NULL) {
+        fprintf(stderr, "vsfsd_serve: no image mounted\n");
+        return -1;
+    }
+
+    int lfd = listen_on(path);
+    if (lfd < 0) {
+        return -1;
+    }
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;   // the listener
+    pool_t *pool = ep < 0 ? NULL : pool_create(nworkers);
+    if (pool == NULL || epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev) < 0) {
+        fprintf(stderr, "vsfsd_serve: failed to start\n");
+        if (pool != NULL) {
+            pool_destroy(pool);
+        }
+        if (ep >= 0) {
+            close(ep);
+        }
+        close(lfd);
+        unlink(path);
+        return -1;
+    }
+
+    int ret = 0;
+    conn_t *conns = NULL;
+    struct epoll_event events[MAX_EVENTS];
+    while (!stop_requested) {
+        int n = epoll_wait(ep, events, MAX_EVENTS, 100);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("vsfsd_serve: epoll_wait");
+            ret = -1;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            conn_t *conn = events[i].data.ptr;
+            if (conn != NULL) {
+                if (read_conn(conn, pool) < 0) {
+                    close_conn(ep, &conns, conn);
+                }
+                continue;
+            }
+
+            int cfd;
+            while ((cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+                conn = conn_new(cfd);
+                ev.events = EPOLLIN;
+                ev.data.ptr = conn;
+                if (conn == NULL || epoll_ctl(ep, EPOLL_CTL_ADD, cfd, &ev) < 0) {
+                    if (conn != NULL) {
+                        conn_put(conn);
+                    } else {
+                        close(cfd);
+                    }
+                    continue;
+                }
+                conn->next = conns;
+                conns = conn;
+            }
+        }
+    }
+
+    // Requests already queued are answered before their connections close
+    fprintf(stderr, "vsfsd: stopping (%lu tasks stolen)\n", (unsigned long)pool_steals(pool));
+    pool_destroy(pool);
+    while (conns != NULL) {
+        close_conn(ep, &conns, conns);
+    }
+    close(ep);
+    close(lfd);
+    unlink(path);
+    stop_requested = 0;
+    return ret;
+}
+
+// Client side
+
+char *vsfsd_shm_create(size_t size, int *shm_fd) {
+    int fd = memfd_create("vsfsd", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        perror("vsfsd_shm_create");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    char *shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED) {
+        perror("vsfsd_shm_create: mmap");
+        close(fd);
+        return NULL;
+    }
+    *shm_fd = fd;
+    return shm;
+}
+
+int vsfsd_connect(const char *path, int shm_fd, size_t shm_size) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "vsfsd_connect: socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    // The buffer's descriptor rides along with the HELLO header
+    vsfsd_req_t req = {0};
+    req.magic = VSFSD_MAGIC;
+    req.op = VSFSD_OP_HELLO;
+    req.len = shm_size;
+    char cbuf[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &shm_fd, sizeof(int));
+
+    vsfsd_resp_t resp;
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(req) || vsfsd_recv(fd, &resp) < 0 || resp.result != 0) {
+        fprintf(stderr, "vsfsd_connect: server refused the shared buffer\n");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int vsfsd_send(int fd, const vsfsd_req_t *req, const char *name) {
+    char frame[FRAME_MAX];
+    if (req->name_len > MAX_FILENAME_LEN) {
+        fprintf(stderr, "vsfsd_send: name too long\n");
+        return -1;
+    }
+    memcpy(frame, req, sizeof(*req));
+    if (req->name_len > 0) {
+        memcpy(frame + sizeof(*req), name, req->name_len);
+    }
+    return send_all(fd, frame, sizeof(*req) + req->name_len);
+}
+
+int vsfsd_recv(int fd, vsfsd_resp_t *resp) {
+    return recv_all(fd, resp, sizeof(*resp));
+}
@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef VSFSD_H
+#define VSFSD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "mkfs.h"
+
+// vsfsd serves the mounted image to other processes over a Unix-domain
+// socket. A connection opens with VSFSD_OP_HELLO, which passes a shared
+// memory buffer (a file descriptor sent with SCM_RIGHTS) that carries the
+// bulk data of every later read, write and stat, so only fixed-size headers
+// cross the socket. Requests are pipelined: a client may have any number
+// outstanding, and responses come back in completion order tagged with the
+// request id, so requests in flight together may run in any order. They are
+// handed to a work-stealing worker pool; the file operations themselves run
+// one at a time under a single lock, since the filesystem keeps its state in
+// globals.
+#define VSFSD_SOCKET "/tmp/vsfsd.sock"
+#define VSFSD_MAGIC 0x56534644 // "VSFD" in hex
+#define VSFSD_DEFAULT_WORKERS 4
+#define VSFSD_MAX_SHM (1u << 30)   // Largest shared buffer a connection may attach
+
+enum {
+    VSFSD_OP_HELLO = 1,   // len = size of the shared buffer sent with the message
+    VSFSD_OP_CREATE,      // ino = parent directory, name, mode; result = new inode
+    VSFSD_OP_LOOKUP,      // ino = parent directory, name; result = inode
+    VSFSD_OP_UNLINK,      // ino = parent directory, name
+    VSFSD_OP_READ,        // ino, offset, len bytes into the buffer at shm_off; result = bytes read
+    VSFSD_OP_WRITE,       // ino, offset, len bytes from the buffer at shm_off; result = bytes written
+    VSFSD_OP_STAT,        // ino; the inode_t is stored in the buffer at shm_off
+    VSFSD_OP_SYNC,        // flush the image
+};
+
+// Request header, followed on the wire by `name_len` bytes of name
+typedef struct {
+    uint32_t magic;
+    uint16_t op;
+    uint16_t name_len;
+    uint64_t id;              // Echoed in the response
+    uint64_t offset;          // File offset
+    uint32_t ino;             // File, or parent directory for name operations
+    uint32_t len;             // Bytes to read or write
+    uint32_t shm_off;         // Where the data sits in the shared buffer
+    uint32_t mode;            // Mode of a new file
+} vsfsd_req_t;
+
+typedef struct {
+    uint64_t id;
+    int64_t result;           // -1 on error
+} vsfsd_resp_t;
+
+// Serve the mounted image on `path` with `nworkers` workers until
+// vsfsd_stop() is called; the socket file is removed on return
+int vsfsd_serve(const char *path, int nworkers);
+
+// Ask a running vsfsd_serve() to return (safe from a signal handler)
+void vsfsd_stop();
+
+// Client side: create a shared buffer of `size` bytes, connect to a server
+// and attach the buffer to the connection; returns the socket (-1 on error)
+char *vsfsd_shm_create(size_t size, int *shm_fd);
+int vsfsd_connect(const char *path, int shm_fd, size_t shm_size);
+
+// Send one request (with its name, if any) and receive one response
+int vsfsd_send(int fd, const vsfsd_req_t *req, const char *name);
+int vsfsd_recv(int fd, vsfsd_resp_t *resp);
+
+#endif // VSFSD_H
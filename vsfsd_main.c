@@ -0,0 +1,94 @@
+#define _GNU_SOURCE
+#include "vsfsd.h"
+#include "fs.h"
+#include "mount.h"
+#include "trace.h"
+#include <signal.h>
+
+typedef struct {
+    const char *image;
+    const char *socket;
+    int workers;
+    size_t format_mib;        // Format the image first (0 = mount it as is)
+    size_t max_files;
+    const char *trace;        // Record every call to this file
+} vsfsd_config_t;
+
+static vsfsd_config_t config;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s IMAGE [--socket PATH] [--workers N] [--format SIZE_MIB] [--max-files N] [--trace FILE]\n", prog);
+}
+
+// Parse the command line into `config`; returns -1 on bad arguments
+static int parse_args(int argc, char **argv) {
+    config = (vsfsd_config_t){.socket = VSFSD_SOCKET, .workers = VSFSD_DEFAULT_WORKERS, .max_files = MAX_INODES};
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (argv[i][0] != '-') {
+            if (config.image != NULL) {
+                return -1;
+            }
+            config.image = argv[i];
+            continue;
+        }
+        if (value == NULL) {
+            return -1;
+        }
+        i++;
+        if (strcmp(argv[i - 1], "--socket") == 0) {
+            config.socket = value;
+        } else if (strcmp(argv[i - 1], "--workers") == 0) {
+            config.workers = atoi(value);
+        } else if (strcmp(argv[i - 1], "--format") == 0) {
+            config.format_mib = strtoul(value, NULL, 0);
+        } else if (strcmp(argv[i - 1], "--max-files") == 0) {
+            config.max_files = strtoul(value, NULL, 0);
+        } else if (strcmp(argv[i - 1], "--trace") == 0) {
+            config.trace = value;
+        } else {
+            return -1;
+        }
+    }
+    return config.image != NULL && config.workers > 0 ? 0 : -1;
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    vsfsd_stop();
+}
+
+int main(int argc, char **argv) {
+    if (parse_args(argc, argv) < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (config.format_mib != 0) {
+        if (format_disk(config.image, config.format_mib * 1024 * 1024, config.max_files) < 0) {
+            return 1;
+        }
+    } else if (mount_disk(config.image, NULL) < 0) {
+        return 1;
+    }
+
+    if (config.trace != NULL && vsfs_trace_start(config.trace) < 0) {
+        unmount_disk();
+        return 1;
+    }
+
+    struct sigaction sa = {0};
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    fprintf(stderr, "vsfsd: serving %s on %s with %d workers\n", config.image, config.socket, config.workers);
+    int ret = vsfsd_serve(config.socket, config.workers);
+    if (config.trace != NULL && vsfs_trace_stop() < 0) {
+        ret = -1;
+    }
+    if (unmount_disk() < 0) {
+        ret = -1;
+    }
+    return ret < 0 ? 1 : 0;
+}